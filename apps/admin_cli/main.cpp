@@ -11,12 +11,22 @@ void print_menu(){
     cout << "  3. List Topics\n";
     cout << "  4. Produce Message\n";
     cout << "  5. Consume Message\n";
-    cout << "  6. Exit\n";
+    cout << "  6. Show Traces\n";
+    cout << "  7. Set Trace Sampling\n";
+    cout << "  8. Move Partition\n";
+    cout << "  9. Set Quota\n";
+    cout << " 10. Exit\n";
     cout << "Choice: ";
 }
 
-int main(){
-    Broker  broker(1, "/tmp/hyperq");
+int main(int argc, char* argv[]){
+    // log directories, comma separated
+    vector<string> log_dirs;
+    stringstream dirs(argc > 1 ? argv[1] : "/tmp/hyperq");
+    for(string dir; getline(dirs, dir, ',');){
+        if(!dir.empty())    log_dirs.push_back(dir);
+    }
+    Broker  broker(1, log_dirs);
     int choice;
     while(true){
         print_menu();
@@ -40,8 +50,8 @@ int main(){
                 cin>>partitions;
                 cin.ignore();
 
-                broker.create_topic(topic, partitions, 1);
-                cout<<"Topics created \n";
+                if(broker.ensure_topic(topic, partitions, 1))   cout<<"Topics created \n";
+                else    cout<<"Topic "<<topic<<" already exists \n";
                 break;
             }
             case 2:
@@ -57,6 +67,60 @@ int main(){
                 cout << "Feature not implemented in CLI\n";
                 break;
             case 6:
+                broker.print_traces();
+                break;
+            case 7: {
+                cout<<"Trace 1 in N requests (0 = off): ";
+                string rate;
+                getline(cin, rate);
+                Tracer::instance().set_sample_rate(stoul(rate));
+                break;
+            }
+            case 8: {
+                cout<<"Topic name: ";
+                string topic;
+                getline(cin, topic);
+                cout<<"Partition: ";
+                string partition;
+                getline(cin, partition);
+                cout<<"Log directories:";
+                for(const auto& dir : broker.get_log_dirs())    cout<<" "<<dir;
+                cout<<"\nMove to: ";
+                string dir;
+                getline(cin, dir);
+                try{
+                    broker.move_partition(topic, stoi(partition), dir);
+                    cout<<"Partition moved to "<<broker.get_log_dir(topic, stoi(partition))<<"\n";
+                }catch(const exception& e){
+                    cout<<"Move failed: "<<e.what()<<"\n";
+                }
+                break;
+            }
+            case 9: {
+                cout<<"Client id or group (client:<id> / group:<id>, empty id = default): ";
+                string target;
+                getline(cin, target);
+                size_t colon = target.find(':');
+                string kind = target.substr(0, colon);
+                if(colon == string::npos || (kind != "client" && kind != "group")){
+                    cout<<"Invalid target\n";
+                    break;
+                }
+                QuotaLimits limits;
+                string value;
+                cout<<"Produce bytes/s (0 = unlimited): ";
+                getline(cin, value);
+                limits.produce_bytes_per_sec = stod(value);
+                cout<<"Fetch bytes/s (0 = unlimited): ";
+                getline(cin, value);
+                limits.fetch_bytes_per_sec = stod(value);
+                cout<<"Requests/s (0 = unlimited): ";
+                getline(cin, value);
+                limits.requests_per_sec = stod(value);
+                broker.set_quota(kind == "client" ? QuotaEntity::Client : QuotaEntity::Group, target.substr(colon + 1), limits);
+                break;
+            }
+            case 10:
                 return 0;
             default:
                 cout<<"Invalid choice\n";
@@ -1,12 +1,15 @@
 #include "hyperq/broker/broker.hpp"
 #include <iostream>
+#include <sstream>
 #include <thread>
 #include <chrono>
 using namespace std;
 
 int main(int argc, char* argv[]) {
     int broker_id = 1;
-    string log_dir = "/tmp/hyperq";
+    string log_dir = "/tmp/hyperq";     // comma separated for several disks
+    int metrics_port = 9464;
+    uint32_t trace_sample_rate = 0;     // 0 = tracing off
     
     // Parse command-line arguments
     if (argc > 1) {
@@ -15,18 +18,38 @@ int main(int argc, char* argv[]) {
     if (argc > 2) {
         log_dir = argv[2];
     }
+    if (argc > 3) {
+        metrics_port = std::stoi(argv[3]);
+    }
+    if (argc > 4) {
+        trace_sample_rate = std::stoul(argv[4]);
+    }
     
     cout << "Starting HyperQ Broker\n";
     cout << "  Broker ID: " << broker_id << "\n";
-    cout << "  Log Directory: " << log_dir << "\n\n";
+    vector<string> log_dirs;
+    stringstream dirs(log_dir);
+    for (string dir; getline(dirs, dir, ',');) {
+        if (!dir.empty()) {
+            log_dirs.push_back(dir);
+        }
+    }
+
+    cout << "  Log Directories: " << log_dir << "\n";
+    cout << "  Metrics Port: " << metrics_port << "\n";
+    cout << "  Trace Sampling: " << (trace_sample_rate ? "1 in " + to_string(trace_sample_rate) : "off") << "\n\n";
     
     try {
-        Broker broker(broker_id, log_dir);
+        Tracer::instance().set_sample_rate(trace_sample_rate);
+        Broker broker(broker_id, log_dirs);
+        PrometheusExporter exporter(metrics_port);
+        broker.register_metrics(exporter);
+        exporter.start();
         
-        // Create default topics
-        broker.create_topic("orders", 3, 1);
-        broker.create_topic("payments", 4, 1);
-        broker.create_topic("events", 2, 1);
+        // Create default topics, a restarted broker already has them
+        broker.ensure_topic("orders", 3, 1);
+        broker.ensure_topic("payments", 4, 1);
+        broker.ensure_topic("events", 2, 1);
         
         cout << "\n✓ Broker ready for connections\n";
         cout << "Press Ctrl+C to stop\n\n";
@@ -34,6 +57,10 @@ int main(int argc, char* argv[]) {
         // Keep broker running
         while (true) {
             broker.print_status();
+            broker.print_metrics();
+            if (trace_sample_rate) {
+                broker.print_traces();
+            }
             this_thread::sleep_for(std::chrono::seconds(30));
         }
     } catch (const std::exception& e) {
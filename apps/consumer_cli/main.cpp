@@ -13,7 +13,7 @@ int main(int argc, char* argv[]){
 
     try{
         Broker broker(1, log_dir);
-        broker.create_topic("cli-topic", 3,1);
+        broker.ensure_topic("cli-topic", 3,1);
         Consumer consumer(broker, group_id, "CLIConsumer");
         cout << "HyperQ Consumer CLI\n";
         cout << "Group ID: " << group_id << "\n";
@@ -16,7 +16,7 @@ void demo_basic_produce_consume() {
     print_header("DEMO 1: BASIC PRODUCE AND CONSUME");
     
     Broker broker(1, "/tmp/hyperq");
-    broker.create_topic("orders", 2, 1);
+    broker.ensure_topic("orders", 2, 1);
     
     Producer producer(broker, "OrderProducer");
     cout << ">>> Sending 5 messages\n";
@@ -46,7 +46,7 @@ void demo_offset_tracking() {
     print_header("DEMO 2: OFFSET TRACKING (FAULT TOLERANCE)");
     
     Broker broker(1, "/tmp/hyperq");
-    broker.create_topic("events", 1, 1);
+    broker.ensure_topic("events", 1, 1);
     
     Producer producer(broker, "EventProducer");
     cout << ">>> Phase 1: Sending 10 messages\n";
@@ -70,7 +70,7 @@ void demo_partitioning() {
     print_header("DEMO 3: PARTITIONING FOR PARALLELISM");
     
     Broker broker(1, "/tmp/hyperq");
-    broker.create_topic("payments", 4, 1);
+    broker.ensure_topic("payments", 4, 1);
     
     Producer producer(broker, "PaymentProducer");
     cout << ">>> Sending 8 payments with customer keys\n";
@@ -9,7 +9,7 @@ int main(int argc, char* argv[]){
     if(argc > 1)    log_dir = argv[1];
     try{
         Broker broker(1, log_dir);
-        broker.create_topic("cli-topic", 3,1);
+        broker.ensure_topic("cli-topic", 3,1);
         Producer Producer(broker, "CLIProducer");
         cout<<"hyperQ Producer CLI \n Enter Messages (quit to exit) \n Format: message [key] \n\n";
         string line;
@@ -0,0 +1,201 @@
+#include "hyperq/broker/broker.hpp"
+#include "hyperq/metrics/metrics.hpp"
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+/*
+ * hyperq-loadgen: end-to-end producer/consumer load generator
+ * N producer threads write M partitions through the Broker, then one consumer
+ * per partition fetches everything back. Results are printed as JSON:
+ * msgs/s, MB/s and p50/p99/p999 request latency for each phase.
+ *
+ *   hyperq-loadgen [--producers N] [--partitions M] [--messages K]
+ *                  [--size BYTES] [--batch S] [--log-dir DIR] [--output FILE]
+*/
+
+struct LoadConfig {
+    int producers = 4;
+    int partitions = 4;
+    size_t messages = 100000;       // total across all producers
+    size_t message_size = 100;
+    size_t batch_size = 1;          // > 1 uses produce_batch
+    string log_dir = "/tmp/hyperq-loadgen";
+    string output;
+};
+
+struct PhaseResult {
+    size_t messages = 0;
+    size_t bytes = 0;
+    double seconds = 0;
+    HistogramSnapshot latency;
+};
+
+LoadConfig parse_args(int argc, char* argv[]) {
+    LoadConfig config;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string flag = argv[i];
+        string value = argv[i + 1];
+        if (flag == "--producers") config.producers = stoi(value);
+        else if (flag == "--partitions") config.partitions = stoi(value);
+        else if (flag == "--messages") config.messages = stoull(value);
+        else if (flag == "--size") config.message_size = stoull(value);
+        else if (flag == "--batch") config.batch_size = stoull(value);
+        else if (flag == "--log-dir") config.log_dir = value;
+        else if (flag == "--output") config.output = value;
+        else throw invalid_argument("Unknown flag: " + flag);
+    }
+    if (config.producers < 1 || config.partitions < 1 || config.batch_size < 1) {
+        throw invalid_argument("producers, partitions and batch must be positive");
+    }
+    return config;
+}
+
+PhaseResult run_producers(Broker& broker, const LoadConfig& config) {
+    Histogram latency;
+    atomic<size_t> failed{0};
+    size_t per_producer = config.messages / config.producers;
+    string payload(config.message_size, 'x');
+
+    uint64_t start = now_ns();
+    vector<thread> threads;
+    for (int t = 0; t < config.producers; t++) {
+        threads.emplace_back([&]() {
+            MessageBatch batch;
+            for (size_t sent = 0; sent < per_producer; sent += config.batch_size) {
+                size_t count = min(config.batch_size, per_producer - sent);
+                uint64_t request_start = now_ns();
+                ProduceResponse response;
+                if (config.batch_size == 1) {
+                    response = broker.produce("load", payload);
+                } else {
+                    batch.clear();
+                    for (size_t i = 0; i < count; i++) {
+                        batch.append(i, "", payload, 0, 0);
+                    }
+                    response = broker.produce_batch("load", RecordBatch::build(0, batch));
+                }
+                latency.record(now_ns() - request_start);
+                if (!response.success) {
+                    failed++;
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    PhaseResult result;
+    result.seconds = (now_ns() - start) / 1e9;
+    result.messages = per_producer * config.producers;
+    result.bytes = result.messages * config.message_size;
+    result.latency = latency.snapshot();
+    if (failed > 0) {
+        throw runtime_error(to_string(failed.load()) + " produce requests failed");
+    }
+    return result;
+}
+
+// one consumer per partition, fetching until the high watermark
+PhaseResult run_consumers(Broker& broker, const LoadConfig& config) {
+    Histogram latency;
+    atomic<size_t> messages{0};
+    atomic<size_t> bytes{0};
+
+    uint64_t start = now_ns();
+    vector<thread> threads;
+    for (int p = 0; p < config.partitions; p++) {
+        threads.emplace_back([&, p]() {
+            long high_watermark = broker.get_partition("load", p)->get_high_watermark();
+            uint64_t offset = 0;
+            while (static_cast<long>(offset) <= high_watermark) {
+                uint64_t request_start = now_ns();
+                FetchResponse response = broker.fetch("load", p, "loadgen", offset);
+                latency.record(now_ns() - request_start);
+                if (!response.success || response.next_offset <= offset) {
+                    break;
+                }
+                for (const auto& batch : RecordBatch::parse_all(response.records)) {
+                    messages += batch.header.record_count;
+                }
+                bytes += response.records.size();
+                offset = response.next_offset;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    PhaseResult result;
+    result.seconds = (now_ns() - start) / 1e9;
+    result.messages = messages;
+    result.bytes = bytes;
+    result.latency = latency.snapshot();
+    return result;
+}
+
+string phase_json(const PhaseResult& result) {
+    ostringstream out;
+    double seconds = result.seconds > 0 ? result.seconds : 1e-9;
+    out << "{\"messages\": " << result.messages
+        << ", \"bytes\": " << result.bytes
+        << ", \"seconds\": " << result.seconds
+        << ", \"msgs_per_sec\": " << result.messages / seconds
+        << ", \"mb_per_sec\": " << result.bytes / seconds / (1024 * 1024)
+        << ", \"latency_ns\": {\"p50\": " << result.latency.percentile(50)
+        << ", \"p99\": " << result.latency.percentile(99)
+        << ", \"p999\": " << result.latency.percentile(99.9)
+        << ", \"max\": " << result.latency.max
+        << ", \"mean\": " << result.latency.mean() << "}}";
+    return out.str();
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        LoadConfig config = parse_args(argc, argv);
+        filesystem::remove_all(config.log_dir);
+
+        PhaseResult produced, consumed;
+        {
+            cout.setstate(ios::badbit);     // the broker logs every request
+            Broker broker(1, config.log_dir);
+            broker.create_topic("load", config.partitions, 1);
+            // create_topic only makes partition 0 leader, this broker serves them all
+            for (int p = 1; p < config.partitions; p++) {
+                broker.get_partition("load", p)->promote_to_leader();
+            }
+            produced = run_producers(broker, config);
+            consumed = run_consumers(broker, config);
+        }
+        cout.clear();
+
+        ostringstream json;
+        json << "{\n"
+             << "  \"config\": {\"producers\": " << config.producers
+             << ", \"partitions\": " << config.partitions
+             << ", \"messages\": " << config.messages
+             << ", \"message_size\": " << config.message_size
+             << ", \"batch_size\": " << config.batch_size << "},\n"
+             << "  \"produce\": " << phase_json(produced) << ",\n"
+             << "  \"consume\": " << phase_json(consumed) << "\n"
+             << "}\n";
+
+        cout << json.str();
+        if (!config.output.empty()) {
+            ofstream(config.output) << json.str();
+        }
+        return 0;
+    } catch (const exception& e) {
+        cout.clear();
+        cerr << "Load generator error: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,551 @@
+#include "hyperq/broker/broker.hpp"
+#include "hyperq/broker/shm_server.hpp"
+#include "hyperq/client/consumer.hpp"
+#include "hyperq/client/shm_producer.hpp"
+#include "hyperq/metrics/metrics.hpp"
+#include "hyperq/storage/commit_log.hpp"
+#include <benchmark/benchmark.h>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+using namespace std;
+
+/*
+ * hyperq-bench: Google Benchmark micro benchmarks
+ * Throughput is reported as items_per_second (msgs/s) and bytes_per_second,
+ * latency as p50_ns/p99_ns/p999_ns counters.
+ * Machine readable output: hyperq-bench --benchmark_format=json
+ *                       or hyperq-bench --benchmark_out=results.json
+*/
+
+const string BENCH_DIR = "/tmp/hyperq-bench";
+
+// attach latency percentiles of one run to the benchmark's counters
+static void report_latency(benchmark::State& state, const Histogram& histogram) {
+    HistogramSnapshot snap = histogram.snapshot();
+    state.counters["p50_ns"] = snap.percentile(50);
+    state.counters["p99_ns"] = snap.percentile(99);
+    state.counters["p999_ns"] = snap.percentile(99.9);
+}
+
+static shared_ptr<CommitLog> fresh_log(const string& name, shared_ptr<IoBackend> io = nullptr) {
+    string dir = BENCH_DIR + "/" + name;
+    filesystem::remove_all(dir);
+    filesystem::create_directories(dir);
+    LogConfig config;
+    config.segment_size = 64 * 1024 * 1024;
+    return make_shared<CommitLog>(dir, config, io);
+}
+
+// one fsync per message, args: message size, I/O backend (0 = syscalls, 1 = io_uring if available)
+static void BM_CommitLogAppendSync(benchmark::State& state) {
+    auto io = IoBackend::create(state.range(1) ? "auto" : "syscall");
+    auto log = fresh_log("append-sync", io);
+    state.SetLabel(io->name());
+    string payload(state.range(0), 'x');
+    Histogram latency;
+
+    for (auto _ : state) {
+        uint64_t start = now_ns();
+        benchmark::DoNotOptimize(log->append("bench", 0, payload));
+        latency.record(now_ns() - start);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * payload.size());
+    report_latency(state, latency);
+}
+BENCHMARK(BM_CommitLogAppendSync)->ArgsProduct({{100, 1024}, {0, 1}})->UseRealTime();
+
+// one fsync per batch, args: batch size, message size
+static void BM_CommitLogAppendBatched(benchmark::State& state) {
+    auto log = fresh_log("append-batched");
+    size_t batch_size = state.range(0);
+    string payload(state.range(1), 'x');
+    MessageBatch messages;
+    for (size_t i = 0; i < batch_size; i++) {
+        messages.append(i, "", payload, 0, 0);
+    }
+    Histogram latency;
+
+    for (auto _ : state) {
+        uint64_t start = now_ns();
+        benchmark::DoNotOptimize(log->append_batch("bench", 0, RecordBatch::build(0, messages)));
+        latency.record(now_ns() - start);
+    }
+
+    state.SetItemsProcessed(state.iterations() * batch_size);
+    state.SetBytesProcessed(state.iterations() * batch_size * payload.size());
+    report_latency(state, latency);
+}
+BENCHMARK(BM_CommitLogAppendBatched)->Args({16, 100})->Args({256, 100})->Args({256, 1024})->UseRealTime();
+
+const size_t FETCH_LOG_MESSAGES = 200000;
+
+// shared log for the fetch benchmarks, written once in large batches
+static shared_ptr<CommitLog> fetch_log() {
+    static shared_ptr<CommitLog> log = []() {
+        auto log = fresh_log("fetch");
+        LogConfig config;
+        config.segment_size = 4 * 1024 * 1024;
+        log->set_topic_config("bench", config);
+        string payload(100, 'x');
+        MessageBatch messages;
+        for (size_t i = 0; i < 1000; i++) {
+            messages.append(i, "key-" + to_string(i), payload, 0, 0);
+        }
+        for (size_t written = 0; written < FETCH_LOG_MESSAGES; written += 1000) {
+            log->append_batch("bench", 0, RecordBatch::build(0, messages));
+        }
+        return log;
+    }();
+    return log;
+}
+
+// read 100 messages, arg: start position in percent of the log
+static void BM_CommitLogFetch(benchmark::State& state) {
+    auto log = fetch_log();
+    uint64_t start_offset = FETCH_LOG_MESSAGES * state.range(0) / 100;
+    MessageBatch messages;
+    Histogram latency;
+    size_t count = 0, bytes = 0;
+
+    for (auto _ : state) {
+        messages.clear();
+        uint64_t start = now_ns();
+        count += log->read_into("bench", 0, start_offset, 100, messages);
+        latency.record(now_ns() - start);
+        bytes += messages.bytes();
+    }
+
+    state.SetItemsProcessed(count);
+    state.SetBytesProcessed(bytes);
+    report_latency(state, latency);
+}
+BENCHMARK(BM_CommitLogFetch)->Arg(0)->Arg(50)->Arg(99);
+
+// CRC32C of a batch-sized buffer, args: bytes, implementation (0 = tables, 1 = runtime choice)
+const int MANY_PARTITIONS = 1000;
+
+// one small partition log per partition, more segment files than a tight fd limit allows open
+static shared_ptr<CommitLog> many_partitions_log() {
+    static shared_ptr<CommitLog> log = []() {
+        auto log = fresh_log("many-partitions");
+        LogConfig config;
+        config.preallocate = false;
+        log->set_topic_config("bench", config);
+        MessageBatch messages;
+        for (size_t i = 0; i < 100; i++) {
+            messages.append(i, "", string(100, 'x'), 0, 0);
+        }
+        for (int p = 0; p < MANY_PARTITIONS; p++) {
+            log->append_batch("bench", p, RecordBatch::build(0, messages));
+        }
+        return log;
+    }();
+    return log;
+}
+
+// read 10 messages of a partition picked at random
+// arg: descriptor cache capacity, 0 = the default (every segment stays open)
+static void BM_ManyPartitionsFetch(benchmark::State& state) {
+    auto log = many_partitions_log();
+    FileCache& files = FileCache::instance();
+    size_t capacity = files.capacity();
+    if (state.range(0) > 0) {
+        files.set_capacity(state.range(0));
+    }
+    state.SetLabel(to_string(files.capacity()) + " fds for " + to_string(MANY_PARTITIONS) + " segments");
+    MessageBatch messages;
+    uint64_t seed = 1;
+    size_t count = 0;
+
+    for (auto _ : state) {
+        messages.clear();
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        count += log->read_into("bench", (seed >> 33) % MANY_PARTITIONS, 50, 10, messages);
+    }
+
+    state.SetItemsProcessed(count);
+    files.set_capacity(capacity);
+}
+BENCHMARK(BM_ManyPartitionsFetch)->Arg(0)->Arg(256);
+
+static void BM_Crc32c(benchmark::State& state) {
+    string data(state.range(0), 'x');
+    bool dispatched = state.range(1);
+    state.SetLabel(dispatched ? Crc32c::implementation_name() : "slicing-by-8");
+    for (auto _ : state) {
+        uint32_t crc = dispatched ? Crc32c::compute(data.data(), data.size())
+                                  : Crc32c::extend_portable(0, data.data(), data.size());
+        benchmark::DoNotOptimize(crc);
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Crc32c)->ArgsProduct({{1024, 16 * 1024, 1024 * 1024}, {0, 1}});
+
+// Broker benchmarks share one broker across the benchmark threads
+// arg: partition count
+static unique_ptr<Broker> bench_broker;
+static unique_ptr<Histogram> broker_latency;
+
+static void setup_broker(const benchmark::State& state) {
+    filesystem::remove_all(BENCH_DIR + "/broker");
+    cout.setstate(ios::badbit);     // the broker logs every request
+    bench_broker = make_unique<Broker>(1, BENCH_DIR + "/broker");
+    bench_broker->create_topic("bench", state.range(0), 1);
+    // create_topic only makes partition 0 leader, this broker serves them all
+    for (int p = 1; p < state.range(0); p++) {
+        bench_broker->get_partition("bench", p)->promote_to_leader();
+    }
+    broker_latency = make_unique<Histogram>();
+}
+
+// 1000 messages per partition, produce() spreads them round-robin
+static void setup_filled_broker(const benchmark::State& state) {
+    setup_broker(state);
+    string payload(100, 'x');
+    for (int64_t i = 0; i < 1000 * state.range(0); i++) {
+        bench_broker->produce("bench", payload);
+    }
+}
+
+// 4000 1KB messages per partition, a 1MB fetch gets a quarter of one
+static void setup_large_broker(const benchmark::State& state) {
+    setup_broker(state);
+    string payload(1024, 'x');
+    for (int64_t i = 0; i < 4000 * state.range(0); i++) {
+        bench_broker->produce("bench", payload);
+    }
+}
+
+// second arg: keyless partitioner (0 = round-robin, 1 = sticky)
+static void setup_produce_broker(const benchmark::State& state) {
+    setup_broker(state);
+    bench_broker->set_partitioner(Partitioner::create(state.range(1) ? "sticky" : "hash"));
+}
+
+static void teardown_broker(const benchmark::State&) {
+    bench_broker.reset();
+    broker_latency.reset();
+    cout.clear();
+}
+
+static void BM_BrokerProduce(benchmark::State& state) {
+    state.SetLabel(state.range(1) ? "sticky" : "hash");
+    string payload(100, 'x');
+    for (auto _ : state) {
+        uint64_t start = now_ns();
+        benchmark::DoNotOptimize(bench_broker->produce("bench", payload));
+        broker_latency->record(now_ns() - start);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * payload.size());
+    if (state.thread_index() == 0) {
+        report_latency(state, *broker_latency);
+    }
+}
+BENCHMARK(BM_BrokerProduce)
+    ->Setup(setup_produce_broker)->Teardown(teardown_broker)
+    ->ArgsProduct({{1, 4}, {0, 1}})->Threads(1)->Threads(4)->UseRealTime();
+
+// partitions spread over log directories, args: partition count, directory count
+static void setup_log_dirs_broker(const benchmark::State& state) {
+    filesystem::remove_all(BENCH_DIR + "/broker");
+    vector<string> dirs;
+    for (int d = 0; d < state.range(1); d++) {
+        dirs.push_back(BENCH_DIR + "/broker/disk-" + to_string(d));
+        filesystem::create_directories(dirs.back());
+    }
+    cout.setstate(ios::badbit);
+    bench_broker = make_unique<Broker>(1, dirs);
+    bench_broker->create_topic("bench", state.range(0), 1);
+    for (int p = 1; p < state.range(0); p++) {
+        bench_broker->get_partition("bench", p)->promote_to_leader();
+    }
+    broker_latency = make_unique<Histogram>();
+}
+
+// each thread appends (one fsync per group) to its own partition
+// with one directory every partition's fsync waits behind the others on the log lock
+static void BM_LogDirsAppend(benchmark::State& state) {
+    state.SetLabel(to_string(state.range(1)) + " dir(s)");
+    Partition* partition = bench_broker->get_partition("bench", state.thread_index() % state.range(0));
+    string payload(100, 'x');
+    for (auto _ : state) {
+        uint64_t start = now_ns();
+        benchmark::DoNotOptimize(partition->append(payload));
+        broker_latency->record(now_ns() - start);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * payload.size());
+    if (state.thread_index() == 0) {
+        report_latency(state, *broker_latency);
+    }
+}
+BENCHMARK(BM_LogDirsAppend)
+    ->Setup(setup_log_dirs_broker)->Teardown(teardown_broker)
+    ->Args({4, 1})->Args({4, 4})->Threads(4)->UseRealTime();
+
+// each thread consumes one partition in its own group, 10 messages per call
+// and rewinds to the start at the end of the partition
+// 100-message batches to partition 0 from a client over shared memory
+// args: partitions, batches in flight (0 = calling the broker directly, no transport)
+static void BM_ShmProduce(benchmark::State& state) {
+    size_t in_flight = state.range(1);
+    state.SetLabel(in_flight ? to_string(in_flight) + " in flight" : "direct");
+    MessageBatch records;
+    for (int i = 0; i < 100; i++) {
+        records.append(i, "", string(100, 'x'), 0, 0);
+    }
+    RecordBatch batch = RecordBatch::build(0, records);
+    batch.seal();
+
+    if (in_flight == 0) {
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(bench_broker->produce_batch("bench", 0, batch));
+        }
+    } else {
+        ShmServer server(*bench_broker, BENCH_DIR + "/shm.sock");
+        server.start();
+        ShmProducer producer(server.get_socket_path(), "bench");
+        deque<uint64_t> tickets;
+        for (auto _ : state) {
+            tickets.push_back(producer.submit("bench", 0, batch));
+            if (tickets.size() >= in_flight) {
+                benchmark::DoNotOptimize(producer.wait(tickets.front()));
+                tickets.pop_front();
+            }
+        }
+        for (uint64_t ticket : tickets) {
+            producer.wait(ticket);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * 100);
+    state.SetBytesProcessed(state.iterations() * batch.size_bytes());
+}
+BENCHMARK(BM_ShmProduce)
+    ->Setup(setup_broker)->Teardown(teardown_broker)
+    ->Args({1, 0})->Args({1, 1})->Args({1, 16})->UseRealTime();
+
+static void BM_BrokerConsume(benchmark::State& state) {
+    int partition = state.thread_index() % state.range(0);
+    string group = "bench-" + to_string(state.thread_index());
+
+    uint64_t offset = 0;    // 0 = resume from the committed offset
+    size_t messages = 0, bytes = 0;
+    for (auto _ : state) {
+        uint64_t start = now_ns();
+        FetchResponse response = bench_broker->consume("bench", partition, group, offset);
+        broker_latency->record(now_ns() - start);
+        messages += response.messages.size();
+        bytes += response.messages.bytes();
+        if (response.messages.empty()) {
+            bench_broker->get_coordinator().reset_offset(group, "bench", partition, 0);
+            offset = 0;
+        } else {
+            offset = response.next_offset;
+        }
+    }
+
+    state.SetItemsProcessed(messages);
+    state.SetBytesProcessed(bytes);
+    if (state.thread_index() == 0) {
+        report_latency(state, *broker_latency);
+    }
+}
+BENCHMARK(BM_BrokerConsume)
+    ->Setup(setup_filled_broker)->Teardown(teardown_broker)
+    ->Arg(1)->Arg(4)->Threads(1)->Threads(4)->UseRealTime();
+
+// 20000 keyed messages, customer-0..19 in turn, in batches of 100
+static void setup_keyed_broker(const benchmark::State& state) {
+    setup_broker(state);
+    for (int b = 0; b < 200; b++) {
+        MessageBatch records;
+        for (int i = 0; i < 100; i++) {
+            records.append(i, "customer-" + to_string((b * 100 + i) % 20), string(100, 'x'), 0, 0);
+        }
+        bench_broker->produce_batch("bench", 0, RecordBatch::build(0, records));
+    }
+}
+
+// a consumer interested in one key of twenty
+// second arg: 0 = consume everything and drop the other keys, 1 = key filter on the broker
+static void BM_FilteredConsume(benchmark::State& state) {
+    bool on_broker = state.range(1);
+    state.SetLabel(on_broker ? "broker filter" : "client filter");
+    RecordFilter filter;
+    filter.keys({"customer-7"});
+
+    uint64_t offset = 0;
+    size_t matched = 0, bytes = 0;
+    for (auto _ : state) {
+        FetchResponse response = bench_broker->consume("bench", 0, "bench", offset, IsolationLevel::ReadUncommitted, "",
+                                                       on_broker ? &filter : nullptr);
+        bytes += response.messages.bytes();
+        for (const auto& msg : response.messages) {
+            matched += filter.matches(msg.key, msg.value) ? 1 : 0;
+        }
+        offset = response.next_offset >= 20000 ? 1 : response.next_offset;   // wrap around, 0 would resume from the committed offset
+    }
+
+    state.SetItemsProcessed(matched);
+    state.counters["bytes_out_per_match"] = benchmark::Counter(matched ? double(bytes) / matched : 0);
+}
+BENCHMARK(BM_FilteredConsume)
+    ->Setup(setup_keyed_broker)->Teardown(teardown_broker)
+    ->Args({1, 0})->Args({1, 1});
+
+// one poll round of a caught-up consumer over every partition, nothing new to return
+// second arg: 0 = one fetch() per partition, 1 = one incremental fetch session request
+static void BM_FetchRound(benchmark::State& state) {
+    int partitions = state.range(0);
+    bool session = state.range(1);
+    state.SetLabel(session ? "session" : "per-partition");
+
+    FetchRequest request;
+    for (int p = 0; p < partitions; p++) {
+        request.partitions.push_back({"bench", p, 0});
+    }
+    if (session) {
+        MultiFetchResponse opened = bench_broker->fetch(request);
+        request.session_id = opened.session_id;
+        request.session_epoch = opened.session_epoch;
+        request.partitions.clear();
+    }
+
+    for (auto _ : state) {
+        uint64_t start = now_ns();
+        if (session) {
+            MultiFetchResponse response = bench_broker->fetch(request);
+            request.session_epoch = response.session_epoch;
+            benchmark::DoNotOptimize(response);
+        } else {
+            for (int p = 0; p < partitions; p++) {
+                benchmark::DoNotOptimize(bench_broker->fetch("bench", p, "round", 0, 1024 * 1024, IsolationLevel::ReadUncommitted, false));
+            }
+        }
+        broker_latency->record(now_ns() - start);
+    }
+    report_latency(state, *broker_latency);
+}
+BENCHMARK(BM_FetchRound)
+    ->Setup(setup_broker)->Teardown(teardown_broker)
+    ->ArgsProduct({{16, 200}, {0, 1}});
+
+// one iteration reads every partition once in a fresh group, the "application" blocks ~1us per message
+// (as if writing it downstream), time prefetching can spend fetching the next records
+// second arg: 0 = consume() partition after partition, 1 = assign() + poll() with prefetching
+static void BM_ConsumerPoll(benchmark::State& state) {
+    int partitions = state.range(0);
+    bool prefetch = state.range(1);
+    state.SetLabel(prefetch ? "poll" : "consume");
+    vector<int> assignment;
+    for (int p = 0; p < partitions; p++) {
+        assignment.push_back(p);
+    }
+
+    auto process = [](const FetchResponse& response) {
+        this_thread::sleep_for(chrono::microseconds(response.messages.size()));
+        return response.messages.size();
+    };
+
+    size_t messages = 0, iteration = 0;
+    for (auto _ : state) {
+        Consumer consumer(*bench_broker, "poll-" + to_string(iteration++), "bench", IsolationLevel::ReadUncommitted, false);
+        size_t expected = 4000 * partitions, received = 0;
+        if (prefetch) {
+            consumer.assign("bench", assignment, 4, partitions);
+            while (received < expected) {
+                received += process(consumer.poll(chrono::milliseconds(1000)));
+            }
+            consumer.unassign();
+        } else {
+            for (int p = 0; p < partitions; p++) {
+                size_t count;
+                do {
+                    count = process(consumer.consume("bench", p));
+                    received += count;
+                } while (count > 0);
+            }
+        }
+        messages += received;
+    }
+    state.SetItemsProcessed(messages);
+}
+BENCHMARK(BM_ConsumerPoll)
+    ->Setup(setup_large_broker)->Teardown(teardown_broker)
+    ->ArgsProduct({{1, 4}, {0, 1}})->UseRealTime();
+
+// 2000 single-partition topics in the registry, a few records in each log
+static void setup_registry(const benchmark::State&) {
+    filesystem::remove_all(BENCH_DIR + "/registry");
+    cout.setstate(ios::badbit);
+    Broker broker(1, BENCH_DIR + "/registry");
+    MessageBatch records;
+    records.append(0, "", string(100, 'x'), 0, 0);
+    for (int t = 0; t < 2000; t++) {
+        broker.create_topic("topic-" + to_string(t), 1, 1);
+        broker.produce_batch("topic-" + to_string(t), 0, RecordBatch::build(0, records));
+    }
+}
+
+static void teardown_registry(const benchmark::State&) {
+    cout.clear();
+}
+
+// one iteration restarts the broker on the registry above
+// arg: 0 = until the constructor returns (ready for traffic), 1 = until every partition is open
+static void BM_BrokerRestart(benchmark::State& state) {
+    bool open_all = state.range(0);
+    state.SetLabel(open_all ? "all open" : "ready");
+    for (auto _ : state) {
+        auto broker = make_unique<Broker>(1, BENCH_DIR + "/registry");
+        if (open_all) {
+            for (int t = 0; t < 2000; t++) {
+                benchmark::DoNotOptimize(broker->get_partition("topic-" + to_string(t), 0));
+            }
+        }
+        state.PauseTiming();
+        broker.reset();
+        state.ResumeTiming();
+    }
+}
+BENCHMARK(BM_BrokerRestart)
+    ->Setup(setup_registry)->Teardown(teardown_registry)
+    ->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static ConsumerGroupCoordinator bench_coordinator;
+
+static void BM_CoordinatorCommit(benchmark::State& state) {
+    string group = "group-" + to_string(state.thread_index());
+    uint64_t offset = 0;
+    for (auto _ : state) {
+        bench_coordinator.commit_offset(group, "bench", offset % 16, offset);
+        offset++;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CoordinatorCommit)->Threads(1)->Threads(4);
+
+static void BM_CoordinatorLookup(benchmark::State& state) {
+    string group = "group-" + to_string(state.thread_index());
+    for (int p = 0; p < 16; p++) {
+        bench_coordinator.commit_offset(group, "bench", p, 100);
+    }
+    int partition = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(bench_coordinator.get_offset(group, "bench", partition));
+        partition = (partition + 1) % 16;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CoordinatorLookup)->Threads(1)->Threads(4);
+
+BENCHMARK_MAIN();
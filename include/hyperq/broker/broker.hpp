@@ -1,17 +1,41 @@
 #pragma once
+#include "hyperq/broker/fetch_session.hpp"
 #include "hyperq/broker/partition.hpp"
+#include "hyperq/broker/partitioner.hpp"
+#include "hyperq/broker/quota_manager.hpp"
+#include "hyperq/broker/topic_registry.hpp"
 #include "hyperq/storage/commit_log.hpp"
+#include "hyperq/storage/log_cleaner.hpp"
+#include "hyperq/storage/log_dirs.hpp"
 #include "hyperq/coordinator/consumer_groups.hpp"
+#include "hyperq/coordinator/transaction_coordinator.hpp"
 #include "hyperq/common/types.hpp"
+#include "hyperq/metrics/metrics.hpp"
+#include "hyperq/metrics/prometheus_exporter.hpp"
+#include "hyperq/metrics/tracing.hpp"
 #include <map>
 #include <memory>
 #include <iostream>
 #include <mutex>
 #include <stdexcept>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <optional>
+#include <thread>
 using namespace std;
 
+// Where a consumer seeking to a point in time should start
+// found = false: every record is older, offset is the log end
+struct OffsetForTimeResponse {
+    bool success;
+    bool found;
+    uint64_t offset;
+    uint64_t timestamp;     // of the record at offset, 0 when not found
+    string error_message;
+};
+
 /*
  * Broker: Main MQ server
  * Responsibilities:
@@ -20,89 +44,139 @@ using namespace std;
  * 3. Handle consumer reads
  * 4. Track consumer groups
  * 5. Manage replication (simplified)
+ * Topics are recorded in a TopicRegistry in the first log directory. A
+ * restarted broker reads it back and serves at once: restored partitions are
+ * opened on first use, and meanwhile OPENER_THREADS threads open the rest.
+ * The transaction coordinator logs its decisions in the same directory and
+ * finishes the ones a crash interrupted before the broker starts serving.
 */
 
 class Broker {
 public:
-    // Create broker
-    explicit Broker(int broker_id, const string& log_dir = "/tmp/hyperq")
+    static constexpr size_t OPENER_THREADS = 8;    // open restored partitions side by side, their I/O overlaps
+
+    // Create broker, closed segments are offloaded to remote_store when given
+    explicit Broker(int broker_id, const string& log_dir = "/tmp/hyperq", shared_ptr<ObjectStore> remote_store = nullptr)
+        : Broker(broker_id, vector<string>{log_dir}, remote_store) {}
+
+    // Partitions are spread over log_dirs (one per disk), see LogDirs
+    Broker(int broker_id, const vector<string>& log_dirs, shared_ptr<ObjectStore> remote_store = nullptr)
         : broker_id_(broker_id),
-          commit_log_(make_shared<CommitLog>(log_dir)),
-          partition_counter_(0) {
-        cout << "[Broker " << broker_id_ << "] Started\n";
+          log_dirs_(log_dirs),
+          registry_(log_dirs_.get_paths()[0]),
+          log_cleaner_(log_dirs_.get_logs()),
+          tail_cache_budget_(make_shared<CacheBudget>()),
+          partitioner_(Partitioner::create("hash")),
+          // seeded from the clock so ids handed out before a restart are never reused
+          next_producer_id_(chrono::duration_cast<chrono::microseconds>(
+              chrono::system_clock::now().time_since_epoch()).count()),
+          transaction_coordinator_(
+              group_coordinator_,
+              [this](const string& topic, int partition, uint64_t producer_id, uint16_t epoch, bool commit) {
+                  write_marker(topic, partition, producer_id, epoch, commit);
+              },
+              [this]() { return next_producer_id_++; },
+              log_dirs_.get_paths()[0]),
+          produce_latency_(MetricsRegistry::instance().histogram(
+              "hyperq_produce_latency_ns", {}, "Produce request latency in nanoseconds")),
+          fetch_latency_(MetricsRegistry::instance().histogram(
+              "hyperq_fetch_latency_ns", {}, "Consume/fetch request latency in nanoseconds")),
+          bytes_in_(MetricsRegistry::instance().counter(
+              "hyperq_bytes_in_total", {}, "Bytes produced")),
+          bytes_out_(MetricsRegistry::instance().counter(
+              "hyperq_bytes_out_total", {}, "Bytes served to consumers")),
+          filtered_records_(MetricsRegistry::instance().counter(
+              "hyperq_fetch_filtered_records_total", {}, "Records left out of consume responses by fetch filters")) {
+        if (remote_store) {
+            remote_storage_ = make_shared<TieredStorage>(log_dirs_.get_logs(), remote_store);
+            remote_storage_->start();
+        }
+        restore_topics();
+        transaction_coordinator_.recover();     // decisions a crash left half-written
+        log_cleaner_.start();
+        cout << "[Broker " << broker_id_ << "] Started (" << log_dirs.size() << " log dir(s), "
+             << log_dirs_.get_logs()[0]->get_io_backend().name() << " storage I/O)\n";
     }
 
     ~Broker() {
+        stopping_ = true;
+        for (auto& opener : openers_) {
+            opener.join();
+        }
+        log_cleaner_.stop();
+        if (remote_storage_) {
+            remote_storage_->stop();
+        }
         cout << "[Broker " << broker_id_ << "] Stopped\n";
     }
 
     //Create topic with partitions
-    void create_topic(const string& topic,int num_partitions,int replication_factor) {
+    // the topic is recorded in the topic registry, a restarted broker has it again
+    void create_topic(const string& topic,int num_partitions,int replication_factor,const LogConfig& config = LogConfig()) {
         lock_guard<mutex> lock(mutex_);
 
         // Check if topic already exists
         if (topics_.find(topic) != topics_.end()) {
             throw invalid_argument("Topic " + topic + " already exists");
         }
+        create_topic_locked(topic, num_partitions, replication_factor, config);
+    }
 
-        vector<unique_ptr<Partition>> partitions;
-
-        // Create partitions
-        for (int p = 0; p < num_partitions; p++) {
-            bool is_leader = (p == 0);  // First partition is leader
-
-            auto partition = make_unique<Partition>(
-                topic, p, broker_id_, is_leader, commit_log_
-            );
-            // add replications
-            for (int r = 1; r <= replication_factor; r++) {
-                partition->add_replica(r);
+    // Create topic unless it exists (e.g. restored after a restart), returns whether it was created
+    // an existing topic keeps its partitions and config
+    bool ensure_topic(const string& topic,int num_partitions,int replication_factor,const LogConfig& config = LogConfig()) {
+        lock_guard<mutex> lock(mutex_);
+        auto topic_it = topics_.find(topic);
+        if (topic_it != topics_.end()) {
+            if (topic_it->second.partitions.size() != static_cast<size_t>(num_partitions)) {
+                cout << "[Broker " << broker_id_ << "] Topic " << topic << " exists with "
+                     << topic_it->second.partitions.size() << " partition(s), keeping them\n";
             }
-            partitions.push_back(move(partition));
+            return false;
         }
-
-        topics_[topic] = move(partitions);
-        cout << "[Broker " << broker_id_ << "] Created topic: " << topic<< " with " << num_partitions << " partition(s)\n";
+        create_topic_locked(topic, num_partitions, replication_factor, config);
+        return true;
     }
 
     // Produce message to topic
-    ProduceResponse produce(const string& topic,const string& message,const string& key = "") {
-        lock_guard<mutex> lock(mutex_);
-
-        // Check if topic exists
-        auto topic_it = topics_.find(topic);
-        if (topic_it == topics_.end()) {
-            return ProduceResponse{
-                false, topic, -1, 0,
-                "Topic " + topic + " does not exist"
-            };
+    // client_id is charged against its quota, response.throttle_time_ms says how long it must then wait
+    ProduceResponse produce(const string& topic,const string& message,const string& key = "",const string& client_id = "") {
+        TraceScope trace(TraceOp::Produce, TraceStage::BrokerReceipt);
+        LatencyTimer timer(produce_latency_);
+        if (uint32_t throttle = quotas_.throttle_time(QuotaType::Produce, client_id)) {
+            return throttled_produce(topic, client_id, throttle);
         }
-
-        auto& partitions = topic_it->second;
-        int partition_count = partitions.size();
-
-        // Select partition
-        int partition_id;
-        if (key.empty()) {
-            // Round-robin if no key
-            partition_id = partition_counter_ % partition_count;
-            partition_counter_++;
-        } else {
-            hash<string> hasher;  // hash the key
-            partition_id = hasher(key) % partition_count;
+        Topic* entry;
+        {
+            lock_guard<mutex> lock(mutex_);
+
+            // Check if topic exists
+            auto topic_it = topics_.find(topic);
+            if (topic_it == topics_.end()) {
+                return ProduceResponse{
+                    false, topic, -1, 0,
+                    "Topic " + topic + " does not exist"
+                };
+            }
+            entry = &topic_it->second;  // topics and their partitions are never removed
         }
 
-        Partition* partition = partitions[partition_id].get();
+        // Select partition
+        int partition_id = partitioner_->partition(topic, key, key.size() + message.size(), entry->partitions.size());
 
-        // Write to leader
+        // Write to leader, mutex_ is released so producers of different partitions
+        // (and of one partition, through its appender) don't queue behind each other
         try {
-            uint64_t offset = partition->append(message);
+            uint64_t offset = open_partition(topic, *entry, partition_id)->append(message, key);
+            bytes_in_.add(key.size() + message.size());
 
             cout << "[Broker " << broker_id_ << "] Produced to "<< topic << ":" << partition_id << " offset " << offset<< "\n";
 
-            return ProduceResponse{
+            ProduceResponse response{
                 true, topic, partition_id, offset, ""
             };
+            response.throttle_time_ms = quotas_.record(QuotaType::Produce, client_id, "", key.size() + message.size());
+            return response;
         } catch (const exception& e) {
             return ProduceResponse{
                 false, topic, partition_id, 0,
@@ -111,57 +185,270 @@ public:
         }
     }
 
-    // Consume messages from topic
-    FetchResponse consume(const string& topic,int partition,const string& group_id,uint64_t offset = 0) {
-        lock_guard<mutex> lock(mutex_);
+    // Produce a client-built record batch
+    // compressed batches are stored and later served as-is, never recompressed
+    ProduceResponse produce_batch(const string& topic,const RecordBatch& batch,const string& key = "",const string& client_id = "") {
+        TraceScope trace(TraceOp::Produce, TraceStage::BrokerReceipt);
+        LatencyTimer timer(produce_latency_);
+        if (uint32_t throttle = quotas_.throttle_time(QuotaType::Produce, client_id)) {
+            return throttled_produce(topic, client_id, throttle);
+        }
+        Topic* entry;
+        {
+            lock_guard<mutex> lock(mutex_);
+
+            auto topic_it = topics_.find(topic);
+            if (topic_it == topics_.end()) {
+                return ProduceResponse{
+                    false, topic, -1, 0,
+                    "Topic " + topic + " does not exist"
+                };
+            }
+            entry = &topic_it->second;  // topics and their partitions are never removed
+        }
 
-        // Check if topic exists
-        auto topic_it = topics_.find(topic);
-        if (topic_it == topics_.end()) {
-            return FetchResponse{
-                false, {}, 0, 0,
-                "Topic " + topic + " does not exist"
-            };
+        int partition_id = partitioner_->partition(topic, key, batch.size_bytes(), entry->partitions.size());
+        return append_batch_to(topic, partition_id, *entry, batch, client_id);
+    }
+
+    // Produce a record batch to a chosen partition
+    // idempotent producers need this: a retry must land where the first attempt went
+    ProduceResponse produce_batch(const string& topic,int partition_id,const RecordBatch& batch,const string& client_id = "") {
+        TraceScope trace(TraceOp::Produce, TraceStage::BrokerReceipt);
+        LatencyTimer timer(produce_latency_);
+        if (uint32_t throttle = quotas_.throttle_time(QuotaType::Produce, client_id)) {
+            return throttled_produce(topic, client_id, throttle);
         }
+        Topic* entry;
+        {
+            lock_guard<mutex> lock(mutex_);
+
+            auto topic_it = topics_.find(topic);
+            if (topic_it == topics_.end()) {
+                return ProduceResponse{
+                    false, topic, -1, 0,
+                    "Topic " + topic + " does not exist"
+                };
+            }
+            if (partition_id < 0 || partition_id >= (int)topic_it->second.partitions.size()) {
+                return ProduceResponse{
+                    false, topic, partition_id, 0,
+                    "Partition " + to_string(partition_id) + " does not exist"
+                };
+            }
+            entry = &topic_it->second;
+        }
+        return append_batch_to(topic, partition_id, *entry, batch, client_id);
+    }
 
-        auto& partitions = topic_it->second;
+    // Partition a produce of record_bytes with this key would go to
+    // counts as that produce for keyless records (moves the round-robin or sticky cursor)
+    int partition_for(const string& topic,const string& key = "",size_t record_bytes = 0) {
+        size_t partition_count;
+        {
+            lock_guard<mutex> lock(mutex_);
+            auto topic_it = topics_.find(topic);
+            if (topic_it == topics_.end()) {
+                throw runtime_error("Topic " + topic + " does not exist");
+            }
+            partition_count = topic_it->second.partitions.size();
+        }
+        return partitioner_->partition(topic, key, record_bytes, partition_count);
+    }
 
-        // Check if partition exists
-        if (partition >= partitions.size()) {
-            return FetchResponse{
-                false, {}, 0, 0,
-                "Partition " + to_string(partition) + " does not exist"
-            };
+    // Replace the partitioner (default "hash"), call before producing
+    void set_partitioner(unique_ptr<Partitioner> partitioner) {
+        if (!partitioner) {
+            throw invalid_argument("partitioner cannot be null");
         }
+        partitioner_ = move(partitioner);
+        cout << "[Broker " << broker_id_ << "] Using " << partitioner_->name() << " partitioner\n";
+    }
+
+    // Memory all partitions' tail caches share (default CacheBudget::DEFAULT_CAPACITY), 0 turns them off
+    // past it the oldest cached batches broker-wide are evicted
+    void set_tail_cache_capacity(size_t bytes) {
+        tail_cache_budget_->set_capacity(bytes);
+        cout << "[Broker " << broker_id_ << "] Tail cache budget " << bytes << " bytes\n";
+    }
+
+    const CacheBudget& get_tail_cache_budget() const {
+        return *tail_cache_budget_;
+    }
+
+    // Rate limits of a client id or consumer group, name "" is the default for those without their own
+    // all-zero limits remove the quota, see QuotaManager
+    void set_quota(QuotaEntity entity, const string& name, const QuotaLimits& limits) {
+        quotas_.set_quota(entity, name, limits);
+        cout << "[Broker " << broker_id_ << "] Quota for " << (entity == QuotaEntity::Client ? "client " : "group ")
+             << (name.empty() ? "<default>" : name) << ": produce " << limits.produce_bytes_per_sec << " B/s, fetch "
+             << limits.fetch_bytes_per_sec << " B/s, " << limits.requests_per_sec << " requests/s (0 = unlimited)\n";
+    }
 
-        Partition* part = partitions[partition].get();
+    QuotaLimits get_quota(QuotaEntity entity, const string& name) const {
+        return quotas_.get_quota(entity, name);
+    }
+
+    // New producer id for an idempotent producer, unique across restarts
+    uint64_t init_producer_id() {
+        uint64_t id = next_producer_id_++;
+        cout << "[Broker " << broker_id_ << "] Assigned producer id " << id << "\n";
+        return id;
+    }
+
+    // Consume messages from topic
+    // read_committed only returns committed transactional data, up to the last stable offset
+    // with a filter only matching messages are returned, the broker skips the others while decoding;
+    // next_offset moves past everything examined even when nothing matched (see RecordScan)
+    FetchResponse consume(const string& topic,int partition,const string& group_id,uint64_t offset = 0,
+                          IsolationLevel isolation = IsolationLevel::ReadUncommitted,const string& client_id = "",
+                          const RecordFilter* filter = nullptr) {
+        TraceScope trace(TraceOp::Fetch, TraceStage::BrokerReceipt);
+        LatencyTimer timer(fetch_latency_);
+        Topic* entry;
+        {
+            lock_guard<mutex> lock(mutex_);
+
+            // Check if topic exists
+            auto topic_it = topics_.find(topic);
+            if (topic_it == topics_.end()) {
+                return FetchResponse{
+                    false, {}, 0, 0,
+                    "Topic " + topic + " does not exist"
+                };
+            }
+            entry = &topic_it->second;  // topics and their partitions are never removed
+
+            // Check if partition exists
+            if (partition < 0 || partition >= (int)entry->partitions.size()) {
+                return FetchResponse{
+                    false, {}, 0, 0,
+                    "Partition " + to_string(partition) + " does not exist"
+                };
+            }
+        }
+        // the read runs without mutex_, a first read of a restored partition opens it without stalling the broker
 
         // Get offset
         if (offset == 0) {
             // Get last committed offset from coordinator
             offset = group_coordinator_.get_offset(group_id, topic, partition);
         }
+        if (uint32_t throttle = quotas_.throttle_time(QuotaType::Fetch, client_id, group_id)) {
+            return throttled_fetch(offset, throttle);
+        }
+
+        optional<RecordScan> scan;
+        if (filter && !filter->empty()) {
+            scan.emplace(*filter, offset);
+        }
 
         // Read from partition
         try {
-            auto messages = part->read(offset, 10);
+            Partition* part = open_partition(topic, *entry, partition);
+            auto messages = part->read(offset, 10, isolation, scan ? &*scan : nullptr);
+            TraceScope::mark(TraceStage::LogRead);
+            bytes_out_.add(messages.bytes());
+
+            uint64_t next_offset = messages.empty() ? offset : messages.back().offset + 1;
+            if (scan) {
+                next_offset = max(next_offset, scan->next_offset);
+                filtered_records_.add(scan->scanned - messages.size());
+            }
 
-            // Commit new offset if we read messages
-            if (!messages.empty()) {
-                uint64_t last_offset = messages.back().offset;
+            // Commit the next offset to read if we moved (the same offset poll() and fetch() commit)
+            if (next_offset > offset) {
                 group_coordinator_.commit_offset(
-                    group_id, topic, partition, last_offset
+                    group_id, topic, partition, next_offset
                 );
             }
 
-            cout << "[Broker " << broker_id_ << "] Consumed from "<< topic << ":" << partition << " group " << group_id<< " messages: " << messages.size() << "\n";
+            cout << "[Broker " << broker_id_ << "] Consumed from "<< topic << ":" << partition << " group " << group_id<< " messages: " << messages.size();
+            if (scan) {
+                cout << " of " << scan->scanned << " scanned";
+            }
+            cout << "\n";
 
-            uint64_t next_offset = messages.empty() ? offset : messages.back().offset + 1;
-            uint64_t lag = part->get_high_watermark() > offset ? part->get_high_watermark() - offset : 0;
+            uint64_t log_end = part->get_high_watermark() + 1;
+            uint64_t lag = log_end > next_offset ? log_end - next_offset : 0;
+            TraceScope::mark(TraceStage::ResponseBuilt);
 
+            FetchResponse response{
+                true, move(messages), next_offset, lag, ""
+            };
+            response.throttle_time_ms = quotas_.record(QuotaType::Fetch, client_id, group_id, response.messages.bytes());
+            return response;
+        } catch (const exception& e) {
             return FetchResponse{
-                true, messages, next_offset, lag, ""
+                false, {}, 0, 0,
+                "Read failed: " + string(e.what())
             };
+        }
+    }
+
+    // Fetch raw record batches (up to max_bytes) for the client to decode
+    // unlike consume() the broker never decompresses, response.records holds the batches as stored
+    // auto_commit = false leaves the group's offset alone (it is committed through a transaction)
+    FetchResponse fetch(const string& topic,int partition,const string& group_id,uint64_t offset = 0,size_t max_bytes = 1024 * 1024,
+                        IsolationLevel isolation = IsolationLevel::ReadUncommitted,bool auto_commit = true,
+                        const string& client_id = "") {
+        TraceScope trace(TraceOp::Fetch, TraceStage::BrokerReceipt);
+        LatencyTimer timer(fetch_latency_);
+        Topic* entry;
+        {
+            lock_guard<mutex> lock(mutex_);
+
+            auto topic_it = topics_.find(topic);
+            if (topic_it == topics_.end()) {
+                return FetchResponse{
+                    false, {}, 0, 0,
+                    "Topic " + topic + " does not exist"
+                };
+            }
+
+            entry = &topic_it->second;
+            if (partition < 0 || partition >= static_cast<int>(entry->partitions.size())) {
+                return FetchResponse{
+                    false, {}, 0, 0,
+                    "Partition " + to_string(partition) + " does not exist"
+                };
+            }
+        }
+        // reads run without mutex_, concurrent fetches (e.g. a consumer's prefetchers) only share the partition's read lock
+
+        if (offset == 0) {
+            offset = group_coordinator_.get_offset(group_id, topic, partition);
+        }
+        if (uint32_t throttle = quotas_.throttle_time(QuotaType::Fetch, client_id, group_id)) {
+            return throttled_fetch(offset, throttle);
+        }
+
+        try {
+            Partition* part = open_partition(topic, *entry, partition);
+            auto batches = part->read_batches(offset, max_bytes, isolation);
+            TraceScope::mark(TraceStage::LogRead);
+
+            FetchResponse response{true, {}, offset, 0, ""};
+            for (const auto& batch : batches) {
+                response.records += batch.serialize();
+            }
+            if (!batches.empty()) {
+                uint64_t last_offset = batches.back().last_offset();
+                if (auto_commit) {
+                    group_coordinator_.commit_offset(group_id, topic, partition, last_offset + 1);
+                }
+                response.next_offset = last_offset + 1;
+            }
+            bytes_out_.add(response.records.size());
+            TraceScope::mark(TraceStage::ResponseBuilt);
+
+            cout << "[Broker " << broker_id_ << "] Fetched from " << topic << ":" << partition << " group " << group_id
+                 << " batches: " << batches.size() << " bytes: " << response.records.size() << "\n";
+
+            uint64_t log_end = part->get_high_watermark() + 1;
+            response.consumer_lag = log_end > response.next_offset ? log_end - response.next_offset : 0;
+            response.throttle_time_ms = quotas_.record(QuotaType::Fetch, client_id, group_id, response.records.size());
+            return response;
         } catch (const exception& e) {
             return FetchResponse{
                 false, {}, 0, 0,
@@ -170,17 +457,145 @@ public:
         }
     }
 
+    // Fetch many partitions in one request, request.max_bytes is shared between them
+    // with a fetch session later requests only carry changed partitions and the response only
+    // partitions with new data (see FetchSessionCache). Offsets are not committed here.
+    // A client over its quota gets no records (the session still takes the request's changes), only the delay
+    MultiFetchResponse fetch(const FetchRequest& request) {
+        TraceScope trace(TraceOp::Fetch, TraceStage::BrokerReceipt);
+        LatencyTimer timer(fetch_latency_);
+        MultiFetchResponse response{true, "", NO_FETCH_SESSION, FETCH_SESSIONLESS, {}};
+        vector<SessionPartition> targets;
+        try {
+            targets = fetch_sessions_.open(request, [this](const string& topic, int partition) {
+                return get_partition(topic, partition);
+            }, response);
+        } catch (const exception& e) {
+            cout << "[Broker " << broker_id_ << "] Fetch from " << request.client_id << " failed: " << e.what() << "\n";
+            return MultiFetchResponse{false, e.what(), request.session_id, request.session_epoch, {}};
+        }
+        bool full = request.session_id == NO_FETCH_SESSION;
+        if (full && response.session_id != NO_FETCH_SESSION) {
+            // only session changes are logged, an idle consumer sends a request every few ms
+            cout << "[Broker " << broker_id_ << "] Opened fetch session " << response.session_id << " for "
+                 << request.client_id << " over " << targets.size() << " partition(s)\n";
+        }
+
+        // partitions are resolved once per session, reads run without mutex_
+        uint32_t throttle = quotas_.throttle_time(QuotaType::Fetch, request.client_id, request.group_id);
+        size_t remaining = throttle > 0 ? 0 : request.max_bytes;
+        size_t bytes = 0;
+        vector<SessionPartition> advanced;
+        for (auto& target : targets) {
+            if (remaining == 0 && !full) {
+                break;
+            }
+            FetchResponse data{true, {}, target.offset, 0, ""};
+            try {
+                long high_watermark = target.part->get_high_watermark();
+                // a caught-up partition costs one watermark check, not a log read
+                if (remaining > 0 && static_cast<long>(target.offset) <= high_watermark) {
+                    auto batches = target.part->read_batches(target.offset, remaining, request.isolation);
+                    for (const auto& batch : batches) {
+                        data.records += batch.serialize();
+                    }
+                    if (!batches.empty()) {
+                        data.next_offset = batches.back().last_offset() + 1;
+                    }
+                    remaining -= min(remaining, data.records.size());
+                }
+                data.consumer_lag = high_watermark >= static_cast<long>(data.next_offset) ? high_watermark + 1 - data.next_offset : 0;
+            } catch (const exception& e) {
+                data = FetchResponse{false, {}, target.offset, 0, "Read failed: " + string(e.what())};
+            }
+            if (data.next_offset != target.offset) {
+                target.offset = data.next_offset;
+                advanced.push_back(target);
+            }
+            if (full || !data.success || !data.records.empty()) {
+                bytes += data.records.size();
+                response.partitions.push_back({target.topic, target.partition, move(data)});
+            }
+        }
+        fetch_sessions_.advance(response.session_id, advanced);
+        TraceScope::mark(TraceStage::LogRead);
+        bytes_out_.add(bytes);
+        response.throttle_time_ms = throttle > 0 ? throttle : quotas_.record(QuotaType::Fetch, request.client_id, request.group_id, bytes);
+        TraceScope::mark(TraceStage::ResponseBuilt);
+        return response;
+    }
+
+    // Drop a fetch session the client no longer uses
+    void close_fetch_session(uint32_t session_id) {
+        fetch_sessions_.close(session_id);
+    }
+
+    size_t get_fetch_session_count() const {
+        return fetch_sessions_.get_session_count();
+    }
+
+    // Move a partition to another of the broker's log directories, it keeps serving meanwhile
+    // (writes wait only while the last changes are copied)
+    void move_partition(const string& topic, int partition, const string& log_dir) {
+        Partition* part = get_partition(topic, partition);
+        if (!part) {
+            throw invalid_argument("Partition " + topic + ":" + to_string(partition) + " does not exist");
+        }
+        log_dirs_.move(topic, partition, log_dir, [part](shared_ptr<CommitLog> target, const function<void()>& catch_up) {
+            part->relocate(move(target), catch_up);
+        });
+    }
+
+    // Log directory holding a partition
+    string get_log_dir(const string& topic, int partition) {
+        get_partition(topic, partition);    // a restored partition is placed when it opens
+        return log_dirs_.get_dir(topic, partition);
+    }
+
+    vector<string> get_log_dirs() const {
+        return log_dirs_.get_paths();
+    }
+
+    // Earliest offset whose record timestamp (ms since the epoch) is at or after timestamp
+    // answered from the segments' time indexes; only the local log is searched
+    OffsetForTimeResponse offsets_for_times(const string& topic, int partition, uint64_t timestamp) {
+        Partition* part = get_partition(topic, partition);
+        if (!part) {
+            return OffsetForTimeResponse{
+                false, false, 0, 0,
+                "Partition " + topic + ":" + to_string(partition) + " does not exist"
+            };
+        }
+        try {
+            TimestampOffset found;
+            if (part->offset_for_time(timestamp, found)) {
+                return OffsetForTimeResponse{true, true, found.offset, found.timestamp, ""};
+            }
+            return OffsetForTimeResponse{true, false, static_cast<uint64_t>(part->get_high_watermark() + 1), 0, ""};
+        } catch (const exception& e) {
+            return OffsetForTimeResponse{
+                false, false, 0, 0,
+                "Lookup failed: " + string(e.what())
+            };
+        }
+    }
+
     //Print broker status (debugging)
     void print_status() const {
         lock_guard<mutex> lock(mutex_);
 
         cout << "\n========== BROKER " << broker_id_ << " STATUS ==========\n";
 
-        for (const auto& [topic, partitions] : topics_) {
+        for (const auto& [topic, entry] : topics_) {
+            const auto& partitions = entry.partitions;
             cout << "Topic: " << topic << " (" << partitions.size()<< " partitions)\n";
 
             for (size_t p = 0; p < partitions.size(); p++) {
-                const auto* partition = partitions[p].get();
+                const auto* partition = partitions[p]->ready.load(memory_order_acquire);
+                if (!partition) {
+                    cout << "  Partition " << p << ": not opened yet\n";
+                    continue;
+                }
                 cout << "  Partition " << p << ":\n"<< "    Leader: " << (partition->is_leader() ? "YES" : "NO")<< "\n"<< "    High Watermark: " << partition->get_high_watermark()<< "\n";
             }
         }
@@ -188,6 +603,50 @@ public:
         cout << "===================================\n\n";
     }
 
+    // Print produce/fetch latency percentiles, throughput counters and fsync latency
+    void print_metrics() const {
+        MetricsRegistry::instance().print();
+    }
+
+    // Print per-stage latency of sampled requests and the slowest traces
+    // tracing is off until Tracer::instance().set_sample_rate() is called
+    void print_traces() const {
+        Tracer::instance().dump();
+    }
+
+    // Export consumer-group lag on the exporter's scrapes
+    // lag is computed from the published high watermark gauges (the last offset, so the log end is one past)
+    // and the coordinator's committed offsets (the next offset to read),
+    // never from topics_, so scrapes don't take mutex_. The broker must outlive the exporter.
+    void register_metrics(PrometheusExporter& exporter) {
+        exporter.add_collector([this](MetricsSnapshot& snap) {
+            map<pair<string, string>, int64_t> high_watermarks;    // {(topic, partition): hw}
+            for (const auto& gauge : snap.gauges) {
+                if (gauge.name == "hyperq_partition_high_watermark" && gauge.labels.size() == 2) {
+                    high_watermarks[{gauge.labels[0].second, gauge.labels[1].second}] = gauge.value;
+                }
+            }
+
+            for (const auto& [group_id, topics] : group_coordinator_.get_committed_offsets()) {
+                for (const auto& [topic, partitions] : topics) {
+                    for (const auto& [partition, offset] : partitions) {
+                        auto hw_it = high_watermarks.find({topic, to_string(partition)});
+                        if (hw_it == high_watermarks.end() || hw_it->second < 0) {
+                            continue;
+                        }
+                        uint64_t lag = group_coordinator_.get_consumer_lag(group_id, topic, partition, hw_it->second + 1);
+                        snap.gauges.push_back({
+                            "hyperq_consumer_group_lag",
+                            {{"group", group_id}, {"topic", topic}, {"partition", to_string(partition)}},
+                            "Messages between the committed offset and the log end",
+                            static_cast<int64_t>(lag)
+                        });
+                    }
+                }
+            }
+        });
+    }
+
     int get_broker_id() const {
         return broker_id_;
     }
@@ -197,20 +656,41 @@ public:
         return topics_.size();
     }
 
+    // Partitions opened so far, restored ones open on first use or in the background
+    size_t get_open_partition_count() const {
+        lock_guard<mutex> lock(mutex_);
+        size_t count = 0;
+        for (const auto& [topic, entry] : topics_) {
+            for (const auto& slot : entry.partitions) {
+                count += slot->ready.load(memory_order_acquire) ? 1 : 0;
+            }
+        }
+        return count;
+    }
+
+    const TopicRegistry& get_topic_registry() const {
+        return registry_;
+    }
+
     //Get partition for topic
+    // a restored partition is opened here, outside mutex_
     Partition* get_partition(const string& topic, int partition_id) {
-        lock_guard<mutex> lock(mutex_);
+        Topic* entry;
+        {
+            lock_guard<mutex> lock(mutex_);
 
-        auto topic_it = topics_.find(topic);
-        if (topic_it == topics_.end()) {
-            return nullptr;
-        }
+            auto topic_it = topics_.find(topic);
+            if (topic_it == topics_.end()) {
+                return nullptr;
+            }
 
-        if (partition_id >= topic_it->second.size()) {
-            return nullptr;
+            if (partition_id < 0 || partition_id >= (int)topic_it->second.partitions.size()) {
+                return nullptr;
+            }
+            entry = &topic_it->second;
         }
 
-        return topic_it->second[partition_id].get();
+        return open_partition(topic, *entry, partition_id);
     }
 
     //Get consumer group coordinator
@@ -218,12 +698,222 @@ public:
         return group_coordinator_;
     }
 
+    TransactionCoordinator& get_transaction_coordinator() {
+        return transaction_coordinator_;
+    }
+
 private:
+    // A partition, opened by whoever needs it first
+    struct PartitionSlot {
+        atomic<Partition*> ready{nullptr};     // set once open, the lock-free path
+        mutex opening;
+        unique_ptr<Partition> partition;
+    };
+
+    struct Topic {
+        int replication_factor = 0;
+        vector<unique_ptr<PartitionSlot>> partitions;
+    };
+
+    // a restored partition waiting for the openers
+    struct PendingOpen {
+        const string* topic;
+        Topic* entry;
+        int partition;
+    };
+
     int broker_id_;
     // {topic: [partitions]}
-    map<string, vector<unique_ptr<Partition>>> topics_;
-    shared_ptr<CommitLog> commit_log_;
+    map<string, Topic> topics_;
+    LogDirs log_dirs_;          // a CommitLog per log directory
+    TopicRegistry registry_;    // topics on disk, in the first log directory
+    LogCleaner log_cleaner_;     // compacts cleanup.policy=compact topics
+    shared_ptr<TieredStorage> remote_storage_;  // null when no object store is configured
+    shared_ptr<CacheBudget> tail_cache_budget_; // shared by every partition's TailCache
     ConsumerGroupCoordinator group_coordinator_;
+    FetchSessionCache fetch_sessions_;
+    QuotaManager quotas_;
     mutable mutex mutex_;
-    int partition_counter_;  // For round-robin partition selection
+    unique_ptr<Partitioner> partitioner_;
+    atomic<uint64_t> next_producer_id_;
+    TransactionCoordinator transaction_coordinator_;
+    Histogram& produce_latency_;
+    Histogram& fetch_latency_;
+    Counter& bytes_in_;
+    Counter& bytes_out_;
+    Counter& filtered_records_;
+    vector<PendingOpen> pending_opens_;     // fixed once the openers start
+    atomic<size_t> next_open_{0};
+    atomic<size_t> opened_{0};
+    atomic<bool> stopping_{false};
+    vector<thread> openers_;
+    chrono::steady_clock::time_point restore_started_;
+
+    // caller holds mutex_
+    void create_topic_locked(const string& topic, int num_partitions, int replication_factor, const LogConfig& config) {
+        if (num_partitions <= 0) {
+            throw invalid_argument("Topic " + topic + " needs at least one partition");
+        }
+        check_config(topic, config);
+        log_dirs_.set_topic_config(topic, config);
+        Topic entry;
+        entry.replication_factor = replication_factor;
+
+        // Create partitions
+        for (int p = 0; p < num_partitions; p++) {
+            auto slot = make_unique<PartitionSlot>();
+            slot->partition = make_partition(topic, p, replication_factor);
+            slot->ready = slot->partition.get();
+            entry.partitions.push_back(move(slot));
+        }
+
+        registry_.add(TopicMetadata{topic, num_partitions, replication_factor, config});
+        topics_.emplace(topic, move(entry));
+        cout << "[Broker " << broker_id_ << "] Created topic: " << topic<< " with " << num_partitions << " partition(s)\n";
+    }
+
+    void check_config(const string& topic, const LogConfig& config) const {
+        if (config.remote_storage && !remote_storage_) {
+            throw invalid_argument("Topic " + topic + " wants remote storage but no object store is configured");
+        }
+        if (config.remote_storage && config.cleanup_policy == CleanupPolicy::Compact) {
+            throw invalid_argument("Topic " + topic + ": remote storage is not supported for compacted topics");
+        }
+    }
+
+    unique_ptr<Partition> make_partition(const string& topic, int p, int replication_factor) {
+        bool is_leader = (p == 0);  // First partition is leader
+
+        auto partition = make_unique<Partition>(
+            topic, p, broker_id_, is_leader, log_dirs_.assign(topic, p), remote_storage_, tail_cache_budget_,
+            [this](uint64_t producer_id) { return transaction_coordinator_.has_decision(producer_id); }
+        );
+        // add replications
+        for (int r = 1; r <= replication_factor; r++) {
+            partition->add_replica(r);
+        }
+        partition->start_appender();    // single writer thread per partition
+        return partition;
+    }
+
+    // the partition, opened first if nobody has yet; a failed open is retried by the next caller
+    Partition* open_partition(const string& topic, Topic& entry, int p) {
+        PartitionSlot& slot = *entry.partitions[p];
+        if (Partition* partition = slot.ready.load(memory_order_acquire)) {
+            return partition;
+        }
+        lock_guard<mutex> lock(slot.opening);
+        if (!slot.partition) {
+            slot.partition = make_partition(topic, p, entry.replication_factor);
+            slot.ready.store(slot.partition.get(), memory_order_release);
+        }
+        return slot.partition.get();
+    }
+
+    // topics from the registry, their partitions left for the openers (or whoever comes first)
+    void restore_topics() {
+        vector<TopicMetadata> topics = registry_.get_topics();
+        if (topics.empty()) {
+            return;
+        }
+        restore_started_ = chrono::steady_clock::now();
+        for (const auto& metadata : topics) {
+            check_config(metadata.name, metadata.config);
+            log_dirs_.set_topic_config(metadata.name, metadata.config);
+            auto topic_it = topics_.emplace(metadata.name, Topic()).first;
+            Topic& entry = topic_it->second;
+            entry.replication_factor = metadata.replication_factor;
+            for (int p = 0; p < metadata.partitions; p++) {
+                entry.partitions.push_back(make_unique<PartitionSlot>());
+                pending_opens_.push_back(PendingOpen{&topic_it->first, &entry, p});
+            }
+        }
+        cout << "[Broker " << broker_id_ << "] Restored " << topics.size() << " topic(s) with " << pending_opens_.size()
+             << " partition(s) from " << registry_.get_snapshot_path() << ", opening them in the background\n";
+
+        size_t threads = min(OPENER_THREADS, pending_opens_.size());
+        for (size_t t = 0; t < threads; t++) {
+            openers_.emplace_back([this]() { open_pending(); });
+        }
+    }
+
+    void open_pending() {
+        while (!stopping_) {
+            size_t i = next_open_++;
+            if (i >= pending_opens_.size()) {
+                return;
+            }
+            const PendingOpen& pending = pending_opens_[i];
+            try {
+                open_partition(*pending.topic, *pending.entry, pending.partition);
+            } catch (const exception& e) {
+                cerr << "[Broker " << broker_id_ << "] Failed to open " << *pending.topic << "-" << pending.partition
+                     << ": " << e.what() << "\n";
+            }
+            if (++opened_ == pending_opens_.size()) {
+                auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - restore_started_);
+                cout << "[Broker " << broker_id_ << "] Opened " << pending_opens_.size() << " restored partition(s) in "
+                     << elapsed.count() << " ms\n";
+            }
+        }
+    }
+
+    ProduceResponse append_batch_to(const string& topic, int partition_id, Topic& entry, const RecordBatch& batch,
+                                    const string& client_id) {
+        try {
+            if (batch.is_transactional()) {
+                transaction_coordinator_.check_partition(batch.header.producer_id, batch.header.producer_epoch,
+                                                         topic, partition_id);
+            }
+            uint64_t offset = open_partition(topic, entry, partition_id)->append_batch(batch);
+            bytes_in_.add(batch.size_bytes());
+
+            cout << "[Broker " << broker_id_ << "] Produced batch of " << batch.header.record_count
+                 << " (" << Compression::codec_name(batch.codec()) << ") to " << topic << ":" << partition_id
+                 << " offset " << offset << "\n";
+
+            ProduceResponse response{
+                true, topic, partition_id, offset, ""
+            };
+            response.throttle_time_ms = quotas_.record(QuotaType::Produce, client_id, "", batch.size_bytes());
+            return response;
+        } catch (const exception& e) {
+            return ProduceResponse{
+                false, topic, partition_id, 0,
+                "Write failed: " + string(e.what())
+            };
+        }
+    }
+
+    // a client still inside its last throttle delay is turned away before anything is written
+    static ProduceResponse throttled_produce(const string& topic, const string& client_id, uint32_t throttle_ms) {
+        ProduceResponse response{
+            false, topic, -1, 0,
+            "Client " + client_id + " is over its produce quota, retry in " + to_string(throttle_ms) + " ms"
+        };
+        response.throttle_time_ms = throttle_ms;
+        return response;
+    }
+
+    // likewise for fetches, an empty response: nothing read, the offset stays
+    static FetchResponse throttled_fetch(uint64_t offset, uint32_t throttle_ms) {
+        FetchResponse response{true, {}, offset, 0, ""};
+        response.throttle_time_ms = throttle_ms;
+        return response;
+    }
+
+    // transaction coordinator callback, mutex_ is released before the marker is appended
+    void write_marker(const string& topic, int partition_id, uint64_t producer_id, uint16_t epoch, bool commit) {
+        Topic* entry;
+        {
+            lock_guard<mutex> lock(mutex_);
+            auto topic_it = topics_.find(topic);
+            if (topic_it == topics_.end() || partition_id < 0 || partition_id >= (int)topic_it->second.partitions.size()) {
+                throw invalid_argument("Partition " + topic + ":" + to_string(partition_id) + " does not exist");
+            }
+            entry = &topic_it->second;
+        }
+        Partition* partition = open_partition(topic, *entry, partition_id);
+        partition->append_marker(producer_id, epoch, commit);
+    }
 };
\ No newline at end of file
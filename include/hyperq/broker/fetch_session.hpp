@@ -0,0 +1,231 @@
+#pragma once
+#include "hyperq/broker/partition.hpp"
+#include "hyperq/common/types.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+using namespace std;
+
+const uint32_t NO_FETCH_SESSION = 0;
+const int32_t FETCH_SESSIONLESS = -1;   // session_epoch of a one-off fetch that opens no session
+
+struct FetchPartition {
+    string topic;
+    int partition;
+    uint64_t offset;        // where to read from
+};
+
+// One fetch over many partitions
+//   session_id 0, epoch 0:  full request, opens a session
+//   session_id 0, epoch -1: full request without a session
+//   session_id N, epoch E:  incremental, E is the epoch the last response handed out
+// An incremental request lists only partitions to add (or to move to a new offset) and ones to forget
+struct FetchRequest {
+    uint32_t session_id = NO_FETCH_SESSION;
+    int32_t session_epoch = 0;
+    vector<FetchPartition> partitions;
+    vector<pair<string, int>> forgotten;
+    size_t max_bytes = 1024 * 1024;     // shared by all partitions
+    IsolationLevel isolation = IsolationLevel::ReadUncommitted;
+    string client_id;       // quotas are charged to the client and its group
+    string group_id;
+};
+
+struct PartitionFetch {
+    string topic;
+    int partition;
+    FetchResponse response;     // records and next_offset, or the partition's error
+};
+
+// A full response has every requested partition, an incremental one only those with data or errors
+// on failure the client drops its session and sends a full request
+struct MultiFetchResponse {
+    bool success;
+    string error_message;
+    uint32_t session_id;
+    int32_t session_epoch;          // to send with the next incremental request
+    vector<PartitionFetch> partitions;
+    uint32_t throttle_time_ms = 0;  // over its quota: how long the client must wait before the next request
+};
+
+// a partition to read this round, offset moves on as data is returned
+struct SessionPartition {
+    string topic;
+    int partition;
+    Partition* part;
+    uint64_t offset;
+};
+
+/*
+ * FetchSessionCache: the broker side of incremental fetch sessions
+ * A session remembers the partitions of one fetching client, already resolved
+ * to their Partition, and the offset each continues from. So a client owning
+ * hundreds of partitions sends them once, later requests carry only changes,
+ * and a poll round costs one request instead of one per partition.
+ * The epoch orders a session's requests: a repeated or reordered request is
+ * rejected instead of moving offsets twice. Past max_sessions the least
+ * recently used session is dropped, its client starts over with a full request.
+*/
+
+class FetchSessionCache {
+public:
+    using Resolver = function<Partition*(const string& topic, int partition)>;
+
+    explicit FetchSessionCache(size_t max_sessions = 1000) : max_sessions_(max_sessions) {}
+
+    // Apply request, returns the partitions to read this round (a session rotates its start so a
+    // small max_bytes doesn't starve its last partitions). Unknown partitions get an error in
+    // response and are not kept. Throws when the session is gone or the epoch is wrong.
+    vector<SessionPartition> open(const FetchRequest& request, const Resolver& resolve, MultiFetchResponse& response) {
+        lock_guard<mutex> lock(mutex_);
+        tick_++;
+        if (request.session_id == NO_FETCH_SESSION) {
+            if (request.session_epoch != 0 && request.session_epoch != FETCH_SESSIONLESS) {
+                throw invalid_argument("A new fetch session starts at epoch 0");
+            }
+            Session session;
+            add_partitions(session, request.partitions, resolve, response);
+            response.session_id = NO_FETCH_SESSION;
+            response.session_epoch = FETCH_SESSIONLESS;
+            if (request.session_epoch == FETCH_SESSIONLESS) {
+                return session.partitions;
+            }
+            if (sessions_.size() >= max_sessions_) {
+                evict_oldest();
+            }
+            uint32_t id = next_session_id_++;
+            if (next_session_id_ == NO_FETCH_SESSION) {
+                next_session_id_++;
+            }
+            session.epoch = 1;
+            session.last_used = tick_;
+            response.session_id = id;
+            response.session_epoch = session.epoch;
+            vector<SessionPartition> targets = session.partitions;
+            sessions_[id] = move(session);
+            return targets;
+        }
+
+        auto it = sessions_.find(request.session_id);
+        if (it == sessions_.end()) {
+            throw runtime_error("Fetch session " + to_string(request.session_id) + " not found");
+        }
+        Session& session = it->second;
+        if (request.session_epoch != session.epoch) {
+            throw runtime_error("Fetch session " + to_string(request.session_id) + " expected epoch " +
+                                to_string(session.epoch) + ", got " + to_string(request.session_epoch));
+        }
+        for (const auto& [topic, partition] : request.forgotten) {
+            auto found = find(session, topic, partition);
+            if (found != session.partitions.end()) {
+                session.partitions.erase(found);
+            }
+        }
+        add_partitions(session, request.partitions, resolve, response);
+        session.epoch = session.epoch == INT32_MAX ? 1 : session.epoch + 1;
+        session.last_used = tick_;
+        response.session_id = request.session_id;
+        response.session_epoch = session.epoch;
+
+        vector<SessionPartition> targets;
+        size_t count = session.partitions.size();
+        targets.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            targets.push_back(session.partitions[(session.rotation + i) % count]);
+        }
+        session.rotation = count == 0 ? 0 : (session.rotation + 1) % count;
+        return targets;
+    }
+
+    // Remember where the partitions that returned data this round continue from
+    void advance(uint32_t session_id, const vector<SessionPartition>& read) {
+        if (session_id == NO_FETCH_SESSION) {
+            return;
+        }
+        lock_guard<mutex> lock(mutex_);
+        auto it = sessions_.find(session_id);
+        if (it == sessions_.end()) {
+            return;     // evicted meanwhile
+        }
+        for (const auto& target : read) {
+            auto found = find(it->second, target.topic, target.partition);
+            if (found != it->second.partitions.end()) {
+                found->offset = target.offset;
+            }
+        }
+    }
+
+    // Drop a session the client is done with
+    void close(uint32_t session_id) {
+        lock_guard<mutex> lock(mutex_);
+        sessions_.erase(session_id);
+    }
+
+    size_t get_session_count() const {
+        lock_guard<mutex> lock(mutex_);
+        return sessions_.size();
+    }
+
+private:
+    struct Session {
+        int32_t epoch = 0;
+        vector<SessionPartition> partitions;
+        size_t rotation = 0;        // partition the next round reads first
+        uint64_t last_used = 0;
+    };
+
+    size_t max_sessions_;
+    unordered_map<uint32_t, Session> sessions_;     // {session_id: session}
+    uint32_t next_session_id_ = 1;
+    uint64_t tick_ = 0;
+    mutable mutex mutex_;
+
+    static vector<SessionPartition>::iterator find(Session& session, const string& topic, int partition) {
+        return find_if(session.partitions.begin(), session.partitions.end(), [&](const SessionPartition& entry) {
+            return entry.partition == partition && entry.topic == topic;
+        });
+    }
+
+    // add, or move to the requested offset
+    static void add_partitions(Session& session, const vector<FetchPartition>& partitions, const Resolver& resolve,
+                               MultiFetchResponse& response) {
+        for (const auto& requested : partitions) {
+            auto found = find(session, requested.topic, requested.partition);
+            if (found != session.partitions.end()) {
+                found->offset = requested.offset;
+                continue;
+            }
+            Partition* part = resolve(requested.topic, requested.partition);
+            if (!part) {
+                response.partitions.push_back({requested.topic, requested.partition, FetchResponse{
+                    false, {}, requested.offset, 0,
+                    "Partition " + requested.topic + ":" + to_string(requested.partition) + " does not exist"
+                }});
+                continue;
+            }
+            session.partitions.push_back({requested.topic, requested.partition, part, requested.offset});
+        }
+    }
+
+    void evict_oldest() {
+        auto oldest = sessions_.begin();
+        for (auto it = sessions_.begin(); it != sessions_.end(); ++it) {
+            if (it->second.last_used < oldest->second.last_used) {
+                oldest = it;
+            }
+        }
+        if (oldest != sessions_.end()) {
+            cout << "[FetchSessionCache] Evicted fetch session " << oldest->first << ", the least recently used of "
+                 << max_sessions_ << "\n";
+            sessions_.erase(oldest);
+        }
+    }
+};
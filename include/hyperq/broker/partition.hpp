@@ -1,7 +1,18 @@
 #pragma once
+#include "hyperq/broker/partition_appender.hpp"
 #include "hyperq/storage/commit_log.hpp"
+#include "hyperq/storage/tail_cache.hpp"
+#include "hyperq/storage/tiered_storage.hpp"
+#include "hyperq/metrics/metrics.hpp"
+#include "hyperq/metrics/tracing.hpp"
 #include "hyperq/common/types.hpp"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <shared_mutex>
 #include <vector>
 #include <stdexcept>
@@ -9,29 +20,113 @@
 
 using namespace std;
 
+// What a fetch may see: everything written, or only committed transactions
+// read_committed stops at the last stable offset and skips aborted batches
+enum class IsolationLevel { ReadUncommitted, ReadCommitted };
+
+/*
+ * Partition: one replica of a topic partition on this broker
+ * Batches from idempotent producers carry (producer_id, epoch, base_sequence).
+ * The partition remembers the last PRODUCER_WINDOW batches of each producer:
+ * a retry of one of them is acked with its original offset instead of being
+ * appended again, and a sequence gap is rejected so ordering survives retries.
+ * Transactional batches stay open until the producer's commit/abort marker.
+ * The last stable offset (LSO) is the first offset of the oldest open
+ * transaction, or the log end when none is open. Aborted (first, marker)
+ * ranges are kept per producer so read_committed fetches can skip them with
+ * a lookup per batch. Ranges and idle producers below the earliest offset
+ * still readable (locally or in the remote tier) are dropped when the log
+ * rolls a segment.
+ * This state is saved in a snapshot whenever the log rolls a segment, and
+ * rebuilt on open from the newest snapshot plus the batch headers after it
+ * (the whole log only when there is no usable snapshot), so opening reads
+ * about one segment however long the log is.
+ * With a cache budget every written batch also goes into a TailCache, and
+ * fetches at the log end are served from memory.
+*/
+
 class Partition {
 public:
+    // whether the transaction coordinator has decided producer_id's open transaction
+    using TransactionDecided = function<bool(uint64_t producer_id)>;
+
     Partition(const string& topic,
               int partition_id,
               int broker_id,
               bool is_leader,
-              shared_ptr<CommitLog> commit_log)
+              shared_ptr<CommitLog> commit_log,
+              shared_ptr<TieredStorage> remote_storage = nullptr,
+              shared_ptr<CacheBudget> cache_budget = nullptr,
+              TransactionDecided decided = nullptr)
         : topic_(topic),
           partition_id_(partition_id),
           broker_id_(broker_id),
           is_leader_(is_leader),
           commit_log_(commit_log),
-          high_watermark_(-1) {
+          remote_storage_(remote_storage),
+          high_watermark_(-1),
+          messages_in_(MetricsRegistry::instance().counter(
+              "hyperq_partition_messages_in_total",
+              {{"topic", topic}, {"partition", to_string(partition_id)}},
+              "Messages appended per partition", MetricSharding::Single)),
+          high_watermark_gauge_(MetricsRegistry::instance().gauge(
+              "hyperq_partition_high_watermark",
+              {{"topic", topic}, {"partition", to_string(partition_id)}},
+              "Last committed offset, -1 when empty", MetricSharding::Single)),
+          duplicates_(MetricsRegistry::instance().counter(
+              "hyperq_partition_duplicate_batches_total",
+              {{"topic", topic}, {"partition", to_string(partition_id)}},
+              "Producer retries acked without appending", MetricSharding::Single)),
+          tail_cache_(cache_budget ? make_unique<TailCache>(topic, partition_id, cache_budget) : nullptr),
+          decided_(move(decided)) {
+        high_watermark_gauge_.set(high_watermark_);
         if (!commit_log_) {
             throw invalid_argument("commit_log cannot be null");
         }
+        load_producer_state();
+        if (is_leader_) {
+            abort_open_transactions();
+        }
+    }
+
+    // CommitLog is shared_ptr, cleans itself; queued appends are finished first
+    ~Partition() {
+        if (appender_) {
+            appender_->stop();
+        }
+    }
+
+    // Route appends through a dedicated writer thread (the Broker does this for
+    // every partition). The thread is the log's single writer and group-commits
+    // concurrent producers. Call before the partition is shared.
+    void start_appender(size_t queue_capacity = 1024) {
+        appender_ = make_unique<PartitionAppender>(
+            topic_ + "-" + to_string(partition_id_),
+            [this](vector<AppendRequest*>& group) { write_group(group); },
+            queue_capacity);
+        appender_->start();
     }
 
-    ~Partition() {} // CommitLog is shared_ptr, cleans itself
+    uint64_t get_append_group_count() const {
+        return appender_ ? appender_->get_group_count() : 0;
+    }
 
     // Append to leader only
-    uint64_t append(const string& message) {
+    uint64_t append(const string& message, const string& key = "") {
+        if (appender_) {
+            Message record;
+            record.offset = 0;
+            record.key = key;
+            record.value = message;
+            record.timestamp = 0;
+            record.partition = partition_id_;
+            RecordBatch batch = RecordBatch::build(0, {record});
+            batch.seal();
+            return appender_->append(move(batch));
+        }
+
         unique_lock<shared_mutex> lock(mutex_);
+        TraceScope::mark(TraceStage::LockAcquired);
 
         if (!is_leader_) {
             throw runtime_error(
@@ -40,20 +135,149 @@ public:
             );
         }
 
-        // Write to commit log with fsync (inside CommitLog::append)
-        uint64_t offset = commit_log_->append(topic_, partition_id_, message);
+        // Write to commit log with fsync, the cache gets the same batch (and timestamp)
+        RecordBatch batch = RecordBatch::build(0, {Message{0, key, message, 0, partition_id_}});
+        batch.seal();
+        uint64_t offset = commit_log_->append_batch(topic_, partition_id_, batch);
+        cache_batch(move(batch), offset);
         high_watermark_ = offset;
+        high_watermark_gauge_.set(high_watermark_);
+        messages_in_.add();
+        if (state_snapshot_due()) {
+            prune_state();
+            save_state(high_watermark_ + 1, encode_state());
+        }
         return offset;
     }
 
-    // Read from any replica
-    vector<Message> read(uint64_t start_offset, size_t max_count) const {
+    // Append a client-built batch to leader only, returns its base offset
+    // a retried batch of an idempotent producer returns the offset it got the first time
+    // the producer's checksum is verified here, on the caller's thread; a batch without one is sealed
+    uint64_t append_batch(RecordBatch batch) {
+        if (!batch.has_checksum()) {
+            batch.seal();
+        } else if (!batch.verify_checksum()) {
+            Segment::checksum_failures().add();
+            throw runtime_error("Record batch checksum mismatch, rejected");
+        }
+        if (appender_) {
+            return appender_->append(move(batch));
+        }
+
+        unique_lock<shared_mutex> lock(mutex_);
+        TraceScope::mark(TraceStage::LockAcquired);
+
+        if (!is_leader_) {
+            throw runtime_error(
+                "Cannot append to partition " + to_string(partition_id_) +
+                ": not leader (broker " + to_string(broker_id_) + ")"
+            );
+        }
+
+        if (batch.has_producer() && !batch.is_control()) {
+            ProducerState& state = producers_[batch.header.producer_id];
+            uint64_t offset;
+            if (find_duplicate(state, batch.header, offset)) {
+                duplicates_.add();
+                return offset;
+            }
+            check_sequence(state, batch.header);
+        }
+
+        uint64_t base_offset = commit_log_->append_batch(topic_, partition_id_, batch);
+        high_watermark_ = base_offset + batch.header.last_offset_delta;
+        high_watermark_gauge_.set(high_watermark_);
+        messages_in_.add(batch.header.record_count);
+        track_batch(batch.header, base_offset);
+        cache_batch(move(batch), base_offset);
+        if (state_snapshot_due()) {
+            prune_state();
+            save_state(high_watermark_ + 1, encode_state());
+        }
+        return base_offset;
+    }
+
+    // End a producer's transaction on this partition, returns the marker's offset
+    uint64_t append_marker(uint64_t producer_id, uint16_t producer_epoch, bool commit) {
+        return append_batch(RecordBatch::control(producer_id, producer_epoch, commit));
+    }
+
+    // First offset a read_committed fetch may not return yet
+    uint64_t get_last_stable_offset() const {
         shared_lock<shared_mutex> lock(mutex_);
-        auto messages =
-            commit_log_->read(topic_, partition_id_, start_offset, max_count);
+        return last_stable_offset();
+    }
+
+    size_t get_open_transaction_count() const {
+        shared_lock<shared_mutex> lock(mutex_);
+        return open_transactions_.size();
+    }
+
+    // Producers the partition currently tracks
+    size_t get_producer_count() const {
+        shared_lock<shared_mutex> lock(mutex_);
+        return producers_.size();
+    }
+
+    // Read from any replica into one pooled buffer
+    // offsets below the local log start come from the remote tier first
+    // with a scan up to max_count records matching its filter, scan->next_offset is where to go on
+    MessageBatch read(uint64_t start_offset, size_t max_count,
+                      IsolationLevel isolation = IsolationLevel::ReadUncommitted, RecordScan* scan = nullptr) const {
+        shared_lock<shared_mutex> lock(mutex_);
+        TraceScope::mark(TraceStage::LockAcquired);
+        uint64_t end_offset = UINT64_MAX;
+        BatchFilter skip;
+        if (isolation == IsolationLevel::ReadCommitted) {
+            end_offset = last_stable_offset();
+            skip = aborted_filter(start_offset);
+        }
+
+        MessageBatch messages;
+        if (tail_cache_ && tail_cache_->read_into(start_offset, max_count, messages, end_offset, skip, scan)) {
+            return messages;
+        }
+        if (reads_remote(start_offset)) {
+            remote_storage_->read_into(topic_, partition_id_, start_offset, max_count, messages, end_offset, skip, scan);
+            if (messages.size() >= max_count || (scan && scan->done())) {
+                return messages;
+            }
+            if (scan) {
+                start_offset = max(start_offset, scan->next_offset);
+            } else if (!messages.empty()) {
+                start_offset = messages.back().offset + 1;
+            }
+        }
+
+        commit_log_->read_into(topic_, partition_id_, start_offset, max_count - messages.size(), messages, end_offset, skip, scan);
         return messages;
     }
 
+    // Read stored batches as-is (still compressed) from any replica
+    vector<RecordBatch> read_batches(uint64_t start_offset, size_t max_bytes,
+                                     IsolationLevel isolation = IsolationLevel::ReadUncommitted) const {
+        shared_lock<shared_mutex> lock(mutex_);
+        TraceScope::mark(TraceStage::LockAcquired);
+        uint64_t end_offset = UINT64_MAX;
+        BatchFilter skip;
+        if (isolation == IsolationLevel::ReadCommitted) {
+            end_offset = last_stable_offset();
+            skip = aborted_filter(start_offset);
+        }
+
+        vector<RecordBatch> cached;
+        if (tail_cache_ && tail_cache_->read_batches(start_offset, max_bytes, end_offset, skip, cached)) {
+            return cached;
+        }
+        if (reads_remote(start_offset)) {
+            auto batches = remote_storage_->read_batches(topic_, partition_id_, start_offset, max_bytes, end_offset, skip);
+            if (!batches.empty()) {
+                return batches;     // client fetches the local part next round
+            }
+        }
+        return commit_log_->read_batches(topic_, partition_id_, start_offset, max_bytes, end_offset, skip);
+    }
+
     bool is_leader() const {
         shared_lock<shared_mutex> lock(mutex_);
         return is_leader_;
@@ -71,6 +295,7 @@ public:
         cout << "[Broker " << broker_id_ << "] "
              << topic_ << "-" << partition_id_
              << " promoted to LEADER\n";
+        abort_open_transactions();
     }
 
     // Add replica broker id
@@ -96,6 +321,7 @@ public:
     void set_high_watermark(long watermark) {
         unique_lock<shared_mutex> lock(mutex_);
         high_watermark_ = watermark;
+        high_watermark_gauge_.set(watermark);
     }
 
     string get_topic() const {
@@ -116,6 +342,26 @@ public:
         return commit_log_->get_last_offset(topic_, partition_id_);
     }
 
+    // First record at or after timestamp (ms since the epoch) in the local log, false when all are older
+    bool offset_for_time(uint64_t timestamp, TimestampOffset& found) const {
+        shared_lock<shared_mutex> lock(mutex_);
+        return commit_log_->offset_for_time(topic_, partition_id_, timestamp, found);
+    }
+
+    // Continue on another commit log that holds a copy of this partition (a log directory move)
+    // catch_up runs while no write or read is in flight and completes the copy
+    void relocate(shared_ptr<CommitLog> target, const function<void()>& catch_up) {
+        lock_guard<mutex> writing(group_write_mutex_);
+        unique_lock<shared_mutex> lock(mutex_);
+        catch_up();
+        commit_log_ = move(target);
+    }
+
+    // null without a cache budget
+    const TailCache* get_tail_cache() const {
+        return tail_cache_.get();
+    }
+
     // Get size of partition in bytes
     size_t get_size() const {
         shared_lock<shared_mutex> lock(mutex_);
@@ -143,7 +389,461 @@ private:
     int broker_id_;
     bool is_leader_;
     shared_ptr<CommitLog> commit_log_;
+    shared_ptr<TieredStorage> remote_storage_;    // null when tiering is off
     long high_watermark_;
     vector<int> replica_brokers_;
     mutable shared_mutex mutex_;
+    mutex group_write_mutex_;       // held by the appender around its log write, relocate() waits on it
+    Counter& messages_in_;
+    Gauge& high_watermark_gauge_;
+    Counter& duplicates_;
+    unique_ptr<PartitionAppender> appender_;     // null: appends run on the caller's thread
+    unique_ptr<TailCache> tail_cache_;           // null: every read goes to the log
+    TransactionDecided decided_;                 // null: every open transaction is aborted on startup
+
+    static constexpr size_t PRODUCER_WINDOW = 5;    // batches remembered per producer
+    static constexpr uint64_t UNWRITTEN = UINT64_MAX;   // staged in the current group
+
+    struct ProducedBatch {
+        int32_t first_sequence;
+        int32_t last_sequence;
+        uint64_t base_offset;
+    };
+
+    struct ProducerState {
+        uint16_t epoch = 0;
+        deque<ProducedBatch> recent;    // oldest first
+        uint64_t last_offset = 0;       // of its newest batch or marker
+    };
+
+    struct AbortedRange {
+        uint64_t first_offset;
+        uint64_t marker_offset;
+    };
+
+    map<uint64_t, ProducerState> producers_;    // {producer_id: state}, guarded by mutex_
+    uint64_t snapshot_offset_ = 0;              // of the last state snapshot, the writer's
+    map<uint64_t, uint64_t> open_transactions_; // {producer_id: first offset}
+    map<uint64_t, deque<AbortedRange>> aborted_;   // {producer_id: ranges in marker order}
+    uint64_t last_abort_marker_ = 0;            // newest marker in aborted_
+
+    // the batch was already written: offset is where it went
+    static bool find_duplicate(const ProducerState& state, const RecordBatchHeader& header, uint64_t& offset) {
+        if (header.producer_epoch != state.epoch) {
+            return false;
+        }
+        for (const auto& produced : state.recent) {
+            if (produced.first_sequence == header.base_sequence &&
+                produced.last_sequence == header.last_sequence()) {
+                offset = produced.base_offset;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // throws unless the batch is the producer's next one
+    void check_sequence(const ProducerState& state, const RecordBatchHeader& header) const {
+        string producer = "Producer " + to_string(header.producer_id);
+        if (header.producer_epoch < state.epoch) {
+            throw runtime_error(producer + " epoch " + to_string(header.producer_epoch) +
+                                " is fenced by epoch " + to_string(state.epoch));
+        }
+        if (state.recent.empty()) {
+            return;     // new producer, or one whose history has been lost
+        }
+        int32_t expected = header.producer_epoch > state.epoch ? 0 : state.recent.back().last_sequence + 1;
+        if (header.base_sequence != expected) {
+            throw invalid_argument(producer + " out of order on " + topic_ + "-" + to_string(partition_id_) +
+                                   ": expected sequence " + to_string(expected) +
+                                   ", got " + to_string(header.base_sequence));
+        }
+    }
+
+    static void record_batch(ProducerState& state, const RecordBatchHeader& header, uint64_t base_offset) {
+        state.last_offset = base_offset;
+        if (header.is_control()) {
+            // markers carry the coordinator's epoch but no sequence
+            if (header.producer_epoch > state.epoch) {
+                state.epoch = header.producer_epoch;
+                state.recent.clear();
+            }
+            return;
+        }
+        if (header.producer_epoch != state.epoch) {
+            state.epoch = header.producer_epoch;
+            state.recent.clear();
+        }
+        state.recent.push_back({header.base_sequence, header.last_sequence(), base_offset});
+        if (state.recent.size() > PRODUCER_WINDOW) {
+            state.recent.pop_front();
+        }
+    }
+
+    // producer and transaction bookkeeping of a written batch (caller holds mutex_ exclusively)
+    void track_batch(const RecordBatchHeader& header, uint64_t base_offset) {
+        if (header.producer_id == NO_PRODUCER_ID) {
+            return;
+        }
+        record_batch(producers_[header.producer_id], header, base_offset);
+        if (!header.is_transactional()) {
+            return;
+        }
+        if (!header.is_control()) {
+            open_transactions_.emplace(header.producer_id, base_offset);    // keeps the first offset
+            return;
+        }
+        auto it = open_transactions_.find(header.producer_id);
+        if (it == open_transactions_.end()) {
+            return;     // the producer never wrote here in this transaction
+        }
+        if (header.is_abort_marker()) {
+            aborted_[header.producer_id].push_back({it->second, base_offset});
+            last_abort_marker_ = base_offset;
+        }
+        open_transactions_.erase(it);
+    }
+
+    // caller holds mutex_
+    uint64_t last_stable_offset() const {
+        uint64_t lso = high_watermark_ + 1;
+        for (const auto& [producer_id, first_offset] : open_transactions_) {
+            lso = min(lso, first_offset);
+        }
+        return lso;
+    }
+
+    // skips batches of aborted transactions, null when none was aborted at or after start_offset
+    // looks the batch's producer up in aborted_ instead of copying ranges (caller holds mutex_ while it is used)
+    BatchFilter aborted_filter(uint64_t start_offset) const {
+        if (aborted_.empty() || last_abort_marker_ < start_offset) {
+            return nullptr;
+        }
+        return [this](const RecordBatchHeader& header) {
+            if (!header.is_transactional() || header.is_control()) {
+                return false;
+            }
+            auto it = aborted_.find(header.producer_id);
+            if (it == aborted_.end()) {
+                return false;
+            }
+            // a producer has one transaction at a time: only the first range ending after the batch can hold it
+            auto range = upper_bound(it->second.begin(), it->second.end(), header.base_offset,
+                [](uint64_t offset, const AbortedRange& aborted) { return offset < aborted.marker_offset; });
+            return range != it->second.end() && header.base_offset >= range->first_offset;
+        };
+    }
+
+    // first offset any reader can still get, locally or from the remote tier
+    uint64_t earliest_offset() const {
+        uint64_t earliest = commit_log_->get_log_start_offset(topic_, partition_id_);
+        uint64_t remote_start;
+        if (remote_storage_ && remote_storage_->get_remote_start_offset(topic_, partition_id_, remote_start)) {
+            earliest = min(earliest, remote_start);
+        }
+        return earliest;
+    }
+
+    // forget aborted ranges and idle producers whose batches are all below the earliest offset,
+    // e.g. after compaction emptied segments (caller holds mutex_ exclusively, or is the constructor)
+    void prune_state() {
+        uint64_t earliest = earliest_offset();
+        for (auto it = aborted_.begin(); it != aborted_.end();) {
+            auto& ranges = it->second;
+            while (!ranges.empty() && ranges.front().marker_offset < earliest) {
+                ranges.pop_front();
+            }
+            it = ranges.empty() ? aborted_.erase(it) : next(it);
+        }
+        for (auto it = producers_.begin(); it != producers_.end();) {
+            bool idle = it->second.last_offset < earliest && !open_transactions_.count(it->first);
+            it = idle ? producers_.erase(it) : next(it);
+        }
+    }
+
+    // retries may arrive after a broker restart, so remember what the log already holds
+    void load_producer_state() {
+        uint64_t from = 0;
+        string state;
+        if (commit_log_->read_state_snapshot(topic_, partition_id_, from, state) && decode_state(state)) {
+            high_watermark_ = static_cast<long>(from) - 1;
+        } else {
+            from = 0;
+            producers_.clear();
+            open_transactions_.clear();
+            aborted_.clear();
+            last_abort_marker_ = 0;
+        }
+        commit_log_->for_each_header_from(topic_, partition_id_, from, [this](const RecordBatchHeader& header) {
+            track_batch(header, header.base_offset);
+            high_watermark_ = header.base_offset + header.last_offset_delta;
+        });
+        snapshot_offset_ = from;
+        prune_state();
+        high_watermark_gauge_.set(high_watermark_);
+    }
+
+    // the log rolled a segment since the last state snapshot (caller holds mutex_, is the writer)
+    bool state_snapshot_due() const {
+        return commit_log_->get_active_base_offset(topic_, partition_id_) > snapshot_offset_;
+    }
+
+    // state as of the log end into a snapshot (caller is the writer, the state is encoded under mutex_)
+    // a failed snapshot only means a longer scan on the next open
+    void save_state(uint64_t offset, const string& state) {
+        try {
+            commit_log_->write_state_snapshot(topic_, partition_id_, offset, state);
+            snapshot_offset_ = offset;
+        } catch (const exception& e) {
+            cerr << "[Broker " << broker_id_ << "] " << topic_ << "-" << partition_id_
+                 << " state snapshot failed: " << e.what() << "\n";
+        }
+    }
+
+    template <typename T>
+    static void put(string& out, T value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    static bool get(const string& data, size_t& pos, T& value) {
+        if (pos + sizeof(T) > data.size()) {
+            return false;
+        }
+        memcpy(&value, data.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    // producers, open transactions and aborted ranges (caller holds mutex_)
+    string encode_state() const {
+        string out;
+        put<uint32_t>(out, producers_.size());
+        for (const auto& [producer_id, state] : producers_) {
+            put(out, producer_id);
+            put(out, state.epoch);
+            put(out, state.last_offset);
+            put<uint32_t>(out, state.recent.size());
+            for (const auto& produced : state.recent) {
+                put(out, produced.first_sequence);
+                put(out, produced.last_sequence);
+                put(out, produced.base_offset);
+            }
+        }
+        put<uint32_t>(out, open_transactions_.size());
+        for (const auto& [producer_id, first_offset] : open_transactions_) {
+            put(out, producer_id);
+            put(out, first_offset);
+        }
+        size_t aborted_count = 0;
+        for (const auto& [producer_id, ranges] : aborted_) {
+            aborted_count += ranges.size();
+        }
+        put<uint32_t>(out, aborted_count);
+        for (const auto& [producer_id, ranges] : aborted_) {
+            for (const auto& aborted : ranges) {
+                put(out, producer_id);
+                put(out, aborted.first_offset);
+                put(out, aborted.marker_offset);
+            }
+        }
+        return out;
+    }
+
+    // false on a malformed state, what was decoded is left for the caller to clear
+    bool decode_state(const string& data) {
+        size_t pos = 0;
+        uint32_t count;
+        if (!get(data, pos, count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint64_t producer_id;
+            uint32_t recent;
+            ProducerState state;
+            if (!get(data, pos, producer_id) || !get(data, pos, state.epoch) || !get(data, pos, state.last_offset) ||
+                !get(data, pos, recent)) {
+                return false;
+            }
+            for (uint32_t j = 0; j < recent; j++) {
+                ProducedBatch produced;
+                if (!get(data, pos, produced.first_sequence) || !get(data, pos, produced.last_sequence) ||
+                    !get(data, pos, produced.base_offset)) {
+                    return false;
+                }
+                state.recent.push_back(produced);
+            }
+            producers_[producer_id] = move(state);
+        }
+        if (!get(data, pos, count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint64_t producer_id, first_offset;
+            if (!get(data, pos, producer_id) || !get(data, pos, first_offset)) {
+                return false;
+            }
+            open_transactions_[producer_id] = first_offset;
+        }
+        if (!get(data, pos, count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint64_t producer_id;
+            AbortedRange aborted;
+            if (!get(data, pos, producer_id) || !get(data, pos, aborted.first_offset) ||
+                !get(data, pos, aborted.marker_offset)) {
+                return false;
+            }
+            aborted_[producer_id].push_back(aborted);
+            last_abort_marker_ = max(last_abort_marker_, aborted.marker_offset);
+        }
+        return pos == data.size();
+    }
+
+    // A transaction still open when the partition comes up (a restart, or a new leader) was
+    // in flight: abort it here, unless the coordinator logged a decision for it, whose
+    // markers it writes itself (caller holds mutex_ exclusively, or is the constructor)
+    void abort_open_transactions() {
+        vector<uint64_t> undecided;
+        for (const auto& [producer_id, first_offset] : open_transactions_) {
+            if (!decided_ || !decided_(producer_id)) {
+                undecided.push_back(producer_id);
+            }
+        }
+        for (uint64_t producer_id : undecided) {
+            RecordBatch marker = RecordBatch::control(producer_id, producers_[producer_id].epoch, false);
+            uint64_t offset = commit_log_->append_batch(topic_, partition_id_, marker);
+            high_watermark_ = offset;
+            track_batch(marker.header, offset);
+            cache_batch(move(marker), offset);
+            cout << "[Broker " << broker_id_ << "] " << topic_ << "-" << partition_id_
+                 << " aborted open transaction of producer " << producer_id << "\n";
+        }
+        high_watermark_gauge_.set(high_watermark_);
+    }
+
+    // appender thread: write a group of requests with one fsync
+    // as the only writer it holds mutex_ just to publish the high watermark,
+    // readers aren't blocked behind the fsync
+    void write_group(vector<AppendRequest*>& group) {
+        lock_guard<mutex> writing(group_write_mutex_);
+        bool is_leader;
+        {
+            shared_lock<shared_mutex> lock(mutex_);
+            is_leader = is_leader_;
+        }
+
+        vector<AppendRequest*> writable;
+        vector<RecordBatch> batches;
+        vector<RecordBatchHeader> headers;
+        // producers as of the end of this group, only this thread adds batches to producers_
+        map<uint64_t, ProducerState> staged;
+        for (auto* request : group) {
+            TraceScope::mark(request->trace, TraceStage::LockAcquired);
+            if (!is_leader) {
+                request->error = make_exception_ptr(runtime_error(
+                    "Cannot append to partition " + to_string(partition_id_) +
+                    ": not leader (broker " + to_string(broker_id_) + ")"));
+                continue;
+            }
+            if (request->batch.has_producer() && !stage_producer_batch(staged, *request)) {
+                continue;
+            }
+            writable.push_back(request);
+            headers.push_back(request->batch.header);
+            batches.push_back(move(request->batch));
+        }
+        if (batches.empty()) {
+            return;
+        }
+
+        // an I/O error fails the whole group and takes the log offline, so nothing below is skipped for
+        // batches that were written: no later append can go past them (see CommitLog)
+        vector<exception_ptr> errors;
+        auto offsets = commit_log_->append_batches(topic_, partition_id_, batches, errors, [&]() {
+            for (auto* request : writable) {
+                TraceScope::mark(request->trace, TraceStage::LogWrite);
+            }
+        });
+
+        unique_lock<shared_mutex> lock(mutex_);
+        for (size_t i = 0; i < writable.size(); i++) {
+            TraceScope::mark(writable[i]->trace, TraceStage::FsyncDone);
+            if (errors[i]) {
+                writable[i]->error = errors[i];
+                continue;
+            }
+            writable[i]->base_offset = offsets[i];
+            high_watermark_ = offsets[i] + headers[i].last_offset_delta;
+            messages_in_.add(headers[i].record_count);
+            track_batch(headers[i], offsets[i]);
+            if (tail_cache_) {
+                tail_cache_->push(move(batches[i]));    // append_batches left it as stored
+            }
+        }
+        high_watermark_gauge_.set(high_watermark_);
+
+        // old state is pruned, and the snapshot written after readers are let go, still under group_write_mutex_
+        if (state_snapshot_due()) {
+            prune_state();
+            uint64_t offset = high_watermark_ + 1;
+            string state = encode_state();
+            lock.unlock();
+            save_state(offset, state);
+        }
+    }
+
+    // Check an idempotent batch against its producer, counting batches earlier in the group
+    // false when the request is already answered (duplicate) or rejected
+    bool stage_producer_batch(map<uint64_t, ProducerState>& staged, AppendRequest& request) {
+        const RecordBatchHeader& header = request.batch.header;
+        auto it = staged.find(header.producer_id);
+        if (it == staged.end()) {
+            shared_lock<shared_mutex> lock(mutex_);
+            auto known = producers_.find(header.producer_id);
+            it = staged.emplace(header.producer_id, known != producers_.end() ? known->second : ProducerState()).first;
+        }
+        ProducerState& state = it->second;
+        if (header.is_control()) {
+            record_batch(state, header, UNWRITTEN);     // a marker may move the epoch on
+            return true;
+        }
+
+        uint64_t offset;
+        if (find_duplicate(state, header, offset)) {
+            if (offset == UNWRITTEN) {
+                // a retry racing its original in the same group, it can ask again once that is acked
+                request.error = make_exception_ptr(runtime_error(
+                    "Producer " + to_string(header.producer_id) + " sequence " +
+                    to_string(header.base_sequence) + " is still being written"));
+                return false;
+            }
+            request.base_offset = offset;
+            duplicates_.add();
+            return false;
+        }
+        try {
+            check_sequence(state, header);
+        } catch (...) {
+            request.error = current_exception();
+            return false;
+        }
+        record_batch(state, header, UNWRITTEN);
+        return true;
+    }
+
+    // a batch just stored at base_offset, in the cache before readers see the new high watermark
+    // (caller holds mutex_ exclusively)
+    void cache_batch(RecordBatch batch, uint64_t base_offset) {
+        if (tail_cache_) {
+            batch.header.base_offset = base_offset;
+            tail_cache_->push(move(batch));
+        }
+    }
+
+    bool reads_remote(uint64_t start_offset) const {
+        return remote_storage_ &&
+               start_offset < commit_log_->get_log_start_offset(topic_, partition_id_);
+    }
 };
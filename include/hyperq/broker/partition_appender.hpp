@@ -0,0 +1,229 @@
+#pragma once
+#include "hyperq/common/ring_buffer.hpp"
+#include "hyperq/metrics/metrics.hpp"
+#include "hyperq/metrics/tracing.hpp"
+#include "hyperq/storage/record_batch.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// One produce request waiting for its partition's appender thread
+// lives on the producer's stack until complete() wakes it
+struct AppendRequest {
+    RecordBatch batch;
+    RequestTrace* trace = nullptr;
+    uint64_t base_offset = 0;
+    exception_ptr error;
+
+    void complete() {
+        // notify under the lock: the waiter may destroy the request right after
+        lock_guard<mutex> lock(done_mutex_);
+        done_ = true;
+        done_cv_.notify_one();
+    }
+
+    void wait() {
+        unique_lock<mutex> lock(done_mutex_);
+        done_cv_.wait(lock, [this]() { return done_; });
+    }
+
+private:
+    bool done_ = false;
+    mutex done_mutex_;
+    condition_variable done_cv_;
+};
+
+/*
+ * PartitionAppender: single writer thread of one partition's log
+ * Producers push requests into an MpscRingBuffer and block until their batch
+ * is durable. The thread drains up to max_group requests at a time and hands
+ * them to write_group together, so concurrent producers share one fsync
+ * (group commit). Ring order is append order.
+ * An idle thread parks on a condition variable with no timeout, so idle
+ * partitions cost no wakeups; a producer finding the ring full sleeps until
+ * the thread has drained some of it. Both sides publish their intent to sleep
+ * (sleeping_, full_waiters_) and check the ring behind a seq_cst fence, so a
+ * wakeup can't be lost between the check and the wait.
+*/
+
+class PartitionAppender {
+public:
+    // writes every request of a group, setting its base_offset or error
+    using WriteGroup = function<void(vector<AppendRequest*>&)>;
+
+    PartitionAppender(const string& name, WriteGroup write_group, size_t queue_capacity = 1024, size_t max_group = 64)
+        : name_(name),
+          write_group_(move(write_group)),
+          queue_(queue_capacity),
+          max_group_(max_group),
+          running_(false),
+          in_flight_(0),
+          sleeping_(false),
+          full_waiters_(0),
+          group_count_(0),
+          group_sizes_(MetricsRegistry::instance().histogram(
+              "hyperq_append_group_size", {}, "Produce requests written per group commit")) {}
+
+    ~PartitionAppender() {
+        stop();
+    }
+
+    PartitionAppender(const PartitionAppender&) = delete;
+    PartitionAppender& operator=(const PartitionAppender&) = delete;
+
+    void start() {
+        if (running_) {
+            return;
+        }
+        running_ = true;
+        thread_ = thread([this]() { run(); });
+    }
+
+    // finishes every request already queued, later appends throw
+    void stop() {
+        if (!running_.exchange(false)) {
+            return;
+        }
+        wake();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    // Queue a batch and block until it is written and fsynced, returns its base offset
+    uint64_t append(RecordBatch batch) {
+        AppendRequest request;
+        request.batch = move(batch);
+        request.trace = TraceScope::current();
+
+        in_flight_++;
+        if (!running_) {
+            in_flight_--;
+            throw runtime_error("Appender for " + name_ + " is stopped");
+        }
+        if (!queue_.try_push(&request)) {
+            push_when_space(&request);  // full: wait for the writer to catch up
+        }
+        in_flight_--;
+        atomic_thread_fence(memory_order_seq_cst);
+        if (sleeping_.load()) {
+            wake();
+        }
+
+        request.wait();
+        if (request.error) {
+            rethrow_exception(request.error);
+        }
+        return request.base_offset;
+    }
+
+    uint64_t get_group_count() const {
+        return group_count_.load(memory_order_relaxed);
+    }
+
+private:
+    static constexpr int SPIN_ROUNDS = 16;
+
+    string name_;
+    WriteGroup write_group_;
+    MpscRingBuffer<AppendRequest*> queue_;
+    size_t max_group_;
+    atomic<bool> running_;
+    atomic<int> in_flight_;     // producers between the running_ check and the push
+    atomic<bool> sleeping_;
+    atomic<int> full_waiters_;  // producers asleep on a full ring
+    atomic<uint64_t> group_count_;
+    Histogram& group_sizes_;
+    mutex wake_mutex_;
+    condition_variable wake_cv_;
+    mutex space_mutex_;
+    condition_variable space_cv_;
+    thread thread_;
+
+    void wake() {
+        lock_guard<mutex> lock(wake_mutex_);
+        wake_cv_.notify_one();
+    }
+
+    // holding space_mutex_ from the announcement to the wait, so notify_space() can't miss us
+    void push_when_space(AppendRequest* request) {
+        unique_lock<mutex> lock(space_mutex_);
+        full_waiters_++;
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!queue_.try_push(request)) {
+            space_cv_.wait(lock);
+        }
+        full_waiters_--;
+    }
+
+    // after a pop: room for producers waiting on a full ring
+    void notify_space() {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (full_waiters_.load() > 0) {
+            lock_guard<mutex> lock(space_mutex_);
+            space_cv_.notify_all();
+        }
+    }
+
+    void run() {
+        vector<AppendRequest*> group;
+        group.reserve(max_group_);
+        int idle_rounds = 0;
+        while (true) {
+            group.clear();
+            queue_.pop_batch(group, max_group_);
+            if (!group.empty()) {
+                notify_space();
+                write(group);
+                idle_rounds = 0;
+                continue;
+            }
+            if (!running_ && in_flight_ == 0 && queue_.empty()) {
+                return;     // drained
+            }
+
+            // spin a little for the next request, then park
+            if (++idle_rounds < SPIN_ROUNDS) {
+                this_thread::yield();
+                continue;
+            }
+            {
+                // check under wake_mutex_ so a producer's wake() can't slip in before the wait
+                unique_lock<mutex> lock(wake_mutex_);
+                sleeping_ = true;
+                atomic_thread_fence(memory_order_seq_cst);
+                if (queue_.empty() && running_) {
+                    wake_cv_.wait(lock);    // a producer or stop() wakes us
+                }
+                sleeping_ = false;
+            }
+            idle_rounds = 0;
+        }
+    }
+
+    void write(vector<AppendRequest*>& group) {
+        try {
+            write_group_(group);
+        } catch (...) {
+            // the whole group failed (e.g. disk error)
+            for (auto* request : group) {
+                if (!request->error) {
+                    request->error = current_exception();
+                }
+            }
+        }
+        group_count_.fetch_add(1, memory_order_relaxed);
+        group_sizes_.record(group.size());
+        for (auto* request : group) {
+            request->complete();
+        }
+    }
+};
@@ -0,0 +1,144 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+using namespace std;
+
+// Kafka's murmur2 (seed 0x9747b28c): stable across builds and platforms,
+// so keys keep their partition when the broker is rebuilt or clients hash the same way
+inline uint32_t murmur2(const char* data, size_t length) {
+    const uint32_t seed = 0x9747b28c;
+    const uint32_t m = 0x5bd1e995;
+    const int r = 24;
+
+    uint32_t h = seed ^ static_cast<uint32_t>(length);
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    size_t blocks = length / 4;
+    for (size_t i = 0; i < blocks; i++) {
+        const unsigned char* b = bytes + i * 4;
+        uint32_t k = b[0] | (b[1] << 8) | (b[2] << 16) | (static_cast<uint32_t>(b[3]) << 24);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h *= m;
+        h ^= k;
+    }
+
+    const unsigned char* tail = bytes + blocks * 4;
+    switch (length % 4) {
+        case 3: h ^= tail[2] << 16; [[fallthrough]];
+        case 2: h ^= tail[1] << 8; [[fallthrough]];
+        case 1: h ^= tail[0];
+                h *= m;
+    }
+
+    h ^= h >> 13;
+    h *= m;
+    h ^= h >> 15;
+    return h;
+}
+
+/*
+ * Partitioner: picks the partition of a produced record
+ * Keyed records always go to murmur2(key) mod partitions. Keyless records:
+ *   "hash"   round-robin, one record per partition in turn
+ *   "sticky" stay on one partition for batch_bytes of records, then move to
+ *            the next, so keyless traffic builds large batches (and large
+ *            group commits) instead of one-record writes on every partition
+ * Per-topic cursors are atomics, callers need no lock.
+*/
+
+class Partitioner {
+public:
+    virtual ~Partitioner() = default;
+
+    // record_bytes: size of the record (or whole batch) about to be sent there
+    int partition(const string& topic, const string& key, size_t record_bytes, int partition_count) {
+        if (partition_count <= 0) {
+            throw invalid_argument("Topic " + topic + " has no partitions");
+        }
+        if (!key.empty()) {
+            return (murmur2(key.data(), key.size()) & 0x7fffffff) % partition_count;
+        }
+        return keyless_partition(cursor(topic), record_bytes, partition_count);
+    }
+
+    virtual string name() const = 0;
+
+    // "hash" or "sticky"
+    static unique_ptr<Partitioner> create(const string& type, size_t batch_bytes = 16 * 1024);
+
+protected:
+    virtual int keyless_partition(atomic<uint64_t>& cursor, size_t record_bytes, int partition_count) = 0;
+
+private:
+    unordered_map<string, unique_ptr<atomic<uint64_t>>> cursors_;     // {topic: cursor}
+    shared_mutex mutex_;
+
+    atomic<uint64_t>& cursor(const string& topic) {
+        {
+            shared_lock<shared_mutex> lock(mutex_);
+            auto it = cursors_.find(topic);
+            if (it != cursors_.end()) {
+                return *it->second;
+            }
+        }
+        unique_lock<shared_mutex> lock(mutex_);
+        auto& slot = cursors_[topic];
+        if (!slot) {
+            slot = make_unique<atomic<uint64_t>>(0);
+        }
+        return *slot;
+    }
+};
+
+// cursor counts records
+class HashPartitioner : public Partitioner {
+public:
+    string name() const override {
+        return "hash";
+    }
+
+protected:
+    int keyless_partition(atomic<uint64_t>& cursor, size_t, int partition_count) override {
+        return cursor.fetch_add(1, memory_order_relaxed) % partition_count;
+    }
+};
+
+// cursor counts bytes, every batch_bytes of them the partition moves on
+class StickyPartitioner : public Partitioner {
+public:
+    explicit StickyPartitioner(size_t batch_bytes) : batch_bytes_(batch_bytes) {
+        if (batch_bytes_ == 0) {
+            throw invalid_argument("Sticky partitioner batch size must be positive");
+        }
+    }
+
+    string name() const override {
+        return "sticky";
+    }
+
+protected:
+    int keyless_partition(atomic<uint64_t>& cursor, size_t record_bytes, int partition_count) override {
+        uint64_t position = cursor.fetch_add(max<size_t>(record_bytes, 1), memory_order_relaxed);
+        return (position / batch_bytes_) % partition_count;
+    }
+
+private:
+    size_t batch_bytes_;
+};
+
+inline unique_ptr<Partitioner> Partitioner::create(const string& type, size_t batch_bytes) {
+    if (type == "hash") {
+        return make_unique<HashPartitioner>();
+    }
+    if (type == "sticky") {
+        return make_unique<StickyPartitioner>(batch_bytes);
+    }
+    throw invalid_argument("Unknown partitioner: " + type);
+}
@@ -0,0 +1,274 @@
+#pragma once
+#include "hyperq/metrics/metrics.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+using namespace std;
+
+enum class QuotaEntity {
+    Client,     // keyed by the client id a producer or consumer sends
+    Group       // keyed by consumer group, shared by all its members
+};
+
+enum class QuotaType {
+    Produce,
+    Fetch
+};
+
+// Rates per second, 0 = unlimited
+struct QuotaLimits {
+    double produce_bytes_per_sec = 0;
+    double fetch_bytes_per_sec = 0;
+    double requests_per_sec = 0;    // produce and fetch requests together
+
+    bool unlimited() const {
+        return produce_bytes_per_sec == 0 && fetch_bytes_per_sec == 0 && requests_per_sec == 0;
+    }
+};
+
+/*
+ * TokenBucket: one rate limit
+ * Refills at rate tokens per second, holding at most one second's worth so
+ * an idle client can burst that much. A request is charged after it ran and
+ * may take the bucket below zero; the debt divided by the rate is how long
+ * the client has to stay quiet. Not thread-safe, QuotaManager locks around it.
+*/
+
+class TokenBucket {
+public:
+    static constexpr double BURST_SECONDS = 1.0;
+
+    explicit TokenBucket(double rate = 0, uint64_t now_ns = 0)
+        : rate_(rate), tokens_(rate * BURST_SECONDS), last_ns_(now_ns) {}
+
+    // 0 = unlimited, keeps the current debt
+    void set_rate(double rate) {
+        tokens_ = rate_ == 0 ? rate * BURST_SECONDS : min(tokens_, rate * BURST_SECONDS);
+        rate_ = rate;
+    }
+
+    // Take cost tokens, returns the throttle delay that leaves
+    uint32_t charge(double cost, uint64_t now_ns) {
+        if (rate_ == 0) {
+            return 0;
+        }
+        refill(now_ns);
+        tokens_ -= cost;
+        return debt_ms();
+    }
+
+    // Milliseconds until the bucket is out of debt, 0 when it has tokens
+    uint32_t throttle_ms(uint64_t now_ns) {
+        if (rate_ == 0) {
+            return 0;
+        }
+        refill(now_ns);
+        return debt_ms();
+    }
+
+    // Full buckets behave exactly like new ones
+    bool full(uint64_t now_ns) {
+        if (rate_ == 0) {
+            return true;
+        }
+        refill(now_ns);
+        return tokens_ >= rate_ * BURST_SECONDS;
+    }
+
+private:
+    double rate_;
+    double tokens_;
+    uint64_t last_ns_;
+
+    void refill(uint64_t now_ns) {
+        if (now_ns > last_ns_) {
+            tokens_ = min(rate_ * BURST_SECONDS, tokens_ + rate_ * (now_ns - last_ns_) / 1e9);
+            last_ns_ = now_ns;
+        }
+    }
+
+    uint32_t debt_ms() const {
+        return tokens_ >= 0 ? 0 : static_cast<uint32_t>(ceil(-tokens_ * 1000 / rate_));
+    }
+};
+
+/*
+ * QuotaManager: per-client and per-group produce/fetch rate limits
+ * Each client id and each consumer group with a quota gets token buckets for
+ * produce bytes, fetch bytes and requests. A served request is charged to
+ * its client and (for fetches) its group, and the response carries how long
+ * the caller must wait before the next one: the broker never holds a thread
+ * to slow a client down. A request arriving while its client or group is
+ * still in debt (the client ignored the delay) is turned away unserved, so a
+ * noisy tenant cannot push the log harder than its quota.
+ * A quota set for the name "" is the default for every client (or group)
+ * without its own. Without any quota configured nothing is looked up.
+*/
+
+class QuotaManager {
+public:
+    QuotaManager()
+        : enabled_(false),
+          sweep_at_(SWEEP_MIN_ENTRIES),
+          throttled_produce_(MetricsRegistry::instance().counter(
+              "hyperq_quota_throttled_total", {{"type", "produce"}}, "Responses carrying a quota throttle delay")),
+          throttled_fetch_(MetricsRegistry::instance().counter(
+              "hyperq_quota_throttled_total", {{"type", "fetch"}}, "Responses carrying a quota throttle delay")) {}
+
+    // Set the quota of a client id or group ("" = the default), all-zero limits remove it
+    void set_quota(QuotaEntity entity, const string& name, const QuotaLimits& limits) {
+        lock_guard<mutex> lock(mutex_);
+        auto& configured = configured_[entity];
+        if (limits.unlimited()) {
+            configured.erase(name);
+        } else {
+            configured[name] = limits;
+        }
+        // running buckets take the new rates, debt already run up stays
+        for (auto& [state_name, state] : states_[entity]) {
+            state.apply(limits_for(entity, state_name));
+        }
+        enabled_ = !configured_[QuotaEntity::Client].empty() || !configured_[QuotaEntity::Group].empty();
+    }
+
+    // Limits in force for a client id or group, all zero when it has none
+    QuotaLimits get_quota(QuotaEntity entity, const string& name) const {
+        lock_guard<mutex> lock(mutex_);
+        return limits_for(entity, name);
+    }
+
+    // Milliseconds the client (and its group, "" = none) still has to wait from earlier requests
+    // a request arriving inside this is turned away unserved
+    uint32_t throttle_time(QuotaType type, const string& client_id, const string& group_id = "") {
+        if (!enabled_) {
+            return 0;
+        }
+        uint64_t now = now_ns();
+        lock_guard<mutex> lock(mutex_);
+        uint32_t throttle = 0;
+        for (State* state : states_of(client_id, group_id)) {
+            throttle = max({throttle, state->bucket(type).throttle_ms(now), state->requests.throttle_ms(now)});
+        }
+        return throttle;
+    }
+
+    // Charge a served request that moved bytes, returns the throttle delay for its response
+    uint32_t record(QuotaType type, const string& client_id, const string& group_id, size_t bytes) {
+        if (!enabled_) {
+            return 0;
+        }
+        uint64_t now = now_ns();
+        lock_guard<mutex> lock(mutex_);
+        uint32_t throttle = 0;
+        for (State* state : states_of(client_id, group_id)) {
+            throttle = max({throttle, state->bucket(type).charge(bytes, now), state->requests.charge(1, now)});
+        }
+        if (throttle > 0) {
+            (type == QuotaType::Produce ? throttled_produce_ : throttled_fetch_).add();
+        }
+        sweep(now);
+        return throttle;
+    }
+
+private:
+    static constexpr size_t SWEEP_MIN_ENTRIES = 1024;
+
+    struct State {
+        TokenBucket produce;
+        TokenBucket fetch;
+        TokenBucket requests;
+
+        State(const QuotaLimits& limits, uint64_t now)
+            : produce(limits.produce_bytes_per_sec, now),
+              fetch(limits.fetch_bytes_per_sec, now),
+              requests(limits.requests_per_sec, now) {}
+
+        void apply(const QuotaLimits& limits) {
+            produce.set_rate(limits.produce_bytes_per_sec);
+            fetch.set_rate(limits.fetch_bytes_per_sec);
+            requests.set_rate(limits.requests_per_sec);
+        }
+
+        TokenBucket& bucket(QuotaType type) {
+            return type == QuotaType::Produce ? produce : fetch;
+        }
+    };
+
+    atomic<bool> enabled_;
+    map<QuotaEntity, unordered_map<string, QuotaLimits>> configured_;   // {entity: {name: limits}}, "" = default
+    map<QuotaEntity, unordered_map<string, State>> states_;             // buckets of names seen, created on first use
+    size_t sweep_at_;
+    mutable mutex mutex_;
+    Counter& throttled_produce_;
+    Counter& throttled_fetch_;
+
+    // caller holds mutex_
+    QuotaLimits limits_for(QuotaEntity entity, const string& name) const {
+        auto configured = configured_.find(entity);
+        if (configured == configured_.end()) {
+            return {};
+        }
+        auto it = configured->second.find(name);
+        if (it == configured->second.end()) {
+            it = configured->second.find("");
+        }
+        return it == configured->second.end() ? QuotaLimits{} : it->second;
+    }
+
+    // buckets a request is charged to: the client's and the group's, if they have a quota
+    vector<State*> states_of(const string& client_id, const string& group_id) {
+        vector<State*> states;
+        if (State* state = state_of(QuotaEntity::Client, client_id)) {
+            states.push_back(state);
+        }
+        if (!group_id.empty()) {
+            if (State* state = state_of(QuotaEntity::Group, group_id)) {
+                states.push_back(state);
+            }
+        }
+        return states;
+    }
+
+    State* state_of(QuotaEntity entity, const string& name) {
+        auto& states = states_[entity];
+        auto it = states.find(name);
+        if (it != states.end()) {
+            return &it->second;
+        }
+        QuotaLimits limits = limits_for(entity, name);
+        if (limits.unlimited()) {
+            return nullptr;
+        }
+        return &states.emplace(name, State(limits, now_ns())).first->second;
+    }
+
+    // drop buckets that refilled completely, a new one would be the same
+    // keeps memory bounded by the clients active in the last second, not all ever seen
+    void sweep(uint64_t now) {
+        size_t total = states_[QuotaEntity::Client].size() + states_[QuotaEntity::Group].size();
+        if (total < sweep_at_) {
+            return;
+        }
+        total = 0;
+        for (auto& [entity, states] : states_) {
+            for (auto it = states.begin(); it != states.end();) {
+                State& state = it->second;
+                if (state.produce.full(now) && state.fetch.full(now) && state.requests.full(now)) {
+                    it = states.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            total += states.size();
+        }
+        sweep_at_ = max(SWEEP_MIN_ENTRIES, total * 2);
+    }
+};
@@ -0,0 +1,298 @@
+#pragma once
+#include "hyperq/broker/broker.hpp"
+#include "hyperq/protocol/shm_ring.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+using namespace std;
+
+struct ShmServerConfig {
+    uint32_t slot_count = 64;               // requests a client can have in flight
+    uint32_t slot_size = 128 * 1024;        // largest request (topic + key + batch) plus the slot header
+};
+
+/*
+ * ShmServer: shared-memory produce endpoint for clients on this host
+ * Listens on a Unix socket. Every client that says hello gets its own memfd
+ * ring (see shm_ring.hpp) and a broker thread serving it: requests are taken
+ * in ring order and appended one at a time, like requests on one Kafka
+ * connection, so a client's batches to a partition keep their order. The
+ * client pipelines by filling slots while earlier ones are being written.
+ * The socket stays open for the life of the connection only to tell each
+ * side when the other went away. Batches are sealed by the client and their
+ * checksum verified by the partition before anything is written.
+*/
+
+class ShmServer {
+public:
+    ShmServer(Broker& broker, const string& socket_path, const ShmServerConfig& config = ShmServerConfig())
+        : broker_(broker), socket_path_(socket_path), config_(config), listen_fd_(-1), running_(false),
+          connections_total_(MetricsRegistry::instance().counter(
+              "hyperq_shm_connections_total", {}, "Shared-memory clients accepted")),
+          requests_total_(MetricsRegistry::instance().counter(
+              "hyperq_shm_requests_total", {}, "Produce requests served over shared memory")) {}
+
+    ~ShmServer() {
+        stop();
+    }
+
+    ShmServer(const ShmServer&) = delete;
+    ShmServer& operator=(const ShmServer&) = delete;
+
+    void start() {
+        if (running_) {
+            return;
+        }
+        sockaddr_un addr{};
+        if (socket_path_.size() >= sizeof(addr.sun_path)) {
+            throw invalid_argument("Socket path too long: " + socket_path_);
+        }
+        listen_fd_ = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0) {
+            throw runtime_error(string("Failed to create shared-memory socket: ") + strerror(errno));
+        }
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path_.c_str(), sizeof(addr.sun_path) - 1);
+        ::unlink(socket_path_.c_str());     // left behind by a previous broker
+        if (::bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            ::listen(listen_fd_, 16) != 0) {
+            string error = strerror(errno);
+            ::close(listen_fd_);
+            throw runtime_error("Failed to listen on " + socket_path_ + ": " + error);
+        }
+
+        running_ = true;
+        thread_ = thread([this]() { serve(); });
+        cout << "[ShmServer] Serving shared-memory clients on " << socket_path_ << "\n";
+    }
+
+    void stop() {
+        if (!running_) {
+            return;
+        }
+        running_ = false;
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        lock_guard<mutex> lock(mutex_);
+        for (auto& connection : connections_) {
+            connection->worker.join();
+        }
+        connections_.clear();
+        ::close(listen_fd_);
+        listen_fd_ = -1;
+        ::unlink(socket_path_.c_str());
+    }
+
+    const string& get_socket_path() const {
+        return socket_path_;
+    }
+
+    // Clients still connected
+    size_t get_connection_count() const {
+        lock_guard<mutex> lock(mutex_);
+        size_t count = 0;
+        for (const auto& connection : connections_) {
+            count += connection->done ? 0 : 1;
+        }
+        return count;
+    }
+
+private:
+    struct Connection {
+        int socket_fd = -1;
+        string client_id;
+        ShmRing ring;
+        thread worker;
+        atomic<bool> done{false};
+
+        ~Connection() {
+            if (socket_fd >= 0) {
+                ::close(socket_fd);
+            }
+        }
+    };
+
+    Broker& broker_;
+    string socket_path_;
+    ShmServerConfig config_;
+    int listen_fd_;
+    atomic<bool> running_;
+    thread thread_;
+    list<unique_ptr<Connection>> connections_;
+    mutable mutex mutex_;
+    Counter& connections_total_;
+    Counter& requests_total_;
+
+    // accept loop; polls so stop() is noticed quickly, finished connections are reaped here
+    void serve() {
+        while (running_) {
+            reap();
+            pollfd pfd{listen_fd_, POLLIN, 0};
+            if (::poll(&pfd, 1, 200) <= 0) {
+                continue;
+            }
+            int client = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) {
+                continue;
+            }
+            auto connection = make_unique<Connection>();
+            connection->socket_fd = client;
+            if (!handshake(*connection)) {
+                continue;
+            }
+            connections_total_.add();
+            cout << "[ShmServer] Client " << connection->client_id << " connected ("
+                 << config_.slot_count << " slots of " << config_.slot_size << " bytes)\n";
+            Connection* raw = connection.get();
+            lock_guard<mutex> lock(mutex_);
+            connections_.push_back(move(connection));
+            raw->worker = thread([this, raw]() { run(*raw); });
+        }
+    }
+
+    void reap() {
+        lock_guard<mutex> lock(mutex_);
+        for (auto it = connections_.begin(); it != connections_.end();) {
+            if ((*it)->done) {
+                (*it)->worker.join();
+                it = connections_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // hello in, welcome plus the ring's memfd out; false when the client is turned away
+    bool handshake(Connection& connection) {
+        pollfd pfd{connection.socket_fd, POLLIN, 0};
+        ShmHello hello{};
+        if (::poll(&pfd, 1, 1000) <= 0 ||
+            ::recv(connection.socket_fd, &hello, sizeof(hello), 0) != static_cast<ssize_t>(sizeof(hello))) {
+            return false;
+        }
+        ShmWelcome welcome{};
+        welcome.magic = SHM_RING_MAGIC;
+        welcome.version = SHM_RING_VERSION;
+        if (hello.magic != SHM_RING_MAGIC || hello.version != SHM_RING_VERSION) {
+            welcome.error = EPROTO;
+            ::send(connection.socket_fd, &welcome, sizeof(welcome), MSG_NOSIGNAL);
+            return false;
+        }
+        hello.client_id[SHM_CLIENT_ID_SIZE - 1] = '\0';
+        connection.client_id = hello.client_id;
+        try {
+            connection.ring = ShmRing::create(config_.slot_count, config_.slot_size);
+        } catch (const exception& e) {
+            cerr << "[ShmServer] Refused " << connection.client_id << ": " << e.what() << "\n";
+            welcome.error = ENOMEM;
+            ::send(connection.socket_fd, &welcome, sizeof(welcome), MSG_NOSIGNAL);
+            return false;
+        }
+        welcome.slot_count = config_.slot_count;
+        welcome.slot_size = config_.slot_size;
+        welcome.region_size = connection.ring.size();
+
+        iovec iov{&welcome, sizeof(welcome)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        int fd = connection.ring.fd();
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+        return ::sendmsg(connection.socket_fd, &message, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(welcome));
+    }
+
+    // one connection: serve slots in ring order until the client hangs up or the server stops
+    void run(Connection& connection) {
+        ShmRingHeader& header = connection.ring.header();
+        uint64_t next = 0;
+        while (running_) {
+            ShmSlot& slot = connection.ring.slot(next);
+            auto requested = [&slot]() {
+                return slot.state.load(memory_order_acquire) == static_cast<uint32_t>(ShmSlotState::Request);
+            };
+            if (!ShmRing::wait(header.broker, requested)) {
+                if (peer_closed(connection.socket_fd)) {
+                    break;
+                }
+                continue;
+            }
+            handle(connection, slot);
+            slot.state.store(static_cast<uint32_t>(ShmSlotState::Response), memory_order_release);
+            ShmRing::notify(header.client);
+            requests_total_.add();
+            next++;
+        }
+        cout << "[ShmServer] Client " << connection.client_id << " disconnected after " << next << " request(s)\n";
+        connection.done = true;
+    }
+
+    void handle(Connection& connection, ShmSlot& slot) {
+        // every field read once into a local: the client may be rewriting the slot meanwhile
+        int32_t partition = slot.partition;
+        uint64_t topic_size = slot.topic_size;
+        uint64_t key_size = slot.key_size;
+        uint64_t batch_size = slot.batch_size;
+        size_t capacity = connection.ring.data_capacity();
+
+        ProduceResponse response{false, "", partition, 0, ""};
+        RecordBatch batch;
+        if (topic_size + key_size + batch_size > capacity) {
+            response.error_message = "Malformed request: larger than its slot";
+        } else {
+            const char* data = slot.data();
+            const char* bytes = data + topic_size + key_size;
+            response.topic.assign(data, topic_size);
+            bool complete = true;
+            size_t header_size = RecordBatch::read_header(batch.header, 0, [&](char* dst, uint64_t from, size_t len) {
+                if (from + len > batch_size) {
+                    complete = false;
+                    return;
+                }
+                memcpy(dst, bytes + from, len);
+            });
+            if (!complete || header_size == 0 || header_size + batch.header.payload_size != batch_size) {
+                response.error_message = "Malformed request: not one record batch";
+            } else {
+                batch.payload.assign(bytes + header_size, batch.header.payload_size);
+                string key(data + topic_size, key_size);
+                response = partition < 0
+                    ? broker_.produce_batch(response.topic, batch, key, connection.client_id)
+                    : broker_.produce_batch(response.topic, partition, batch, connection.client_id);
+            }
+        }
+
+        slot.success = response.success ? 1 : 0;
+        slot.response_partition = response.partition;
+        slot.throttle_time_ms = response.throttle_time_ms;
+        slot.offset = response.offset;
+        size_t message_size = min(response.error_message.size(), capacity);
+        memcpy(slot.data(), response.error_message.data(), message_size);
+        slot.message_size = message_size;
+    }
+
+    // the client never writes after its hello, so anything readable is the hang-up
+    static bool peer_closed(int fd) {
+        pollfd pfd{fd, POLLIN, 0};
+        return ::poll(&pfd, 1, 0) != 0;
+    }
+};
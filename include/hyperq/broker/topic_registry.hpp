@@ -0,0 +1,364 @@
+#pragma once
+#include "hyperq/storage/commit_log.hpp"
+#include "hyperq/storage/crc32c.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+// A topic as the broker remembers it across restarts
+struct TopicMetadata {
+    string name;
+    int partitions = 0;
+    int replication_factor = 0;
+    LogConfig config;
+};
+
+/*
+ * TopicRegistry: the broker's topics, kept on disk
+ *   <log_dir>/__topics.snapshot   every topic, rewritten whole
+ *   <log_dir>/__topics.log        topics created since the snapshot
+ * Both hold entries [size u32][crc u32][topic], the CRC32C covering the topic
+ * bytes; the snapshot starts with [magic u32][version u32][entry count u32].
+ * A created topic is appended to the log and fsynced before create_topic
+ * returns. Loading replays the log over the snapshot, and a non-empty log
+ * (or one past COMPACT_AFTER entries while running) is folded into a new
+ * snapshot: written to a temp file, fsynced and renamed over the old one,
+ * then the log is emptied. A crash in between replays the log again, which
+ * is harmless, a later entry for a topic replaces the earlier one.
+ * Creates are fsynced one at a time, so only the last log entry can be torn:
+ * the log ends at the first entry failing its checksum, a create that never
+ * returned. A bad snapshot entry stops the broker (throws) rather than lose
+ * topics without a word.
+ * Entries only ever add fields at the end: an older entry reads back with
+ * the defaults of the fields it lacks, like record batch headers.
+*/
+
+class TopicRegistry {
+public:
+    static constexpr uint32_t SNAPSHOT_MAGIC = 0x48515452;     // "HQTR"
+    static constexpr uint32_t SNAPSHOT_VERSION = 1;
+    static constexpr size_t COMPACT_AFTER = 1024;               // log entries before a new snapshot
+
+    explicit TopicRegistry(const string& dir)
+        : snapshot_path_(dir + "/__topics.snapshot"), log_path_(dir + "/__topics.log"), log_fd_(-1), log_size_(0),
+          log_entries_(0) {
+        mkdir(dir.c_str(), 0755);
+        ::unlink((snapshot_path_ + ".tmp").c_str());    // a snapshot that was never renamed into place
+        load_snapshot();
+        size_t replayed = replay_log();
+        log_fd_ = ::open(log_path_.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (log_fd_ < 0) {
+            throw runtime_error("Failed to open " + log_path_ + ": " + strerror(errno));
+        }
+        if (replayed > 0 || log_size_ > 0) {
+            compact();
+        }
+    }
+
+    ~TopicRegistry() {
+        if (log_fd_ >= 0) {
+            ::close(log_fd_);
+        }
+    }
+
+    TopicRegistry(const TopicRegistry&) = delete;
+    TopicRegistry& operator=(const TopicRegistry&) = delete;
+
+    // Record a topic, durable when this returns; replaces an entry of the same name
+    void add(const TopicMetadata& topic) {
+        lock_guard<mutex> lock(mutex_);
+        string entry = frame(encode(topic));
+        write_fully(log_fd_, entry.data(), entry.size(), log_size_);
+        if (::fdatasync(log_fd_) != 0) {
+            throw runtime_error("fsync failed on " + log_path_ + ": " + strerror(errno));
+        }
+        log_size_ += entry.size();
+        topics_[topic.name] = topic;
+        if (++log_entries_ >= COMPACT_AFTER) {
+            compact();
+        }
+    }
+
+    bool contains(const string& name) const {
+        lock_guard<mutex> lock(mutex_);
+        return topics_.count(name) > 0;
+    }
+
+    // Every topic, by name
+    vector<TopicMetadata> get_topics() const {
+        lock_guard<mutex> lock(mutex_);
+        vector<TopicMetadata> topics;
+        topics.reserve(topics_.size());
+        for (const auto& [name, topic] : topics_) {
+            topics.push_back(topic);
+        }
+        return topics;
+    }
+
+    size_t size() const {
+        lock_guard<mutex> lock(mutex_);
+        return topics_.size();
+    }
+
+    const string& get_snapshot_path() const {
+        return snapshot_path_;
+    }
+
+    const string& get_log_path() const {
+        return log_path_;
+    }
+
+private:
+    string snapshot_path_;
+    string log_path_;
+    int log_fd_;
+    uint64_t log_size_;         // bytes in the log, appends go here
+    size_t log_entries_;        // since the last snapshot
+    map<string, TopicMetadata> topics_;
+    mutable mutex mutex_;
+
+    static void put_u32(string& out, uint32_t value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void put_u64(string& out, uint64_t value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    // reads a field, or keeps the default when the entry ends before it
+    template <typename T>
+    static void get(const string& data, size_t& pos, T& value) {
+        if (pos + sizeof(T) <= data.size()) {
+            memcpy(&value, data.data() + pos, sizeof(T));
+            pos += sizeof(T);
+        } else {
+            pos = data.size();
+        }
+    }
+
+    static string encode(const TopicMetadata& topic) {
+        string out;
+        put_u32(out, static_cast<uint32_t>(topic.name.size()));
+        out.append(topic.name);
+        put_u32(out, static_cast<uint32_t>(topic.partitions));
+        put_u32(out, static_cast<uint32_t>(topic.replication_factor));
+        put_u64(out, topic.config.segment_size);
+        out.push_back(static_cast<char>(topic.config.cleanup_policy));
+        out.push_back(topic.config.remote_storage);
+        put_u64(out, static_cast<uint64_t>(topic.config.local_retention_ms));
+        out.push_back(topic.config.preallocate);
+        out.push_back(topic.config.direct_io);
+        out.push_back(topic.config.verify_checksums);
+        return out;
+    }
+
+    static TopicMetadata decode(const string& data, const string& path) {
+        TopicMetadata topic;
+        size_t pos = 0;
+        uint32_t name_size = 0;
+        get(data, pos, name_size);
+        if (name_size == 0 || pos + name_size > data.size()) {
+            throw runtime_error("Corrupt topic entry in " + path);
+        }
+        topic.name = data.substr(pos, name_size);
+        pos += name_size;
+        uint32_t partitions = 0;
+        uint32_t replication_factor = 0;
+        uint8_t cleanup_policy = static_cast<uint8_t>(topic.config.cleanup_policy);
+        uint8_t remote_storage = topic.config.remote_storage;
+        uint8_t preallocate = topic.config.preallocate;
+        uint8_t direct_io = topic.config.direct_io;
+        uint8_t verify_checksums = topic.config.verify_checksums;
+        get(data, pos, partitions);
+        get(data, pos, replication_factor);
+        get(data, pos, topic.config.segment_size);
+        get(data, pos, cleanup_policy);
+        get(data, pos, remote_storage);
+        get(data, pos, topic.config.local_retention_ms);
+        get(data, pos, preallocate);
+        get(data, pos, direct_io);
+        get(data, pos, verify_checksums);
+        if (partitions == 0 || partitions > INT32_MAX || cleanup_policy > static_cast<uint8_t>(CleanupPolicy::Compact)) {
+            throw runtime_error("Corrupt topic entry for " + topic.name + " in " + path);
+        }
+        topic.partitions = static_cast<int>(partitions);
+        topic.replication_factor = static_cast<int>(replication_factor);
+        topic.config.cleanup_policy = static_cast<CleanupPolicy>(cleanup_policy);
+        topic.config.remote_storage = remote_storage;
+        topic.config.preallocate = preallocate;
+        topic.config.direct_io = direct_io;
+        topic.config.verify_checksums = verify_checksums;
+        return topic;
+    }
+
+    static string frame(const string& entry) {
+        string out;
+        put_u32(out, static_cast<uint32_t>(entry.size()));
+        put_u32(out, Crc32c::compute(entry.data(), entry.size()));
+        out.append(entry);
+        return out;
+    }
+
+    // next framed entry at pos, false at the end of data or on a torn or corrupt entry
+    static bool unframe(const string& data, size_t& pos, string& entry) {
+        if (pos + 2 * sizeof(uint32_t) > data.size()) {
+            return false;
+        }
+        uint32_t size;
+        uint32_t crc;
+        memcpy(&size, data.data() + pos, sizeof(size));
+        memcpy(&crc, data.data() + pos + sizeof(size), sizeof(crc));
+        size_t start = pos + 2 * sizeof(uint32_t);
+        if (size > data.size() - start || Crc32c::compute(data.data() + start, size) != crc) {
+            return false;
+        }
+        entry.assign(data, start, size);
+        pos = start + size;
+        return true;
+    }
+
+    // whole file, "" when it doesn't exist
+    static string read_file(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno == ENOENT) {
+                return "";
+            }
+            throw runtime_error("Failed to open " + path + ": " + strerror(errno));
+        }
+        string data;
+        char buffer[64 * 1024];
+        for (;;) {
+            ssize_t n = ::read(fd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                string error = strerror(errno);
+                ::close(fd);
+                throw runtime_error("Read failed on " + path + ": " + error);
+            }
+            if (n == 0) {
+                break;
+            }
+            data.append(buffer, n);
+        }
+        ::close(fd);
+        return data;
+    }
+
+    static void write_fully(int fd, const char* data, size_t len, uint64_t offset) {
+        while (len > 0) {
+            ssize_t n = ::pwrite(fd, data, len, offset);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error(string("Write failed: ") + strerror(errno));
+            }
+            data += n;
+            len -= n;
+            offset += n;
+        }
+    }
+
+    void load_snapshot() {
+        string data = read_file(snapshot_path_);
+        if (data.empty()) {
+            return;
+        }
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        uint32_t count = 0;
+        size_t pos = 0;
+        get(data, pos, magic);
+        get(data, pos, version);
+        get(data, pos, count);
+        if (magic != SNAPSHOT_MAGIC || version > SNAPSHOT_VERSION) {
+            throw runtime_error(snapshot_path_ + " is not a topic snapshot of this version");
+        }
+        string entry;
+        for (uint32_t i = 0; i < count; i++) {
+            if (!unframe(data, pos, entry)) {
+                throw runtime_error("Corrupt topic snapshot " + snapshot_path_ + ": entry " + to_string(i) +
+                                    " of " + to_string(count) + " fails its checksum");
+            }
+            TopicMetadata topic = decode(entry, snapshot_path_);
+            topics_[topic.name] = move(topic);
+        }
+    }
+
+    // returns the entries replayed, a torn tail is left for compact() to drop
+    size_t replay_log() {
+        string data = read_file(log_path_);
+        size_t pos = 0;
+        size_t replayed = 0;
+        string entry;
+        while (unframe(data, pos, entry)) {
+            TopicMetadata topic = decode(entry, log_path_);
+            topics_[topic.name] = move(topic);
+            replayed++;
+        }
+        if (pos < data.size()) {
+            cout << "[TopicRegistry] Dropping " << data.size() - pos << " bytes after the last good entry of "
+                 << log_path_ << "\n";
+        }
+        log_size_ = data.size();
+        return replayed;
+    }
+
+    // every topic into a new snapshot, then an empty log; caller holds mutex_ (or is the constructor)
+    void compact() {
+        string data;
+        put_u32(data, SNAPSHOT_MAGIC);
+        put_u32(data, SNAPSHOT_VERSION);
+        put_u32(data, static_cast<uint32_t>(topics_.size()));
+        for (const auto& [name, topic] : topics_) {
+            data.append(frame(encode(topic)));
+        }
+
+        string tmp = snapshot_path_ + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw runtime_error("Failed to create " + tmp + ": " + strerror(errno));
+        }
+        try {
+            write_fully(fd, data.data(), data.size(), 0);
+            if (::fsync(fd) != 0) {
+                throw runtime_error("fsync failed on " + tmp + ": " + strerror(errno));
+            }
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+        if (::rename(tmp.c_str(), snapshot_path_.c_str()) != 0) {
+            throw runtime_error("Failed to rename " + tmp + ": " + strerror(errno));
+        }
+        sync_parent();
+
+        if (::ftruncate(log_fd_, 0) != 0 || ::fdatasync(log_fd_) != 0) {
+            throw runtime_error("Failed to empty " + log_path_ + ": " + strerror(errno));
+        }
+        log_size_ = 0;
+        log_entries_ = 0;
+    }
+
+    // makes the rename durable
+    void sync_parent() {
+        string dir = snapshot_path_.substr(0, snapshot_path_.rfind('/'));
+        int fd = ::open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+};
@@ -1,28 +1,49 @@
 #pragma once
 #include "hyperq/broker/broker.hpp"
 #include "hyperq/common/types.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <iostream>
 using namespace std;
 
 // Customer : client that reads from broker
+// read_committed consumers only see committed transactions; without auto_commit the consumer
+// keeps its own position and offsets are committed by the application (e.g. in a producer's transaction)
+// assign() + poll(): fetcher threads keep up to max_prefetch fetches buffered per partition, so the
+// next records are already decoded while the application processes the current ones. Each fetcher
+// reads all its partitions with one request per round, through an incremental fetch session
+// the consumer's name is its client id for broker quotas, a throttled response holds back every fetcher
 class Consumer{
     public:
-        explicit Consumer(Broker& broker, const string& group_id, const string& name="Consumer") : broker_(broker), group_id_(group_id), name_(name), consumed_count_(0){
+        explicit Consumer(Broker& broker, const string& group_id, const string& name="Consumer",
+                          IsolationLevel isolation=IsolationLevel::ReadUncommitted, bool auto_commit=true) : broker_(broker), group_id_(group_id), name_(name), isolation_(isolation), auto_commit_(auto_commit), consumed_count_(0){
             cout<<"["<<name_<<"] Started in group: "<<group_id_<<"\n";
         }
 
         !Consumer(){
+            unassign();
             cout<<"["<<name_<<"] Stopeed. Consumed: "<<consumed_count_<<" messages\n";
         }
 
         // consume messages from partition (last commit offset)
         // get last offset -> read from that offset onwards -> process messages -> commit new offset to coordinator
 
+        // batches arrive as stored (maybe compressed) and are decoded here, not on the broker
         FetchResponse consume(const string& topic, int partition, size_t max_messages=10){
             (void)max_messages; // broker uses fixed batch so unused rn
-            FetchResponse response = broker_.consume(topic, partition, group_id_, 0);
+            FetchResponse response = fetch_decoded(topic, partition, get_position(topic, partition), auto_commit_);
+            if(response.success && !auto_commit_)  positions_[{topic, partition}] = response.next_offset;
             if(response.success){
                 consumed_count_ += response.messages.size();
                 cout<<"["<<name_<<"] Consumed from "<< topic<<":"<<partition<<" count "<< response.messages.size()<<"\n";
@@ -48,6 +69,113 @@ class Consumer{
             return consumed_count;
         }
 
+        // Start prefetching partitions of topic from their current position, replaces any previous assignment
+        // fetcher_threads split the partitions between them, max_prefetch bounds the fetches buffered per partition
+        void assign(const string& topic, const vector<int>& partitions, size_t max_prefetch=4, size_t fetcher_threads=1){
+            if(max_prefetch == 0 || fetcher_threads == 0){
+                throw invalid_argument("max_prefetch and fetcher_threads must be positive");
+            }
+            unassign();
+            assigned_topic_ = topic;
+            max_prefetch_ = max_prefetch;
+            fetcher_threads_ = fetcher_threads;
+            stopping_ = false;
+            for(int partition : partitions){
+                auto prefetch = make_unique<PrefetchPartition>();
+                prefetch->partition = partition;
+                prefetch->position = get_position(topic, partition);
+                prefetched_.push_back(move(prefetch));
+            }
+
+            size_t threads = min(fetcher_threads, prefetched_.size());
+            for(size_t t = 0; t < threads; t++){
+                vector<PrefetchPartition*> owned;
+                for(size_t i = t; i < prefetched_.size(); i += threads)   owned.push_back(prefetched_[i].get());
+                fetchers_.emplace_back([this, owned]() { fetch_loop(owned); });
+            }
+            cout<<"["<<name_<<"] Assigned "<<topic<<" partitions: "<<partitions.size()<<" prefetch: "<<max_prefetch<<"\n";
+        }
+
+        // Stop the fetchers and drop what they buffered, positions stay at what poll() delivered
+        void unassign(){
+            {
+                lock_guard<mutex> lock(prefetch_mutex_);
+                stopping_ = true;
+            }
+            space_cv_.notify_all();
+            for(auto& fetcher : fetchers_)  fetcher.join();
+            fetchers_.clear();
+            prefetched_.clear();
+        }
+
+        // Hand out one buffered fetch of the assigned partitions, waiting up to timeout for one to arrive
+        // partitions take turns; on timeout the response is successful and empty. Fetch errors are
+        // delivered here too (the fetcher retries after a backoff). Delivering moves the position
+        // (and commits it with auto_commit).
+        FetchResponse poll(chrono::milliseconds timeout){
+            FetchResponse response{true, {}, 0, 0, ""};
+            int partition = -1;
+            {
+                unique_lock<mutex> lock(prefetch_mutex_);
+                PrefetchPartition* ready = nullptr;
+                ready_cv_.wait_for(lock, timeout, [&]() { return (ready = next_ready()) != nullptr; });
+                if(!ready)  return response;
+                response = move(ready->buffered.front());
+                ready->buffered.pop_front();
+                partition = ready->partition;
+            }
+            space_cv_.notify_all();
+
+            if(response.success){
+                if(auto_commit_){
+                    broker_.get_coordinator().commit_offset(group_id_, assigned_topic_, partition, response.next_offset);
+                }else{
+                    positions_[{assigned_topic_, partition}] = response.next_offset;
+                }
+                consumed_count_ += response.messages.size();
+            }else{
+                cout<<"["<<name_<<"] ERROR: "<<response.error_message<<"\n";
+            }
+            return response;
+        }
+
+        // Move where partition is read from next: the own position, or with auto commit the group's offset
+        // if the partition is assigned, what was prefetched is dropped and the fetchers start over there
+        void seek(const string& topic, int partition, uint64_t offset){
+            if(auto_commit_){
+                broker_.get_coordinator().commit_offset(group_id_, topic, partition, offset);
+            }else{
+                positions_[{topic, partition}] = offset;
+            }
+            if(topic != assigned_topic_)    return;
+            vector<int> partitions;
+            for(const auto& prefetch : prefetched_)     partitions.push_back(prefetch->partition);
+            if(find(partitions.begin(), partitions.end(), partition) != partitions.end()){
+                assign(topic, partitions, max_prefetch_, fetcher_threads_);
+            }
+        }
+
+        // Seek to the first record at or after timestamp (ms since the epoch), the log end when all are older
+        // false leaves the position alone (unknown partition)
+        bool seek_to_time(const string& topic, int partition, uint64_t timestamp){
+            OffsetForTimeResponse response = broker_.offsets_for_times(topic, partition, timestamp);
+            if(!response.success){
+                cout<<"["<<name_<<"] ERROR: "<<response.error_message<<"\n";
+                return false;
+            }
+            seek(topic, partition, response.offset);
+            cout<<"["<<name_<<"] Seeked "<<topic<<":"<<partition<<" to offset "<<response.offset<<" for time "<<timestamp<<"\n";
+            return true;
+        }
+
+        // fetches buffered and not yet polled, across the assignment
+        size_t get_prefetched_count() const {
+            lock_guard<mutex> lock(prefetch_mutex_);
+            size_t count = 0;
+            for(const auto& prefetch : prefetched_)     count += prefetch->buffered.size();
+            return count;
+        }
+
         int get_consumed_count() const {
             return consumed_count;
         }
@@ -62,6 +190,11 @@ class Consumer{
         uint64_t get_committed_offset(const string& topic, int partition) const {
             return broker_.get_coordinator().get_offset(group_id_, topic, partition);
         }
+        // where the next consume() reads from: own position without auto commit, else the committed offset
+        uint64_t get_position(const string& topic, int partition) const {
+            auto it = positions_.find({topic, partition});
+            return it != positions_.end() ? it->second : get_committed_offset(topic, partition);
+        }
         uint64_t get_lag(const string& topic, int partition, uint64_t latest_offset){
             return broker_.get_coordinator().get_consumer_lag(group_id, topic, partition, latest_offset);
         }
@@ -69,5 +202,154 @@ class Consumer{
         Broker& broker_;
         string group_id_;
         string name_;
+        IsolationLevel isolation_;
+        bool auto_commit_;
+        map<pair<string,int>, uint64_t> positions_;     // {(topic, partition): next offset}, only without auto commit
         int consumed_count;
+
+        // an empty fetch means the partitions are caught up, their fetcher waits before asking again:
+        // FETCH_BACKOFF after the first, doubling with every empty one up to FETCH_BACKOFF_MAX
+        static constexpr chrono::milliseconds FETCH_BACKOFF{5};
+        static constexpr chrono::milliseconds FETCH_BACKOFF_MAX{100};
+        static constexpr size_t FETCH_MAX_BYTES = 1024 * 1024;     // per fetcher request, shared by its partitions
+
+        struct PrefetchPartition{
+            int partition;
+            uint64_t position;                  // next offset to fetch, ahead of what poll() delivered
+            deque<FetchResponse> buffered;      // decoded fetches, at most max_prefetch_
+        };
+
+        string assigned_topic_;
+        size_t max_prefetch_ = 0;
+        size_t fetcher_threads_ = 0;
+        vector<unique_ptr<PrefetchPartition>> prefetched_;
+        size_t poll_cursor_ = 0;                // partition poll() looks at first
+        vector<thread> fetchers_;
+        bool stopping_ = false;
+        mutable mutex prefetch_mutex_;
+        condition_variable ready_cv_;           // a fetch was buffered
+        condition_variable space_cv_;           // a fetch was polled, or stopping
+        atomic<int64_t> throttled_until_ns_{0}; // steady clock, no fetch before this (the broker's quota asked so)
+
+        chrono::steady_clock::time_point throttled_until() const{
+            return chrono::steady_clock::time_point(chrono::nanoseconds(throttled_until_ns_.load()));
+        }
+        void note_throttle(uint32_t throttle_time_ms){
+            if(throttle_time_ms == 0)   return;
+            auto until = chrono::steady_clock::now() + chrono::milliseconds(throttle_time_ms);
+            throttled_until_ns_ = chrono::duration_cast<chrono::nanoseconds>(until.time_since_epoch()).count();
+        }
+
+        // fetch from offset and decode the batches (they may start before offset)
+        FetchResponse fetch_decoded(const string& topic, int partition, uint64_t offset, bool commit){
+            TraceScope trace(TraceOp::Fetch, TraceStage::Enqueue);     // delivered once decoded
+            if(throttled_until() > chrono::steady_clock::now())     this_thread::sleep_until(throttled_until());
+            FetchResponse response = broker_.fetch(topic, partition, group_id_, offset, 1024 * 1024, isolation_, commit, name_);
+            note_throttle(response.throttle_time_ms);
+            decode(response, partition, offset);
+            return response;
+        }
+
+        static void decode(FetchResponse& response, int partition, uint64_t offset){
+            if(!response.success)   return;
+            for(const auto& batch : RecordBatch::parse_all(response.records)){
+                batch.decode_into(response.messages, partition, offset, batch.header.record_count);
+            }
+        }
+
+        // next partition in turn with a buffered fetch, caller holds prefetch_mutex_
+        PrefetchPartition* next_ready(){
+            for(size_t i = 0; i < prefetched_.size(); i++){
+                PrefetchPartition* prefetch = prefetched_[(poll_cursor_ + i) % prefetched_.size()].get();
+                if(!prefetch->buffered.empty()){
+                    poll_cursor_ = (poll_cursor_ + i + 1) % prefetched_.size();
+                    return prefetch;
+                }
+            }
+            return nullptr;
+        }
+
+        // fetcher thread: one fetch session over the owned partitions, a partition whose buffer is full
+        // is forgotten by the session and added back (at its position) once poll() makes room
+        // offsets are never committed here, only when poll() hands the records out
+        void fetch_loop(const vector<PrefetchPartition*>& owned){
+            unordered_map<int, size_t> index;   // {partition: position in owned}
+            for(size_t i = 0; i < owned.size(); i++)    index[owned[i]->partition] = i;
+            vector<bool> in_session(owned.size(), false);
+            FetchRequest request;
+            request.max_bytes = FETCH_MAX_BYTES;
+            request.isolation = isolation_;
+            request.client_id = name_;
+            request.group_id = group_id_;
+
+            chrono::milliseconds backoff = FETCH_BACKOFF;
+            unique_lock<mutex> lock(prefetch_mutex_);
+            while(!stopping_){
+                if(throttled_until() > chrono::steady_clock::now()){
+                    space_cv_.wait_until(lock, throttled_until(), [this]{ return stopping_; });
+                    continue;
+                }
+                auto has_room = [&](size_t i) { return owned[i]->buffered.size() < max_prefetch_; };
+                bool any_room = false;
+                for(size_t i = 0; i < owned.size(); i++)    any_room = any_room || has_room(i);
+                if(!any_room){
+                    space_cv_.wait_for(lock, FETCH_BACKOFF);
+                    continue;
+                }
+                request.partitions.clear();
+                request.forgotten.clear();
+                for(size_t i = 0; i < owned.size(); i++){
+                    // positions are only written by this thread
+                    if(has_room(i) && !in_session[i])   request.partitions.push_back({assigned_topic_, owned[i]->partition, owned[i]->position});
+                    if(!has_room(i) && in_session[i])   request.forgotten.push_back({assigned_topic_, owned[i]->partition});
+                    in_session[i] = has_room(i);
+                }
+                lock.unlock();
+
+                MultiFetchResponse response;
+                {
+                    TraceScope trace(TraceOp::Fetch, TraceStage::Enqueue);     // delivered once decoded
+                    response = broker_.fetch(request);
+                    note_throttle(response.throttle_time_ms);
+                    for(auto& data : response.partitions){
+                        decode(data.response, data.partition, owned[index.at(data.partition)]->position);
+                        data.response.records.clear();     // only the decoded messages are buffered
+                    }
+                }
+                lock.lock();
+
+                bool fetched = false;
+                if(!response.success){
+                    // session lost (evicted, or out of step): start over with a full request
+                    request.session_id = NO_FETCH_SESSION;
+                    request.session_epoch = 0;
+                    fill(in_session.begin(), in_session.end(), false);
+                }else{
+                    request.session_id = response.session_id;
+                    request.session_epoch = response.session_epoch;
+                }
+                for(auto& data : response.partitions){
+                    size_t i = index.at(data.partition);
+                    PrefetchPartition* prefetch = owned[i];
+                    if(data.response.success){
+                        prefetch->position = data.response.next_offset;
+                    }else{
+                        in_session[i] = false;      // re-sent next round, its error is delivered again
+                    }
+                    if(!data.response.success || !data.response.messages.empty()){
+                        fetched = fetched || data.response.success;
+                        prefetch->buffered.push_back(move(data.response));
+                        ready_cv_.notify_one();
+                    }
+                }
+                if(fetched){
+                    backoff = FETCH_BACKOFF;
+                }else{
+                    // caught up or failing: wait for a poll or the backoff, longer the longer nothing comes
+                    space_cv_.wait_for(lock, backoff);
+                    backoff = min(backoff * 2, FETCH_BACKOFF_MAX);
+                }
+            }
+            if(request.session_id != NO_FETCH_SESSION)  broker_.close_fetch_session(request.session_id);
+        }
 };
\ No newline at end of file
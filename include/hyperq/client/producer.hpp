@@ -1,25 +1,86 @@
 #pragma once
 #include "hyperq/broker/broker.hpp"
 #include "hyperq/common/types.hpp"
+#include <chrono>
+#include <map>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 #include <iostream>
 using namespace std;
 
 // Producer : the client that sens message to broker
+// an idempotent producer numbers its batches per partition and retries failed sends with the
+// same number, the broker acks a batch it already has instead of writing it twice
+// after init_transactions() sends go into transactions: begin, send..., send_offsets, commit/abort
+// the producer's name is its client id for broker quotas, a throttled response delays the next send
+// batches are checksummed (CRC32C) here once final, the broker verifies them before writing
 class Producer{
     public:
-        // create producer
-        explicit Producer(Broker& broker, const string& name="Producer"):broker_(broker), name_(name),produced_count_(0){
+        // create producer, batches from send_batch are compressed with the given codec
+        explicit Producer(Broker& broker, const string& name="Producer", CompressionCodec compression=CompressionCodec::None, bool idempotent=false):broker_(broker), name_(name), compression_(compression), produced_count_(0), producer_id_(NO_PRODUCER_ID), producer_epoch_(0), in_transaction_(false){
+            if(!Compression::is_available(compression_)){
+                throw invalid_argument("Compression codec "+Compression::codec_name(compression_)+" is not available in this build");
+            }
+            if(idempotent){
+                producer_id_ = broker_.init_producer_id();
+            }
             cout<<"["<<name_<<"] Started \n";
         }
         ~Producer(){
             cout<<"["<<name_<<"] Stopped, Produced: "<<produced_count_<<" messages\n";
         }
 
+        // Make this producer transactional (implies idempotent)
+        // a previous producer with the same transactional_id is fenced and its open transaction aborted
+        void init_transactions(const string& transactional_id){
+            ProducerIdentity identity = broker_.get_transaction_coordinator().init_producer(transactional_id);
+            transactional_id_ = transactional_id;
+            producer_id_ = identity.producer_id;
+            producer_epoch_ = identity.epoch;
+            next_sequence_.clear();     // sequences restart with every epoch
+            cout<<"["<<name_<<"] Transactional as "<<transactional_id_<<" (producer "<<producer_id_<<" epoch "<<producer_epoch_<<")\n";
+        }
+
+        void begin_transaction(){
+            if(transactional_id_.empty())   throw logic_error("init_transactions() was not called");
+            if(in_transaction_)     throw logic_error("A transaction is already in progress");
+            in_transaction_ = true;
+            transaction_partitions_.clear();
+        }
+
+        // commit a consumer group's offset only if the transaction commits
+        void send_offsets_to_transaction(const string& group_id, const string& topic, int partition, uint64_t offset){
+            if(!in_transaction_)    throw logic_error("No transaction in progress");
+            broker_.get_transaction_coordinator().add_offset(transactional_id_, identity(), group_id, topic, partition, offset);
+        }
+
+        void commit_transaction(){
+            end_transaction(true);
+        }
+
+        void abort_transaction(){
+            end_transaction(false);
+        }
+
         // send message to topic, routes to broker which selects the partition
         ProduceResponse send(const string& topic, const string& message, const string& key=""){
-            ProduceResponse response = broker_.produce(topic, message, key);
+            ProduceResponse response;
+            {
+                TraceScope trace(TraceOp::Produce, TraceStage::Enqueue);
+                if(is_idempotent()){
+                    MessageBatch records;
+                    records.append(0, key, message, 0, 0);
+                    response = send_idempotent(topic, RecordBatch::build(0, records), key);
+                }else{
+                    wait_throttle();
+                    response = broker_.produce(topic, message, key, name_);
+                    note_throttle(response.throttle_time_ms);
+                }
+            }
             if(response.success){
                 produced_count_++;
                 cout<<"[ "<<name_<<"] sent to "<<topic<<":"<<response.partition<<"offset "<<response.offset<<"\n";
@@ -29,14 +90,36 @@ class Producer{
             return response;
         }
 
-        // batch processing
+        // batch processing: one record batch, compressed once here and stored as-is by the broker
         int send_batch(const string& topic, const vector<string>& messages, const string& key=""){
-            int success_cnt = 0;
-            for(const auto& message : messages){
-                auto response = send(topic, message, key);
-                if(response.success)    success_cnt++;
+            if(messages.empty())    return 0;
+
+            ProduceResponse response;
+            {
+                TraceScope trace(TraceOp::Produce, TraceStage::Enqueue);     // broker_receipt includes building and compressing
+                MessageBatch records;
+                for(size_t i = 0; i < messages.size(); i++){
+                    records.append(i, key, messages[i], 0, 0);    // offsets relative, broker assigns the base
+                }
+                RecordBatch batch = RecordBatch::build(0, records);
+                batch.compress(compression_);
+
+                if(is_idempotent()){
+                    response = send_idempotent(topic, move(batch), key);
+                }else{
+                    batch.seal();
+                    wait_throttle();
+                    response = broker_.produce_batch(topic, batch, key, name_);
+                    note_throttle(response.throttle_time_ms);
+                }
             }
-            return success_cnt;
+            if(!response.success){
+                cout<<"["<<name_<<"] Error: "<<response.error_message<<"\n";
+                return 0;
+            }
+            produced_count_ += messages.size();
+            cout<<"["<<name_<<"] sent batch of "<<messages.size()<<" to "<<topic<<":"<<response.partition<<" offset "<<response.offset<<"\n";
+            return messages.size();
         }
 
         int get_produced_count() const{
@@ -45,8 +128,86 @@ class Producer{
         string get_name() const{
             return name_;
         }
+        bool is_idempotent() const{
+            return producer_id_ != NO_PRODUCER_ID;
+        }
+        bool is_transactional() const{
+            return !transactional_id_.empty();
+        }
+        uint64_t get_producer_id() const{
+            return producer_id_;
+        }
     private:
+        static const int MAX_RETRIES = 3;
+
         Broker& broker_;
         string name_;
+        CompressionCodec compression_;
         int produced_count_;
+        uint64_t producer_id_;      // NO_PRODUCER_ID unless idempotent
+        uint16_t producer_epoch_;
+        map<pair<string,int>, int32_t> next_sequence_;  // {(topic, partition): sequence of the next batch}
+        string transactional_id_;   // empty unless transactional
+        bool in_transaction_;
+        set<pair<string,int>> transaction_partitions_;  // registered with the coordinator in this transaction
+        chrono::steady_clock::time_point throttled_until_{};    // no request before this, the broker's quota asked so
+
+        // sleeping here, not in the broker, is what keeps an over-quota producer from taking broker threads
+        void wait_throttle(){
+            if(throttled_until_ > chrono::steady_clock::now())  this_thread::sleep_until(throttled_until_);
+        }
+        void note_throttle(uint32_t throttle_time_ms){
+            if(throttle_time_ms > 0)    throttled_until_ = chrono::steady_clock::now() + chrono::milliseconds(throttle_time_ms);
+        }
+
+        ProducerIdentity identity() const{
+            return ProducerIdentity{producer_id_, producer_epoch_};
+        }
+
+        void end_transaction(bool commit){
+            if(!in_transaction_)    throw logic_error("No transaction in progress");
+            broker_.get_transaction_coordinator().end_transaction(transactional_id_, identity(), commit);
+            in_transaction_ = false;
+            cout<<"["<<name_<<"] "<<(commit ? "Committed" : "Aborted")<<" transaction over "<<transaction_partitions_.size()<<" partition(s)\n";
+        }
+
+        // pin the partition, stamp the sequence and retry until acked, the sequence only moves on success
+        ProduceResponse send_idempotent(const string& topic, RecordBatch batch, const string& key){
+            int partition;
+            try{
+                partition = broker_.partition_for(topic, key, batch.size_bytes());
+            }catch(const exception& e){
+                return ProduceResponse{false, topic, -1, 0, e.what()};
+            }
+            if(is_transactional()){
+                if(!in_transaction_){
+                    return ProduceResponse{false, topic, partition, 0, "No transaction in progress"};
+                }
+                if(transaction_partitions_.insert({topic, partition}).second){
+                    try{
+                        broker_.get_transaction_coordinator().add_partition(transactional_id_, identity(), topic, partition);
+                    }catch(const exception& e){
+                        transaction_partitions_.erase({topic, partition});
+                        return ProduceResponse{false, topic, partition, 0, e.what()};
+                    }
+                }
+                batch.set_transactional();
+            }
+            int32_t& sequence = next_sequence_[{topic, partition}];
+            batch.set_producer(producer_id_, producer_epoch_, sequence);
+            batch.seal();   // final now, retries resend the same bytes
+
+            ProduceResponse response;
+            for(int attempt = 0; attempt <= MAX_RETRIES; attempt++){
+                wait_throttle();
+                response = broker_.produce_batch(topic, partition, batch, name_);
+                note_throttle(response.throttle_time_ms);
+                if(response.success)    break;
+                cout<<"["<<name_<<"] Retrying sequence "<<sequence<<" to "<<topic<<":"<<partition<<" ("<<response.error_message<<")\n";
+            }
+            if(response.success){
+                sequence = batch.header.last_sequence() + 1;
+            }
+            return response;
+        }
 };
\ No newline at end of file
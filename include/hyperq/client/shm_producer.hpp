@@ -0,0 +1,162 @@
+#pragma once
+#include "hyperq/common/types.hpp"
+#include "hyperq/protocol/shm_ring.hpp"
+#include "hyperq/storage/record_batch.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+using namespace std;
+
+// ShmProducer : produces to a broker on the same host through shared memory, see ShmServer
+// batches are serialized straight into a ring slot the broker reads, no socket I/O per request
+// submit() returns once the request is in its slot and wait(ticket) collects the response, so up to
+// slot_count requests are in flight; submitting into a full ring first collects the oldest one
+// every ticket must be waited for once, collected responses are kept until then
+// thread-safe, callers serialize on one mutex (a sidecar usually sends from one thread anyway)
+class ShmProducer{
+    public:
+        ShmProducer(const string& socket_path, const string& client_id="ShmProducer")
+            :socket_path_(socket_path), client_id_(client_id), socket_fd_(-1), next_(0), collected_(0){
+            try{
+                connect();
+            }catch(...){
+                if(socket_fd_ >= 0)     ::close(socket_fd_);
+                throw;
+            }
+            topics_.resize(ring_.slot_count());
+            cout<<"["<<client_id_<<"] Connected to "<<socket_path_<<" ("<<ring_.slot_count()<<" shared-memory slots)\n";
+        }
+        ~ShmProducer(){
+            ::close(socket_fd_);    // the broker's connection thread sees the hang-up and unmaps its side
+        }
+
+        ShmProducer(const ShmProducer&) = delete;
+        ShmProducer& operator=(const ShmProducer&) = delete;
+
+        // queue a batch for topic (partition -1: the broker picks one from key), returns its ticket
+        // the batch is sealed here unless it already is
+        uint64_t submit(const string& topic, int partition, RecordBatch batch, const string& key=""){
+            size_t request_bytes = topic.size() + key.size() + batch.size_bytes();
+            if(request_bytes > ring_.data_capacity()){
+                throw invalid_argument("Request of "+to_string(request_bytes)+" bytes exceeds the shared-memory slot size of "+to_string(ring_.data_capacity()));
+            }
+            if(!batch.has_checksum())   batch.seal();
+
+            lock_guard<mutex> lock(mutex_);
+            while(next_ - collected_ >= ring_.slot_count())  collect();     // ring full
+            ShmSlot& slot = ring_.slot(next_);
+            slot.partition = partition;
+            slot.topic_size = topic.size();
+            slot.key_size = key.size();
+            slot.batch_size = batch.size_bytes();
+            char* out = slot.data();
+            memcpy(out, topic.data(), topic.size());
+            out += topic.size();
+            memcpy(out, key.data(), key.size());
+            out += key.size();
+            memcpy(out, &batch.header, sizeof(batch.header));
+            memcpy(out + sizeof(batch.header), batch.payload.data(), batch.payload.size());
+            slot.state.store(static_cast<uint32_t>(ShmSlotState::Request), memory_order_release);
+            ShmRing::notify(ring_.header().broker);
+            topics_[next_ % topics_.size()] = topic;
+            return next_++;
+        }
+
+        // response to a submitted batch, blocks until the broker has written it
+        ProduceResponse wait(uint64_t ticket){
+            lock_guard<mutex> lock(mutex_);
+            if(ticket >= next_)     throw invalid_argument("Unknown ticket "+to_string(ticket));
+            while(collected_ <= ticket)  collect();
+            auto it = done_.find(ticket);
+            if(it == done_.end())   throw invalid_argument("Ticket "+to_string(ticket)+" was already waited for");
+            ProduceResponse response = move(it->second);
+            done_.erase(it);
+            return response;
+        }
+
+        ProduceResponse send_batch(const string& topic, int partition, RecordBatch batch, const string& key=""){
+            return wait(submit(topic, partition, move(batch), key));
+        }
+
+        // largest topic + key + serialized batch one request can carry
+        size_t max_request_bytes() const{
+            return ring_.data_capacity();
+        }
+
+    private:
+        string socket_path_;
+        string client_id_;
+        int socket_fd_;
+        ShmRing ring_;
+        mutex mutex_;
+        uint64_t next_;         // ticket of the next submit, its slot is next_ % slot_count
+        uint64_t collected_;    // oldest ticket whose response is still in its slot
+        vector<string> topics_;     // topic of the request in each slot
+        unordered_map<uint64_t, ProduceResponse> done_;     // collected, not yet waited for
+
+        // hello out, welcome and the ring's memfd in
+        void connect(){
+            sockaddr_un addr{};
+            if(socket_path_.size() >= sizeof(addr.sun_path))   throw invalid_argument("Socket path too long: "+socket_path_);
+            socket_fd_ = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+            if(socket_fd_ < 0)  throw runtime_error(string("Failed to create socket: ")+strerror(errno));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, socket_path_.c_str(), sizeof(addr.sun_path) - 1);
+            if(::connect(socket_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0){
+                throw runtime_error("Failed to connect to "+socket_path_+": "+strerror(errno));
+            }
+
+            ShmHello hello{};
+            hello.magic = SHM_RING_MAGIC;
+            hello.version = SHM_RING_VERSION;
+            strncpy(hello.client_id, client_id_.c_str(), SHM_CLIENT_ID_SIZE - 1);
+            if(::send(socket_fd_, &hello, sizeof(hello), MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(hello))){
+                throw runtime_error("Shared-memory handshake failed: "+string(strerror(errno)));
+            }
+
+            ShmWelcome welcome{};
+            iovec iov{&welcome, sizeof(welcome)};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+            msghdr message{};
+            message.msg_iov = &iov;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            ssize_t received = ::recvmsg(socket_fd_, &message, MSG_CMSG_CLOEXEC);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+            int fd = -1;
+            if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)  memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+            if(received != static_cast<ssize_t>(sizeof(welcome)) || welcome.magic != SHM_RING_MAGIC || welcome.error != 0 || fd < 0){
+                if(fd >= 0)     ::close(fd);
+                throw runtime_error("Broker refused the shared-memory connection"+
+                                    (welcome.error ? string(": ")+strerror(welcome.error) : string("")));
+            }
+            ring_ = ShmRing::attach(fd, welcome);
+        }
+
+        // move the oldest response out of its slot and free the slot, caller holds mutex_
+        void collect(){
+            ShmSlot& slot = ring_.slot(collected_);
+            auto responded = [&slot](){
+                return slot.state.load(memory_order_acquire) == static_cast<uint32_t>(ShmSlotState::Response);
+            };
+            while(!ShmRing::wait(ring_.header().client, responded)){
+                pollfd pfd{socket_fd_, POLLIN, 0};
+                if(::poll(&pfd, 1, 0) != 0)  throw runtime_error("Broker closed the shared-memory connection");
+            }
+            ProduceResponse response{slot.success != 0, topics_[collected_ % topics_.size()], slot.response_partition, slot.offset, ""};
+            response.error_message.assign(slot.data(), min<size_t>(slot.message_size, ring_.data_capacity()));
+            response.throttle_time_ms = slot.throttle_time_ms;
+            slot.state.store(static_cast<uint32_t>(ShmSlotState::Free), memory_order_release);
+            done_.emplace(collected_++, move(response));
+        }
+};
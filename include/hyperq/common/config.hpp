@@ -0,0 +1,6 @@
+#pragma once
+#include <cstddef>
+using namespace std;
+
+// alignment used to keep hot atomics written by different threads on separate cache lines
+const size_t CACHE_LINE_SIZE = 64;
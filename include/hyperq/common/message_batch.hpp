@@ -0,0 +1,193 @@
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+using namespace std;
+
+/*
+ * BufferPool: recycles the byte buffers behind MessageBatch
+ * Buffers keep their capacity between uses, so a steady fetch/produce loop
+ * stops allocating once the pool is warm. Oversized buffers are dropped
+ * instead of pooled so one huge fetch doesn't pin memory forever.
+*/
+
+class BufferPool {
+public:
+    static BufferPool& instance() {
+        static BufferPool pool;
+        return pool;
+    }
+
+    string acquire(size_t min_capacity = 0) {
+        string buffer;
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (!free_.empty()) {
+                buffer = move(free_.back());
+                free_.pop_back();
+            }
+        }
+        buffer.clear();
+        buffer.reserve(min_capacity);
+        return buffer;
+    }
+
+    void release(string&& buffer) {
+        if (buffer.capacity() == 0 || buffer.capacity() > MAX_POOLED_CAPACITY) {
+            return;
+        }
+        lock_guard<mutex> lock(mutex_);
+        if (free_.size() < MAX_POOLED_BUFFERS) {
+            free_.push_back(move(buffer));
+        }
+    }
+
+    size_t get_free_count() const {
+        lock_guard<mutex> lock(mutex_);
+        return free_.size();
+    }
+
+private:
+    static constexpr size_t MAX_POOLED_BUFFERS = 64;
+    static constexpr size_t MAX_POOLED_CAPACITY = 8 * 1024 * 1024;
+
+    vector<string> free_;
+    mutable mutex mutex_;
+};
+
+// Read-only view of one message inside a MessageBatch
+// key/value point into the batch buffer: valid until the batch is appended to or destroyed
+struct MessageView {
+    uint64_t offset;
+    string_view key;
+    string_view value;
+    uint64_t timestamp;
+    int partition;
+};
+
+/*
+ * MessageBatch: many messages in one pooled buffer
+ * Keys and values are packed back to back in buffer_, entries_ holds the
+ * descriptors. A fetch of N messages costs one recycled buffer plus one
+ * descriptor array instead of 2N strings.
+*/
+
+class MessageBatch {
+public:
+    MessageBatch() : buffer_(BufferPool::instance().acquire()) {}
+
+    ~MessageBatch() {
+        BufferPool::instance().release(move(buffer_));
+    }
+
+    MessageBatch(MessageBatch&& other) noexcept
+        : buffer_(move(other.buffer_)), entries_(move(other.entries_)) {
+        other.buffer_.clear();
+        other.entries_.clear();
+    }
+
+    MessageBatch& operator=(MessageBatch&& other) noexcept {
+        if (this != &other) {
+            BufferPool::instance().release(move(buffer_));
+            buffer_ = move(other.buffer_);
+            entries_ = move(other.entries_);
+            other.buffer_.clear();
+            other.entries_.clear();
+        }
+        return *this;
+    }
+
+    MessageBatch(const MessageBatch& other)
+        : buffer_(BufferPool::instance().acquire(other.buffer_.size())), entries_(other.entries_) {
+        buffer_.append(other.buffer_);
+    }
+
+    MessageBatch& operator=(const MessageBatch& other) {
+        if (this != &other) {
+            buffer_.assign(other.buffer_);
+            entries_ = other.entries_;
+        }
+        return *this;
+    }
+
+    void reserve(size_t count, size_t bytes) {
+        entries_.reserve(count);
+        buffer_.reserve(bytes);
+    }
+
+    void append(uint64_t offset, string_view key, string_view value, uint64_t timestamp, int partition) {
+        entries_.push_back(Entry{offset, timestamp, buffer_.size(),
+                                 static_cast<uint32_t>(key.size()),
+                                 static_cast<uint32_t>(value.size()), partition});
+        buffer_.append(key.data(), key.size());
+        buffer_.append(value.data(), value.size());
+    }
+
+    void clear() {
+        buffer_.clear();
+        entries_.clear();
+    }
+
+    size_t size() const {
+        return entries_.size();
+    }
+
+    bool empty() const {
+        return entries_.empty();
+    }
+
+    // bytes of keys and values held
+    size_t bytes() const {
+        return buffer_.size();
+    }
+
+    MessageView operator[](size_t i) const {
+        const Entry& e = entries_[i];
+        string_view data(buffer_);
+        return MessageView{e.offset, data.substr(e.pos, e.key_size),
+                           data.substr(e.pos + e.key_size, e.value_size), e.timestamp, e.partition};
+    }
+
+    MessageView front() const {
+        return (*this)[0];
+    }
+
+    MessageView back() const {
+        return (*this)[entries_.size() - 1];
+    }
+
+    class const_iterator {
+    public:
+        const_iterator(const MessageBatch* batch, size_t index) : batch_(batch), index_(index) {}
+        MessageView operator*() const { return (*batch_)[index_]; }
+        const_iterator& operator++() { index_++; return *this; }
+        bool operator!=(const const_iterator& other) const { return index_ != other.index_; }
+        bool operator==(const const_iterator& other) const { return index_ == other.index_; }
+    private:
+        const MessageBatch* batch_;
+        size_t index_;
+    };
+
+    const_iterator begin() const {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, entries_.size());
+    }
+
+private:
+    struct Entry {
+        uint64_t offset;
+        uint64_t timestamp;
+        size_t pos;          // key starts here, value follows it
+        uint32_t key_size;
+        uint32_t value_size;
+        int partition;
+    };
+
+    string buffer_;
+    vector<Entry> entries_;
+};
@@ -0,0 +1,105 @@
+#pragma once
+#include "hyperq/common/config.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+using namespace std;
+
+/*
+ * MpscRingBuffer: bounded lock-free queue, many producers / one consumer
+ * Every slot carries a sequence number telling whose turn it is: producers
+ * claim a position with one CAS on tail_ and publish by bumping the slot's
+ * sequence, the consumer owns head_ outright and never CASes. Also fine as an
+ * SPSC queue. Slots and both cursors sit on their own cache lines.
+*/
+
+template <typename T>
+class MpscRingBuffer {
+public:
+    // capacity is rounded up to a power of two
+    explicit MpscRingBuffer(size_t capacity) : mask_(0), head_(0), tail_(0) {
+        if (capacity == 0) {
+            throw invalid_argument("Ring buffer capacity must be positive");
+        }
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        mask_ = size - 1;
+        slots_.reset(new Slot[size]);
+        for (size_t i = 0; i < size; i++) {
+            slots_[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    MpscRingBuffer(const MpscRingBuffer&) = delete;
+    MpscRingBuffer& operator=(const MpscRingBuffer&) = delete;
+
+    // any thread; false when full
+    bool try_push(T item) {
+        size_t pos = tail_.load(memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots_[pos & mask_];
+            size_t sequence = slot.sequence.load(memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    slot.value = move(item);
+                    slot.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;   // the consumer hasn't freed this slot yet
+            } else {
+                pos = tail_.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // consumer only; false when empty
+    bool try_pop(T& item) {
+        Slot& slot = slots_[head_ & mask_];
+        if (slot.sequence.load(memory_order_acquire) != head_ + 1) {
+            return false;
+        }
+        item = move(slot.value);
+        slot.sequence.store(head_ + mask_ + 1, memory_order_release);
+        head_++;
+        return true;
+    }
+
+    // consumer only: move up to max_items into out, returns how many
+    size_t pop_batch(vector<T>& out, size_t max_items) {
+        size_t popped = 0;
+        T item;
+        while (popped < max_items && try_pop(item)) {
+            out.push_back(move(item));
+            popped++;
+        }
+        return popped;
+    }
+
+    // consumer only
+    bool empty() const {
+        return slots_[head_ & mask_].sequence.load(memory_order_acquire) != head_ + 1;
+    }
+
+    size_t capacity() const {
+        return mask_ + 1;
+    }
+
+private:
+    struct alignas(CACHE_LINE_SIZE) Slot {
+        atomic<size_t> sequence;
+        T value{};
+    };
+
+    size_t mask_;                   // read-only after construction
+    unique_ptr<Slot[]> slots_;
+    alignas(CACHE_LINE_SIZE) size_t head_;          // consumer cursor
+    alignas(CACHE_LINE_SIZE) atomic<size_t> tail_;  // producer cursor
+};
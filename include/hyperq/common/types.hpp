@@ -3,6 +3,7 @@
 #include <vector>
 #include <csdtint>
 #include <chrono>
+#include "hyperq/common/message_batch.hpp"
 using namespace std;
 
 struct Message{
@@ -19,14 +20,17 @@ struct ProduceRespoonse{
     int partition;
     uint64_t offset;    // assigned offset
     int partition;
+    uint32_t throttle_time_ms{};    // over its quota: how long the client must wait before the next request
 };
 
 struct FetchResponse{
     bool success;
-    vector<Message> messages;
+    MessageBatch messages;  // decoded messages, one pooled buffer
     uint64_t next_offset;   // next offset to fetch
     uint64_t consumer_lag;  // how far behind is the consumer
     string error_messages;  // if any
+    string records{};       // raw record batches from Broker::fetch, decoded by the client
+    uint32_t throttle_time_ms{};    // over its quota: how long the client must wait before the next request
 };
 
 // this encloses the data types structure in our project
\ No newline at end of file
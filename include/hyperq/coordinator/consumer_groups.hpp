@@ -14,6 +14,7 @@ class ConsumerGroupCoordinator{
         ~ConsumerGroupCoordinator() = default;
 
         // commit offset for comsumer group
+        // offset is the next one the group reads, one past its last consumed message
         void commit_offset(const string& group_id, const string& topic, int partition, uint64_t offset){
             lock_guard<mutex> lock(mutex_);
             offsets_[group_id][topic][partition] = offset;
@@ -32,7 +33,7 @@ class ConsumerGroupCoordinator{
             return partition_it->second;
         }
 
-        // calculate consumer lag
+        // calculate consumer lag, latest_offset is the log end (one past the last offset)
         uint64_t get_consumer_lag(const string& group_id, const string& topic, int partition, uint64_t latest_offset) const{
             lock_guard<mutex> lock(mutex_);
 
@@ -54,6 +55,12 @@ class ConsumerGroupCoordinator{
             return 0;   // no lag
         }
 
+        // copy of every committed offset {group_id: {topic: {partition: offset}}}
+        map<string, map<string, map<int, uint64_t>>> get_committed_offsets() const{
+            lock_guard<mutex> lock(mutex_);
+            return offsets_;
+        }
+
         // join consumer groups
         /*
         adds consumer to group and subscribers to topics
@@ -0,0 +1,298 @@
+#pragma once
+#include "hyperq/coordinator/consumer_groups.hpp"
+#include "hyperq/coordinator/transaction_log.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+using namespace std;
+
+/*
+ * TransactionCoordinator: atomic writes across partitions plus offset commits
+ * A producer registers every partition it writes to and every consumer offset
+ * it wants committed with the transaction. Ending it writes a commit or abort
+ * marker into each partition, then (on commit) hands the offsets to the
+ * ConsumerGroupCoordinator, so a read_committed consumer sees the output and
+ * the input offsets move together.
+ * init_producer() on an id that is still in use bumps the epoch and aborts
+ * whatever the previous instance left open. A commit or abort whose marker
+ * writes failed stays Prepare*, and init_producer() first finishes it by
+ * writing the markers again.
+ * With a log dir every identity and every decision goes to a TransactionLog
+ * before it is acted on: a coordinator restarted between two markers finds
+ * the decision there and recover() writes the rest, while partitions leave
+ * such a transaction open rather than abort it (has_decision()). Ongoing
+ * transactions are not logged, partitions abort those when they come up.
+*/
+
+class TransactionCoordinator{
+    public:
+        // write a commit/abort marker of producer into topic-partition
+        using MarkerWriter = function<void(const string& topic, int partition, uint64_t producer_id, uint16_t epoch, bool commit)>;
+
+        // log_dir "" keeps the state in memory only
+        TransactionCoordinator(ConsumerGroupCoordinator& groups, MarkerWriter write_marker, function<uint64_t()> new_producer_id,
+                               const string& log_dir = "")
+            : groups_(groups), write_marker_(move(write_marker)), new_producer_id_(move(new_producer_id)),
+              log_(log_dir.empty() ? nullptr : make_unique<TransactionLog>(log_dir)){
+            if(!log_)   return;
+            size_t pending = 0;
+            for(const auto& [id, record] : log_->get_records()){
+                Transaction& txn = transactions_[id];
+                txn.identity = record.identity;
+                by_producer_[record.identity.producer_id] = id;
+                if(record.state == TransactionState::PrepareCommit || record.state == TransactionState::PrepareAbort){
+                    txn.state = record.state;
+                    txn.partitions = record.partitions;
+                    txn.offsets = record.offsets;
+                    pending++;
+                }
+            }
+            if(!transactions_.empty()){
+                cout<<"[TransactionCoordinator] Restored "<<transactions_.size()<<" transactional id(s), "<<pending
+                    <<" decision(s) to finish, from "<<log_->get_path()<<"\n";
+            }
+        }
+
+        // register (or re-register) a transactional id, returns the identity to produce with
+        ProducerIdentity init_producer(const string& transactional_id){
+            unique_lock<mutex> lock(mutex_);
+            auto it = transactions_.find(transactional_id);
+            if(it == transactions_.end()){
+                ProducerIdentity identity{new_producer_id_(), 0};
+                persist(transactional_id, identity, TransactionState::Empty, Transaction());
+                transactions_[transactional_id].identity = identity;
+                by_producer_[identity.producer_id] = transactional_id;
+                return identity;
+            }
+
+            Transaction& txn = it->second;
+            // a completion that threw part-way is finished with its decision before the epoch moves on
+            wait_for_completion(lock, txn);
+            if(txn.state == TransactionState::PrepareCommit || txn.state == TransactionState::PrepareAbort){
+                complete(lock, transactional_id, txn, txn.state == TransactionState::PrepareCommit);
+            }
+            ProducerIdentity next{txn.identity.producer_id, static_cast<uint16_t>(txn.identity.epoch + 1)};
+            if(txn.identity.epoch == UINT16_MAX){
+                next = {new_producer_id_(), 0};    // epochs ran out, start over under a new id
+            }
+            if(txn.state != TransactionState::Ongoing){
+                persist(transactional_id, next, TransactionState::Empty, txn);  // else the abort's record carries it
+            }
+            by_producer_.erase(txn.identity.producer_id);
+            by_producer_[next.producer_id] = transactional_id;
+            txn.identity = next;
+            if(txn.state == TransactionState::Ongoing){
+                // markers at the new epoch also fence the old instance's late writes
+                complete(lock, transactional_id, txn, false);
+            }
+            return txn.identity;
+        }
+
+        // the producer is about to write to topic-partition in its current transaction
+        void add_partition(const string& transactional_id, const ProducerIdentity& producer, const string& topic, int partition){
+            lock_guard<mutex> lock(mutex_);
+            Transaction& txn = active(transactional_id, producer);
+            txn.state = TransactionState::Ongoing;
+            txn.partitions.insert({topic, partition});
+        }
+
+        // commit a consumer group offset together with the transaction (same meaning as commit_offset)
+        void add_offset(const string& transactional_id, const ProducerIdentity& producer,
+                        const string& group_id, const string& topic, int partition, uint64_t offset){
+            lock_guard<mutex> lock(mutex_);
+            Transaction& txn = active(transactional_id, producer);
+            txn.state = TransactionState::Ongoing;
+            txn.offsets[group_id][{topic, partition}] = offset;
+        }
+
+        // Commit or abort the producer's transaction, returns once every marker is written
+        // if a marker write fails the call throws and can be repeated with the same decision
+        void end_transaction(const string& transactional_id, const ProducerIdentity& producer, bool commit){
+            unique_lock<mutex> lock(mutex_);
+            Transaction& txn = find(transactional_id, producer);
+            wait_for_completion(lock, txn);
+            if(txn.state == TransactionState::Empty)    return;    // nothing was written
+            if(txn.state != TransactionState::Ongoing &&
+               txn.state != (commit ? TransactionState::PrepareCommit : TransactionState::PrepareAbort)){
+                throw runtime_error("Transaction " + transactional_id + " is already being " + (commit ? "aborted" : "committed"));
+            }
+            complete(lock, transactional_id, txn, commit);
+        }
+
+        // Finish the decisions found in the log on startup, returns how many were finished
+        // one whose markers still fail stays pending for init_producer() or the next restart
+        size_t recover(){
+            unique_lock<mutex> lock(mutex_);
+            size_t finished = 0;
+            for(auto& [transactional_id, txn] : transactions_){
+                if(!prepared(txn) || txn.completing)   continue;
+                try{
+                    complete(lock, transactional_id, txn, txn.state == TransactionState::PrepareCommit);
+                    finished++;
+                }catch(const exception& e){
+                    cout<<"[TransactionCoordinator] Could not finish "<<transactional_id<<" yet: "<<e.what()<<"\n";
+                }
+            }
+            return finished;
+        }
+
+        // Throws unless producer_id at this epoch has an open transaction that registered topic-partition
+        // (add_partition()), the broker checks each transactional batch: no marker would ever end it otherwise
+        void check_partition(uint64_t producer_id, uint16_t epoch, const string& topic, int partition) const{
+            lock_guard<mutex> lock(mutex_);
+            auto it = by_producer_.find(producer_id);
+            if(it == by_producer_.end()){
+                throw runtime_error("Producer " + to_string(producer_id) + " has no transactional id");
+            }
+            const Transaction& txn = transactions_.at(it->second);
+            if(txn.identity.epoch != epoch){
+                throw runtime_error("Producer " + to_string(producer_id) + " epoch " + to_string(epoch) +
+                                    " of " + it->second + " is fenced by epoch " + to_string(txn.identity.epoch));
+            }
+            if(txn.state != TransactionState::Ongoing || !txn.partitions.count({topic, partition})){
+                throw runtime_error(topic + ":" + to_string(partition) + " was not added to the transaction of " + it->second);
+            }
+        }
+
+        // whether producer_id's transaction is decided and its markers still being written
+        // (partitions coming up leave it open, the coordinator ends it)
+        bool has_decision(uint64_t producer_id) const{
+            lock_guard<mutex> lock(mutex_);
+            auto it = by_producer_.find(producer_id);
+            return it != by_producer_.end() && prepared(transactions_.at(it->second));
+        }
+
+        TransactionState get_state(const string& transactional_id) const{
+            lock_guard<mutex> lock(mutex_);
+            auto it = transactions_.find(transactional_id);
+            return it == transactions_.end() ? TransactionState::Empty : it->second.state;
+        }
+
+        size_t get_transaction_count() const{
+            lock_guard<mutex> lock(mutex_);
+            return transactions_.size();
+        }
+
+    private:
+        struct Transaction{
+            ProducerIdentity identity{0, 0};
+            TransactionState state = TransactionState::Empty;
+            bool completing = false;    // markers are being written right now
+            set<pair<string, int>> partitions;
+            map<string, map<pair<string, int>, uint64_t>> offsets;     // {group_id: {(topic, partition): offset}}
+        };
+
+        ConsumerGroupCoordinator& groups_;
+        MarkerWriter write_marker_;
+        function<uint64_t()> new_producer_id_;
+        unique_ptr<TransactionLog> log_;            // null without a log dir
+        map<string, Transaction> transactions_;     // {transactional_id: transaction}
+        map<uint64_t, string> by_producer_;         // {producer_id: transactional_id}
+        mutable mutex mutex_;
+        condition_variable completed_;              // a completion finished or failed
+
+        Transaction& find(const string& transactional_id, const ProducerIdentity& producer){
+            auto it = transactions_.find(transactional_id);
+            if(it == transactions_.end()){
+                throw invalid_argument("Unknown transactional id " + transactional_id);
+            }
+            const ProducerIdentity& current = it->second.identity;
+            if(current.producer_id != producer.producer_id || current.epoch != producer.epoch){
+                throw runtime_error("Producer " + to_string(producer.producer_id) + " epoch " + to_string(producer.epoch) +
+                                    " of " + transactional_id + " is fenced by epoch " + to_string(current.epoch));
+            }
+            return it->second;
+        }
+
+        // a transaction that can still take partitions and offsets
+        Transaction& active(const string& transactional_id, const ProducerIdentity& producer){
+            Transaction& txn = find(transactional_id, producer);
+            check_not_completing(transactional_id, txn);
+            return txn;
+        }
+
+        static bool prepared(const Transaction& txn){
+            return txn.state == TransactionState::PrepareCommit || txn.state == TransactionState::PrepareAbort;
+        }
+
+        static void check_not_completing(const string& transactional_id, const Transaction& txn){
+            if(prepared(txn)){
+                throw runtime_error("Transaction " + transactional_id + " is still completing");
+            }
+        }
+
+        void wait_for_completion(unique_lock<mutex>& lock, Transaction& txn){
+            completed_.wait(lock, [&txn]{ return !txn.completing; });
+        }
+
+        // record an id's state in the log, durable on return; caller holds mutex_
+        void persist(const string& transactional_id, const ProducerIdentity& identity, TransactionState state,
+                     const Transaction& txn){
+            if(!log_)   return;
+            TransactionRecord record;
+            record.transactional_id = transactional_id;
+            record.identity = identity;
+            record.state = state;
+            if(state == TransactionState::PrepareCommit || state == TransactionState::PrepareAbort){
+                record.partitions = txn.partitions;
+                record.offsets = txn.offsets;
+            }
+            log_->append(record);
+        }
+
+        // the decision is logged first, then the markers are written without holding mutex_,
+        // the Prepare state keeps others off the transaction
+        // if a write throws the state stays Prepare*, so a retry writes them again with the same decision
+        void complete(unique_lock<mutex>& lock, const string& transactional_id, Transaction& txn, bool commit){
+            TransactionState decision = commit ? TransactionState::PrepareCommit : TransactionState::PrepareAbort;
+            if(txn.state != decision){
+                persist(transactional_id, txn.identity, decision, txn);     // throws: nothing was decided
+                txn.state = decision;
+            }
+            txn.completing = true;
+            ProducerIdentity identity = txn.identity;
+            auto partitions = txn.partitions;
+            lock.unlock();
+            try{
+                for(const auto& [topic, partition] : partitions){
+                    write_marker_(topic, partition, identity.producer_id, identity.epoch, commit);
+                }
+            }catch(...){
+                lock.lock();
+                txn.completing = false;
+                completed_.notify_all();
+                throw;
+            }
+            lock.lock();
+            txn.completing = false;
+            completed_.notify_all();
+
+            if(commit){
+                for(const auto& [group_id, offsets] : txn.offsets){
+                    for(const auto& [topic_partition, offset] : offsets){
+                        groups_.commit_offset(group_id, topic_partition.first, topic_partition.second, offset);
+                    }
+                }
+            }
+            cout<<"[TransactionCoordinator] "<<(commit ? "Committed " : "Aborted ")<<transactional_id
+                <<" across "<<partitions.size()<<" partition(s)\n";
+            txn.state = TransactionState::Empty;
+            txn.partitions.clear();
+            txn.offsets.clear();
+            try{
+                persist(transactional_id, txn.identity, TransactionState::Empty, txn);
+            }catch(const exception& e){
+                // the markers are out: a restart only writes them again, and a marker for a
+                // transaction the partition no longer has open changes nothing
+                cout<<"[TransactionCoordinator] Failed to log the end of "<<transactional_id<<": "<<e.what()<<"\n";
+            }
+        }
+};
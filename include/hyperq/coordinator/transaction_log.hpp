@@ -0,0 +1,283 @@
+#pragma once
+#include "hyperq/storage/crc32c.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+// Identity of a transactional producer, the epoch fences older instances of the same transactional id
+struct ProducerIdentity{
+    uint64_t producer_id;
+    uint16_t epoch;
+};
+
+enum class TransactionState { Empty, Ongoing, PrepareCommit, PrepareAbort };
+
+// A transactional id as the coordinator remembers it across restarts
+struct TransactionRecord{
+    string transactional_id;
+    ProducerIdentity identity{0, 0};
+    TransactionState state = TransactionState::Empty;
+    set<pair<string, int>> partitions;                          // the decision's partitions (Prepare* only)
+    map<string, map<pair<string, int>, uint64_t>> offsets;      // {group_id: {(topic, partition): offset}}
+};
+
+/*
+ * TransactionLog: the transaction coordinator's state, kept on disk
+ *   <log_dir>/__transactions.log   entries [size u32][crc u32][record]
+ * A record is a transactional id's state after a change: its producer id
+ * and epoch, and for PrepareCommit/PrepareAbort the partitions and offsets
+ * the decision covers. The coordinator appends it, fsynced, before acting on
+ * the change, so a decision is on disk before its first marker is written
+ * and a restarted coordinator can finish it.
+ * Loading keeps the last record of every id. Records are fsynced one at a
+ * time, so the log ends at the first record failing its checksum, a write
+ * that never returned. The loaded log, and one past COMPACT_AFTER records
+ * while running, is rewritten with one record per id (temp file, fsync,
+ * rename), the way TopicRegistry folds its log.
+ * Not thread-safe: the coordinator calls it under its mutex.
+*/
+
+class TransactionLog{
+    public:
+        static constexpr size_t COMPACT_AFTER = 1024;      // records appended before the log is rewritten
+
+        explicit TransactionLog(const string& dir)
+            : path_(dir + "/__transactions.log"), fd_(-1), size_(0), appended_(0){
+            mkdir(dir.c_str(), 0755);
+            ::unlink((path_ + ".tmp").c_str());     // a rewrite that was never renamed into place
+            size_t replayed = replay();
+            fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            if(fd_ < 0)     throw runtime_error("Failed to open "+path_+": "+strerror(errno));
+            if(replayed > 0 || size_ > 0)   compact();
+        }
+
+        ~TransactionLog(){
+            if(fd_ >= 0)    ::close(fd_);
+        }
+
+        TransactionLog(const TransactionLog&) = delete;
+        TransactionLog& operator=(const TransactionLog&) = delete;
+
+        // Record an id's new state, durable when this returns
+        void append(const TransactionRecord& record){
+            string entry = frame(encode(record));
+            write_fully(fd_, entry.data(), entry.size(), size_);
+            if(::fdatasync(fd_) != 0)   throw runtime_error("fsync failed on "+path_+": "+strerror(errno));
+            size_ += entry.size();
+            records_[record.transactional_id] = record;
+            if(++appended_ >= COMPACT_AFTER)    compact();
+        }
+
+        // last record of every id, by id
+        const map<string, TransactionRecord>& get_records() const{
+            return records_;
+        }
+
+        const string& get_path() const{
+            return path_;
+        }
+
+    private:
+        string path_;
+        int fd_;
+        uint64_t size_;         // bytes in the log, appends go here
+        size_t appended_;       // since the last rewrite
+        map<string, TransactionRecord> records_;
+
+        template <typename T>
+        static void put(string& out, T value){
+            out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        static void put_string(string& out, const string& value){
+            put<uint32_t>(out, value.size());
+            out.append(value);
+        }
+
+        template <typename T>
+        static bool get(const string& data, size_t& pos, T& value){
+            if(pos + sizeof(T) > data.size())   return false;
+            memcpy(&value, data.data() + pos, sizeof(T));
+            pos += sizeof(T);
+            return true;
+        }
+
+        static bool get_string(const string& data, size_t& pos, string& value){
+            uint32_t size = 0;
+            if(!get(data, pos, size) || size > data.size() - pos)     return false;
+            value.assign(data, pos, size);
+            pos += size;
+            return true;
+        }
+
+        static string encode(const TransactionRecord& record){
+            string out;
+            put_string(out, record.transactional_id);
+            put<uint64_t>(out, record.identity.producer_id);
+            put<uint16_t>(out, record.identity.epoch);
+            put<uint8_t>(out, static_cast<uint8_t>(record.state));
+            put<uint32_t>(out, record.partitions.size());
+            for(const auto& [topic, partition] : record.partitions){
+                put_string(out, topic);
+                put<int32_t>(out, partition);
+            }
+            put<uint32_t>(out, record.offsets.size());
+            for(const auto& [group_id, offsets] : record.offsets){
+                put_string(out, group_id);
+                put<uint32_t>(out, offsets.size());
+                for(const auto& [topic_partition, offset] : offsets){
+                    put_string(out, topic_partition.first);
+                    put<int32_t>(out, topic_partition.second);
+                    put<uint64_t>(out, offset);
+                }
+            }
+            return out;
+        }
+
+        // a record whose checksum matched but does not parse is a bug or foreign data: stop
+        TransactionRecord decode(const string& data) const{
+            TransactionRecord record;
+            size_t pos = 0;
+            uint8_t state = 0;
+            uint32_t partitions = 0;
+            uint32_t groups = 0;
+            bool ok = get_string(data, pos, record.transactional_id) && get(data, pos, record.identity.producer_id) &&
+                      get(data, pos, record.identity.epoch) && get(data, pos, state) &&
+                      state <= static_cast<uint8_t>(TransactionState::PrepareAbort) && get(data, pos, partitions);
+            for(uint32_t i = 0; ok && i < partitions; i++){
+                string topic;
+                int32_t partition = 0;
+                ok = get_string(data, pos, topic) && get(data, pos, partition);
+                record.partitions.insert({topic, partition});
+            }
+            ok = ok && get(data, pos, groups);
+            for(uint32_t g = 0; ok && g < groups; g++){
+                string group_id;
+                uint32_t count = 0;
+                ok = get_string(data, pos, group_id) && get(data, pos, count);
+                for(uint32_t i = 0; ok && i < count; i++){
+                    string topic;
+                    int32_t partition = 0;
+                    uint64_t offset = 0;
+                    ok = get_string(data, pos, topic) && get(data, pos, partition) && get(data, pos, offset);
+                    record.offsets[group_id][{topic, partition}] = offset;
+                }
+            }
+            if(!ok)     throw runtime_error("Corrupt transaction record in "+path_);
+            record.state = static_cast<TransactionState>(state);
+            return record;
+        }
+
+        static string frame(const string& entry){
+            string out;
+            put<uint32_t>(out, entry.size());
+            put<uint32_t>(out, Crc32c::compute(entry.data(), entry.size()));
+            out.append(entry);
+            return out;
+        }
+
+        // next framed entry at pos, false at the end of data or on a torn or corrupt entry
+        static bool unframe(const string& data, size_t& pos, string& entry){
+            uint32_t size = 0;
+            uint32_t crc = 0;
+            size_t start = pos + 2 * sizeof(uint32_t);
+            if(start > data.size())     return false;
+            memcpy(&size, data.data() + pos, sizeof(size));
+            memcpy(&crc, data.data() + pos + sizeof(size), sizeof(crc));
+            if(size > data.size() - start || Crc32c::compute(data.data() + start, size) != crc)  return false;
+            entry.assign(data, start, size);
+            pos = start + size;
+            return true;
+        }
+
+        // returns the records replayed, a torn tail is left for compact() to drop
+        size_t replay(){
+            int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd < 0){
+                if(errno == ENOENT)     return 0;
+                throw runtime_error("Failed to open "+path_+": "+strerror(errno));
+            }
+            string data;
+            char buffer[64 * 1024];
+            ssize_t n;
+            while((n = ::read(fd, buffer, sizeof(buffer))) != 0){
+                if(n < 0 && errno == EINTR)     continue;
+                if(n < 0){
+                    string error = strerror(errno);
+                    ::close(fd);
+                    throw runtime_error("Read failed on "+path_+": "+error);
+                }
+                data.append(buffer, n);
+            }
+            ::close(fd);
+
+            size_t pos = 0;
+            size_t replayed = 0;
+            string entry;
+            while(unframe(data, pos, entry)){
+                TransactionRecord record = decode(entry);
+                records_[record.transactional_id] = move(record);
+                replayed++;
+            }
+            if(pos < data.size()){
+                cout<<"[TransactionLog] Dropping "<<data.size() - pos<<" bytes after the last good record of "<<path_<<"\n";
+            }
+            size_ = data.size();
+            return replayed;
+        }
+
+        static void write_fully(int fd, const char* data, size_t len, uint64_t offset){
+            while(len > 0){
+                ssize_t n = ::pwrite(fd, data, len, offset);
+                if(n < 0){
+                    if(errno == EINTR)  continue;
+                    throw runtime_error(string("Write failed: ")+strerror(errno));
+                }
+                data += n;
+                len -= n;
+                offset += n;
+            }
+        }
+
+        // one record per id into a new log renamed over the old one
+        void compact(){
+            string data;
+            for(const auto& [id, record] : records_){
+                data.append(frame(encode(record)));
+            }
+            string tmp = path_ + ".tmp";
+            int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if(fd < 0)  throw runtime_error("Failed to create "+tmp+": "+strerror(errno));
+            try{
+                write_fully(fd, data.data(), data.size(), 0);
+                if(::fsync(fd) != 0)    throw runtime_error("fsync failed on "+tmp+": "+strerror(errno));
+            }catch(...){
+                ::close(fd);
+                throw;
+            }
+            if(::rename(tmp.c_str(), path_.c_str()) != 0){
+                ::close(fd);
+                throw runtime_error("Failed to rename "+tmp+": "+strerror(errno));
+            }
+            string dir = path_.substr(0, path_.rfind('/'));
+            int dir_fd = ::open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+            if(dir_fd >= 0){
+                ::fsync(dir_fd);
+                ::close(dir_fd);
+            }
+            ::close(fd_);
+            fd_ = fd;       // the renamed file is the log now
+            size_ = data.size();
+            appended_ = 0;
+        }
+};
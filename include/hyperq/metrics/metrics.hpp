@@ -0,0 +1,361 @@
+#pragma once
+#include "hyperq/common/config.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+/*
+ * Metrics: lock-free counters, gauges and latency histograms
+ * A metric is split into METRIC_SHARDS cache-line sized shards. A thread
+ * always writes the same shard (picked round-robin on first use), so recording
+ * is one relaxed atomic add with no sharing between cores. Readers sum shards.
+ * Labelled per-partition counters and gauges exist once per partition and see
+ * few writers each, so they are registered with MetricSharding::Single: one
+ * cache line instead of ~1KB of shards per series.
+ * Metrics live in the MetricsRegistry and are never freed, so hot paths look
+ * them up once and keep the reference.
+*/
+
+const size_t METRIC_SHARDS = 16;
+static_assert((METRIC_SHARDS & (METRIC_SHARDS - 1)) == 0, "METRIC_SHARDS must be a power of two");
+
+// Sharded for broker-wide hot metrics, Single (one atomic) for per-partition series
+enum class MetricSharding { Sharded, Single };
+
+inline size_t metric_shard_count(MetricSharding sharding) {
+    return sharding == MetricSharding::Sharded ? METRIC_SHARDS : 1;
+}
+
+using MetricLabels = vector<pair<string, string>>;
+
+// Shard of the calling thread, fixed for the thread's lifetime
+inline size_t metric_shard() {
+    static atomic<size_t> next_shard{0};
+    thread_local size_t shard = next_shard.fetch_add(1, memory_order_relaxed) % METRIC_SHARDS;
+    return shard;
+}
+
+inline uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class Counter {
+public:
+    explicit Counter(MetricSharding sharding = MetricSharding::Sharded)
+        : shards_(new Shard[metric_shard_count(sharding)]), mask_(metric_shard_count(sharding) - 1) {}
+
+    void add(uint64_t n = 1) {
+        shards_[metric_shard() & mask_].value.fetch_add(n, memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        uint64_t total = 0;
+        for (size_t s = 0; s <= mask_; s++) {
+            total += shards_[s].value.load(memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    struct alignas(CACHE_LINE_SIZE) Shard {
+        atomic<uint64_t> value{0};
+    };
+    unique_ptr<Shard[]> shards_;
+    size_t mask_;
+};
+
+// Gauge: a value that goes up and down (queue depth, open files)
+class Gauge {
+public:
+    explicit Gauge(MetricSharding sharding = MetricSharding::Sharded)
+        : shards_(new Shard[metric_shard_count(sharding)]), mask_(metric_shard_count(sharding) - 1) {}
+
+    void add(int64_t delta) {
+        shards_[metric_shard() & mask_].value.fetch_add(delta, memory_order_relaxed);
+    }
+
+    void sub(int64_t delta) {
+        add(-delta);
+    }
+
+    // sharded: not atomic against concurrent add(), use for gauges with a single writer
+    void set(int64_t value) {
+        if (mask_ == 0) {
+            shards_[0].value.store(value, memory_order_relaxed);
+            return;
+        }
+        add(value - this->value());
+    }
+
+    int64_t value() const {
+        int64_t total = 0;
+        for (size_t s = 0; s <= mask_; s++) {
+            total += shards_[s].value.load(memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    struct alignas(CACHE_LINE_SIZE) Shard {
+        atomic<int64_t> value{0};
+    };
+    unique_ptr<Shard[]> shards_;
+    size_t mask_;
+};
+
+// Merged view of a histogram at one point in time
+struct HistogramSnapshot {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    vector<uint64_t> buckets;
+
+    // value at percentile p (0-100), reported as the upper edge of its bucket
+    uint64_t percentile(double p) const;
+
+    double mean() const {
+        return count ? static_cast<double>(sum) / count : 0.0;
+    }
+};
+
+/*
+ * Histogram: HDR-style log-linear buckets
+ * Values below 2^SUB_BUCKET_BITS get exact buckets; above that every power of
+ * two is split into 2^SUB_BUCKET_BITS linear sub-buckets, so any recorded value
+ * is off by at most ~3%. Values of 2^40 and up (~18 min in ns) share the last bucket.
+*/
+
+class Histogram {
+public:
+    static constexpr int SUB_BUCKET_BITS = 5;
+    static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+    static constexpr int MAX_VALUE_BITS = 40;
+    static constexpr size_t BUCKETS = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    Histogram() : shards_(new Shard[METRIC_SHARDS]) {}
+
+    void record(uint64_t value) {
+        Shard& shard = shards_[metric_shard()];
+        shard.buckets[bucket_index(value)].fetch_add(1, memory_order_relaxed);
+        shard.count.fetch_add(1, memory_order_relaxed);
+        shard.sum.fetch_add(value, memory_order_relaxed);
+        uint64_t seen = shard.max.load(memory_order_relaxed);
+        while (value > seen && !shard.max.compare_exchange_weak(seen, value, memory_order_relaxed)) {
+        }
+    }
+
+    HistogramSnapshot snapshot() const {
+        HistogramSnapshot snap;
+        snap.buckets.assign(BUCKETS, 0);
+        for (size_t s = 0; s < METRIC_SHARDS; s++) {
+            const Shard& shard = shards_[s];
+            snap.count += shard.count.load(memory_order_relaxed);
+            snap.sum += shard.sum.load(memory_order_relaxed);
+            snap.max = max(snap.max, shard.max.load(memory_order_relaxed));
+            for (size_t b = 0; b < BUCKETS; b++) {
+                snap.buckets[b] += shard.buckets[b].load(memory_order_relaxed);
+            }
+        }
+        return snap;
+    }
+
+    static size_t bucket_index(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - SUB_BUCKET_BITS;
+        size_t index = (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+        return min(index, BUCKETS - 1);
+    }
+
+    // largest value that lands in bucket index
+    static uint64_t bucket_upper_bound(size_t index) {
+        if (index < SUB_BUCKETS) {
+            return index;
+        }
+        int shift = index / SUB_BUCKETS - 1;
+        uint64_t low = (SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+        return low + (uint64_t(1) << shift) - 1;
+    }
+
+private:
+    struct alignas(CACHE_LINE_SIZE) Shard {
+        atomic<uint64_t> count{0};
+        atomic<uint64_t> sum{0};
+        atomic<uint64_t> max{0};
+        array<atomic<uint64_t>, BUCKETS> buckets{};
+    };
+    unique_ptr<Shard[]> shards_;
+};
+
+inline uint64_t HistogramSnapshot::percentile(double p) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(p / 100.0 * count + 0.5);
+    rank = std::max<uint64_t>(1, min(rank, count));  // member max hides std::max
+    uint64_t seen = 0;
+    for (size_t b = 0; b < buckets.size(); b++) {
+        seen += buckets[b];
+        if (seen >= rank) {
+            return min(Histogram::bucket_upper_bound(b), max);
+        }
+    }
+    return max;
+}
+
+// Records the time from construction to destruction into a histogram (ns)
+class LatencyTimer {
+public:
+    explicit LatencyTimer(Histogram& histogram) : histogram_(histogram), start_ns_(now_ns()) {}
+    ~LatencyTimer() {
+        histogram_.record(now_ns() - start_ns_);
+    }
+
+private:
+    Histogram& histogram_;
+    uint64_t start_ns_;
+};
+
+struct MetricsSnapshot {
+    struct Value {
+        string name;
+        MetricLabels labels;
+        string help;
+        int64_t value;
+    };
+    struct Distribution {
+        string name;
+        MetricLabels labels;
+        string help;
+        HistogramSnapshot histogram;
+    };
+    vector<Value> counters;
+    vector<Value> gauges;
+    vector<Distribution> histograms;
+};
+
+/*
+ * MetricsRegistry: named, labelled metrics
+ * Registration takes a mutex, recording never does.
+*/
+
+class MetricsRegistry {
+public:
+    static MetricsRegistry& instance() {
+        static MetricsRegistry registry;
+        return registry;
+    }
+
+    // sharding applies when the series is created, later lookups get the existing metric
+    Counter& counter(const string& name, const MetricLabels& labels = {}, const string& help = "",
+                     MetricSharding sharding = MetricSharding::Sharded) {
+        return get_or_create(counters_, name, labels, help, sharding);
+    }
+
+    Gauge& gauge(const string& name, const MetricLabels& labels = {}, const string& help = "",
+                 MetricSharding sharding = MetricSharding::Sharded) {
+        return get_or_create(gauges_, name, labels, help, sharding);
+    }
+
+    Histogram& histogram(const string& name, const MetricLabels& labels = {}, const string& help = "") {
+        return get_or_create(histograms_, name, labels, help);
+    }
+
+    // Read every metric; only the registry map is locked, never the metrics
+    MetricsSnapshot snapshot() const {
+        MetricsSnapshot snap;
+        lock_guard<mutex> lock(mutex_);
+        for (const auto& [name, series] : counters_) {
+            for (const auto& [labels, metric] : series) {
+                snap.counters.push_back({name, labels, help_for(name), static_cast<int64_t>(metric->value())});
+            }
+        }
+        for (const auto& [name, series] : gauges_) {
+            for (const auto& [labels, metric] : series) {
+                snap.gauges.push_back({name, labels, help_for(name), metric->value()});
+            }
+        }
+        for (const auto& [name, series] : histograms_) {
+            for (const auto& [labels, metric] : series) {
+                snap.histograms.push_back({name, labels, help_for(name), metric->snapshot()});
+            }
+        }
+        return snap;
+    }
+
+    // Human readable dump, latencies as p50/p99/p999
+    void print(ostream& out = cout) const {
+        MetricsSnapshot snap = snapshot();
+        out << "\n========== METRICS ==========\n";
+        for (const auto& c : snap.counters) {
+            out << c.name << format_labels(c.labels) << " " << c.value << "\n";
+        }
+        for (const auto& g : snap.gauges) {
+            out << g.name << format_labels(g.labels) << " " << g.value << "\n";
+        }
+        for (const auto& h : snap.histograms) {
+            out << h.name << format_labels(h.labels)
+                << " count=" << h.histogram.count
+                << " mean=" << static_cast<uint64_t>(h.histogram.mean())
+                << " p50=" << h.histogram.percentile(50)
+                << " p99=" << h.histogram.percentile(99)
+                << " p999=" << h.histogram.percentile(99.9)
+                << " max=" << h.histogram.max << "\n";
+        }
+        out << "=============================\n\n";
+    }
+
+    static string format_labels(const MetricLabels& labels) {
+        if (labels.empty()) {
+            return "";
+        }
+        string out = "{";
+        for (size_t i = 0; i < labels.size(); i++) {
+            if (i > 0) out += ",";
+            out += labels[i].first + "=\"" + labels[i].second + "\"";
+        }
+        return out + "}";
+    }
+
+private:
+    template <typename T>
+    using Series = map<string, map<MetricLabels, unique_ptr<T>>>;
+
+    Series<Counter> counters_;
+    Series<Gauge> gauges_;
+    Series<Histogram> histograms_;
+    map<string, string> help_;
+    mutable mutex mutex_;
+
+    template <typename T, typename... Args>
+    T& get_or_create(Series<T>& series, const string& name, const MetricLabels& labels, const string& help,
+                     Args... args) {
+        lock_guard<mutex> lock(mutex_);
+        if (!help.empty()) {
+            help_[name] = help;
+        }
+        auto& metric = series[name][labels];
+        if (!metric) {
+            metric = make_unique<T>(args...);
+        }
+        return *metric;
+    }
+
+    string help_for(const string& name) const {
+        auto it = help_.find(name);
+        return it != help_.end() ? it->second : "";
+    }
+};
@@ -0,0 +1,251 @@
+#pragma once
+#include "hyperq/metrics/metrics.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+using namespace std;
+
+/*
+ * PrometheusExporter: embedded HTTP endpoint serving GET /metrics
+ * Scrapes are handled on the exporter's own thread and rendered from a
+ * MetricsRegistry snapshot, so they never touch the broker or log locks.
+ * Collectors can append derived series (e.g. consumer lag) to each snapshot;
+ * they run on the exporter thread and must stay off the hot-path locks too.
+*/
+
+class PrometheusExporter {
+public:
+    using Collector = function<void(MetricsSnapshot&)>;
+
+    // port 0 binds an ephemeral port, see get_port()
+    explicit PrometheusExporter(int port, const string& bind_address = "0.0.0.0")
+        : port_(port), bind_address_(bind_address), listen_fd_(-1), running_(false) {}
+
+    ~PrometheusExporter() {
+        stop();
+    }
+
+    PrometheusExporter(const PrometheusExporter&) = delete;
+    PrometheusExporter& operator=(const PrometheusExporter&) = delete;
+
+    void add_collector(Collector collector) {
+        lock_guard<mutex> lock(mutex_);
+        collectors_.push_back(move(collector));
+    }
+
+    void start() {
+        if (running_) {
+            return;
+        }
+        listen_fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) {
+            throw runtime_error(string("Failed to create metrics socket: ") + strerror(errno));
+        }
+        int reuse = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port_);
+        if (inet_pton(AF_INET, bind_address_.c_str(), &addr.sin_addr) != 1) {
+            ::close(listen_fd_);
+            throw invalid_argument("Invalid metrics bind address: " + bind_address_);
+        }
+        if (::bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            ::listen(listen_fd_, 16) != 0) {
+            string error = strerror(errno);
+            ::close(listen_fd_);
+            throw runtime_error("Failed to listen on metrics port " + to_string(port_) + ": " + error);
+        }
+
+        socklen_t len = sizeof(addr);
+        getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len);
+        port_ = ntohs(addr.sin_port);
+
+        running_ = true;
+        thread_ = thread([this]() { serve(); });
+        cout << "[PrometheusExporter] Serving /metrics on " << bind_address_ << ":" << port_ << "\n";
+    }
+
+    void stop() {
+        if (!running_) {
+            return;
+        }
+        running_ = false;
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        ::close(listen_fd_);
+        listen_fd_ = -1;
+    }
+
+    int get_port() const {
+        return port_;
+    }
+
+    // Registry snapshot plus collector output in the text exposition format
+    string render() const {
+        MetricsSnapshot snap = MetricsRegistry::instance().snapshot();
+        {
+            lock_guard<mutex> lock(mutex_);
+            for (const auto& collector : collectors_) {
+                collector(snap);
+            }
+        }
+        return render(snap);
+    }
+
+    static string render(const MetricsSnapshot& snap) {
+        string out;
+        string last_name;
+        auto header = [&](const string& name, const string& help, const char* type) {
+            if (name == last_name) {
+                return;
+            }
+            last_name = name;
+            if (!help.empty()) {
+                out += "# HELP " + name + " " + help + "\n";
+            }
+            out += "# TYPE " + name + " " + type + "\n";
+        };
+
+        for (const auto& c : snap.counters) {
+            header(c.name, c.help, "counter");
+            out += c.name + format_labels(c.labels) + " " + to_string(c.value) + "\n";
+        }
+        for (const auto& g : snap.gauges) {
+            header(g.name, g.help, "gauge");
+            out += g.name + format_labels(g.labels) + " " + to_string(g.value) + "\n";
+        }
+        for (const auto& h : snap.histograms) {
+            header(h.name, h.help, "histogram");
+            // one bucket per power of two: the last sub-bucket of each power ends exactly there
+            uint64_t cumulative = 0;
+            const auto& buckets = h.histogram.buckets;
+            for (size_t b = 0; b + 1 < buckets.size(); b++) {
+                cumulative += buckets[b];
+                if ((b + 1) % Histogram::SUB_BUCKETS == 0) {
+                    out += h.name + "_bucket" +
+                           format_labels(h.labels, "le", to_string(Histogram::bucket_upper_bound(b))) +
+                           " " + to_string(cumulative) + "\n";
+                }
+            }
+            out += h.name + "_bucket" + format_labels(h.labels, "le", "+Inf") + " " +
+                   to_string(h.histogram.count) + "\n";
+            out += h.name + "_sum" + format_labels(h.labels) + " " + to_string(h.histogram.sum) + "\n";
+            out += h.name + "_count" + format_labels(h.labels) + " " + to_string(h.histogram.count) + "\n";
+        }
+        return out;
+    }
+
+private:
+    int port_;
+    string bind_address_;
+    int listen_fd_;
+    atomic<bool> running_;
+    thread thread_;
+    vector<Collector> collectors_;
+    mutable mutex mutex_;
+
+    static string format_labels(const MetricLabels& labels, const string& extra_name = "", const string& extra_value = "") {
+        MetricLabels all = labels;
+        if (!extra_name.empty()) {
+            all.emplace_back(extra_name, extra_value);
+        }
+        if (all.empty()) {
+            return "";
+        }
+        string out = "{";
+        for (size_t i = 0; i < all.size(); i++) {
+            if (i > 0) out += ",";
+            out += all[i].first + "=\"" + escape_label(all[i].second) + "\"";
+        }
+        return out + "}";
+    }
+
+    static string escape_label(const string& value) {
+        string out;
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                out += '\\';
+                out += c;
+            } else if (c == '\n') {
+                out += "\\n";
+            } else {
+                out += c;
+            }
+        }
+        return out;
+    }
+
+    // accept loop, one connection at a time; polls so stop() is noticed quickly
+    void serve() {
+        while (running_) {
+            pollfd pfd{listen_fd_, POLLIN, 0};
+            if (::poll(&pfd, 1, 200) <= 0) {
+                continue;
+            }
+            int client = ::accept(listen_fd_, nullptr, nullptr);
+            if (client < 0) {
+                continue;
+            }
+            try {
+                handle(client);
+            } catch (const exception& e) {
+                cerr << "[PrometheusExporter] Scrape failed: " << e.what() << "\n";
+            }
+            ::close(client);
+        }
+    }
+
+    void handle(int client) {
+        // a scrape request is tiny, read until the end of the headers
+        string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == string::npos && request.size() < 8192) {
+            pollfd pfd{client, POLLIN, 0};
+            if (::poll(&pfd, 1, 1000) <= 0) {
+                return;     // slow or idle client
+            }
+            ssize_t n = ::recv(client, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                return;
+            }
+            request.append(buffer, n);
+        }
+
+        string status = "200 OK";
+        string body;
+        if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 13, "GET /metrics?") == 0) {
+            body = render();
+        } else {
+            status = "404 Not Found";
+            body = "Not Found\n";
+        }
+
+        string response = "HTTP/1.1 " + status + "\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: " + to_string(body.size()) + "\r\n"
+                          "Connection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t n = ::send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return;
+            }
+            sent += n;
+        }
+    }
+};
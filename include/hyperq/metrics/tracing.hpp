@@ -0,0 +1,250 @@
+#pragma once
+#include "hyperq/metrics/metrics.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+using namespace std;
+
+/*
+ * Request tracing: per-stage timestamps of sampled produce/fetch requests
+ * A trace lives in a thread_local slot while the request runs, so the
+ * client, broker, partition and segment can each stamp their stage without
+ * passing anything along. When the request finishes, the time between
+ * consecutive stages goes into hyperq_trace_stage_ns{op,stage} histograms,
+ * named after the stage that ends the interval:
+ *   produce: broker_receipt (client + serialization), lock_acquired (lock wait,
+ *            or queue wait behind a partition appender), log_write, fsync, ack
+ *   fetch:   broker_receipt, lock_acquired, log_read, response_built, delivered
+ * Unsampled requests pay one thread_local load per stage.
+*/
+
+enum class TraceOp : uint8_t { Produce = 0, Fetch = 1 };
+
+enum class TraceStage : uint8_t {
+    Enqueue = 0,        // client starts the request
+    BrokerReceipt,
+    LockAcquired,
+    LogWrite,           // produce: record batch written to the segment
+    FsyncDone,          // produce: segment flushed
+    LogRead,            // fetch: batches read from the log
+    ResponseBuilt,      // fetch: response serialized
+    Done                // produce: ack sent, fetch: delivered to the consumer
+};
+
+const size_t TRACE_STAGES = 8;
+
+struct RequestTrace {
+    TraceOp op = TraceOp::Produce;
+    array<uint64_t, TRACE_STAGES> at{};     // now_ns() per stage, 0 = not reached
+
+    uint64_t total_ns() const {
+        uint64_t first = 0, last = 0;
+        for (uint64_t t : at) {
+            if (t == 0) continue;
+            if (first == 0) first = t;
+            last = t;
+        }
+        return last - first;
+    }
+};
+
+class Tracer {
+public:
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    // trace one in every n requests, 0 turns tracing off
+    void set_sample_rate(uint32_t one_in_n) {
+        sample_rate_.store(one_in_n, memory_order_relaxed);
+    }
+
+    uint32_t get_sample_rate() const {
+        return sample_rate_.load(memory_order_relaxed);
+    }
+
+    bool should_sample() {
+        uint32_t rate = sample_rate_.load(memory_order_relaxed);
+        if (rate == 0) {
+            return false;
+        }
+        thread_local uint32_t counter = 0;
+        return ++counter % rate == 0;
+    }
+
+    // Aggregate a finished trace into the stage histograms
+    void record(const RequestTrace& trace) {
+        lock_guard<mutex> lock(mutex_);
+        size_t op = static_cast<size_t>(trace.op);
+        uint64_t prev = 0;
+        for (size_t s = 0; s < TRACE_STAGES; s++) {
+            if (trace.at[s] == 0) continue;
+            if (prev != 0) {
+                stage_histogram(op, s).record(trace.at[s] - prev);
+            }
+            prev = trace.at[s];
+        }
+        stage_histogram(op, TRACE_STAGES).record(trace.total_ns());
+
+        // keep the slowest traces for the dump
+        slowest_.push_back(trace);
+        sort(slowest_.begin(), slowest_.end(), [](const RequestTrace& a, const RequestTrace& b) {
+            return a.total_ns() > b.total_ns();
+        });
+        if (slowest_.size() > MAX_SLOW_TRACES) {
+            slowest_.pop_back();
+        }
+    }
+
+    vector<RequestTrace> get_slowest_traces() const {
+        lock_guard<mutex> lock(mutex_);
+        return slowest_;
+    }
+
+    void reset_slowest_traces() {
+        lock_guard<mutex> lock(mutex_);
+        slowest_.clear();
+    }
+
+    // Debug dump: stage percentiles per op, then the slowest traces stage by stage
+    void dump(ostream& out = cout) const {
+        lock_guard<mutex> lock(mutex_);
+        out << "\n========== TRACES (1 in " << get_sample_rate() << ") ==========\n";
+        for (size_t op = 0; op < 2; op++) {
+            for (size_t s = 1; s <= TRACE_STAGES; s++) {
+                if (!histograms_[op][s]) continue;
+                HistogramSnapshot snap = histograms_[op][s]->snapshot();
+                out << op_name(op) << " " << stage_name(op, s)
+                    << " count=" << snap.count
+                    << " p50=" << snap.percentile(50)
+                    << " p99=" << snap.percentile(99)
+                    << " p999=" << snap.percentile(99.9)
+                    << " max=" << snap.max << "\n";
+            }
+        }
+        for (const auto& trace : slowest_) {
+            size_t op = static_cast<size_t>(trace.op);
+            out << "slow " << op_name(op) << " total=" << trace.total_ns() << "ns:";
+            uint64_t prev = 0;
+            for (size_t s = 0; s < TRACE_STAGES; s++) {
+                if (trace.at[s] == 0) continue;
+                if (prev != 0) {
+                    out << " " << stage_name(op, s) << "=" << trace.at[s] - prev;
+                }
+                prev = trace.at[s];
+            }
+            out << "\n";
+        }
+        out << "=============================\n\n";
+    }
+
+    static string op_name(size_t op) {
+        return op == static_cast<size_t>(TraceOp::Produce) ? "produce" : "fetch";
+    }
+
+    // name of the interval ending at stage, TRACE_STAGES is the whole request
+    static string stage_name(size_t op, size_t stage) {
+        switch (stage) {
+            case static_cast<size_t>(TraceStage::Enqueue): return "enqueue";
+            case static_cast<size_t>(TraceStage::BrokerReceipt): return "broker_receipt";
+            case static_cast<size_t>(TraceStage::LockAcquired): return "lock_acquired";
+            case static_cast<size_t>(TraceStage::LogWrite): return "log_write";
+            case static_cast<size_t>(TraceStage::FsyncDone): return "fsync";
+            case static_cast<size_t>(TraceStage::LogRead): return "log_read";
+            case static_cast<size_t>(TraceStage::ResponseBuilt): return "response_built";
+            case static_cast<size_t>(TraceStage::Done):
+                return op == static_cast<size_t>(TraceOp::Produce) ? "ack" : "delivered";
+            default: return "total";
+        }
+    }
+
+private:
+    static constexpr size_t MAX_SLOW_TRACES = 16;
+
+    Tracer() : sample_rate_(0) {}
+
+    atomic<uint32_t> sample_rate_;
+    // [op][stage], index TRACE_STAGES holds the request total; created on first use
+    array<array<Histogram*, TRACE_STAGES + 1>, 2> histograms_{};
+    vector<RequestTrace> slowest_;
+    mutable mutex mutex_;
+
+    // caller holds mutex_
+    Histogram& stage_histogram(size_t op, size_t stage) {
+        Histogram*& histogram = histograms_[op][stage];
+        if (!histogram) {
+            histogram = &MetricsRegistry::instance().histogram(
+                "hyperq_trace_stage_ns", {{"op", op_name(op)}, {"stage", stage_name(op, stage)}},
+                "Time between consecutive stages of sampled requests in nanoseconds");
+        }
+        return *histogram;
+    }
+};
+
+/*
+ * TraceScope: marks a stage of the current request
+ * The outermost scope on a thread decides sampling and owns the trace, inner
+ * scopes (the broker under a client call) only stamp their stage. The owner
+ * stamps Done and hands the trace to the Tracer when it goes out of scope.
+*/
+
+class TraceScope {
+public:
+    TraceScope(TraceOp op, TraceStage stage) : owner_(false) {
+        if (active()) {
+            mark(stage);
+            return;
+        }
+        if (!Tracer::instance().should_sample()) {
+            return;
+        }
+        owner_ = true;
+        trace_.op = op;
+        active() = &trace_;
+        mark(stage);
+    }
+
+    ~TraceScope() {
+        if (!owner_) {
+            return;
+        }
+        mark(TraceStage::Done);
+        active() = nullptr;
+        Tracer::instance().record(trace_);
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    // stamp a stage of the request running on this thread, no-op when unsampled
+    static void mark(TraceStage stage) {
+        mark(active(), stage);
+    }
+
+    // stamp a request handed to another thread, trace comes from current()
+    static void mark(RequestTrace* trace, TraceStage stage) {
+        if (trace) {
+            trace->at[static_cast<size_t>(stage)] = now_ns();
+        }
+    }
+
+    // trace of the request running on this thread, null when unsampled
+    static RequestTrace* current() {
+        return active();
+    }
+
+private:
+    bool owner_;
+    RequestTrace trace_;
+
+    static RequestTrace*& active() {
+        thread_local RequestTrace* trace = nullptr;
+        return trace;
+    }
+};
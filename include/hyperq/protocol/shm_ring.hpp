@@ -0,0 +1,299 @@
+#pragma once
+#include "hyperq/common/config.hpp"
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+using namespace std;
+
+/*
+ * Shared-memory produce transport for clients on the broker's host
+ * A client connects to the broker's Unix socket (ShmHello) and is handed a
+ * memfd (ShmWelcome + SCM_RIGHTS) holding one ring of request slots, mapped
+ * by both processes:
+ *   [ShmRingHeader][slot 0][slot 1]...[slot n-1]
+ * The client writes a request (topic, key, serialized record batch) into the
+ * next free slot and marks it Request. The broker takes slots in ring order,
+ * appends the batch and writes the response into the same slot, marked
+ * Response, which the client reads before marking the slot Free again. A
+ * client may fill the whole ring before collecting anything, so the broker
+ * goes from one request to the next without a round trip.
+ * Slot states are the only synchronization. A side waiting on the other spins
+ * briefly, then sleeps on a futex word in the shared header; notify() only
+ * makes the wake syscall when someone is asleep.
+ * The memory is writable by the client at any time: the broker reads every
+ * field once, checks sizes against the slot and copies before using them.
+*/
+
+const uint32_t SHM_RING_MAGIC = 0x48515348;     // "HSQH"
+const uint32_t SHM_RING_VERSION = 1;
+const size_t SHM_CLIENT_ID_SIZE = 64;
+
+static_assert(atomic<uint32_t>::is_always_lock_free, "shared-memory slots need address-free atomics");
+
+enum class ShmSlotState : uint32_t {
+    Free = 0,
+    Request = 1,    // written by the client
+    Response = 2    // written by the broker
+};
+
+// Client's first and only message on the socket
+struct ShmHello {
+    uint32_t magic;
+    uint32_t version;
+    char client_id[SHM_CLIENT_ID_SIZE];     // NUL terminated, the client id for quotas
+};
+
+// Broker's answer, the memfd rides along as SCM_RIGHTS when accepted
+struct ShmWelcome {
+    uint32_t magic;
+    uint32_t version;
+    int32_t error;          // 0, or the errno the connection was refused with
+    uint32_t slot_count;
+    uint32_t slot_size;     // bytes of one slot, its ShmSlot header included
+    uint32_t reserved;
+    uint64_t region_size;
+};
+
+// One side's futex word and how many of its threads sleep on it
+struct alignas(CACHE_LINE_SIZE) ShmWaiter {
+    atomic<uint32_t> sequence;      // bumped by every notify()
+    atomic<uint32_t> sleepers;
+};
+
+struct ShmRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    ShmWaiter broker;       // the connection's broker thread waits here for requests
+    ShmWaiter client;       // client threads wait here for responses
+};
+
+struct alignas(CACHE_LINE_SIZE) ShmSlot {
+    atomic<uint32_t> state;
+    // request
+    int32_t partition;          // -1: the broker partitions by key
+    uint32_t topic_size;
+    uint32_t key_size;
+    uint32_t batch_size;        // a serialized record batch after the topic and key
+    // response
+    uint32_t success;
+    int32_t response_partition;
+    uint32_t throttle_time_ms;
+    uint64_t offset;
+    uint32_t message_size;      // error message, in place of the request data
+
+    char* data() {
+        return reinterpret_cast<char*>(this + 1);
+    }
+};
+
+/*
+ * ShmRing: one process's mapping of a ring
+ * The broker creates it (a sealed memfd: the client can't shrink the file
+ * under the broker's mapping), clients attach to the descriptor they were
+ * sent. Owns the mapping and the descriptor.
+ * The geometry (slot count and size) is kept in the object, set by create()
+ * or checked by attach(): the copy in the shared header is for the client's
+ * information only and never read back, a client rewriting it can't move the
+ * broker's slots.
+*/
+
+class ShmRing {
+public:
+    static constexpr int SPIN_ROUNDS = 1024;
+    static constexpr long WAIT_SLICE_NS = 100 * 1000 * 1000;   // sleepers recheck their peer this often
+
+    ShmRing() : fd_(-1), base_(nullptr), size_(0), slot_count_(0), slot_size_(0) {}
+
+    ShmRing(ShmRing&& other) noexcept
+        : fd_(other.fd_), base_(other.base_), size_(other.size_),
+          slot_count_(other.slot_count_), slot_size_(other.slot_size_) {
+        other.fd_ = -1;
+        other.base_ = nullptr;
+    }
+
+    ShmRing& operator=(ShmRing&& other) noexcept {
+        if (this != &other) {
+            release();
+            fd_ = exchange(other.fd_, -1);
+            base_ = exchange(other.base_, nullptr);
+            size_ = other.size_;
+            slot_count_ = other.slot_count_;
+            slot_size_ = other.slot_size_;
+        }
+        return *this;
+    }
+
+    ~ShmRing() {
+        release();
+    }
+
+    // Broker side: a fresh ring of slot_count slots of slot_size bytes
+    static ShmRing create(uint32_t slot_count, uint32_t slot_size) {
+        if (!valid_geometry(slot_count, slot_size)) {
+            throw invalid_argument("Shared-memory slots must be cache-line multiples larger than their header");
+        }
+        ShmRing ring;
+        ring.slot_count_ = slot_count;
+        ring.slot_size_ = slot_size;
+        ring.size_ = sizeof(ShmRingHeader) + static_cast<uint64_t>(slot_count) * slot_size;
+        ring.fd_ = static_cast<int>(syscall(SYS_memfd_create, "hyperq-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+        if (ring.fd_ < 0) {
+            throw runtime_error(string("memfd_create failed: ") + strerror(errno));
+        }
+        if (::ftruncate(ring.fd_, ring.size_) != 0 ||
+            ::fcntl(ring.fd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+            throw runtime_error(string("Failed to size shared-memory ring: ") + strerror(errno));
+        }
+        ring.map();
+
+        ShmRingHeader* header = new (ring.base_) ShmRingHeader{};
+        header->magic = SHM_RING_MAGIC;
+        header->version = SHM_RING_VERSION;
+        header->slot_count = slot_count;
+        header->slot_size = slot_size;
+        for (uint32_t i = 0; i < slot_count; i++) {
+            new (ring.base_ + sizeof(ShmRingHeader) + static_cast<uint64_t>(i) * slot_size) ShmSlot{};
+        }
+        return ring;
+    }
+
+    // Client side: map the descriptor the broker sent, taking ownership of it
+    static ShmRing attach(int fd, const ShmWelcome& welcome) {
+        ShmRing ring;
+        ring.fd_ = fd;
+        ring.size_ = welcome.region_size;
+        ring.slot_count_ = welcome.slot_count;
+        ring.slot_size_ = welcome.slot_size;
+        struct stat st;
+        if (!valid_geometry(welcome.slot_count, welcome.slot_size) ||
+            fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) != welcome.region_size ||
+            welcome.region_size != sizeof(ShmRingHeader) + static_cast<uint64_t>(welcome.slot_count) * welcome.slot_size) {
+            throw runtime_error("Shared-memory ring does not match the broker's description");
+        }
+        ring.map();
+        if (ring.header().magic != SHM_RING_MAGIC || ring.header().version != SHM_RING_VERSION ||
+            ring.header().slot_count != ring.slot_count_ || ring.header().slot_size != ring.slot_size_) {
+            throw runtime_error("Not a shared-memory ring of this version");
+        }
+        return ring;
+    }
+
+    ShmRingHeader& header() const {
+        return *reinterpret_cast<ShmRingHeader*>(base_);
+    }
+
+    // Slot of the sequence-th request, the ring wraps around
+    ShmSlot& slot(uint64_t sequence) const {
+        return *reinterpret_cast<ShmSlot*>(base_ + sizeof(ShmRingHeader) + (sequence % slot_count_) * slot_size_);
+    }
+
+    uint32_t slot_count() const {
+        return slot_count_;
+    }
+
+    // Bytes of request data (topic + key + batch) one slot holds
+    size_t data_capacity() const {
+        return slot_size_ - sizeof(ShmSlot);
+    }
+
+    int fd() const {
+        return fd_;
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+
+    // Wake the waiter's side after publishing a slot, a syscall only if it sleeps
+    static void notify(ShmWaiter& waiter) {
+        waiter.sequence.fetch_add(1);
+        if (waiter.sleepers.load() > 0) {
+            futex(waiter.sequence, FUTEX_WAKE, INT_MAX, nullptr);
+        }
+    }
+
+    // Spin, then sleep until ready() or a wait slice is over, returns ready()
+    template <typename Ready>
+    static bool wait(ShmWaiter& waiter, Ready ready) {
+        for (int i = 0; i < spin_rounds(); i++) {
+            if (ready()) {
+                return true;
+            }
+            cpu_relax();
+        }
+        // a notify() after the sequence is read makes the futex wait return at once
+        uint32_t seen = waiter.sequence.load();
+        waiter.sleepers.fetch_add(1);
+        if (!ready()) {
+            timespec timeout{0, WAIT_SLICE_NS};
+            futex(waiter.sequence, FUTEX_WAIT, seen, &timeout);
+        }
+        waiter.sleepers.fetch_sub(1);
+        return ready();
+    }
+
+private:
+    int fd_;
+    char* base_;
+    uint64_t size_;
+    uint32_t slot_count_;   // never re-read from the shared header
+    uint32_t slot_size_;
+
+    static bool valid_geometry(uint32_t slot_count, uint32_t slot_size) {
+        return slot_count > 0 && slot_size > sizeof(ShmSlot) && slot_size % CACHE_LINE_SIZE == 0;
+    }
+
+    void map() {
+        void* base = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (base == MAP_FAILED) {
+            throw runtime_error(string("Failed to map shared-memory ring: ") + strerror(errno));
+        }
+        base_ = static_cast<char*>(base);
+    }
+
+    void release() {
+        if (base_) {
+            ::munmap(base_, size_);
+            base_ = nullptr;
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    // shared (not FUTEX_PRIVATE_FLAG): the two sides are different processes
+    static void futex(atomic<uint32_t>& word, int op, uint32_t value, const timespec* timeout) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), op, value, timeout, nullptr, 0);
+    }
+
+    // on a single CPU the other side can't make progress while we spin
+    static int spin_rounds() {
+        static const int rounds = thread::hardware_concurrency() > 1 ? SPIN_ROUNDS : 0;
+        return rounds;
+    }
+
+    static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#else
+        this_thread::yield();
+#endif
+    }
+};
@@ -1,146 +1,746 @@
 #pragma once
 #include "hyperq/common/types.hpp"
-#include <fstream>
+#include "hyperq/storage/crc32c.hpp"
+#include "hyperq/storage/segment.hpp"
+#include <exception>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <stdexcept>
+#include <unordered_map>
 #include <vector>
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 using namespace std;
 
+// cleanup.policy of a topic
+// Delete: segments are kept until retention removes them
+// Compact: closed segments are rewritten keeping only the latest record per key
+enum class CleanupPolicy { Delete, Compact };
+
+struct LogConfig {
+    uint64_t segment_size = 1024 * 1024;    // roll the active segment past this size
+    CleanupPolicy cleanup_policy = CleanupPolicy::Delete;
+    bool remote_storage = false;            // upload closed segments to the remote tier
+    int64_t local_retention_ms = -1;        // drop uploaded segments locally after this age, -1 keeps them
+    bool preallocate = true;                // fallocate the active segment to segment_size
+    bool direct_io = false;                 // O_DIRECT appends, keeps write-once data out of the page cache
+    bool verify_checksums = false;          // check batch CRCs on every read, not only when recovering
+
+    // parse a cleanup.policy value ("delete" or "compact")
+    static CleanupPolicy parse_cleanup_policy(const string& value) {
+        if (value == "delete") return CleanupPolicy::Delete;
+        if (value == "compact") return CleanupPolicy::Compact;
+        throw invalid_argument("Unknown cleanup.policy: " + value);
+    }
+};
+
+// true for batches a reader must not see (read_committed skips aborted transactions)
+using BatchFilter = function<bool(const RecordBatchHeader&)>;
+
 // CommitLog is "append-only" persistant log
 // every messahe is written with fsync before ACK (0 data loss on pwr failure)
+// each partition is a directory of segments: <log_dir>/<topic>-<partition>/<base_offset>.log
+// next to them <offset>.snapshot holds the partition owner's state as of offset (see write_state_snapshot)
+// segment I/O goes through io (default: the process-wide io_uring or syscall backend)
+// segment descriptors come from FileCache, idle ones are closed past its capacity
+// a partition whose write or fsync failed goes offline: its tail on disk is unknown, so appends
+// are refused (no retry lands behind batches nobody recorded) until a restart recovers it
 class CommitLog{
     public:
-        explicit CommitLog(const string& log_dir):log_dir_(log_dir), current_offset_(0){
+        explicit CommitLog(const string& log_dir, const LogConfig& default_config = LogConfig(),
+                           shared_ptr<IoBackend> io = nullptr)
+            : log_dir_(log_dir), default_config_(default_config), current_offset_(0),
+              io_(io ? move(io) : IoBackend::default_backend()){
             mkdir(log_dir_.c_str(), 0755);
         }
-        // destructor
-        ~CommitLog(){
-            // for all log files in commit log
-            for(auto& [key, file] : log_files_){
-                // if file is open
-                if(file.is_open()){
-                    file.flush();
-                    file.close();
-                }
+        // segments close their own files
+        ~CommitLog() = default;
+
+        // set per-topic log config (cleanup.policy, segment size)
+        void set_topic_config(const string& topic, const LogConfig& config){
+            lock_guard<mutex> lock(mutex_);
+            topic_configs_[topic] = config;
+            for(auto& [key, log] : logs_){
+                if(log->topic == topic)  log->config = config;
             }
         }
 
+        LogConfig get_topic_config(const string& topic) const{
+            lock_guard<mutex> lock(mutex_);
+            return config_for(topic);
+        }
+
         // append message to log
-        uint64_t append(const string& topic, const string& message, int partition){
+        uint64_t append(const string& topic, int partition, const string& message, const string& key = ""){
             lock_guard<mutex> lock(mutex_);     // acquire lock
 
-            string key = get_partition_key(topic, partition);   // generate key for partition
-            fstream& file = get_or_create_file(key);    // get file partition
-            file.seekp(0,ios::end); // seek eof
+            PartitionLog* log = open_log(topic, partition, true);
+            if(log->config.cleanup_policy == CleanupPolicy::Compact && key.empty()){
+                throw invalid_argument("Topic " + topic + " is compacted, messages need a key");
+            }
 
-            uint64_t offset = offsets_[key];
-            file << offset << ":" << message << "\n";
-            file.flush();   // flush to file system buffer
-            fsync(fileno(file));    // force OS to write to disk (durability)
+            Message record;
+            record.offset = log->next_offset;
+            record.key = key;
+            record.value = message;
+            record.timestamp = 0;
+            record.partition = partition;
+            RecordBatch batch = RecordBatch::build(record.offset, {record});
+            return append_locked(*log, batch);
+        }
 
-            offests_[key]++;
-            current_offset_++;
+        // append a producer-built batch as-is (possibly compressed)
+        // the log only assigns the base offset, records keep their deltas
+        // returns the base offset
+        uint64_t append_batch(const string& topic, int partition, RecordBatch batch){
+            if(!batch.has_checksum())   batch.seal();   // before taking the lock
+            lock_guard<mutex> lock(mutex_);
 
-            return offset;
+            PartitionLog* log = open_log(topic, partition, true);
+            validate_locked(*log, batch);
+            return append_locked(*log, batch);
+        }
+
+        // group commit: write all batches, then fsync once
+        // a batch failing validation gets its exception in errors[i] and is skipped
+        // on_written runs after the writes, before the fsync
+        // written batches stay in place with their base offsets set, as stored
+        // a write or fsync error takes the partition offline and fails the whole group
+        // returns base offsets (meaningless where errors[i] is set)
+        vector<uint64_t> append_batches(const string& topic, int partition, vector<RecordBatch>& batches,
+                                        vector<exception_ptr>& errors, const function<void()>& on_written = nullptr){
+            lock_guard<mutex> lock(mutex_);
+
+            PartitionLog* log = open_log(topic, partition, true);
+            vector<uint64_t> offsets(batches.size(), 0);
+            errors.assign(batches.size(), nullptr);
+            vector<shared_ptr<Segment>> written;    // the group may roll a segment
+            for(size_t i = 0; i < batches.size(); i++){
+                try{
+                    validate_locked(*log, batches[i]);
+                }catch(const invalid_argument&){
+                    errors[i] = current_exception();
+                    continue;
+                }
+                offsets[i] = append_locked(*log, batches[i], false);
+                if(written.empty() || written.back() != active_segment(*log)){
+                    written.push_back(active_segment(*log));
+                }
+            }
+            if(on_written)  on_written();
+            try{
+                for(const auto& segment : written){
+                    segment->flush();
+                }
+            }catch(const exception& e){
+                take_offline(*log, e);
+                throw;
+            }
+            return offsets;
         }
 
         //read message from log starting at offset
         vector<Message> read(const string& topic, int partition, uint64_t start_offset, size_t max_count) const{
             lock_guard<mutex> lock(mutex_);
             vector<Message> messages;
-            string key = get_partition_key(topic, partition);
 
-            auto it = log_files_.find(key);
-            if(it == log_files_.end())  return messages;    // empty
+            PartitionLog* log = open_log(topic, partition, false);
+            if(!log || max_count == 0)  return messages;    // empty
 
-            ifstream infile(get_file_path(key));
-            if(!infile.is_open())   return messages;    // empty
+            // segment holding start_offset, or the first one after it (compaction may leave gaps)
+            auto it = log->segments.upper_bound(start_offset);
+            if(it != log->segments.begin())  --it;
 
-            string line;
-            uint64_t current_offset = 0;
-            size_t count=0;
-            while(getline(infile, line) && count < max_count){
-                size_t colon_pos = line.find(":");
-                if(colon_pos == string.npos)    continue;   // invlid line, skip
-                try{
-                    uint64_t msg_offset = stoull(line.substr(0, colon_pos));
-                    if(msg_offset < start_offset)   continue;
-
-                    string msg_value = line.substr(colon_pos + 1);
-
-                    // create message object
-                    Message msg;
-                    msg.offset = msg_offset;
-                    msg.value = msg_value;
-                    msg.partition = partition;
-                    msg.timestamp = 0;
-                    msg.key = "";
-                    messages.push_back(msg);
-                    count++;
-                }catch(const exception &e){ continue; }
-            }
-            infile.close();
+            for(; it != log->segments.end() && messages.size() < max_count; ++it){
+                it->second->for_each_batch(start_offset, [&](const RecordBatch& batch){
+                    check_batch(*log, batch);
+                    for(auto& msg : batch.records(partition)){
+                        if(msg.offset < start_offset)   continue;
+                        messages.push_back(move(msg));
+                        if(messages.size() >= max_count)    return false;
+                    }
+                    return true;
+                });
+            }
             return messages;
         }
 
+        // read into an arena batch (fetch path), appends at most max_count messages
+        // stops at the first batch starting at end_offset, batches matching skip are left out
+        // with a scan only records matching its filter count, see RecordScan
+        // returns how many were added
+        size_t read_into(const string& topic, int partition, uint64_t start_offset, size_t max_count, MessageBatch& out,
+                         uint64_t end_offset = UINT64_MAX, const BatchFilter& skip = nullptr, RecordScan* scan = nullptr) const{
+            lock_guard<mutex> lock(mutex_);
+
+            PartitionLog* log = open_log(topic, partition, false);
+            if(!log)    return 0;   // empty
+
+            auto it = log->segments.upper_bound(start_offset);
+            if(it != log->segments.begin())  --it;
+
+            size_t added = 0;
+            bool done = false;
+            for(; it != log->segments.end() && added < max_count && !done; ++it){
+                it->second->for_each_batch(start_offset, [&](const RecordBatch& batch){
+                    if(batch.header.base_offset >= end_offset){
+                        done = true;
+                        return false;
+                    }
+                    if(skip && skip(batch.header))  return true;
+                    check_batch(*log, batch);
+                    added += batch.decode_into(out, partition, start_offset, max_count - added, scan);
+                    done = scan && scan->done();
+                    return added < max_count && !done;
+                });
+            }
+            return added;
+        }
+
+        // visit headers of the batches starting at or after start_offset, in log order
+        // (rebuilding per-producer state from a state snapshot without reading the whole log)
+        void for_each_header_from(const string& topic, int partition, uint64_t start_offset,
+                                  const function<void(const RecordBatchHeader&)>& visit) const{
+            lock_guard<mutex> lock(mutex_);
+            PartitionLog* log = open_log(topic, partition, false);
+            if(!log)    return;
+
+            auto it = log->segments.upper_bound(start_offset);
+            if(it != log->segments.begin())  --it;
+            for(; it != log->segments.end(); ++it){
+                it->second->for_each_header([&](const RecordBatchHeader& header){
+                    if(header.base_offset >= start_offset)  visit(header);
+                });
+            }
+        }
+
+        // Save the partition's state as of offset (producers, transactions: the owner's bytes)
+        // in <offset>.snapshot next to the segments: written to a temp file, fsynced and renamed,
+        // then older snapshots are deleted. The file I/O runs without the log lock.
+        void write_state_snapshot(const string& topic, int partition, uint64_t offset, const string& state){
+            string dir;
+            {
+                lock_guard<mutex> lock(mutex_);
+                dir = open_log(topic, partition, true)->dir;
+            }
+            string data;
+            uint32_t magic = STATE_SNAPSHOT_MAGIC;
+            uint32_t crc = Crc32c::compute(state.data(), state.size());
+            data.append(reinterpret_cast<const char*>(&magic), sizeof(magic));
+            data.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+            data.append(state);
+
+            string path = dir + "/" + Segment::file_name(offset, ".snapshot");
+            string tmp = path + ".tmp";
+            int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if(fd < 0)  throw runtime_error("Failed to create " + tmp + ": " + strerror(errno));
+            bool written = ::write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()) && ::fdatasync(fd) == 0;
+            ::close(fd);
+            if(!written || ::rename(tmp.c_str(), path.c_str()) != 0){
+                ::unlink(tmp.c_str());
+                throw runtime_error("Failed to write " + path + ": " + strerror(errno));
+            }
+            int dir_fd = ::open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+            if(dir_fd >= 0){
+                ::fsync(dir_fd);
+                ::close(dir_fd);
+            }
+
+            lock_guard<mutex> lock(mutex_);
+            PartitionLog* log = open_log(topic, partition, true);
+            log->snapshots.insert(offset);
+            for(auto it = log->snapshots.begin(); *it < offset;){
+                ::unlink((log->dir + "/" + Segment::file_name(*it, ".snapshot")).c_str());
+                it = log->snapshots.erase(it);
+            }
+        }
+
+        // newest state snapshot not past the log end, false when there is none (or it is corrupt):
+        // the owner then rebuilds its state from the whole log
+        bool read_state_snapshot(const string& topic, int partition, uint64_t& offset, string& state) const{
+            lock_guard<mutex> lock(mutex_);
+            PartitionLog* log = open_log(topic, partition, false);
+            if(!log)    return false;
+            for(auto it = log->snapshots.rbegin(); it != log->snapshots.rend(); ++it){
+                if(*it > log->next_offset)  continue;   // the log lost its tail in a crash
+                string path = log->dir + "/" + Segment::file_name(*it, ".snapshot");
+                string data;
+                if(!read_small_file(path, data) || data.size() < 2 * sizeof(uint32_t))  break;
+                uint32_t magic, crc;
+                memcpy(&magic, data.data(), sizeof(magic));
+                memcpy(&crc, data.data() + sizeof(magic), sizeof(crc));
+                size_t header = 2 * sizeof(uint32_t);
+                if(magic != STATE_SNAPSHOT_MAGIC || Crc32c::compute(data.data() + header, data.size() - header) != crc){
+                    cout << "[CommitLog] Ignoring corrupt state snapshot " << path << "\n";
+                    break;
+                }
+                offset = *it;
+                state = data.substr(header);
+                return true;
+            }
+            return false;
+        }
+
+        // base offset of the segment being written
+        uint64_t get_active_base_offset(const string& topic, int partition) const{
+            lock_guard<mutex> lock(mutex_);
+            PartitionLog* log = open_log(topic, partition, false);
+            return log ? prev(log->segments.end())->first : 0;
+        }
+
+        // read stored batches as-is starting at the batch holding start_offset
+        // stops once max_bytes is reached, but always returns at least one batch
+        // end_offset and skip work as in read_into
+        vector<RecordBatch> read_batches(const string& topic, int partition, uint64_t start_offset, size_t max_bytes,
+                                         uint64_t end_offset = UINT64_MAX, const BatchFilter& skip = nullptr) const{
+            lock_guard<mutex> lock(mutex_);
+            vector<RecordBatch> batches;
+
+            PartitionLog* log = open_log(topic, partition, false);
+            if(!log)    return batches;     // empty
+
+            auto it = log->segments.upper_bound(start_offset);
+            if(it != log->segments.begin())  --it;
+
+            size_t bytes = 0;
+            bool full = false;
+            for(; it != log->segments.end() && !full; ++it){
+                it->second->for_each_batch(start_offset, [&](const RecordBatch& batch){
+                    if(batch.header.base_offset >= end_offset){
+                        full = true;
+                        return false;
+                    }
+                    if(skip && skip(batch.header))  return true;
+                    if(!batches.empty() && bytes + batch.size_bytes() > max_bytes){
+                        full = true;
+                        return false;
+                    }
+                    check_batch(*log, batch);
+                    bytes += batch.size_bytes();
+                    batches.push_back(batch);
+                    full = bytes >= max_bytes;
+                    return !full;
+                });
+            }
+            return batches;
+        }
+
+        // first record with a timestamp at or after timestamp, false when every record is older
+        // segments are tried oldest first, each skipped on its max timestamp or searched through its time index
+        bool offset_for_time(const string& topic, int partition, uint64_t timestamp, TimestampOffset& found) const{
+            lock_guard<mutex> lock(mutex_);
+            PartitionLog* log = open_log(topic, partition, false);
+            if(!log)    return false;
+            for(const auto& [base, segment] : log->segments){
+                if(segment->find_time(timestamp, found))  return true;
+            }
+            return false;
+        }
+
         // return highest offset written in the partition
         uint64_t get_last_offset(const string& topic, int partition) const{
             lock_guard<mutex> lock(mutex_);
-            key = get_partition_key(topic, partition);
-            auto it = offsets_.find(key);
-            if(it == offsets_.end())    return 0;   // no messages yet
-            uint64_t last = it->second;
-            return (last > 0) ? (last-1) : 0;
+            PartitionLog* log = open_log(topic, partition, false);
+            if(!log)    return 0;   // no messages yet
+            return (log->next_offset > 0) ? (log->next_offset - 1) : 0;
         }
 
-        // get total size of log file for monitoring disk usage
-        size_t get_log_size(const string& topic, innt partition) const{
+        // get total size of log segments for monitoring disk usage
+        size_t get_log_size(const string& topic, int partition) const{
             lock_guard<mutex> lock(mutex_);
-            string key = get_partition_key(topic, partition);
-            string file_path = get_file_path(key);
-            struct stat buffer;
-            if(stat(file_path.c_str(), &buffer) == 0)   return buffer.st_size;
-            return 0;   // file doesnt exist;
+            PartitionLog* log = open_log(topic, partition, false);
+            if(!log)    return 0;   // partition doesnt exist
+            size_t total = 0;
+            for(const auto& [base, segment] : log->segments){
+                total += segment->size();
+            }
+            return total;
+        }
+
+        size_t get_segment_count(const string& topic, int partition) const{
+            lock_guard<mutex> lock(mutex_);
+            PartitionLog* log = open_log(topic, partition, false);
+            return log ? log->segments.size() : 0;
         }
 
         size_t get_current_offset() const{
             lock_guard<mutex> lock(mutex_);
             return current_offset_;
         }
-        
+
+        const IoBackend& get_io_backend() const{
+            return *io_;
+        }
+
         size_t get_partition_count() const{
             lock_guard<mutex> lock(mutex_);
-            return offsets_.size();
+            return logs_.size();
+        }
+
+        // open partitions whose topic uses cleanup.policy=compact
+        vector<pair<string, int>> get_compacted_partitions() const{
+            lock_guard<mutex> lock(mutex_);
+            vector<pair<string, int>> result;
+            for(const auto& [key, log] : logs_){
+                if(log->config.cleanup_policy == CleanupPolicy::Compact){
+                    result.emplace_back(log->topic, log->partition);
+                }
+            }
+            return result;
+        }
+
+        // open partitions whose topic has remote storage enabled
+        vector<pair<string, int>> get_tiered_partitions() const{
+            lock_guard<mutex> lock(mutex_);
+            vector<pair<string, int>> result;
+            for(const auto& [key, log] : logs_){
+                if(log->config.remote_storage){
+                    result.emplace_back(log->topic, log->partition);
+                }
+            }
+            return result;
+        }
+
+        // all segments except the active one, oldest first
+        vector<shared_ptr<Segment>> get_closed_segments(const string& topic, int partition) const{
+            lock_guard<mutex> lock(mutex_);
+            vector<shared_ptr<Segment>> closed;
+            PartitionLog* log = open_log(topic, partition, false);
+            if(!log)    return closed;
+            for(auto it = log->segments.begin(); it != prev(log->segments.end()); ++it){
+                closed.push_back(it->second);
+            }
+            return closed;
+        }
+
+        // delete a closed segment from local disk (after it was uploaded)
+        bool remove_segment(const string& topic, int partition, uint64_t base_offset){
+            lock_guard<mutex> lock(mutex_);
+            PartitionLog* log = open_log(topic, partition, false);
+            if(!log)    return false;
+            auto it = log->segments.find(base_offset);
+            if(it == log->segments.end() || next(it) == log->segments.end()){
+                return false;   // unknown or active segment
+            }
+            it->second->remove();
+            log->segments.erase(it);
+            publish_stats(*log);
+            return true;
+        }
+
+        // forget an open partition, e.g. it moved to another log directory (files are left alone)
+        void close_partition(const string& topic, int partition){
+            lock_guard<mutex> lock(mutex_);
+            logs_.erase(get_partition_key(topic, partition));
+        }
+
+        // first offset still on local disk
+        uint64_t get_log_start_offset(const string& topic, int partition) const{
+            lock_guard<mutex> lock(mutex_);
+            PartitionLog* log = open_log(topic, partition, false);
+            if(!log)    return 0;
+            return log->segments.begin()->second->base_offset();
+        }
+
+        // Rewrite the closed segments of a compacted partition keeping only the
+        // latest record per key. The active segment is never touched.
+        // The heavy reading/writing happens without the log lock, on_io is called
+        // with every chunk of bytes moved so the caller can throttle.
+        // returns bytes reclaimed
+        uint64_t compact(const string& topic, int partition, const function<void(size_t)>& on_io = nullptr){
+            vector<shared_ptr<Segment>> closed;
+            uint64_t active_base = 0;
+            {
+                lock_guard<mutex> lock(mutex_);
+                PartitionLog* log = open_log(topic, partition, false);
+                if(!log || log->config.cleanup_policy != CleanupPolicy::Compact)    return 0;
+
+                active_base = active_segment(*log)->base_offset();
+                if(active_base == log->cleaned_through) return 0;   // nothing rolled since last pass
+                for(const auto& [base, segment] : log->segments){
+                    if(base != active_base) closed.push_back(segment);
+                }
+            }
+
+            auto account = [&](size_t bytes){
+                if(on_io)   on_io(bytes);
+            };
+
+            // pass 1: latest offset of every key in the closed segments
+            // transactional batches and their markers are kept as written, so whether they
+            // committed never has to be known here and they don't shadow other records
+            unordered_map<string, uint64_t> offset_map;
+            for(const auto& segment : closed){
+                segment->for_each_batch(0, [&](const RecordBatch& batch){
+                    account(batch.size_bytes());
+                    if(batch.is_transactional())    return true;
+                    for(const auto& msg : batch.records(partition)){
+                        offset_map[msg.key] = msg.offset;
+                    }
+                    return true;
+                });
+            }
+
+            // pass 2: copy surviving records into <base>.cleaned
+            vector<shared_ptr<Segment>> cleaned;
+            for(const auto& segment : closed){
+                ::unlink((segment->dir() + "/" + Segment::file_name(segment->base_offset(), ".cleaned")).c_str());
+                auto copy = make_shared<Segment>(segment->dir(), segment->base_offset(), ".cleaned", io_);
+                segment->for_each_batch(0, [&](const RecordBatch& batch){
+                    account(batch.size_bytes());
+                    if(batch.is_transactional()){
+                        copy->append(batch, false);
+                        account(batch.size_bytes());
+                        return true;
+                    }
+                    vector<Message> kept;
+                    for(auto& msg : batch.records(partition)){
+                        if(offset_map[msg.key] == msg.offset)   kept.push_back(move(msg));
+                    }
+                    if(!kept.empty()){
+                        RecordBatch rewritten = RecordBatch::build(batch.header.base_offset, kept);
+                        rewritten.compress(batch.codec());
+                        if(batch.has_producer()){
+                            // keep the last sequence, the producer's next one follows it
+                            int32_t dropped = static_cast<int32_t>(batch.header.record_count - kept.size());
+                            rewritten.set_producer(batch.header.producer_id, batch.header.producer_epoch,
+                                                   batch.header.base_sequence + dropped);
+                        }
+                        rewritten.seal();
+                        copy->append(rewritten, false);
+                        account(rewritten.size_bytes());
+                    }
+                    return true;
+                });
+                copy->flush();
+                cleaned.push_back(copy);
+            }
+
+            // swap the cleaned copies in
+            uint64_t reclaimed = 0;
+            lock_guard<mutex> lock(mutex_);
+            PartitionLog* log = logs_.count(get_partition_key(topic, partition)) ? open_log(topic, partition, false) : nullptr;
+            if(!log){
+                for(const auto& copy : cleaned)  copy->remove();   // partition closed meanwhile
+                return 0;
+            }
+            for(size_t i = 0; i < closed.size(); i++){
+                auto it = log->segments.find(closed[i]->base_offset());
+                if(it == log->segments.end() || it->second != closed[i]){
+                    cleaned[i]->remove();   // segment went away meanwhile
+                    continue;
+                }
+                if(cleaned[i]->size() < closed[i]->size())  reclaimed += closed[i]->size() - cleaned[i]->size();   // a rewrite can come out larger
+                if(cleaned[i]->empty()){
+                    cleaned[i]->remove();
+                    closed[i]->remove();
+                    log->segments.erase(it);
+                }else{
+                    closed[i]->replace_with(*cleaned[i]);   // readers still holding closed[i] keep the old file
+                    it->second = cleaned[i];
+                }
+            }
+            log->cleaned_through = active_base;
+            publish_stats(*log);
+            return reclaimed;
         }
 
     private:
+        struct PartitionLog{
+            string topic;
+            int partition;
+            string dir;
+            LogConfig config;
+            map<uint64_t, shared_ptr<Segment>> segments;     // {base_offset: segment}, last one is active
+            uint64_t next_offset = 0;
+            uint64_t cleaned_through = 0;   // active base offset at the last compaction
+            set<uint64_t> snapshots;        // offsets of the state snapshots on disk
+            string offline;                 // the I/O error that took it offline, empty while appends are allowed
+            Gauge* log_end_offset = nullptr;    // published for the metrics exporter
+            Gauge* size_bytes = nullptr;
+        };
+
+        static constexpr uint32_t STATE_SNAPSHOT_MAGIC = 0x48515053;   // "HQPS"
+
         string log_dir_;
-        map<string, fstream> log_files_;
-        map<string, uint64_t> offsets_;
+        LogConfig default_config_;
+        map<string, LogConfig> topic_configs_;
+        // opened lazily, readers may open partitions that exist on disk only
+        mutable map<string, unique_ptr<PartitionLog>> logs_;
         mutable mutex mutex_;
         uint64_t current_offset_;
+        shared_ptr<IoBackend> io_;
 
         static string get_partition_key(const string& topic, int partition){
-            return topic+":"+to_string(partition);
+            return topic+"-"+to_string(partition);
+        }
+
+        LogConfig config_for(const string& topic) const{
+            auto it = topic_configs_.find(topic);
+            return it != topic_configs_.end() ? it->second : default_config_;
         }
 
-        string get_file_path(const string& key){
-            return log_dir_ + "/" + key + ".log";
+        static shared_ptr<Segment>& active_segment(PartitionLog& log){
+            return prev(log.segments.end())->second;
         }
 
-        fstream& get_or_create_file(const string& key){
-            if(log_files_.find(key)!=log_files_.end())  return log_files_[key]; // if already open return
-            //otw create file
-            string file_path = get_file_path(key);
-            fstream& file = log_files_[key];
-            file.opne(file_path, ios::in | ios::out | ios::app);
-            if(!file.is_open()){
-                file.open(file_path, ios::in | ios::out | ios::app | ios::ate);
+        // find partition log, loading its segments from disk on first use
+        PartitionLog* open_log(const string& topic, int partition, bool create) const{
+            string key = get_partition_key(topic, partition);
+            auto it = logs_.find(key);
+            if(it != logs_.end())   return it->second.get();    // if already open return
+
+            string dir = log_dir_ + "/" + key;
+            struct stat st;
+            if(stat(dir.c_str(), &st) != 0){
+                if(!create) return nullptr;
+                if(mkdir(dir.c_str(), 0755) != 0){
+                    throw runtime_error("Failed to create partition dir: " + dir);
+                }
+            }
+
+            auto log = make_unique<PartitionLog>();
+            log->topic = topic;
+            log->partition = partition;
+            log->dir = dir;
+            log->config = config_for(topic);
+
+            DIR* handle = opendir(dir.c_str());
+            if(!handle) throw runtime_error("Failed to open partition dir: " + dir);
+            set<uint64_t> bases;
+            while(struct dirent* entry = readdir(handle)){
+                string name = entry->d_name;
+                uint64_t base_offset;
+                if(Segment::parse_file_name(name, base_offset)){
+                    bases.insert(base_offset);
+                }else if(Segment::parse_file_name(name, base_offset, ".snapshot")){
+                    log->snapshots.insert(base_offset);
+                }else if(ends_with(name, ".cleaned") || ends_with(name, ".snapshot.tmp")){
+                    ::unlink((dir + "/" + name).c_str());   // interrupted compaction or snapshot
+                }
+            }
+            closedir(handle);
+            // rolled segments were fsynced whole, only the active one can hold a garbled write
+            for(uint64_t base_offset : bases){
+                bool active = base_offset == *bases.rbegin();
+                log->segments[base_offset] = make_shared<Segment>(dir, base_offset, ".log", io_, active);
+            }
+
+            if(log->segments.empty()){
+                log->segments[0] = make_shared<Segment>(dir, 0, ".log", io_);
+            }
+            for(auto& [base, segment] : log->segments){
+                if(segment != active_segment(*log))  segment->trim();    // crashed before the roll finished
             }
-            if(offsets_.find(key) == offsets_.end())    offsets_[key] = 0;
+            prepare_active(*log);
+            log->next_offset = active_segment(*log)->next_offset();
+
+            MetricLabels labels = {{"topic", topic}, {"partition", to_string(partition)}};
+            log->log_end_offset = &MetricsRegistry::instance().gauge(
+                "hyperq_partition_log_end_offset", labels, "Next offset to be written", MetricSharding::Single);
+            log->size_bytes = &MetricsRegistry::instance().gauge(
+                "hyperq_partition_log_size_bytes", labels, "Bytes in local segments", MetricSharding::Single);
+            publish_stats(*log);
+
+            PartitionLog* result = log.get();
+            logs_[key] = move(log);
+            return result;
+        }
+
+        static bool ends_with(const string& name, const string& suffix){
+            return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+        }
+
+        static bool read_small_file(const string& path, string& data){
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd < 0)  return false;
+            char buffer[64 * 1024];
+            ssize_t n;
+            while((n = ::read(fd, buffer, sizeof(buffer))) > 0)  data.append(buffer, n);
+            ::close(fd);
+            return n == 0;
+        }
+
+        // reject batches the partition can't take (empty, keyless on a compacted topic)
+        static void validate_locked(const PartitionLog& log, const RecordBatch& batch){
+            if(batch.header.record_count == 0){
+                throw invalid_argument("Cannot append an empty record batch");
+            }
+            if(log.config.cleanup_policy == CleanupPolicy::Compact){
+                for(const auto& msg : batch.records(log.partition)){
+                    if(msg.key.empty()){
+                        throw invalid_argument("Topic " + log.topic + " is compacted, messages need a key");
+                    }
+                }
+            }
+        }
+
+        // with verify_checksums a read fails on a corrupt batch instead of serving it
+        static void check_batch(const PartitionLog& log, const RecordBatch& batch){
+            if(log.config.verify_checksums && !batch.verify_checksum()){
+                Segment::checksum_failures().add();
+                throw runtime_error("Checksum mismatch in " + log.topic + "-" + to_string(log.partition) +
+                                    " batch at offset " + to_string(batch.header.base_offset));
+            }
+        }
+
+        // written and fsynced by the segment before we ACK, unless the caller syncs the group
+        // assigns the batch its base offset, seals it if nobody did (partitions do that off the lock)
+        uint64_t append_locked(PartitionLog& log, RecordBatch& batch, bool sync = true){
+            if(!batch.has_checksum())   batch.seal();
+            if(!log.offline.empty()){
+                throw runtime_error("Log "+get_partition_key(log.topic, log.partition)+" is offline after an I/O error: "+log.offline);
+            }
+            try{
+                maybe_roll(log);
+                batch.header.base_offset = log.next_offset;
+                active_segment(log)->append(batch, sync);
+            }catch(const exception& e){
+                take_offline(log, e);
+                throw;
+            }
+
+            log.next_offset = batch.last_offset() + 1;
+            current_offset_ += batch.header.record_count;
+            log.log_end_offset->set(log.next_offset);
+            log.size_bytes->add(batch.size_bytes());
+            return batch.header.base_offset;
+        }
+
+        // a failed write may have left part of a batch behind, a failed fsync may have lost earlier ones:
+        // the owner never recorded them, so taking more appends would put retries after them
+        static void take_offline(PartitionLog& log, const exception& e){
+            if(!log.offline.empty())    return;
+            log.offline = e.what();
+            cout << "[CommitLog] " << get_partition_key(log.topic, log.partition) << " offline after an I/O error: " << e.what() << "\n";
+        }
+
+        // mirror end offset and size into gauges so scrapes never need mutex_
+        static void publish_stats(PartitionLog& log){
+            uint64_t total = 0;
+            for(const auto& [base, segment] : log.segments){
+                total += segment->size();
+            }
+            log.log_end_offset->set(log.next_offset);
+            log.size_bytes->set(total);
+        }
+
+        // start a new segment once the active one is full
+        void maybe_roll(PartitionLog& log){
+            if(active_segment(log)->size() < log.config.segment_size)   return;
+            active_segment(log)->trim();
+            log.segments[log.next_offset] = make_shared<Segment>(log.dir, log.next_offset, ".log", io_);
+            prepare_active(log);
+        }
 
-            return file;
+        static void prepare_active(PartitionLog& log){
+            auto& segment = active_segment(log);
+            if(log.config.preallocate)  segment->preallocate(log.config.segment_size);
+            if(log.config.direct_io)    segment->enable_direct_io();
         }
-};
\ No newline at end of file
+};
@@ -0,0 +1,157 @@
+#pragma once
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#ifdef HYPERQ_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HYPERQ_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HYPERQ_HAVE_ZSTD
+#include <zstd.h>
+#endif
+using namespace std;
+
+/*
+ * Batch compression codecs
+ * The codec id is stored in the batch header attributes, so the broker can
+ * store and serve compressed batches without looking inside them.
+ * Codecs are compiled in when CMake finds the library (HYPERQ_HAVE_*).
+*/
+
+enum class CompressionCodec : uint8_t {
+    None = 0,
+    Zlib = 1,
+    Lz4 = 2,
+    Zstd = 3
+};
+
+class Compression {
+public:
+    static bool is_available(CompressionCodec codec) {
+        switch (codec) {
+            case CompressionCodec::None:
+                return true;
+#ifdef HYPERQ_HAVE_ZLIB
+            case CompressionCodec::Zlib:
+                return true;
+#endif
+#ifdef HYPERQ_HAVE_LZ4
+            case CompressionCodec::Lz4:
+                return true;
+#endif
+#ifdef HYPERQ_HAVE_ZSTD
+            case CompressionCodec::Zstd:
+                return true;
+#endif
+            default:
+                return false;
+        }
+    }
+
+    static string compress(CompressionCodec codec, const string& data) {
+        switch (codec) {
+            case CompressionCodec::None:
+                return data;
+#ifdef HYPERQ_HAVE_ZLIB
+            case CompressionCodec::Zlib: {
+                uLongf size = compressBound(data.size());
+                string out(size, '\0');
+                if (compress2(reinterpret_cast<Bytef*>(&out[0]), &size,
+                              reinterpret_cast<const Bytef*>(data.data()), data.size(),
+                              Z_BEST_SPEED) != Z_OK) {
+                    throw runtime_error("zlib compression failed");
+                }
+                out.resize(size);
+                return out;
+            }
+#endif
+#ifdef HYPERQ_HAVE_LZ4
+            case CompressionCodec::Lz4: {
+                string out(LZ4_compressBound(data.size()), '\0');
+                int size = LZ4_compress_default(data.data(), &out[0], data.size(), out.size());
+                if (size <= 0) {
+                    throw runtime_error("lz4 compression failed");
+                }
+                out.resize(size);
+                return out;
+            }
+#endif
+#ifdef HYPERQ_HAVE_ZSTD
+            case CompressionCodec::Zstd: {
+                string out(ZSTD_compressBound(data.size()), '\0');
+                size_t size = ZSTD_compress(&out[0], out.size(), data.data(), data.size(), 3);
+                if (ZSTD_isError(size)) {
+                    throw runtime_error(string("zstd compression failed: ") + ZSTD_getErrorName(size));
+                }
+                out.resize(size);
+                return out;
+            }
+#endif
+            default:
+                throw runtime_error("Compression codec " + codec_name(codec) + " is not available");
+        }
+    }
+
+    // uncompressed_size is recorded by the writer, decoders need it to size the output
+    static string decompress(CompressionCodec codec, const string& data, size_t uncompressed_size) {
+        switch (codec) {
+            case CompressionCodec::None:
+                return data;
+#ifdef HYPERQ_HAVE_ZLIB
+            case CompressionCodec::Zlib: {
+                string out(uncompressed_size, '\0');
+                uLongf size = uncompressed_size;
+                if (uncompress(reinterpret_cast<Bytef*>(&out[0]), &size,
+                               reinterpret_cast<const Bytef*>(data.data()), data.size()) != Z_OK ||
+                    size != uncompressed_size) {
+                    throw runtime_error("zlib decompression failed");
+                }
+                return out;
+            }
+#endif
+#ifdef HYPERQ_HAVE_LZ4
+            case CompressionCodec::Lz4: {
+                string out(uncompressed_size, '\0');
+                int size = LZ4_decompress_safe(data.data(), &out[0], data.size(), out.size());
+                if (size < 0 || static_cast<size_t>(size) != uncompressed_size) {
+                    throw runtime_error("lz4 decompression failed");
+                }
+                return out;
+            }
+#endif
+#ifdef HYPERQ_HAVE_ZSTD
+            case CompressionCodec::Zstd: {
+                string out(uncompressed_size, '\0');
+                size_t size = ZSTD_decompress(&out[0], out.size(), data.data(), data.size());
+                if (ZSTD_isError(size) || size != uncompressed_size) {
+                    throw runtime_error("zstd decompression failed");
+                }
+                return out;
+            }
+#endif
+            default:
+                throw runtime_error("Compression codec " + codec_name(codec) + " is not available");
+        }
+    }
+
+    static string codec_name(CompressionCodec codec) {
+        switch (codec) {
+            case CompressionCodec::None: return "none";
+            case CompressionCodec::Zlib: return "zlib";
+            case CompressionCodec::Lz4: return "lz4";
+            case CompressionCodec::Zstd: return "zstd";
+        }
+        return "unknown";
+    }
+
+    // parse a compression.type value
+    static CompressionCodec parse_codec(const string& name) {
+        if (name == "none") return CompressionCodec::None;
+        if (name == "zlib") return CompressionCodec::Zlib;
+        if (name == "lz4") return CompressionCodec::Lz4;
+        if (name == "zstd") return CompressionCodec::Zstd;
+        throw invalid_argument("Unknown compression codec: " + name);
+    }
+};
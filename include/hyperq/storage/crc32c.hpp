@@ -0,0 +1,215 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define HYPERQ_CRC32C_SSE42 1
+#endif
+using namespace std;
+
+/*
+ * CRC32C (Castagnoli), the checksum of stored record batches
+ * On x86-64 CPUs with SSE4.2 the crc32 instruction takes 8 bytes at a time.
+ * It has a latency of 3 cycles but issues every cycle, so longer buffers are
+ * cut into three streams computed side by side, whose CRCs are then combined
+ * with precomputed shift tables. Other CPUs use slicing-by-8 tables, still
+ * several times faster than a byte at a time. The implementation is picked
+ * once at runtime, the same binary runs on any x86-64.
+*/
+
+class Crc32c {
+public:
+    // CRC of data continuing from crc, the CRC of everything before it (0 to start)
+    static uint32_t extend(uint32_t crc, const void* data, size_t len) {
+        return implementation()(crc, static_cast<const uint8_t*>(data), len);
+    }
+
+    static uint32_t compute(const void* data, size_t len) {
+        return extend(0, data, len);
+    }
+
+    // Table-driven version whatever the CPU supports
+    static uint32_t extend_portable(uint32_t crc, const void* data, size_t len) {
+        return extend_tables(crc, static_cast<const uint8_t*>(data), len);
+    }
+
+    static bool hardware_accelerated() {
+        return implementation() != &extend_tables;
+    }
+
+    static const char* implementation_name() {
+        return hardware_accelerated() ? "sse4.2" : "slicing-by-8";
+    }
+
+private:
+    using ExtendFn = uint32_t (*)(uint32_t, const uint8_t*, size_t);
+
+    static constexpr uint32_t POLY = 0x82f63b78;        // reflected Castagnoli polynomial
+    static constexpr size_t LONG_BLOCK = 8192;          // bytes per stream, long buffers
+    static constexpr size_t SHORT_BLOCK = 256;          // bytes per stream, what is left
+
+    struct Tables {
+        uint32_t slice[8][256];
+        uint32_t long_shift[4][256];    // advance a CRC register over LONG_BLOCK zero bytes
+        uint32_t short_shift[4][256];   // same over SHORT_BLOCK
+    };
+
+    static ExtendFn implementation() {
+        static const ExtendFn chosen = choose();
+        return chosen;
+    }
+
+    static ExtendFn choose() {
+#ifdef HYPERQ_CRC32C_SSE42
+        if (__builtin_cpu_supports("sse4.2")) {
+            tables();   // the combine step needs the shift tables
+            return &extend_sse42;
+        }
+#endif
+        return &extend_tables;
+    }
+
+    static const Tables& tables() {
+        static const Tables built = build_tables();
+        return built;
+    }
+
+    static Tables build_tables() {
+        Tables t;
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t crc = n;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+            }
+            t.slice[0][n] = crc;
+        }
+        for (uint32_t n = 0; n < 256; n++) {
+            for (int k = 1; k < 8; k++) {
+                uint32_t previous = t.slice[k - 1][n];
+                t.slice[k][n] = (previous >> 8) ^ t.slice[0][previous & 0xff];
+            }
+        }
+        build_shift(t.long_shift, x8nmodp(LONG_BLOCK));
+        build_shift(t.short_shift, x8nmodp(SHORT_BLOCK));
+        return t;
+    }
+
+    // polynomial arithmetic mod POLY, reflected: bit 31 is x^0
+    static uint32_t multmodp(uint32_t a, uint32_t b) {
+        uint32_t m = 1u << 31;
+        uint32_t product = 0;
+        for (;;) {
+            if (a & m) {
+                product ^= b;
+                if ((a & (m - 1)) == 0) {
+                    break;
+                }
+            }
+            m >>= 1;
+            b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+        }
+        return product;
+    }
+
+    // x^(8n) mod POLY: appending n zero bytes multiplies a CRC register by this
+    static uint32_t x8nmodp(size_t n) {
+        uint32_t power = 1u << 30;          // x^(2^k), from x^1
+        uint32_t result = 1u << 31;         // x^0
+        n *= 8;
+        while (n) {
+            if (n & 1) {
+                result = multmodp(power, result);
+            }
+            power = multmodp(power, power);
+            n >>= 1;
+        }
+        return result;
+    }
+
+    // shift[k][b]: byte k of a register holding b, times the operator; linear, so lookups xor together
+    static void build_shift(uint32_t shift[4][256], uint32_t op) {
+        for (uint32_t n = 0; n < 256; n++) {
+            for (int k = 0; k < 4; k++) {
+                shift[k][n] = multmodp(op, n << (8 * k));
+            }
+        }
+    }
+
+    static uint32_t shift(const uint32_t table[4][256], uint32_t crc) {
+        return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+               table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+    }
+
+    static uint64_t load64(const uint8_t* p) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        return word;
+    }
+
+    // slicing-by-8: one lookup per byte, eight of them independent (little endian only, like the log format)
+    static uint32_t extend_tables(uint32_t crc, const uint8_t* p, size_t len) {
+        const Tables& t = tables();
+        crc = ~crc;
+        while (len >= 8) {
+            uint64_t word = load64(p) ^ crc;
+            crc = t.slice[7][word & 0xff] ^ t.slice[6][(word >> 8) & 0xff] ^
+                  t.slice[5][(word >> 16) & 0xff] ^ t.slice[4][(word >> 24) & 0xff] ^
+                  t.slice[3][(word >> 32) & 0xff] ^ t.slice[2][(word >> 40) & 0xff] ^
+                  t.slice[1][(word >> 48) & 0xff] ^ t.slice[0][word >> 56];
+            p += 8;
+            len -= 8;
+        }
+        while (len--) {
+            crc = t.slice[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+#ifdef HYPERQ_CRC32C_SSE42
+    // streams a, b, c of block bytes each: crc(a b c) = shift(shift(crc(a)) ^ crc(b)) ^ crc(c)
+    // where b and c start from 0, the register update being linear
+    __attribute__((target("sse4.2")))
+    static const uint8_t* three_streams(uint64_t& crc, const uint8_t* p, size_t block, const uint32_t table[4][256]) {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const uint8_t* end = p + block;
+        do {
+            crc = _mm_crc32_u64(crc, load64(p));
+            crc1 = _mm_crc32_u64(crc1, load64(p + block));
+            crc2 = _mm_crc32_u64(crc2, load64(p + 2 * block));
+            p += 8;
+        } while (p < end);
+        crc = shift(table, static_cast<uint32_t>(crc)) ^ crc1;
+        crc = shift(table, static_cast<uint32_t>(crc)) ^ crc2;
+        return p + 2 * block;
+    }
+
+    __attribute__((target("sse4.2")))
+    static uint32_t extend_sse42(uint32_t crc_in, const uint8_t* p, size_t len) {
+        const Tables& t = tables();
+        uint64_t crc = ~crc_in;
+        while (len > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+            crc = _mm_crc32_u8(static_cast<uint32_t>(crc), *p++);
+            len--;
+        }
+        while (len >= 3 * LONG_BLOCK) {
+            p = three_streams(crc, p, LONG_BLOCK, t.long_shift);
+            len -= 3 * LONG_BLOCK;
+        }
+        while (len >= 3 * SHORT_BLOCK) {
+            p = three_streams(crc, p, SHORT_BLOCK, t.short_shift);
+            len -= 3 * SHORT_BLOCK;
+        }
+        while (len >= 8) {
+            crc = _mm_crc32_u64(crc, load64(p));
+            p += 8;
+            len -= 8;
+        }
+        while (len--) {
+            crc = _mm_crc32_u8(static_cast<uint32_t>(crc), *p++);
+        }
+        return ~static_cast<uint32_t>(crc);
+    }
+#endif
+};
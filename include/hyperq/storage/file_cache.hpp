@@ -0,0 +1,236 @@
+#pragma once
+#include "hyperq/metrics/metrics.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+using namespace std;
+
+/*
+ * FileCache: bounded set of open segment descriptors, shared by the process
+ * A broker hosting tens of thousands of partitions has more segment files
+ * than the fd limit lets it keep open. Segments register here and take their
+ * descriptor for each operation: a hit is a hash lookup, a miss reopens the
+ * file, and past capacity the least recently used idle descriptor is closed.
+ * One O_RDWR descriptor per segment serves appends, fsyncs and reads alike.
+ * A descriptor is pinned while in use and never closed under its user; with
+ * everything pinned the cache goes over capacity rather than block.
+ * Capacity defaults to half the RLIMIT_NOFILE soft limit, the rest is left
+ * to sockets. HYPERQ_MAX_OPEN_SEGMENTS overrides it.
+*/
+
+class FileCache {
+public:
+    static constexpr size_t MIN_CAPACITY = 16;
+    static constexpr size_t MAX_DEFAULT_CAPACITY = 16384;
+
+    // A pinned descriptor, unpinned when the handle goes away
+    class Handle {
+    public:
+        Handle() : cache_(nullptr), id_(0), fd_(-1) {}
+
+        Handle(Handle&& other) noexcept : cache_(other.cache_), id_(other.id_), fd_(other.fd_) {
+            other.cache_ = nullptr;
+            other.fd_ = -1;
+        }
+
+        Handle& operator=(Handle&& other) noexcept {
+            if (this != &other) {
+                reset();
+                cache_ = other.cache_;
+                id_ = other.id_;
+                fd_ = other.fd_;
+                other.cache_ = nullptr;
+                other.fd_ = -1;
+            }
+            return *this;
+        }
+
+        ~Handle() {
+            reset();
+        }
+
+        int fd() const {
+            return fd_;
+        }
+
+        explicit operator bool() const {
+            return fd_ >= 0;
+        }
+
+        void reset() {
+            if (cache_) {
+                cache_->unpin(id_);
+                cache_ = nullptr;
+                fd_ = -1;
+            }
+        }
+
+    private:
+        friend class FileCache;
+
+        Handle(FileCache* cache, uint64_t id, int fd) : cache_(cache), id_(id), fd_(fd) {}
+
+        FileCache* cache_;
+        uint64_t id_;
+        int fd_;
+    };
+
+    // The cache every segment uses, the fd limit being per process
+    static FileCache& instance() {
+        static FileCache cache(default_capacity());
+        return cache;
+    }
+
+    explicit FileCache(size_t capacity)
+        : capacity_(max(capacity, MIN_CAPACITY)),
+          next_id_(1),
+          opens_(MetricsRegistry::instance().counter(
+              "hyperq_segment_file_opens_total", {}, "Segment files opened, first opens and reopens after eviction")),
+          evictions_(MetricsRegistry::instance().counter(
+              "hyperq_segment_file_evictions_total", {}, "Idle segment descriptors closed to stay under capacity")),
+          open_files_(MetricsRegistry::instance().gauge(
+              "hyperq_segment_open_files", {}, "Segment descriptors currently open")) {}
+
+    ~FileCache() {
+        for (auto& [id, entry] : open_) {
+            ::close(entry.fd);
+        }
+    }
+
+    FileCache(const FileCache&) = delete;
+    FileCache& operator=(const FileCache&) = delete;
+
+    // Id for a new file, nothing is opened until the first acquire
+    uint64_t register_file() {
+        return next_id_++;
+    }
+
+    // Pin the descriptor of file id, (re)opening path on a miss (O_CREAT when create is set)
+    Handle acquire(uint64_t id, const string& path, bool create = false) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            auto it = open_.find(id);
+            if (it != open_.end()) {
+                pin_locked(it->second);
+                return Handle(this, id, it->second.fd);
+            }
+        }
+        // open() may wait on the filesystem, keep other segments going meanwhile
+        int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+        if (fd < 0) {
+            throw runtime_error("Failed to open segment " + path + ": " + strerror(errno));
+        }
+        opens_.add();
+
+        lock_guard<mutex> lock(mutex_);
+        auto [it, inserted] = open_.try_emplace(id);
+        Entry& entry = it->second;
+        if (inserted) {
+            entry.fd = fd;
+            entry.position = idle_.insert(idle_.begin(), id);
+        } else {
+            ::close(fd);    // another thread opened it first
+        }
+        pin_locked(entry);
+        evict_locked();
+        return Handle(this, id, entry.fd);
+    }
+
+    // Close the descriptor of a file going away, it must not be pinned
+    void forget(uint64_t id) {
+        lock_guard<mutex> lock(mutex_);
+        auto it = open_.find(id);
+        if (it == open_.end()) {
+            return;
+        }
+        ::close(it->second.fd);
+        (it->second.pins > 0 ? busy_ : idle_).erase(it->second.position);
+        open_.erase(it);
+        open_files_.set(open_.size());
+    }
+
+    // Closes idle descriptors right away when shrinking
+    void set_capacity(size_t capacity) {
+        lock_guard<mutex> lock(mutex_);
+        capacity_ = max(capacity, MIN_CAPACITY);
+        evict_locked();
+    }
+
+    size_t capacity() const {
+        lock_guard<mutex> lock(mutex_);
+        return capacity_;
+    }
+
+    size_t open_count() const {
+        lock_guard<mutex> lock(mutex_);
+        return open_.size();
+    }
+
+    // RLIMIT_NOFILE soft limit / 2, or HYPERQ_MAX_OPEN_SEGMENTS
+    static size_t default_capacity() {
+        if (const char* value = getenv("HYPERQ_MAX_OPEN_SEGMENTS")) {
+            return max<size_t>(MIN_CAPACITY, strtoull(value, nullptr, 10));
+        }
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+            return MAX_DEFAULT_CAPACITY;
+        }
+        return clamp<size_t>(limit.rlim_cur / 2, MIN_CAPACITY, MAX_DEFAULT_CAPACITY);
+    }
+
+private:
+    struct Entry {
+        int fd = -1;
+        size_t pins = 0;
+        list<uint64_t>::iterator position;     // in busy_ while pinned, else in idle_
+    };
+
+    size_t capacity_;
+    atomic<uint64_t> next_id_;
+    unordered_map<uint64_t, Entry> open_;   // {file id: descriptor}
+    list<uint64_t> idle_;                   // unpinned, most recently used first
+    list<uint64_t> busy_;                   // pinned, never evicted
+    mutable mutex mutex_;
+    Counter& opens_;
+    Counter& evictions_;
+    Gauge& open_files_;
+
+    // entries move between the lists by splicing, a hit allocates nothing
+    void pin_locked(Entry& entry) {
+        if (entry.pins++ == 0) {
+            busy_.splice(busy_.end(), idle_, entry.position);
+        }
+    }
+
+    void unpin(uint64_t id) {
+        lock_guard<mutex> lock(mutex_);
+        auto it = open_.find(id);
+        if (it == open_.end() || --it->second.pins > 0) {
+            return;
+        }
+        idle_.splice(idle_.begin(), busy_, it->second.position);
+        evict_locked();
+    }
+
+    void evict_locked() {
+        while (open_.size() > capacity_ && !idle_.empty()) {
+            auto it = open_.find(idle_.back());
+            ::close(it->second.fd);
+            idle_.pop_back();
+            open_.erase(it);
+            evictions_.add();
+        }
+        open_files_.set(open_.size());
+    }
+};
@@ -0,0 +1,70 @@
+#pragma once
+#include "hyperq/storage/record_batch.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+struct TimeIndexEntry {
+    uint64_t timestamp;     // largest record timestamp up to and including this batch
+    uint64_t offset;        // base offset of the batch
+    uint64_t position;      // byte position of the batch in the segment
+};
+
+// Result of a timestamp lookup: the first record at or after the timestamp
+struct TimestampOffset {
+    uint64_t offset;
+    uint64_t timestamp;     // of that record
+};
+
+/*
+ * TimeIndex: sparse timestamp -> batch index of one segment
+ * Producers' clocks need not agree, so record timestamps are not ordered by
+ * offset. An entry is only added for a batch raising the largest timestamp
+ * seen so far, at most one per interval_bytes of log, which keeps entry
+ * timestamps strictly increasing and a lookup a binary search. Every batch
+ * before an entry with timestamp < t is older than t, so a search for t can
+ * start scanning at that entry's batch.
+ * Held in memory and rebuilt from the batch headers when the segment is
+ * recovered, which reads every header anyway.
+*/
+
+class TimeIndex {
+public:
+    static constexpr uint64_t DEFAULT_INTERVAL_BYTES = 4096;
+
+    explicit TimeIndex(uint64_t interval_bytes = DEFAULT_INTERVAL_BYTES)
+        : interval_bytes_(interval_bytes), max_timestamp_(0) {}
+
+    // Called for every batch in file order, position is where its header starts
+    void add(const RecordBatchHeader& header, uint64_t position) {
+        if (header.max_timestamp <= max_timestamp_) {
+            return;
+        }
+        max_timestamp_ = header.max_timestamp;
+        if (entries_.empty() || position - entries_.back().position >= interval_bytes_) {
+            entries_.push_back({max_timestamp_, header.base_offset, position});
+        }
+    }
+
+    // Byte position to scan from for the first record at or after timestamp
+    uint64_t lookup(uint64_t timestamp) const {
+        auto it = partition_point(entries_.begin(), entries_.end(),
+            [timestamp](const TimeIndexEntry& entry) { return entry.timestamp < timestamp; });
+        return it == entries_.begin() ? 0 : prev(it)->position;
+    }
+
+    // Largest record timestamp in the segment, 0 when it has none
+    uint64_t max_timestamp() const {
+        return max_timestamp_;
+    }
+
+    size_t size() const {
+        return entries_.size();
+    }
+
+private:
+    uint64_t interval_bytes_;
+    uint64_t max_timestamp_;
+    vector<TimeIndexEntry> entries_;
+};
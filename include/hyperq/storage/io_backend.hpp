@@ -0,0 +1,581 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#ifdef HYPERQ_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+using namespace std;
+
+/*
+ * Storage I/O backends used by segments
+ *   SyscallIoBackend: pwrite/pread/fdatasync on the calling thread
+ *   IoUringBackend:   one io_uring shared by every partition of the process.
+ *                     A synced append is a linked write+fdatasync pair, so it
+ *                     costs a single io_uring_enter. Small writes go through
+ *                     registered buffers, reads are submitted asynchronously.
+ * IoBackend::default_backend() picks io_uring when the kernel has it and falls
+ * back to syscalls otherwise. HYPERQ_IO_BACKEND=syscall|uring|auto overrides it.
+*/
+
+// O_DIRECT wants buffer address, file offset and length aligned to the device block
+const size_t IO_ALIGNMENT = 4096;
+
+class AlignedBuffer {
+public:
+    explicit AlignedBuffer(size_t size)
+        : size_(align_up(size > 0 ? size : 1)),
+          data_(static_cast<char*>(aligned_alloc(IO_ALIGNMENT, size_))) {
+        if (!data_) {
+            throw bad_alloc();
+        }
+    }
+
+    ~AlignedBuffer() {
+        free(data_);
+    }
+
+    AlignedBuffer(const AlignedBuffer&) = delete;
+    AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+    char* data() {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    static uint64_t align_up(uint64_t n) {
+        return (n + IO_ALIGNMENT - 1) & ~static_cast<uint64_t>(IO_ALIGNMENT - 1);
+    }
+
+private:
+    size_t size_;
+    char* data_;
+};
+
+// Completion of one submitted operation (two for a linked write+sync)
+class IoCompletion {
+public:
+    explicit IoCompletion(int parts = 1) : remaining_(parts) {}
+
+    void complete(int part, int result) {
+        // notify under the lock: the waiter may destroy the completion right after
+        lock_guard<mutex> lock(mutex_);
+        results_[part] = result;
+        if (--remaining_ == 0) {
+            done_cv_.notify_all();
+        }
+    }
+
+    void wait() {
+        unique_lock<mutex> lock(mutex_);
+        done_cv_.wait(lock, [this]() { return remaining_ == 0; });
+    }
+
+    // syscall-style result of a part: bytes transferred or -errno
+    int result(int part = 0) const {
+        return results_[part];
+    }
+
+private:
+    int remaining_;
+    array<int, 2> results_{};
+    mutex mutex_;
+    condition_variable done_cv_;
+};
+
+// Read started by read_async(), buffer is only valid after wait()
+struct PendingRead {
+    string buffer;
+    uint64_t offset = 0;
+    IoCompletion done;
+    function<int()> deferred;   // set by backends that only read once waited for
+
+    // bytes read, short only at the end of the file
+    size_t wait() {
+        if (deferred) {
+            done.complete(0, deferred());
+            deferred = nullptr;
+        }
+        done.wait();
+        if (done.result() < 0) {
+            throw runtime_error(string("Read failed: ") + strerror(-done.result()));
+        }
+        return done.result();
+    }
+
+    // the kernel may still be filling the buffer
+    ~PendingRead() {
+        if (!deferred) {
+            done.wait();
+        }
+    }
+};
+
+class IoBackend {
+public:
+    virtual ~IoBackend() = default;
+
+    // Write len bytes at offset, durable on return when sync is set
+    virtual void write(int fd, const char* data, size_t len, uint64_t offset, bool sync) = 0;
+
+    // Make earlier writes to fd durable (data and file size, not timestamps)
+    virtual void sync(int fd) = 0;
+
+    // Start reading len bytes at offset
+    virtual shared_ptr<PendingRead> read_async(int fd, size_t len, uint64_t offset) = 0;
+
+    virtual string name() const = 0;
+
+    // "syscall", "uring" or "auto" (io_uring when the kernel allows it)
+    static shared_ptr<IoBackend> create(const string& type);
+
+    // process-wide backend, picked once from HYPERQ_IO_BACKEND
+    static shared_ptr<IoBackend> default_backend() {
+        static shared_ptr<IoBackend> backend = []() {
+            const char* type = getenv("HYPERQ_IO_BACKEND");
+            return create(type ? type : "auto");
+        }();
+        return backend;
+    }
+
+protected:
+    static void pwrite_fully(int fd, const char* data, size_t len, uint64_t offset) {
+        while (len > 0) {
+            ssize_t n = ::pwrite(fd, data, len, offset);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error(string("Write failed: ") + strerror(errno));
+            }
+            data += n;
+            len -= n;
+            offset += n;
+        }
+    }
+
+    // stops early at the end of the file, returns bytes read or -errno
+    static ssize_t pread_fully(int fd, char* buffer, size_t len, uint64_t offset) {
+        size_t total = 0;
+        while (total < len) {
+            ssize_t n = ::pread(fd, buffer + total, len - total, offset + total);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return -errno;
+            }
+            if (n == 0) break;
+            total += n;
+        }
+        return total;
+    }
+};
+
+class SyscallIoBackend : public IoBackend {
+public:
+    void write(int fd, const char* data, size_t len, uint64_t offset, bool sync) override {
+        pwrite_fully(fd, data, len, offset);
+        if (sync) {
+            this->sync(fd);
+        }
+    }
+
+    void sync(int fd) override {
+        if (::fdatasync(fd) != 0) {
+            throw runtime_error(string("fdatasync failed: ") + strerror(errno));
+        }
+    }
+
+    // reads in wait() on the caller's thread, a read-ahead nobody waits for costs nothing
+    shared_ptr<PendingRead> read_async(int fd, size_t len, uint64_t offset) override {
+        auto read = make_shared<PendingRead>();
+        read->buffer.resize(len);
+        read->offset = offset;
+        PendingRead* target = read.get();
+        read->deferred = [fd, len, offset, target]() {
+            return static_cast<int>(pread_fully(fd, &target->buffer[0], len, offset));
+        };
+        return read;
+    }
+
+    string name() const override {
+        return "syscall";
+    }
+};
+
+#ifdef HYPERQ_HAVE_IO_URING
+
+/*
+ * IoUringBackend: raw io_uring_setup/enter/register, no liburing needed
+ * Any thread may submit (under submit_mutex_), a single reaper thread blocks
+ * in io_uring_enter for completions and wakes the submitters. user_data is
+ * the IoCompletion pointer with the part number in the low bit.
+*/
+
+class IoUringBackend : public IoBackend {
+public:
+    static constexpr unsigned QUEUE_DEPTH = 256;
+    static constexpr size_t REGISTERED_BUFFERS = 16;
+    static constexpr size_t REGISTERED_BUFFER_SIZE = 256 * 1024;
+
+    IoUringBackend() : ring_fd_(-1), in_flight_(0), stopping_(false) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params));
+        if (ring_fd_ < 0) {
+            throw runtime_error(string("io_uring_setup failed: ") + strerror(errno));
+        }
+        // IORING_OP_READ/WRITE arrived in 5.6 together with this feature bit
+        if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+            ::close(ring_fd_);
+            throw runtime_error("io_uring too old (needs Linux 5.6)");
+        }
+        try {
+            map_rings(params);
+        } catch (...) {
+            unmap_rings();
+            ::close(ring_fd_);
+            throw;
+        }
+        register_buffers();
+        reaper_ = thread([this]() { reap(); });
+    }
+
+    ~IoUringBackend() override {
+        // a NOP with user_data 0 wakes the reaper so it can see stopping_
+        stopping_ = true;
+        {
+            lock_guard<mutex> lock(submit_mutex_);
+            io_uring_sqe* sqe = next_sqe();
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = 0;
+            submit(1);
+        }
+        reaper_.join();
+        unmap_rings();
+        ::close(ring_fd_);
+    }
+
+    IoUringBackend(const IoUringBackend&) = delete;
+    IoUringBackend& operator=(const IoUringBackend&) = delete;
+
+    void write(int fd, const char* data, size_t len, uint64_t offset, bool sync) override {
+        int buffer = acquire_buffer(len);
+        if (buffer >= 0) {
+            memcpy(buffers_[buffer]->data(), data, len);
+        }
+
+        IoCompletion done(sync ? 2 : 1);
+        {
+            lock_guard<mutex> lock(submit_mutex_);
+            reserve_locked(sync ? 2 : 1);
+            io_uring_sqe* sqe = next_sqe();
+            sqe->fd = fd;
+            sqe->off = offset;
+            sqe->len = static_cast<uint32_t>(len);
+            sqe->user_data = user_data(&done, 0);
+            if (buffer >= 0) {
+                sqe->opcode = IORING_OP_WRITE_FIXED;
+                sqe->addr = reinterpret_cast<uint64_t>(buffers_[buffer]->data());
+                sqe->buf_index = static_cast<uint16_t>(buffer);
+            } else {
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->addr = reinterpret_cast<uint64_t>(data);
+            }
+            if (sync) {
+                // the fdatasync only starts once the write has completed in full
+                sqe->flags = IOSQE_IO_LINK;
+                prepare_sync(next_sqe(), fd, user_data(&done, 1));
+            }
+            submit(sync ? 2 : 1);
+        }
+        done.wait();
+        release_buffer(buffer);
+
+        int written = done.result(0);
+        if (written < 0) {
+            throw runtime_error(string("Write failed: ") + strerror(-written));
+        }
+        if (static_cast<size_t>(written) < len) {
+            // a short write breaks the link and cancels the sync, finish it by hand
+            pwrite_fully(fd, data + written, len - written, offset + written);
+            if (sync && ::fdatasync(fd) != 0) {
+                throw runtime_error(string("fdatasync failed: ") + strerror(errno));
+            }
+        } else if (sync && done.result(1) < 0) {
+            throw runtime_error(string("fdatasync failed: ") + strerror(-done.result(1)));
+        }
+    }
+
+    void sync(int fd) override {
+        IoCompletion done;
+        {
+            lock_guard<mutex> lock(submit_mutex_);
+            reserve_locked(1);
+            prepare_sync(next_sqe(), fd, user_data(&done, 0));
+            submit(1);
+        }
+        done.wait();
+        if (done.result() < 0) {
+            throw runtime_error(string("fdatasync failed: ") + strerror(-done.result()));
+        }
+    }
+
+    shared_ptr<PendingRead> read_async(int fd, size_t len, uint64_t offset) override {
+        auto read = make_shared<PendingRead>();
+        read->buffer.resize(len);
+        read->offset = offset;
+        if (len == 0) {
+            read->done.complete(0, 0);
+            return read;
+        }
+        lock_guard<mutex> lock(submit_mutex_);
+        reserve_locked(1);
+        io_uring_sqe* sqe = next_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->off = offset;
+        sqe->addr = reinterpret_cast<uint64_t>(&read->buffer[0]);
+        sqe->len = static_cast<uint32_t>(len);
+        sqe->user_data = user_data(&read->done, 0);
+        submit(1);
+        return read;
+    }
+
+    string name() const override {
+        return "io_uring";
+    }
+
+    size_t registered_buffer_count() const {
+        return buffers_.size();
+    }
+
+private:
+    int ring_fd_;
+    // mmapped rings, the kernel updates the other end of each
+    void* sq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    void* cq_ring_ = nullptr;
+    size_t cq_ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+    unsigned cq_mask_ = 0;
+    unsigned cq_entries_ = 0;
+
+    mutex submit_mutex_;
+    condition_variable space_cv_;       // in_flight_ dropped below cq_entries_
+    unsigned in_flight_;                // guarded by submit_mutex_
+    atomic<bool> stopping_;
+    thread reaper_;
+
+    vector<unique_ptr<AlignedBuffer>> buffers_;     // registered with the ring, fixed size
+    vector<int> free_buffers_;
+    mutex buffer_mutex_;
+
+    static uint64_t user_data(IoCompletion* done, int part) {
+        return reinterpret_cast<uint64_t>(done) | static_cast<uint64_t>(part);
+    }
+
+    void map_rings(const io_uring_params& params) {
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = map_region(sq_ring_size_, IORING_OFF_SQ_RING);
+        cq_ring_ = single_mmap ? sq_ring_ : map_region(cq_ring_size_, IORING_OFF_CQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(map_region(sqes_size_, IORING_OFF_SQES));
+
+        char* sq = static_cast<char*>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+
+        char* cq = static_cast<char*>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cq_entries_ = params.cq_entries;
+    }
+
+    void* map_region(size_t size, off_t offset) {
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, offset);
+        if (ptr == MAP_FAILED) {
+            throw runtime_error(string("io_uring mmap failed: ") + strerror(errno));
+        }
+        return ptr;
+    }
+
+    void unmap_rings() {
+        if (sqes_) munmap(sqes_, sqes_size_);
+        if (cq_ring_ && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_) munmap(sq_ring_, sq_ring_size_);
+    }
+
+    // optional: without registered buffers (e.g. memlock limit) every write is a plain WRITE
+    void register_buffers() {
+        vector<iovec> iovecs;
+        for (size_t i = 0; i < REGISTERED_BUFFERS; i++) {
+            buffers_.push_back(make_unique<AlignedBuffer>(REGISTERED_BUFFER_SIZE));
+            iovecs.push_back({buffers_.back()->data(), REGISTERED_BUFFER_SIZE});
+        }
+        if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS,
+                    iovecs.data(), static_cast<unsigned>(iovecs.size())) != 0) {
+            cout << "[IoUring] Buffer registration failed (" << strerror(errno) << "), using plain writes\n";
+            buffers_.clear();
+            return;
+        }
+        for (size_t i = 0; i < buffers_.size(); i++) {
+            free_buffers_.push_back(static_cast<int>(i));
+        }
+    }
+
+    // index of a free registered buffer that fits len, -1 if none
+    int acquire_buffer(size_t len) {
+        if (len > REGISTERED_BUFFER_SIZE) {
+            return -1;
+        }
+        lock_guard<mutex> lock(buffer_mutex_);
+        if (free_buffers_.empty()) {
+            return -1;
+        }
+        int buffer = free_buffers_.back();
+        free_buffers_.pop_back();
+        return buffer;
+    }
+
+    void release_buffer(int buffer) {
+        if (buffer < 0) {
+            return;
+        }
+        lock_guard<mutex> lock(buffer_mutex_);
+        free_buffers_.push_back(buffer);
+    }
+
+    static void prepare_sync(io_uring_sqe* sqe, int fd, uint64_t data) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = data;
+    }
+
+    // caller holds submit_mutex_: wait until count more completions fit in the CQ ring
+    void reserve_locked(unsigned count) {
+        unique_lock<mutex> lock(submit_mutex_, adopt_lock);
+        space_cv_.wait(lock, [&]() { return in_flight_ + count <= cq_entries_; });
+        lock.release();
+        in_flight_ += count;
+    }
+
+    // caller holds submit_mutex_; every submit() drains the SQ, so a slot is always free
+    io_uring_sqe* next_sqe() {
+        unsigned tail = *sq_tail_;
+        unsigned index = tail & sq_mask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        return sqe;
+    }
+
+    // caller holds submit_mutex_
+    void submit(unsigned count) {
+        while (count > 0) {
+            long submitted = syscall(__NR_io_uring_enter, ring_fd_, count, 0, 0, nullptr, 0);
+            if (submitted < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                    this_thread::yield();
+                    continue;
+                }
+                throw runtime_error(string("io_uring_enter failed: ") + strerror(errno));
+            }
+            count -= static_cast<unsigned>(submitted);
+        }
+    }
+
+    void reap() {
+        while (true) {
+            unsigned head = *cq_head_;
+            unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                if (stopping_) {
+                    return;
+                }
+                long ret = syscall(__NR_io_uring_enter, ring_fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                    cout << "[IoUring] io_uring_enter failed: " << strerror(errno) << "\n";
+                }
+                continue;
+            }
+
+            unsigned completed = 0;
+            for (; head != tail; head++) {
+                const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+                if (cqe.user_data != 0) {
+                    auto* done = reinterpret_cast<IoCompletion*>(cqe.user_data & ~uint64_t(1));
+                    done->complete(static_cast<int>(cqe.user_data & 1), cqe.res);
+                    completed++;
+                }
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+            lock_guard<mutex> lock(submit_mutex_);
+            in_flight_ -= completed;
+            space_cv_.notify_all();
+        }
+    }
+};
+
+#endif
+
+inline shared_ptr<IoBackend> IoBackend::create(const string& type) {
+    if (type == "syscall") {
+        return make_shared<SyscallIoBackend>();
+    }
+    if (type != "uring" && type != "auto") {
+        throw invalid_argument("Unknown I/O backend: " + type);
+    }
+#ifdef HYPERQ_HAVE_IO_URING
+    try {
+        return make_shared<IoUringBackend>();
+    } catch (const exception& e) {
+        if (type == "uring") {
+            throw;
+        }
+        cout << "[IoBackend] io_uring unavailable (" << e.what() << "), using syscalls\n";
+    }
+#else
+    if (type == "uring") {
+        throw runtime_error("Built without io_uring support");
+    }
+#endif
+    return make_shared<SyscallIoBackend>();
+}
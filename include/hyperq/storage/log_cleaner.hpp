@@ -0,0 +1,141 @@
+#pragma once
+#include "hyperq/storage/commit_log.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+/*
+ * LogCleaner: background compaction of cleanup.policy=compact topics
+ * Every interval it asks the CommitLog (each one, with several log
+ * directories) to compact each compacted partition.
+ * Segment I/O is throttled to max_io_bytes_per_sec so cleaning never
+ * competes with producers for disk bandwidth.
+*/
+
+class LogCleaner {
+public:
+    LogCleaner(shared_ptr<CommitLog> commit_log,
+               chrono::milliseconds interval = chrono::seconds(15),
+               double max_io_bytes_per_sec = 8.0 * 1024 * 1024)
+        : LogCleaner(vector<shared_ptr<CommitLog>>{commit_log}, interval, max_io_bytes_per_sec) {}
+
+    LogCleaner(vector<shared_ptr<CommitLog>> commit_logs,
+               chrono::milliseconds interval = chrono::seconds(15),
+               double max_io_bytes_per_sec = 8.0 * 1024 * 1024)
+        : commit_logs_(move(commit_logs)),
+          interval_(interval),
+          max_io_bytes_per_sec_(max_io_bytes_per_sec),
+          running_(false) {
+        for (const auto& commit_log : commit_logs_) {
+            if (!commit_log) {
+                throw invalid_argument("commit_log cannot be null");
+            }
+        }
+    }
+
+    ~LogCleaner() {
+        stop();
+    }
+
+    void start() {
+        lock_guard<mutex> lock(mutex_);
+        if (running_) {
+            return;
+        }
+        running_ = true;
+        thread_ = thread(&LogCleaner::run, this);
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (!running_) {
+                return;
+            }
+            running_ = false;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    // Compact every compacted partition once, returns bytes reclaimed
+    uint64_t clean_once() {
+        uint64_t reclaimed = 0;
+        for (const auto& commit_log : commit_logs_) {
+            for (const auto& [topic, partition] : commit_log->get_compacted_partitions()) {
+                try {
+                    uint64_t bytes = commit_log->compact(topic, partition,
+                        [this](size_t io_bytes) { throttle(io_bytes); });
+                    if (bytes > 0) {
+                        cout << "[LogCleaner] Compacted " << topic << "-" << partition
+                             << " reclaimed " << bytes << " bytes\n";
+                    }
+                    reclaimed += bytes;
+                } catch (const exception& e) {
+                    cerr << "[LogCleaner] Failed to compact " << topic << "-" << partition
+                         << ": " << e.what() << "\n";
+                }
+            }
+        }
+        total_reclaimed_ += reclaimed;
+        return reclaimed;
+    }
+
+    uint64_t get_total_reclaimed() const {
+        return total_reclaimed_;
+    }
+
+private:
+    vector<shared_ptr<CommitLog>> commit_logs_;
+    chrono::milliseconds interval_;
+    double max_io_bytes_per_sec_;
+    bool running_;
+    atomic<uint64_t> total_reclaimed_{0};
+    thread thread_;
+    mutex mutex_;
+    condition_variable cv_;
+
+    // throttling window
+    chrono::steady_clock::time_point window_start_;
+    uint64_t window_bytes_ = 0;
+
+    void run() {
+        unique_lock<mutex> lock(mutex_);
+        while (running_) {
+            cv_.wait_for(lock, interval_, [this] { return !running_; });
+            if (!running_) {
+                break;
+            }
+            lock.unlock();
+            clean_once();
+            lock.lock();
+        }
+    }
+
+    // Sleep long enough to keep the I/O rate under the limit
+    void throttle(size_t bytes) {
+        if (max_io_bytes_per_sec_ <= 0) {
+            return;
+        }
+        auto now = chrono::steady_clock::now();
+        if (window_bytes_ == 0 || now - window_start_ > chrono::seconds(1)) {
+            window_start_ = now;
+            window_bytes_ = 0;
+        }
+        window_bytes_ += bytes;
+
+        auto expected = chrono::duration<double>(window_bytes_ / max_io_bytes_per_sec_);
+        auto elapsed = chrono::duration<double>(now - window_start_);
+        if (expected > elapsed) {
+            this_thread::sleep_for(expected - elapsed);
+        }
+    }
+};
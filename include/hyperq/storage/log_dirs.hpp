@@ -0,0 +1,397 @@
+#pragma once
+#include "hyperq/storage/commit_log.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+using namespace std;
+
+/*
+ * LogDirs: the log directories of a broker, one per disk (JBOD)
+ * Every directory has its own CommitLog, so its own log lock, and with more
+ * than one directory its own IoBackend (an io_uring ring and reaper thread):
+ * writes and fsyncs of partitions on different disks run side by side
+ * instead of queueing behind one lock and one device.
+ * A partition lives in one directory, <log_dir>/<topic>-<partition>/.
+ * assign() finds it on disk, or places a new partition in the directory with
+ * the fewest partitions, on a tie the one with the most free space.
+ * move() relocates a partition while it is served: its files are copied,
+ * then the copy is caught up while the partition holds its writers and
+ * renamed into place. The catch-up skips files that look unchanged, except
+ * the active segment: preallocation fixes its size and mtime is too coarse
+ * to see an append made just after the bulk copy, so it is always copied.
+ * A move cut short by a crash leaves a ".move" copy (or a ".delete"
+ * original) that is removed on startup.
+*/
+
+class LogDirs {
+public:
+    // relocate(target, catch_up): stop the partition's writers, call catch_up, continue on target
+    using Relocate = function<void(shared_ptr<CommitLog> target, const function<void()>& catch_up)>;
+
+    explicit LogDirs(const vector<string>& dirs, const LogConfig& default_config = LogConfig()) {
+        if (dirs.empty()) {
+            throw invalid_argument("At least one log directory is needed");
+        }
+        for (const auto& dir : dirs) {
+            if (index_of(dir) != NO_DIR) {
+                throw invalid_argument("Log directory " + dir + " is listed twice");
+            }
+            // a single directory keeps the process-wide backend
+            shared_ptr<IoBackend> io = dirs.size() == 1 ? IoBackend::default_backend() : create_backend();
+            dirs_.push_back(LogDir{dir, make_shared<CommitLog>(dir, default_config, io), 0});
+            remove_interrupted_moves(dir);
+        }
+    }
+
+    // Commit log of the directory holding topic-partition, placing it first if it is new
+    shared_ptr<CommitLog> assign(const string& topic, int partition) {
+        lock_guard<mutex> lock(mutex_);
+        string name = partition_name(topic, partition);
+        auto it = placement_.find(name);
+        if (it != placement_.end()) {
+            return dirs_[it->second].log;
+        }
+
+        size_t chosen = NO_DIR;
+        for (size_t i = 0; i < dirs_.size(); i++) {
+            if (!is_directory(dirs_[i].path + "/" + name)) {
+                continue;
+            }
+            if (chosen == NO_DIR) {
+                chosen = i;
+            } else {
+                cout << "[LogDirs] " << name << " found in " << dirs_[chosen].path << " and " << dirs_[i].path
+                     << ", using " << dirs_[chosen].path << "\n";
+            }
+        }
+        if (chosen == NO_DIR) {
+            chosen = least_loaded();
+        }
+        placement_[name] = chosen;
+        dirs_[chosen].partitions++;
+        return dirs_[chosen].log;
+    }
+
+    // Directory holding an assigned partition
+    string get_dir(const string& topic, int partition) const {
+        lock_guard<mutex> lock(mutex_);
+        auto it = placement_.find(partition_name(topic, partition));
+        if (it == placement_.end()) {
+            throw invalid_argument("Partition " + topic + ":" + to_string(partition) + " has no log directory");
+        }
+        return dirs_[it->second].path;
+    }
+
+    // Move an assigned partition to target_dir, the partition keeps serving meanwhile
+    // relocate is the partition's switch (Partition::relocate)
+    void move(const string& topic, int partition, const string& target_dir, const Relocate& relocate) {
+        string name = partition_name(topic, partition);
+        size_t from;
+        size_t to;
+        {
+            lock_guard<mutex> lock(mutex_);
+            auto it = placement_.find(name);
+            if (it == placement_.end()) {
+                throw invalid_argument("Partition " + topic + ":" + to_string(partition) + " has no log directory");
+            }
+            from = it->second;
+            to = index_of(target_dir);
+            if (to == NO_DIR) {
+                throw invalid_argument("Unknown log directory: " + target_dir);
+            }
+            if (from == to) {
+                return;
+            }
+            if (!moving_.insert(name).second) {
+                throw runtime_error("Partition " + topic + ":" + to_string(partition) + " is already being moved");
+            }
+        }
+
+        string source = dirs_[from].path + "/" + name;
+        string staging = dirs_[to].path + "/" + name + ".move";
+        string destination = dirs_[to].path + "/" + name;
+        map<string, FileVersion> copied;
+        try {
+            if (is_directory(destination)) {
+                throw runtime_error(destination + " already exists");
+            }
+            remove_tree(staging);
+            if (mkdir(staging.c_str(), 0755) != 0) {
+                throw runtime_error("Failed to create " + staging + ": " + strerror(errno));
+            }
+            uint64_t bulk = copy_changed(source, staging, copied);
+            relocate(dirs_[to].log, [&]() {
+                // writers are held: copy what changed since, then make the copy the partition
+                string active = Segment::file_name(dirs_[from].log->get_active_base_offset(topic, partition));
+                uint64_t delta = copy_changed(source, staging, copied, active);
+                sync_path(staging);
+                rename_path(staging, destination);
+                sync_path(dirs_[to].path);
+                dirs_[from].log->close_partition(topic, partition);
+                rename_path(source, source + ".delete");
+                cout << "[LogDirs] Moved " << name << " from " << dirs_[from].path << " to " << dirs_[to].path
+                     << " (" << bulk << " bytes copied, " << delta << " while writes were held)\n";
+            });
+        } catch (...) {
+            remove_tree(staging);
+            lock_guard<mutex> lock(mutex_);
+            moving_.erase(name);
+            throw;
+        }
+        remove_tree(source + ".delete");
+
+        lock_guard<mutex> lock(mutex_);
+        placement_[name] = to;
+        dirs_[from].partitions--;
+        dirs_[to].partitions++;
+        moving_.erase(name);
+    }
+
+    // Apply a topic's log config in every directory
+    void set_topic_config(const string& topic, const LogConfig& config) {
+        for (const auto& dir : dirs_) {
+            dir.log->set_topic_config(topic, config);
+        }
+    }
+
+    vector<shared_ptr<CommitLog>> get_logs() const {
+        vector<shared_ptr<CommitLog>> logs;
+        for (const auto& dir : dirs_) {
+            logs.push_back(dir.log);
+        }
+        return logs;
+    }
+
+    vector<string> get_paths() const {
+        vector<string> paths;
+        for (const auto& dir : dirs_) {
+            paths.push_back(dir.path);
+        }
+        return paths;
+    }
+
+    // Partitions assigned to a directory
+    size_t get_partition_count(const string& dir) const {
+        lock_guard<mutex> lock(mutex_);
+        size_t i = index_of(dir);
+        return i == NO_DIR ? 0 : dirs_[i].partitions;
+    }
+
+    // Bytes available to the broker on the directory's filesystem
+    static uint64_t free_bytes(const string& dir) {
+        struct statvfs st;
+        if (statvfs(dir.c_str(), &st) != 0) {
+            return 0;
+        }
+        return static_cast<uint64_t>(st.f_bavail) * st.f_frsize;
+    }
+
+private:
+    static constexpr size_t NO_DIR = SIZE_MAX;
+    static constexpr size_t COPY_CHUNK = 1024 * 1024;
+
+    struct LogDir {
+        string path;
+        shared_ptr<CommitLog> log;
+        size_t partitions;      // assigned to this directory
+    };
+
+    // what a file looked like when it was copied, any change means copying it again
+    struct FileVersion {
+        ino_t inode;
+        off_t size;
+        int64_t mtime_ns;
+    };
+
+    vector<LogDir> dirs_;                   // fixed after construction
+    map<string, size_t> placement_;         // {topic-partition: index in dirs_}
+    set<string> moving_;
+    mutable mutex mutex_;
+
+    static string partition_name(const string& topic, int partition) {
+        return topic + "-" + to_string(partition);
+    }
+
+    static shared_ptr<IoBackend> create_backend() {
+        const char* type = getenv("HYPERQ_IO_BACKEND");
+        return IoBackend::create(type ? type : "auto");
+    }
+
+    size_t index_of(const string& dir) const {
+        for (size_t i = 0; i < dirs_.size(); i++) {
+            if (dirs_[i].path == dir) {
+                return i;
+            }
+        }
+        return NO_DIR;
+    }
+
+    // caller holds mutex_
+    size_t least_loaded() const {
+        size_t best = 0;
+        uint64_t best_free = free_bytes(dirs_[0].path);
+        for (size_t i = 1; i < dirs_.size(); i++) {
+            if (dirs_[i].partitions > dirs_[best].partitions) {
+                continue;
+            }
+            uint64_t free = free_bytes(dirs_[i].path);
+            if (dirs_[i].partitions < dirs_[best].partitions || free > best_free) {
+                best = i;
+                best_free = free;
+            }
+        }
+        return best;
+    }
+
+    static bool is_directory(const string& path) {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+
+    static vector<string> list(const string& dir) {
+        vector<string> names;
+        DIR* handle = opendir(dir.c_str());
+        if (!handle) {
+            return names;
+        }
+        while (struct dirent* entry = readdir(handle)) {
+            string name = entry->d_name;
+            if (name != "." && name != "..") {
+                names.push_back(name);
+            }
+        }
+        closedir(handle);
+        return names;
+    }
+
+    static bool has_suffix(const string& name, const string& suffix) {
+        return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    static void remove_interrupted_moves(const string& dir) {
+        for (const auto& name : list(dir)) {
+            if (has_suffix(name, ".move") || has_suffix(name, ".delete")) {
+                cout << "[LogDirs] Removing " << dir << "/" << name << " left by an interrupted move\n";
+                remove_tree(dir + "/" + name);
+            }
+        }
+    }
+
+    // partition directories hold files only
+    static void remove_tree(const string& dir) {
+        if (!is_directory(dir)) {
+            return;
+        }
+        for (const auto& name : list(dir)) {
+            ::unlink((dir + "/" + name).c_str());
+        }
+        ::rmdir(dir.c_str());
+    }
+
+    static void rename_path(const string& from, const string& to) {
+        if (::rename(from.c_str(), to.c_str()) != 0) {
+            throw runtime_error("Failed to rename " + from + " to " + to + ": " + strerror(errno));
+        }
+    }
+
+    static void sync_path(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("Failed to open " + path + ": " + strerror(errno));
+        }
+        int result = ::fsync(fd);
+        ::close(fd);
+        if (result != 0) {
+            throw runtime_error("fsync failed on " + path + ": " + strerror(errno));
+        }
+    }
+
+    // Make dst a copy of src, copying only files that changed since the versions in copied
+    // (and always_copy, whose changes the version can miss), returns bytes copied
+    static uint64_t copy_changed(const string& src, const string& dst, map<string, FileVersion>& copied,
+                                 const string& always_copy = "") {
+        uint64_t bytes = 0;
+        set<string> present;
+        for (const auto& name : list(src)) {
+            struct stat st;
+            if (stat((src + "/" + name).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            present.insert(name);
+            FileVersion version{st.st_ino, st.st_size,
+                                static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec};
+            auto it = copied.find(name);
+            if (name != always_copy && it != copied.end() && it->second.inode == version.inode &&
+                it->second.size == version.size && it->second.mtime_ns == version.mtime_ns) {
+                continue;
+            }
+            bytes += copy_file(src + "/" + name, dst + "/" + name);
+            copied[name] = version;
+        }
+        for (auto it = copied.begin(); it != copied.end();) {
+            if (present.count(it->first)) {
+                ++it;
+                continue;
+            }
+            ::unlink((dst + "/" + it->first).c_str());     // deleted by retention or compaction meanwhile
+            it = copied.erase(it);
+        }
+        return bytes;
+    }
+
+    static uint64_t copy_file(const string& from, const string& to) {
+        int in = ::open(from.c_str(), O_RDONLY);
+        if (in < 0) {
+            throw runtime_error("Failed to open " + from + ": " + strerror(errno));
+        }
+        int out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            ::close(in);
+            throw runtime_error("Failed to create " + to + ": " + strerror(errno));
+        }
+        string buffer(COPY_CHUNK, '\0');
+        uint64_t total = 0;
+        string error;
+        while (error.empty()) {
+            ssize_t n = ::read(in, &buffer[0], buffer.size());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                if (n < 0) error = "Read failed on " + from + ": " + strerror(errno);
+                break;
+            }
+            for (ssize_t written = 0; written < n && error.empty();) {
+                ssize_t w = ::write(out, buffer.data() + written, n - written);
+                if (w < 0 && errno != EINTR) {
+                    error = "Write failed on " + to + ": " + strerror(errno);
+                }
+                written += max<ssize_t>(w, 0);
+            }
+            total += n;
+        }
+        if (error.empty() && ::fsync(out) != 0) {
+            error = "fsync failed on " + to + ": " + strerror(errno);
+        }
+        ::close(in);
+        ::close(out);
+        if (!error.empty()) {
+            throw runtime_error(error);
+        }
+        return total;
+    }
+};
@@ -0,0 +1,133 @@
+#pragma once
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+/*
+ * ObjectStore: remote tier for closed segments
+ * Keys look like "<topic>-<partition>/<file>". Objects are immutable once put.
+*/
+
+class ObjectStore {
+public:
+    virtual ~ObjectStore() = default;
+
+    // Upload a local file under key
+    virtual void put(const string& key, const string& local_path) = 0;
+
+    // Read length bytes at offset (shorter at the end of the object)
+    virtual string get_range(const string& key, uint64_t offset, size_t length) = 0;
+
+    virtual uint64_t size(const string& key) = 0;
+
+    virtual void remove(const string& key) = 0;
+
+    // All keys starting with prefix
+    virtual vector<string> list(const string& prefix) = 0;
+};
+
+// FileSystemObjectStore: a local directory standing in for a real object store
+class FileSystemObjectStore : public ObjectStore {
+public:
+    explicit FileSystemObjectStore(const string& root_dir) : root_dir_(root_dir) {
+        mkdir(root_dir_.c_str(), 0755);
+    }
+
+    void put(const string& key, const string& local_path) override {
+        string path = object_path(key);
+        size_t slash = key.rfind('/');
+        if (slash != string::npos) {
+            mkdir((root_dir_ + "/" + key.substr(0, slash)).c_str(), 0755);
+        }
+
+        // copy to a temp file then rename, so readers never see a partial object
+        string tmp_path = path + ".tmp";
+        {
+            ifstream in(local_path, ios::binary);
+            if (!in.is_open()) {
+                throw runtime_error("Failed to open " + local_path + " for upload");
+            }
+            ofstream out(tmp_path, ios::binary | ios::trunc);
+            if (!out.is_open()) {
+                throw runtime_error("Failed to create object " + tmp_path);
+            }
+            out << in.rdbuf();
+            if (!out.flush()) {
+                throw runtime_error("Failed to write object " + tmp_path);
+            }
+        }
+        if (::rename(tmp_path.c_str(), path.c_str()) != 0) {
+            throw runtime_error("Failed to commit object " + key + ": " + strerror(errno));
+        }
+    }
+
+    string get_range(const string& key, uint64_t offset, size_t length) override {
+        ifstream in(object_path(key), ios::binary);
+        if (!in.is_open()) {
+            throw runtime_error("Object " + key + " does not exist");
+        }
+        in.seekg(offset);
+        string data(length, '\0');
+        in.read(&data[0], length);
+        data.resize(in.gcount());
+        return data;
+    }
+
+    uint64_t size(const string& key) override {
+        struct stat st;
+        if (stat(object_path(key).c_str(), &st) != 0) {
+            throw runtime_error("Object " + key + " does not exist");
+        }
+        return st.st_size;
+    }
+
+    void remove(const string& key) override {
+        ::unlink(object_path(key).c_str());
+    }
+
+    vector<string> list(const string& prefix) override {
+        vector<string> keys;
+        DIR* root = opendir(root_dir_.c_str());
+        if (!root) {
+            return keys;
+        }
+        while (struct dirent* dir_entry = readdir(root)) {
+            string dir_name = dir_entry->d_name;
+            if (dir_name == "." || dir_name == "..") {
+                continue;
+            }
+            DIR* dir = opendir((root_dir_ + "/" + dir_name).c_str());
+            if (!dir) {
+                continue;
+            }
+            while (struct dirent* entry = readdir(dir)) {
+                string name = entry->d_name;
+                if (name == "." || name == ".." ||
+                    (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0)) {
+                    continue;
+                }
+                string key = dir_name + "/" + name;
+                if (key.compare(0, prefix.size(), prefix) == 0) {
+                    keys.push_back(key);
+                }
+            }
+            closedir(dir);
+        }
+        closedir(root);
+        return keys;
+    }
+
+private:
+    string root_dir_;
+
+    string object_path(const string& key) const {
+        return root_dir_ + "/" + key;
+    }
+};
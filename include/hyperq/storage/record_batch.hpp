@@ -0,0 +1,427 @@
+#pragma once
+#include "hyperq/common/types.hpp"
+#include "hyperq/storage/compression.hpp"
+#include "hyperq/storage/crc32c.hpp"
+#include "hyperq/storage/record_filter.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+using namespace std;
+
+/*
+ * RecordBatch: unit written to and read from a segment
+ * [RecordBatchHeader][record][record]...
+ * record = [offset_delta u32][key_size u32][value_size u32][key][value]
+ * integers are stored in host byte order
+ * every record keeps its own offset delta so offsets survive compaction
+ * Record timestamps are milliseconds since the epoch, base_timestamp plus a
+ * delta; a batch whose records differ sets RECORD_BATCH_TIMESTAMP_DELTAS and
+ * every record then has [timestamp_delta u32] after its offset delta.
+ * compressed batches carry [uncompressed_size u32][compressed records] as payload
+ * and the codec in the low bits of attributes
+ * Control batches hold one marker record ending a producer's transaction, they
+ * take an offset like any record but are never decoded into messages.
+ * Header versions only ever add fields at the end: an older header is a prefix
+ * of the current one and reads back with the new fields zeroed.
+ *   magic 1: 24 bytes
+ *   magic 2: 40 bytes, adds the idempotent producer fields
+ *   magic 3: 56 bytes, adds the batch timestamps (older batches read as time 0)
+ *   magic 4: 64 bytes, adds the CRC32C
+ * The CRC covers the payload and every header field but the base offset
+ * (assigned on append), the magic (upgraded on read) and itself, so it is
+ * computed once, by whoever finishes the batch, and stays valid in the log.
+ * RECORD_BATCH_CHECKSUM marks it as set; batches written before it have none.
+*/
+
+const uint8_t RECORD_BATCH_MAGIC = 4;
+const uint8_t RECORD_BATCH_CODEC_MASK = 0x07;
+const uint8_t RECORD_BATCH_TRANSACTIONAL = 0x08;
+const uint8_t RECORD_BATCH_CONTROL = 0x10;
+const uint8_t RECORD_BATCH_ABORT = 0x20;        // control batch type: abort, otherwise commit
+const uint8_t RECORD_BATCH_TIMESTAMP_DELTAS = 0x40;     // records carry a timestamp delta
+const uint8_t RECORD_BATCH_CHECKSUM = 0x80;     // crc is set
+const size_t RECORD_BATCH_MIN_HEADER_SIZE = 24;     // magic 1, enough to find the magic of any version
+const uint64_t NO_PRODUCER_ID = 0;
+
+struct RecordBatchHeader {
+    uint64_t base_offset;
+    uint32_t payload_size;       // bytes of records following the header
+    uint32_t record_count;
+    uint32_t last_offset_delta;
+    uint8_t magic;
+    uint8_t attributes;          // bits 0-2: compression codec, 3: transactional, 4: control, 5: abort marker,
+                                 // 6: timestamp deltas, 7: checksum
+    uint16_t reserved;
+    // magic 2
+    uint64_t producer_id;        // NO_PRODUCER_ID unless the producer is idempotent
+    int32_t base_sequence;       // producer's sequence number of the first record
+    uint16_t producer_epoch;
+    uint16_t reserved2;
+    // magic 3
+    uint64_t base_timestamp;     // smallest record timestamp
+    uint64_t max_timestamp;      // largest record timestamp
+    // magic 4
+    uint32_t crc;                // CRC32C, see RecordBatch::checksum()
+    uint32_t reserved3;
+
+    // stored size of a header with this magic, 0 for an unknown one
+    static size_t stored_size(uint8_t magic) {
+        switch (magic) {
+            case 1: return RECORD_BATCH_MIN_HEADER_SIZE;
+            case 2: return 40;
+            case 3: return 56;
+            case 4: return 64;
+            default: return 0;
+        }
+    }
+
+    // sequence number of the last record
+    int32_t last_sequence() const {
+        return base_sequence + static_cast<int32_t>(record_count) - 1;
+    }
+
+    bool is_transactional() const {
+        return attributes & RECORD_BATCH_TRANSACTIONAL;
+    }
+
+    bool is_control() const {
+        return attributes & RECORD_BATCH_CONTROL;
+    }
+
+    bool is_abort_marker() const {
+        return is_control() && (attributes & RECORD_BATCH_ABORT);
+    }
+};
+
+static_assert(sizeof(RecordBatchHeader) == 64, "RecordBatchHeader layout is part of the log format");
+
+struct RecordBatch {
+    RecordBatchHeader header{};
+    string payload;
+
+    // Encode records into a batch starting at base_offset
+    // records without a timestamp (0) are stamped with the current time
+    static RecordBatch build(uint64_t base_offset, const vector<Message>& records) {
+        return build_from(base_offset, records, 0);
+    }
+
+    // Same, straight from an arena batch (no per-message strings)
+    static RecordBatch build(uint64_t base_offset, const MessageBatch& records) {
+        return build_from(base_offset, records, records.bytes());
+    }
+
+    // Wall clock in milliseconds since the epoch, the timestamp of records built without one
+    static uint64_t current_time_ms() {
+        return chrono::duration_cast<chrono::milliseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Compress the records in place, done once by the producer
+    void compress(CompressionCodec codec) {
+        if (codec == CompressionCodec::None) {
+            return;
+        }
+        if (this->codec() != CompressionCodec::None) {
+            throw logic_error("Record batch is already compressed");
+        }
+        string compressed;
+        put_u32(compressed, static_cast<uint32_t>(payload.size()));
+        compressed.append(Compression::compress(codec, payload));
+
+        payload = move(compressed);
+        header.payload_size = static_cast<uint32_t>(payload.size());
+        header.attributes = (header.attributes & ~RECORD_BATCH_CODEC_MASK) | static_cast<uint8_t>(codec);
+        unseal();
+    }
+
+    CompressionCodec codec() const {
+        return static_cast<CompressionCodec>(header.attributes & RECORD_BATCH_CODEC_MASK);
+    }
+
+    // Stamp the batch for broker-side deduplication, base_sequence numbers its first record
+    void set_producer(uint64_t producer_id, uint16_t producer_epoch, int32_t base_sequence) {
+        header.producer_id = producer_id;
+        header.producer_epoch = producer_epoch;
+        header.base_sequence = base_sequence;
+        unseal();
+    }
+
+    bool has_producer() const {
+        return header.producer_id != NO_PRODUCER_ID;
+    }
+
+    // Transaction marker of a producer, written by the transaction coordinator
+    static RecordBatch control(uint64_t producer_id, uint16_t producer_epoch, bool commit) {
+        RecordBatch batch = empty_batch(0);
+        batch.header.base_timestamp = batch.header.max_timestamp = current_time_ms();
+        batch.add_record(0, 0, "", commit ? "COMMIT" : "ABORT");
+        batch.header.payload_size = static_cast<uint32_t>(batch.payload.size());
+        batch.header.attributes = RECORD_BATCH_TRANSACTIONAL | RECORD_BATCH_CONTROL | (commit ? 0 : RECORD_BATCH_ABORT);
+        batch.header.producer_id = producer_id;
+        batch.header.producer_epoch = producer_epoch;
+        batch.seal();
+        return batch;
+    }
+
+    void set_transactional() {
+        header.attributes |= RECORD_BATCH_TRANSACTIONAL;
+        unseal();
+    }
+
+    // CRC32C of the batch as stored, without the base offset, magic and crc fields
+    uint32_t checksum() const {
+        const char* bytes = reinterpret_cast<const char*>(&header);
+        uint32_t crc = Crc32c::extend(0, bytes + offsetof(RecordBatchHeader, payload_size),
+                                      offsetof(RecordBatchHeader, magic) - offsetof(RecordBatchHeader, payload_size));
+        crc = Crc32c::extend(crc, bytes + offsetof(RecordBatchHeader, attributes),
+                             offsetof(RecordBatchHeader, crc) - offsetof(RecordBatchHeader, attributes));
+        return Crc32c::extend(crc, payload.data(), payload.size());
+    }
+
+    // Set the checksum once the batch is final (the producer before sending, the broker for its own batches)
+    // changing the batch afterwards through compress/set_producer/set_transactional drops it again
+    void seal() {
+        header.attributes |= RECORD_BATCH_CHECKSUM;
+        header.crc = checksum();
+    }
+
+    bool has_checksum() const {
+        return header.attributes & RECORD_BATCH_CHECKSUM;
+    }
+
+    // false when the batch has a checksum that its bytes no longer match
+    bool verify_checksum() const {
+        return !has_checksum() || header.crc == checksum();
+    }
+
+    bool is_transactional() const {
+        return header.is_transactional();
+    }
+
+    bool is_control() const {
+        return header.is_control();
+    }
+
+    // Decode records of this batch, decompressing if needed
+    vector<Message> records(int partition) const {
+        vector<Message> messages;
+        messages.reserve(header.record_count);
+        for_each_record([&](uint64_t offset, uint64_t timestamp, string_view key, string_view value) {
+            Message msg;
+            msg.offset = offset;
+            msg.key = string(key);
+            msg.value = string(value);
+            msg.timestamp = timestamp;
+            msg.partition = partition;
+            messages.push_back(move(msg));
+            return true;
+        });
+        return messages;
+    }
+
+    // Decode records with offset >= min_offset into an arena batch, at most max_count
+    // with a scan only records matching its filter are copied, the others just counted
+    // returns how many were added
+    size_t decode_into(MessageBatch& out, int partition, uint64_t min_offset, size_t max_count,
+                       RecordScan* scan = nullptr) const {
+        size_t added = 0;
+        for_each_record([&](uint64_t offset, uint64_t timestamp, string_view key, string_view value) {
+            if (offset < min_offset) return true;
+            if (added >= max_count) return false;
+            if (scan) {
+                if (scan->done()) return false;
+                scan->scanned++;
+                scan->next_offset = offset + 1;
+                if (!scan->filter.matches(key, value)) return true;
+            }
+            out.append(offset, key, value, timestamp, partition);
+            added++;
+            return true;
+        });
+        return added;
+    }
+
+    // Visit (offset, timestamp, key, value) of every record, views are valid during the call only
+    // visitor returns false to stop, control batches have no visible records
+    template <typename Visitor>
+    void for_each_record(Visitor visit) const {
+        if (is_control()) {
+            return;
+        }
+        string decompressed;
+        if (codec() != CompressionCodec::None) {
+            size_t pos = 0;
+            uint32_t uncompressed_size = get_u32(payload, pos);
+            decompressed = Compression::decompress(codec(), payload.substr(pos), uncompressed_size);
+        }
+        const string& data = codec() == CompressionCodec::None ? payload : decompressed;
+
+        string_view view(data);
+        bool timestamp_deltas = header.attributes & RECORD_BATCH_TIMESTAMP_DELTAS;
+        size_t pos = 0;
+        for (uint32_t i = 0; i < header.record_count; i++) {
+            uint32_t delta = get_u32(data, pos);
+            uint64_t timestamp = header.base_timestamp + (timestamp_deltas ? get_u32(data, pos) : 0);
+            uint32_t key_size = get_u32(data, pos);
+            uint32_t value_size = get_u32(data, pos);
+            if (pos + key_size + value_size > data.size()) {
+                throw runtime_error("Corrupt record batch at offset " + to_string(header.base_offset));
+            }
+            if (!visit(header.base_offset + delta, timestamp, view.substr(pos, key_size),
+                       view.substr(pos + key_size, value_size))) {
+                return;
+            }
+            pos += key_size + value_size;
+        }
+    }
+
+    uint64_t last_offset() const {
+        return header.base_offset + header.last_offset_delta;
+    }
+
+    size_t size_bytes() const {
+        return sizeof(RecordBatchHeader) + payload.size();
+    }
+
+    // Header followed by payload, as stored on disk
+    string serialize() const {
+        string bytes;
+        bytes.reserve(size_bytes());
+        bytes.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        bytes.append(payload);
+        return bytes;
+    }
+
+    // Decode a stored header of any version, upgraded to the current magic
+    // read(dst, pos, len) copies stored bytes, returns the stored header size or 0 if unknown
+    template <typename Reader>
+    static size_t read_header(RecordBatchHeader& header, uint64_t pos, Reader read) {
+        header = RecordBatchHeader{};
+        char* dst = reinterpret_cast<char*>(&header);
+        read(dst, pos, RECORD_BATCH_MIN_HEADER_SIZE);
+        size_t size = RecordBatchHeader::stored_size(header.magic);
+        if (size > RECORD_BATCH_MIN_HEADER_SIZE) {
+            read(dst + RECORD_BATCH_MIN_HEADER_SIZE, pos + RECORD_BATCH_MIN_HEADER_SIZE, size - RECORD_BATCH_MIN_HEADER_SIZE);
+        }
+        if (size > 0) {
+            header.magic = RECORD_BATCH_MAGIC;
+        }
+        return size;
+    }
+
+    // Split serialized batches (a fetch response) back into batches
+    static vector<RecordBatch> parse_all(const string& bytes) {
+        vector<RecordBatch> batches;
+        size_t pos = 0;
+        while (pos < bytes.size()) {
+            if (pos + RECORD_BATCH_MIN_HEADER_SIZE > bytes.size()) {
+                throw runtime_error("Truncated record batch header");
+            }
+            RecordBatch batch;
+            size_t header_size = RecordBatchHeader::stored_size(static_cast<uint8_t>(bytes[pos + offsetof(RecordBatchHeader, magic)]));
+            if (header_size == 0 || pos + header_size > bytes.size()) {
+                throw runtime_error("Corrupt record batch header at byte " + to_string(pos));
+            }
+            read_header(batch.header, pos, [&](char* dst, uint64_t from, size_t len) {
+                memcpy(dst, bytes.data() + from, len);
+            });
+            pos += header_size;
+            if (pos + batch.header.payload_size > bytes.size()) {
+                throw runtime_error("Corrupt record batch at offset " + to_string(batch.header.base_offset));
+            }
+            batch.payload = bytes.substr(pos, batch.header.payload_size);
+            pos += batch.header.payload_size;
+            batches.push_back(move(batch));
+        }
+        return batches;
+    }
+
+private:
+    // a stale checksum would read as corruption, so a changed batch has none until sealed again
+    void unseal() {
+        header.attributes &= ~RECORD_BATCH_CHECKSUM;
+        header.crc = 0;
+    }
+
+    static RecordBatch empty_batch(uint64_t base_offset) {
+        RecordBatch batch;
+        batch.header.base_offset = base_offset;
+        batch.header.magic = RECORD_BATCH_MAGIC;
+        return batch;
+    }
+
+    // Shared by both build overloads: Message and MessageView have the same fields
+    template <typename Records>
+    static RecordBatch build_from(uint64_t base_offset, const Records& records, size_t data_bytes) {
+        RecordBatch batch = empty_batch(base_offset);
+        uint64_t now = 0;
+        uint64_t min_timestamp = UINT64_MAX;
+        uint64_t max_timestamp = 0;
+        for (const auto& record : records) {
+            uint64_t timestamp = record.timestamp;
+            if (timestamp == 0) {
+                timestamp = now = now ? now : current_time_ms();
+            }
+            min_timestamp = min(min_timestamp, timestamp);
+            max_timestamp = max(max_timestamp, timestamp);
+        }
+        if (min_timestamp > max_timestamp) {
+            min_timestamp = 0;      // no records
+        }
+        if (max_timestamp - min_timestamp > UINT32_MAX) {
+            throw invalid_argument("Record timestamps of one batch are more than 2^32 ms apart");
+        }
+        batch.header.base_timestamp = min_timestamp;
+        batch.header.max_timestamp = max_timestamp;
+        size_t fields = 3;
+        if (max_timestamp != min_timestamp) {
+            batch.header.attributes |= RECORD_BATCH_TIMESTAMP_DELTAS;
+            fields = 4;
+        }
+        if (data_bytes > 0) {
+            batch.payload.reserve(data_bytes + records.size() * fields * sizeof(uint32_t));
+        }
+        for (const auto& record : records) {
+            batch.add_record(record.offset, record.timestamp ? record.timestamp : now, record.key, record.value);
+        }
+        batch.header.payload_size = static_cast<uint32_t>(batch.payload.size());
+        return batch;
+    }
+
+    void add_record(uint64_t offset, uint64_t timestamp, string_view key, string_view value) {
+        if (offset < header.base_offset) {
+            throw invalid_argument("Record offset " + to_string(offset) +
+                                   " is below batch base offset " + to_string(header.base_offset));
+        }
+        uint32_t delta = static_cast<uint32_t>(offset - header.base_offset);
+        put_u32(payload, delta);
+        if (header.attributes & RECORD_BATCH_TIMESTAMP_DELTAS) {
+            put_u32(payload, static_cast<uint32_t>(timestamp - header.base_timestamp));
+        }
+        put_u32(payload, static_cast<uint32_t>(key.size()));
+        put_u32(payload, static_cast<uint32_t>(value.size()));
+        payload.append(key.data(), key.size());
+        payload.append(value.data(), value.size());
+        header.last_offset_delta = max(header.last_offset_delta, delta);
+        header.record_count++;
+    }
+
+    static void put_u32(string& out, uint32_t value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    uint32_t get_u32(const string& data, size_t& pos) const {
+        if (pos + sizeof(uint32_t) > data.size()) {
+            throw runtime_error("Corrupt record batch at offset " + to_string(header.base_offset));
+        }
+        uint32_t value;
+        memcpy(&value, data.data() + pos, sizeof(value));
+        pos += sizeof(value);
+        return value;
+    }
+};
@@ -0,0 +1,148 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+using namespace std;
+
+/*
+ * RecordFilter: the records a filtered fetch returns
+ * Evaluated in the broker's decode loop (RecordBatch::decode_into) before a
+ * record is copied out, so the records a selective consumer would throw away
+ * cost neither the copy nor the transfer. Conditions combine with AND:
+ *   key prefix     keys starting with the given bytes
+ *   key set        keys equal to one of the given keys
+ *   value prefix   values starting with the given bytes (records carry no
+ *                  headers, a producer tags the value instead)
+ * A filter is built once and checked against every record, so the work is
+ * moved up front: prefixes of up to 8 bytes become a masked 64-bit word
+ * compared in one instruction, and the key set keeps a bitmap of its key
+ * lengths that turns most misses away before anything is hashed.
+*/
+
+class RecordFilter {
+public:
+    RecordFilter() = default;
+
+    // the key set holds views into keys_, copies would point into the original
+    RecordFilter(const RecordFilter&) = delete;
+    RecordFilter& operator=(const RecordFilter&) = delete;
+    RecordFilter(RecordFilter&&) = default;
+    RecordFilter& operator=(RecordFilter&&) = default;
+
+    RecordFilter& key_prefix(const string& prefix) {
+        key_prefix_ = Prefix(prefix);
+        return *this;
+    }
+
+    RecordFilter& keys(const vector<string>& keys) {
+        keys_ = keys;
+        key_set_.clear();
+        key_set_.reserve(keys_.size());
+        key_lengths_ = 0;
+        for (const string& key : keys_) {
+            key_set_.insert(key);
+            key_lengths_ |= length_bit(key.size());
+        }
+        has_keys_ = true;
+        return *this;
+    }
+
+    RecordFilter& value_prefix(const string& prefix) {
+        value_prefix_ = Prefix(prefix);
+        return *this;
+    }
+
+    // true when there is no condition, every record matches
+    bool empty() const {
+        return key_prefix_.empty() && value_prefix_.empty() && !has_keys_;
+    }
+
+    bool matches(string_view key, string_view value) const {
+        if (!key_prefix_.matches(key) || !value_prefix_.matches(value)) {
+            return false;
+        }
+        if (has_keys_) {
+            return (key_lengths_ & length_bit(key.size())) && key_set_.count(key) > 0;
+        }
+        return true;
+    }
+
+private:
+    class Prefix {
+    public:
+        Prefix() : word_(0), mask_(0) {}
+
+        explicit Prefix(const string& bytes) : bytes_(bytes), word_(0), mask_(0) {
+            if (bytes_.size() <= sizeof(uint64_t)) {
+                memcpy(&word_, bytes_.data(), bytes_.size());
+                mask_ = bytes_.size() == sizeof(uint64_t) ? ~0ULL : (1ULL << (8 * bytes_.size())) - 1;
+            }
+        }
+
+        bool empty() const {
+            return bytes_.empty();
+        }
+
+        bool matches(string_view data) const {
+            if (bytes_.empty()) {
+                return true;
+            }
+            if (data.size() < bytes_.size()) {
+                return false;
+            }
+            // short prefix and at least a word to load: one compare (little endian, like the log format)
+            if (mask_ != 0 && data.size() >= sizeof(uint64_t)) {
+                uint64_t word;
+                memcpy(&word, data.data(), sizeof(word));
+                return (word & mask_) == word_;
+            }
+            return memcmp(data.data(), bytes_.data(), bytes_.size()) == 0;
+        }
+
+    private:
+        string bytes_;
+        uint64_t word_;     // the prefix in the low bytes, when it fits
+        uint64_t mask_;     // 0 for an empty or long prefix
+    };
+
+    // lengths of 63 bytes and more share the top bit
+    static uint64_t length_bit(size_t length) {
+        return 1ULL << min<size_t>(length, 63);
+    }
+
+    Prefix key_prefix_;
+    Prefix value_prefix_;
+    bool has_keys_ = false;
+    vector<string> keys_;
+    unordered_set<string_view> key_set_;
+    uint64_t key_lengths_ = 0;
+};
+
+/*
+ * RecordScan: progress of one filtered read
+ * A selective filter may match nothing in a long stretch of log, so a read
+ * stops after examining limit records even with no match. next_offset is
+ * past the last record examined, where the consumer continues; it moves on
+ * even when nothing matched.
+*/
+
+struct RecordScan {
+    static constexpr size_t DEFAULT_LIMIT = 64 * 1024;
+
+    const RecordFilter& filter;
+    uint64_t next_offset;
+    size_t limit;
+    size_t scanned = 0;
+
+    RecordScan(const RecordFilter& filter, uint64_t start_offset, size_t limit = DEFAULT_LIMIT)
+        : filter(filter), next_offset(start_offset), limit(limit) {}
+
+    bool done() const {
+        return scanned >= limit;
+    }
+};
@@ -0,0 +1,536 @@
+#pragma once
+#include "hyperq/storage/file_cache.hpp"
+#include "hyperq/storage/index.hpp"
+#include "hyperq/storage/io_backend.hpp"
+#include "hyperq/storage/record_batch.hpp"
+#include "hyperq/metrics/metrics.hpp"
+#include "hyperq/metrics/tracing.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+/*
+ * Segment: one file of a partition log, named after the first offset it holds
+ *   <partition_dir>/00000000000000000042.log
+ * Only the newest (active) segment is appended to. Once rolled a segment is
+ * immutable, except that the log cleaner may swap in a compacted copy.
+ * Writes, fsyncs and fetch reads go through an IoBackend (io_uring or syscalls).
+ * The active segment may be preallocated: the file then has a zero tail past
+ * the last batch, so appends don't change its size and fdatasync has no
+ * metadata to flush. trim() cuts the tail once the segment is rolled.
+ * With direct I/O the active segment is written through a second O_DIRECT
+ * descriptor, reads stay buffered.
+ * A sparse TimeIndex over the batch timestamps answers offset-for-time
+ * lookups without reading the whole file.
+ * Recovery reads only batch headers, unless asked to verify checksums: then
+ * every payload is read and the file is cut before the first corrupt batch.
+ * The log asks for that on the active segment, the one a crash can garble.
+ * The file descriptor comes from the process-wide FileCache and may be closed
+ * while the segment sits idle; every operation pins it for its duration.
+ * Unsynced writes keep it pinned until flush(), so the fsync goes through the
+ * descriptor that saw any writeback error.
+*/
+
+class Segment {
+public:
+    Segment(const string& dir, uint64_t base_offset, const string& suffix = ".log",
+            shared_ptr<IoBackend> io = IoBackend::default_backend(), bool verify_checksums = false)
+        : dir_(dir),
+          path_(dir + "/" + file_name(base_offset, suffix)),
+          base_offset_(base_offset),
+          next_offset_(base_offset),
+          size_(0),
+          file_size_(0),
+          files_(FileCache::instance()),
+          file_id_(files_.register_file()),
+          direct_fd_(-1),
+          io_(move(io)) {
+        recover(files_.acquire(file_id_, path_, true), verify_checksums);
+    }
+
+    ~Segment() {
+        close_direct();
+        held_.reset();
+        files_.forget(file_id_);
+    }
+
+    Segment(const Segment&) = delete;
+    Segment& operator=(const Segment&) = delete;
+
+    // Append one batch at the end of the file, fsync before returning when sync is set
+    void append(const RecordBatch& batch, bool sync = true) {
+        string bytes = batch.serialize();
+        uint64_t position = size_;
+        if (sync) {
+            // one linked write+fdatasync on io_uring, the two stages end together
+            LatencyTimer timer(fsync_latency());
+            write(bytes, true);
+            TraceScope::mark(TraceStage::LogWrite);
+            TraceScope::mark(TraceStage::FsyncDone);
+        } else {
+            write(bytes, false);
+            TraceScope::mark(TraceStage::LogWrite);
+        }
+        size_ += bytes.size();
+        next_offset_ = batch.last_offset() + 1;
+        time_index_.add(batch.header, position);
+    }
+
+    // Force written data to disk (durability)
+    void flush() {
+        LatencyTimer timer(fsync_latency());
+        try {
+            io_->sync(held_ ? held_.fd() : file().fd());
+        } catch (const runtime_error& e) {
+            throw runtime_error(string(e.what()) + " on " + path_);
+        }
+        if (!removed_) {
+            held_.reset();
+        }
+    }
+
+    // Reserve disk space up to bytes (mode 0 fallocate, the file reads as zeros there)
+    void preallocate(uint64_t bytes) {
+        if (bytes <= file_size_) {
+            return;
+        }
+        if (::fallocate(file().fd(), 0, 0, bytes) != 0) {
+            // e.g. unsupported by the filesystem, appends just grow the file
+            if (errno != EOPNOTSUPP) {
+                cout << "[Segment] Preallocation of " << path_ << " failed: " << strerror(errno) << "\n";
+            }
+            return;
+        }
+        file_size_ = bytes;
+    }
+
+    // Cut the preallocated tail (and O_DIRECT padding) off a rolled segment
+    // it is not written again, the O_DIRECT descriptor is closed too
+    void trim() {
+        close_direct();
+        if (file_size_ == size_) {
+            return;
+        }
+        if (::ftruncate(file().fd(), size_) != 0) {
+            throw runtime_error("ftruncate failed on " + path_ + ": " + strerror(errno));
+        }
+        file_size_ = size_;
+    }
+
+    // Write appends with O_DIRECT from now on, false if the filesystem refuses
+    bool enable_direct_io() {
+        if (direct_fd_ >= 0) {
+            return true;
+        }
+        direct_fd_ = ::open(path_.c_str(), O_WRONLY | O_DIRECT);
+        if (direct_fd_ < 0) {
+            if (errno == EINVAL) {
+                cout << "[Segment] O_DIRECT not supported for " << path_ << ", using buffered writes\n";
+                return false;
+            }
+            throw runtime_error("Failed to open segment " + path_ + " with O_DIRECT: " + strerror(errno));
+        }
+        // direct writes start at a block boundary, so keep the partial last block around
+        direct_tail_.resize(size_ % IO_ALIGNMENT);
+        if (!direct_tail_.empty()) {
+            read_fully(file().fd(), &direct_tail_[0], direct_tail_.size(), size_ - direct_tail_.size());
+        }
+        return true;
+    }
+
+    bool direct_io() const {
+        return direct_fd_ >= 0;
+    }
+
+    // Visit batches in file order, skipping those that end before start_offset
+    // visitor returns false to stop early
+    void for_each_batch(uint64_t start_offset, const function<bool(const RecordBatch&)>& visit) const {
+        scan_batches(0, start_offset, visit);
+    }
+
+    // First record with a timestamp at or after timestamp, false when every record here is older
+    // the time index picks where to start, batches are scanned from there
+    bool find_time(uint64_t timestamp, TimestampOffset& found) const {
+        if (time_index_.max_timestamp() < timestamp) {
+            return false;
+        }
+        bool matched = false;
+        scan_batches(time_index_.lookup(timestamp), 0, [&](const RecordBatch& batch) {
+            if (batch.header.max_timestamp < timestamp) {
+                return true;
+            }
+            batch.for_each_record([&](uint64_t offset, uint64_t record_timestamp, string_view, string_view) {
+                if (record_timestamp < timestamp) {
+                    return true;
+                }
+                found = {offset, record_timestamp};
+                matched = true;
+                return false;
+            });
+            return !matched;
+        });
+        return matched;
+    }
+
+    const TimeIndex& time_index() const {
+        return time_index_;
+    }
+
+    // Visit batch headers in file order without reading payloads
+    void for_each_header(const function<void(const RecordBatchHeader&)>& visit) const {
+        ReadCursor cursor(*this);
+        uint64_t pos = 0;
+        while (pos + RECORD_BATCH_MIN_HEADER_SIZE <= size_) {
+            RecordBatchHeader header;
+            size_t header_size = RecordBatch::read_header(header, pos, [&](char* dst, uint64_t from, size_t len) {
+                cursor.read(from, dst, len);
+            });
+            if (header_size == 0) {
+                throw runtime_error("Corrupt record batch in " + path_ + " at byte " + to_string(pos));
+            }
+            visit(header);
+            pos += header_size + header.payload_size;
+        }
+    }
+
+    // Move the file to a new path, later reopens use it
+    void rename_to(const string& new_path) {
+        if (::rename(path_.c_str(), new_path.c_str()) != 0) {
+            throw runtime_error("Failed to rename " + path_ + " to " + new_path + ": " + strerror(errno));
+        }
+        path_ = new_path;
+    }
+
+    // Swap in a rewritten copy of this segment (compaction): the copy is renamed over our path,
+    // we keep reading the old file through a pinned descriptor, as if removed; a reopen by
+    // path after an eviction would read the copy at our positions
+    void replace_with(Segment& copy) {
+        if (!held_) {
+            held_ = file();
+        }
+        removed_ = true;
+        copy.rename_to(path_);
+    }
+
+    // Delete the file, the descriptor stays readable until the last owner lets go
+    // (pinned from here on, an unlinked file can't be reopened)
+    void remove() {
+        if (!held_) {
+            held_ = file();
+        }
+        removed_ = true;
+        ::unlink(path_.c_str());
+    }
+
+    uint64_t base_offset() const {
+        return base_offset_;
+    }
+
+    // Offset the next appended record will get
+    uint64_t next_offset() const {
+        return next_offset_;
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    // Last write time of the file, used for retention
+    // a stat by path, sweeping idle segments doesn't reopen them
+    int64_t last_modified_ms() const {
+        struct stat st;
+        if (::stat(path_.c_str(), &st) != 0) {
+            return 0;
+        }
+        return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000;
+    }
+
+    const string& path() const {
+        return path_;
+    }
+
+    const string& dir() const {
+        return dir_;
+    }
+
+    // Batches found corrupt, on recovery or by a verifying read
+    static Counter& checksum_failures() {
+        static Counter& counter = MetricsRegistry::instance().counter(
+            "hyperq_log_checksum_failures_total", {}, "Record batches whose CRC32C did not match");
+        return counter;
+    }
+
+    static string file_name(uint64_t base_offset, const string& suffix = ".log") {
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu", static_cast<unsigned long long>(base_offset));
+        return string(name) + suffix;
+    }
+
+    // Parse "<base_offset><suffix>", false for anything else
+    static bool parse_file_name(const string& name, uint64_t& base_offset, const string& suffix = ".log") {
+        if (name.size() <= suffix.size() ||
+            name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+            return false;
+        }
+        string digits = name.substr(0, name.size() - suffix.size());
+        if (digits.find_first_not_of("0123456789") != string::npos) {
+            return false;
+        }
+        base_offset = stoull(digits);
+        return true;
+    }
+
+private:
+    static constexpr size_t READ_WINDOW = 64 * 1024;
+    static constexpr size_t SKIP_READ = 512;
+    static constexpr size_t DIRECT_BUFFER_SIZE = 64 * 1024;
+
+    string dir_;
+    string path_;
+    uint64_t base_offset_;
+    uint64_t next_offset_;
+    uint64_t size_;         // end of the last batch
+    uint64_t file_size_;    // on disk, past size_ when preallocated or padded
+    FileCache& files_;
+    uint64_t file_id_;
+    FileCache::Handle held_;    // pinned across unsynced writes and once removed
+    bool removed_ = false;
+    int direct_fd_;         // O_DIRECT writer, -1 when buffered
+    string direct_tail_;    // bytes of the partial block at size_, rewritten by the next direct write
+    unique_ptr<AlignedBuffer> direct_buffer_;
+    shared_ptr<IoBackend> io_;
+    TimeIndex time_index_;
+
+    // Reader behind for_each_batch: small reads are served from a window of
+    // the file, and while a scan streams through consecutive windows the next
+    // one is read asynchronously. Large payloads are read straight into place.
+    class ReadCursor {
+    public:
+        explicit ReadCursor(const Segment& segment) : segment_(segment), file_(segment.file()), window_pos_(0) {}
+
+        void read(uint64_t pos, char* out, size_t len) {
+            while (len > 0) {
+                uint64_t window_end = window_pos_ + window_.size();
+                if (pos >= window_pos_ && pos < window_end) {
+                    size_t n = min<uint64_t>(len, window_end - pos);
+                    memcpy(out, window_.data() + (pos - window_pos_), n);
+                    out += n;
+                    pos += n;
+                    len -= n;
+                    continue;
+                }
+                bool sequential = !window_.empty() && pos == window_end;
+                if (ahead_ && ahead_->offset == pos) {
+                    size_t n = ahead_->wait();
+                    window_ = move(ahead_->buffer);
+                    window_.resize(n);
+                } else if (len >= READ_WINDOW) {
+                    read_fully(pos, out, len);
+                    return;
+                } else {
+                    // right after a skip only read a page, the scan may skip again
+                    window_.resize(min<uint64_t>(sequential ? READ_WINDOW : SKIP_READ, segment_.size_ - pos));
+                    read_fully(pos, &window_[0], window_.size());
+                }
+                window_pos_ = pos;
+                if (window_.empty()) {
+                    throw runtime_error("Unexpected end of segment " + segment_.path_);
+                }
+                ahead_.reset();
+                uint64_t next = pos + window_.size();
+                if (sequential && next < segment_.size_) {
+                    ahead_ = segment_.io_->read_async(file_.fd(), min<uint64_t>(READ_WINDOW, segment_.size_ - next), next);
+                }
+            }
+        }
+
+    private:
+        const Segment& segment_;
+        FileCache::Handle file_;    // pinned until a pending read-ahead is done, ahead_ goes first
+        string window_;             // file bytes from window_pos_
+        uint64_t window_pos_;
+        shared_ptr<PendingRead> ahead_;
+
+        void read_fully(uint64_t pos, char* out, size_t len) {
+            if (pos + len > segment_.size_) {
+                throw runtime_error("Unexpected end of segment " + segment_.path_);
+            }
+            segment_.read_fully(file_.fd(), out, len, pos);
+        }
+    };
+
+    FileCache::Handle file() const {
+        return files_.acquire(file_id_, path_);
+    }
+
+    void close_direct() {
+        if (direct_fd_ >= 0) {
+            ::close(direct_fd_);
+            direct_fd_ = -1;
+        }
+    }
+
+    // for_each_batch from the batch at byte position (a batch boundary)
+    void scan_batches(uint64_t position, uint64_t start_offset, const function<bool(const RecordBatch&)>& visit) const {
+        ReadCursor cursor(*this);
+        uint64_t pos = position;
+        while (pos + RECORD_BATCH_MIN_HEADER_SIZE <= size_) {
+            RecordBatch batch;
+            size_t header_size = RecordBatch::read_header(batch.header, pos, [&](char* dst, uint64_t from, size_t len) {
+                cursor.read(from, dst, len);
+            });
+            if (header_size == 0) {
+                throw runtime_error("Corrupt record batch in " + path_ + " at byte " + to_string(pos));
+            }
+            pos += header_size;
+
+            if (batch.last_offset() >= start_offset) {
+                batch.payload.resize(batch.header.payload_size);
+                cursor.read(pos, &batch.payload[0], batch.header.payload_size);
+                if (!visit(batch)) {
+                    return;
+                }
+            }
+            pos += batch.header.payload_size;
+        }
+    }
+
+    void write(const string& bytes, bool sync) {
+        if (direct_fd_ >= 0) {
+            write_direct(bytes, sync);
+            return;
+        }
+        if (!sync && !held_) {
+            held_ = file();     // until flush()
+        }
+        io_->write(held_ ? held_.fd() : file().fd(), bytes.data(), bytes.size(), size_, sync);
+        file_size_ = max(file_size_, size_ + bytes.size());
+    }
+
+    // Whole blocks from the one holding size_: staged tail + batch + zero padding
+    void write_direct(const string& bytes, bool sync) {
+        uint64_t block_start = size_ - direct_tail_.size();
+        size_t used = direct_tail_.size() + bytes.size();
+        size_t length = AlignedBuffer::align_up(used);
+        if (!direct_buffer_ || direct_buffer_->size() < length) {
+            direct_buffer_ = make_unique<AlignedBuffer>(max(length, DIRECT_BUFFER_SIZE));
+        }
+        char* out = direct_buffer_->data();
+        memcpy(out, direct_tail_.data(), direct_tail_.size());
+        memcpy(out + direct_tail_.size(), bytes.data(), bytes.size());
+        memset(out + used, 0, length - used);
+
+        io_->write(direct_fd_, out, length, block_start, sync);
+        size_t partial = used % IO_ALIGNMENT;
+        direct_tail_.assign(out + used - partial, partial);
+        file_size_ = max(file_size_, block_start + length);
+    }
+
+    static Histogram& fsync_latency() {
+        static Histogram& histogram = MetricsRegistry::instance().histogram(
+            "hyperq_log_fsync_latency_ns", {}, "Segment fsync latency in nanoseconds");
+        return histogram;
+    }
+
+    // Scan existing batches to find the next offset, dropping a torn tail write
+    // with verify a batch failing its checksum ends the log too
+    void recover(const FileCache::Handle& file, bool verify) {
+        int fd = file.fd();
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            throw runtime_error("fstat failed on " + path_ + ": " + strerror(errno));
+        }
+        uint64_t file_size = st.st_size;
+        file_size_ = file_size;
+
+        uint64_t pos = 0;
+        while (pos + RECORD_BATCH_MIN_HEADER_SIZE <= file_size) {
+            RecordBatchHeader header;
+            bool truncated = false;
+            size_t header_size = RecordBatch::read_header(header, pos, [&](char* dst, uint64_t from, size_t len) {
+                if (from + len > file_size) {
+                    truncated = true;
+                    return;
+                }
+                read_fully(fd, dst, len, from);
+            });
+            uint64_t batch_end = pos + header_size + header.payload_size;
+            if (header_size == 0 || truncated || batch_end > file_size) {
+                break;
+            }
+            if (verify && !payload_matches(fd, header, pos + header_size)) {
+                checksum_failures().add();
+                cout << "[Segment] Checksum mismatch in " << path_ << " at byte " << pos
+                     << " (offset " << header.base_offset << ")\n";
+                break;
+            }
+            next_offset_ = header.base_offset + header.last_offset_delta + 1;
+            time_index_.add(header, pos);
+            pos = batch_end;
+        }
+
+        if (pos != file_size && !zero_at(fd, pos, file_size)) {
+            cout << "[Segment] Truncating " << path_ << " from " << file_size
+                 << " to " << pos << " bytes (incomplete or corrupt batch)\n";
+            if (::ftruncate(fd, pos) != 0) {
+                throw runtime_error("ftruncate failed on " + path_ + ": " + strerror(errno));
+            }
+            file_size_ = pos;
+        }
+        size_ = pos;
+    }
+
+    bool payload_matches(int fd, const RecordBatchHeader& header, uint64_t payload_pos) const {
+        if (!(header.attributes & RECORD_BATCH_CHECKSUM)) {
+            return true;    // written before checksums
+        }
+        RecordBatch batch;
+        batch.header = header;
+        batch.payload.resize(header.payload_size);
+        read_fully(fd, &batch.payload[0], batch.payload.size(), payload_pos);
+        return batch.verify_checksum();
+    }
+
+    // A zeroed header where the next batch would start is preallocated space, not a torn write
+    bool zero_at(int fd, uint64_t pos, uint64_t file_size) const {
+        char header[sizeof(RecordBatchHeader)];
+        size_t len = min<uint64_t>(sizeof(header), file_size - pos);
+        read_fully(fd, header, len, pos);
+        for (size_t i = 0; i < len; i++) {
+            if (header[i] != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void read_fully(int fd, void* buffer, size_t len, uint64_t pos) const {
+        char* out = static_cast<char*>(buffer);
+        while (len > 0) {
+            ssize_t n = ::pread(fd, out, len, pos);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error("Read failed on " + path_ + ": " + strerror(errno));
+            }
+            if (n == 0) {
+                throw runtime_error("Unexpected end of segment " + path_);
+            }
+            out += n;
+            len -= n;
+            pos += n;
+        }
+    }
+};
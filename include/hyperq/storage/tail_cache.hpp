@@ -0,0 +1,261 @@
+#pragma once
+#include "hyperq/common/message_batch.hpp"
+#include "hyperq/metrics/metrics.hpp"
+#include "hyperq/storage/commit_log.hpp"
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+using namespace std;
+
+class TailCache;
+
+/*
+ * CacheBudget: memory shared by the tail caches of one broker
+ * Every cached batch is charged here in append order. Past the capacity the
+ * oldest batches broker-wide are evicted first, whichever partition holds
+ * them, so busy partitions keep a longer tail than idle ones.
+*/
+
+class CacheBudget {
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 64 * 1024 * 1024;
+
+    explicit CacheBudget(size_t capacity_bytes = DEFAULT_CAPACITY)
+        : capacity_bytes_(capacity_bytes),
+          used_bytes_(0),
+          used_gauge_(MetricsRegistry::instance().gauge(
+              "hyperq_tail_cache_bytes", {}, "Bytes of record batches held by partition tail caches")),
+          evictions_(MetricsRegistry::instance().counter(
+              "hyperq_tail_cache_evictions_total", {}, "Batches evicted from tail caches to stay in budget")) {}
+
+    // 0 turns caching off, shrinking evicts right away
+    void set_capacity(size_t capacity_bytes) {
+        lock_guard<mutex> lock(mutex_);
+        capacity_bytes_ = capacity_bytes;
+        evict_locked();
+    }
+
+    size_t get_capacity() const {
+        lock_guard<mutex> lock(mutex_);
+        return capacity_bytes_;
+    }
+
+    size_t get_used_bytes() const {
+        lock_guard<mutex> lock(mutex_);
+        return used_bytes_;
+    }
+
+private:
+    friend class TailCache;
+
+    struct Entry {
+        TailCache* cache;
+        uint64_t base_offset;
+        size_t bytes;
+    };
+
+    size_t capacity_bytes_;
+    size_t used_bytes_;
+    deque<Entry> entries_;      // oldest first
+    mutable mutex mutex_;       // never taken while holding a cache's lock, eviction locks caches under it
+    Gauge& used_gauge_;
+    Counter& evictions_;
+
+    void charge(TailCache* cache, uint64_t base_offset, size_t bytes) {
+        lock_guard<mutex> lock(mutex_);
+        entries_.push_back({cache, base_offset, bytes});
+        used_bytes_ += bytes;
+        used_gauge_.add(bytes);
+        evict_locked();
+    }
+
+    // forget every batch of cache (it was cleared or is going away)
+    void release(TailCache* cache) {
+        lock_guard<mutex> lock(mutex_);
+        size_t freed = 0;
+        auto kept = remove_if(entries_.begin(), entries_.end(), [&](const Entry& entry) {
+            if (entry.cache != cache) {
+                return false;
+            }
+            freed += entry.bytes;
+            return true;
+        });
+        entries_.erase(kept, entries_.end());
+        used_bytes_ -= freed;
+        used_gauge_.sub(freed);
+    }
+
+    inline void evict_locked();
+};
+
+/*
+ * TailCache: the newest record batches of one partition, in memory
+ * The partition pushes every batch it writes, as stored (base offset
+ * assigned), so the cache is always a contiguous run of batches ending at the
+ * log end. A fetch starting inside that run, which is where tail consumers
+ * read, is answered from memory without the commit log's lock or any disk
+ * I/O. Anything older goes to the log as before.
+ * Cached batches are the bytes that were written; a later compaction of their
+ * segment does not reach them, which is fine as compaction may lag anyway.
+*/
+
+class TailCache {
+public:
+    TailCache(const string& topic, int partition, shared_ptr<CacheBudget> budget)
+        : partition_(partition),
+          budget_(move(budget)),
+          bytes_(0),
+          hits_(MetricsRegistry::instance().counter(
+              "hyperq_tail_cache_hits_total",
+              {{"topic", topic}, {"partition", to_string(partition)}},
+              "Fetches served from the partition's tail cache", MetricSharding::Single)),
+          misses_(MetricsRegistry::instance().counter(
+              "hyperq_tail_cache_misses_total",
+              {{"topic", topic}, {"partition", to_string(partition)}},
+              "Fetches below the tail cache, read from the log", MetricSharding::Single)) {
+        if (!budget_) {
+            throw invalid_argument("cache budget cannot be null");
+        }
+    }
+
+    ~TailCache() {
+        budget_->release(this);
+    }
+
+    TailCache(const TailCache&) = delete;
+    TailCache& operator=(const TailCache&) = delete;
+
+    // Cache a batch the log just stored, called by the partition's single writer in offset order
+    void push(RecordBatch batch) {
+        uint64_t base_offset = batch.header.base_offset;
+        size_t bytes = batch.size_bytes();
+        {
+            unique_lock<shared_mutex> lock(mutex_);
+            if (!batches_.empty() && base_offset != batches_.back().last_offset() + 1) {
+                lock.unlock();
+                clear();    // not contiguous: start a new run from this batch
+                lock.lock();
+            }
+            batches_.push_back(move(batch));
+            bytes_ += bytes;
+        }
+        budget_->charge(this, base_offset, bytes);
+    }
+
+    // Stored batches from the one holding start_offset, as CommitLog::read_batches returns them
+    // false (out untouched) when start_offset is below the cached run
+    bool read_batches(uint64_t start_offset, size_t max_bytes, uint64_t end_offset, const BatchFilter& skip,
+                      vector<RecordBatch>& out) const {
+        shared_lock<shared_mutex> lock(mutex_);
+        if (!covers(start_offset)) {
+            misses_.add();
+            return false;
+        }
+        size_t bytes = 0;
+        for (auto it = first_holding(start_offset); it != batches_.end(); ++it) {
+            if (it->header.base_offset >= end_offset) {
+                break;
+            }
+            if (skip && skip(it->header)) {
+                continue;
+            }
+            if (!out.empty() && bytes + it->size_bytes() > max_bytes) {
+                break;
+            }
+            bytes += it->size_bytes();
+            out.push_back(*it);
+            if (bytes >= max_bytes) {
+                break;
+            }
+        }
+        hits_.add();
+        return true;
+    }
+
+    // Decode up to max_count messages from start_offset, as CommitLog::read_into does
+    // false (out untouched) when start_offset is below the cached run
+    bool read_into(uint64_t start_offset, size_t max_count, MessageBatch& out,
+                   uint64_t end_offset, const BatchFilter& skip, RecordScan* scan = nullptr) const {
+        shared_lock<shared_mutex> lock(mutex_);
+        if (!covers(start_offset)) {
+            misses_.add();
+            return false;
+        }
+        size_t added = 0;
+        for (auto it = first_holding(start_offset); it != batches_.end() && added < max_count && !(scan && scan->done()); ++it) {
+            if (it->header.base_offset >= end_offset) {
+                break;
+            }
+            if (skip && skip(it->header)) {
+                continue;
+            }
+            added += it->decode_into(out, partition_, start_offset, max_count - added, scan);
+        }
+        hits_.add();
+        return true;
+    }
+
+    void clear() {
+        {
+            unique_lock<shared_mutex> lock(mutex_);
+            batches_.clear();
+            bytes_ = 0;
+        }
+        budget_->release(this);
+    }
+
+    size_t get_batch_count() const {
+        shared_lock<shared_mutex> lock(mutex_);
+        return batches_.size();
+    }
+
+    size_t get_bytes() const {
+        shared_lock<shared_mutex> lock(mutex_);
+        return bytes_;
+    }
+
+private:
+    friend class CacheBudget;
+
+    int partition_;
+    shared_ptr<CacheBudget> budget_;
+    deque<RecordBatch> batches_;    // contiguous, oldest first
+    size_t bytes_;
+    mutable shared_mutex mutex_;
+    Counter& hits_;
+    Counter& misses_;
+
+    // caller holds mutex_; past the newest batch counts as covered (nothing newer exists)
+    bool covers(uint64_t start_offset) const {
+        return !batches_.empty() && batches_.front().header.base_offset <= start_offset;
+    }
+
+    deque<RecordBatch>::const_iterator first_holding(uint64_t start_offset) const {
+        return partition_point(batches_.begin(), batches_.end(),
+            [start_offset](const RecordBatch& batch) { return batch.last_offset() < start_offset; });
+    }
+
+    // budget eviction, drops the oldest batch if it is still the one that was charged
+    void evict(uint64_t base_offset, size_t bytes) {
+        unique_lock<shared_mutex> lock(mutex_);
+        if (!batches_.empty() && batches_.front().header.base_offset == base_offset) {
+            batches_.pop_front();
+            bytes_ -= bytes;
+        }
+    }
+};
+
+inline void CacheBudget::evict_locked() {
+    while (used_bytes_ > capacity_bytes_ && !entries_.empty()) {
+        Entry oldest = entries_.front();
+        entries_.pop_front();
+        oldest.cache->evict(oldest.base_offset, oldest.bytes);
+        used_bytes_ -= oldest.bytes;
+        used_gauge_.sub(oldest.bytes);
+        evictions_.add();
+    }
+}
@@ -0,0 +1,463 @@
+#pragma once
+#include "hyperq/storage/commit_log.hpp"
+#include "hyperq/storage/object_store.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+struct TieredStorageConfig {
+    chrono::milliseconds sync_interval = chrono::seconds(30);   // upload / local cleanup pass
+    size_t chunk_size = 1024 * 1024;                            // remote read granularity
+    size_t cache_bytes = 64 * 1024 * 1024;                      // read-ahead cache budget
+};
+
+/*
+ * RemoteReadCache: LRU cache of fixed-size chunks of remote objects
+ * A miss fetches the chunk synchronously and queues the next chunk for a
+ * background prefetch, so sequential historical reads mostly hit the cache.
+*/
+
+class RemoteReadCache {
+public:
+    RemoteReadCache(shared_ptr<ObjectStore> store, size_t chunk_size, size_t capacity_bytes)
+        : store_(store), chunk_size_(chunk_size), capacity_bytes_(capacity_bytes),
+          used_bytes_(0), running_(true) {
+        prefetcher_ = thread(&RemoteReadCache::prefetch_loop, this);
+    }
+
+    ~RemoteReadCache() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            running_ = false;
+        }
+        cv_.notify_all();
+        prefetcher_.join();
+    }
+
+    // Read length bytes at pos of an object of object_size bytes
+    string read(const string& key, uint64_t object_size, uint64_t pos, size_t length) {
+        string data;
+        data.reserve(length);
+        while (length > 0 && pos < object_size) {
+            uint64_t chunk = pos / chunk_size_;
+            shared_ptr<const string> bytes = get_chunk(key, chunk);
+            if ((chunk + 1) * chunk_size_ < object_size) {
+                request_prefetch(key, chunk + 1);
+            }
+
+            size_t in_chunk = pos - chunk * chunk_size_;
+            if (in_chunk >= bytes->size()) {
+                break;
+            }
+            size_t n = min(length, bytes->size() - in_chunk);
+            data.append(*bytes, in_chunk, n);
+            pos += n;
+            length -= n;
+        }
+        return data;
+    }
+
+    // Drop every cached chunk of an object
+    void invalidate(const string& key) {
+        lock_guard<mutex> lock(mutex_);
+        for (auto it = lru_.begin(); it != lru_.end();) {
+            if (it->key == key) {
+                used_bytes_ -= it->data->size();
+                index_.erase(chunk_id(it->key, it->chunk));
+                it = lru_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    size_t get_hits() const {
+        lock_guard<mutex> lock(mutex_);
+        return hits_;
+    }
+
+    size_t get_misses() const {
+        lock_guard<mutex> lock(mutex_);
+        return misses_;
+    }
+
+private:
+    struct Chunk {
+        string key;
+        uint64_t chunk;
+        shared_ptr<const string> data;
+    };
+
+    shared_ptr<ObjectStore> store_;
+    size_t chunk_size_;
+    size_t capacity_bytes_;
+    size_t used_bytes_;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    list<Chunk> lru_;    // front = most recently used
+    unordered_map<string, list<Chunk>::iterator> index_;
+    deque<pair<string, uint64_t>> prefetch_queue_;
+    set<string> prefetch_pending_;
+    bool running_;
+    thread prefetcher_;
+    mutable mutex mutex_;
+    condition_variable cv_;
+
+    static string chunk_id(const string& key, uint64_t chunk) {
+        return key + "#" + to_string(chunk);
+    }
+
+    shared_ptr<const string> get_chunk(const string& key, uint64_t chunk) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            auto it = index_.find(chunk_id(key, chunk));
+            if (it != index_.end()) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                hits_++;
+                return it->second->data;
+            }
+            misses_++;
+        }
+        // fetch outside the lock, remote reads are slow
+        auto data = make_shared<const string>(store_->get_range(key, chunk * chunk_size_, chunk_size_));
+        insert(key, chunk, data);
+        return data;
+    }
+
+    void insert(const string& key, uint64_t chunk, shared_ptr<const string> data) {
+        lock_guard<mutex> lock(mutex_);
+        string id = chunk_id(key, chunk);
+        if (index_.count(id)) {
+            return;
+        }
+        lru_.push_front(Chunk{key, chunk, data});
+        index_[id] = lru_.begin();
+        used_bytes_ += data->size();
+
+        while (used_bytes_ > capacity_bytes_ && lru_.size() > 1) {
+            Chunk& victim = lru_.back();
+            used_bytes_ -= victim.data->size();
+            index_.erase(chunk_id(victim.key, victim.chunk));
+            lru_.pop_back();
+        }
+    }
+
+    void request_prefetch(const string& key, uint64_t chunk) {
+        lock_guard<mutex> lock(mutex_);
+        string id = chunk_id(key, chunk);
+        if (index_.count(id) || prefetch_pending_.count(id)) {
+            return;
+        }
+        prefetch_pending_.insert(id);
+        prefetch_queue_.emplace_back(key, chunk);
+        cv_.notify_one();
+    }
+
+    void prefetch_loop() {
+        unique_lock<mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this] { return !running_ || !prefetch_queue_.empty(); });
+            if (!running_) {
+                return;
+            }
+            auto [key, chunk] = prefetch_queue_.front();
+            prefetch_queue_.pop_front();
+
+            lock.unlock();
+            try {
+                insert(key, chunk, make_shared<const string>(
+                    store_->get_range(key, chunk * chunk_size_, chunk_size_)));
+            } catch (const exception& e) {
+                cerr << "[TieredStorage] Prefetch of " << key << " failed: " << e.what() << "\n";
+            }
+            lock.lock();
+            prefetch_pending_.erase(chunk_id(key, chunk));
+        }
+    }
+};
+
+/*
+ * TieredStorage: offloads closed segments to an ObjectStore
+ * A background pass uploads closed segments of remote_storage topics and
+ * deletes local copies older than local_retention_ms once uploaded.
+ * Reads below the local log start offset are served from the remote tier.
+ * Object keys: "<topic>-<partition>/<base_offset>-<next_offset>.log"
+*/
+
+class TieredStorage {
+public:
+    TieredStorage(shared_ptr<CommitLog> commit_log,
+                  shared_ptr<ObjectStore> store,
+                  const TieredStorageConfig& config = TieredStorageConfig())
+        : TieredStorage(vector<shared_ptr<CommitLog>>{commit_log}, store, config) {}
+
+    // one per log directory, a partition may move between them
+    TieredStorage(vector<shared_ptr<CommitLog>> commit_logs,
+                  shared_ptr<ObjectStore> store,
+                  const TieredStorageConfig& config = TieredStorageConfig())
+        : commit_logs_(move(commit_logs)),
+          store_(store),
+          config_(config),
+          cache_(store, config.chunk_size, config.cache_bytes),
+          running_(false) {
+        bool missing = !store_ || commit_logs_.empty();
+        for (const auto& commit_log : commit_logs_) {
+            missing = missing || !commit_log;
+        }
+        if (missing) {
+            throw invalid_argument("commit_log and store cannot be null");
+        }
+        load_remote_index();
+    }
+
+    ~TieredStorage() {
+        stop();
+    }
+
+    void start() {
+        lock_guard<mutex> lock(thread_mutex_);
+        if (running_) {
+            return;
+        }
+        running_ = true;
+        thread_ = thread(&TieredStorage::run, this);
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(thread_mutex_);
+            if (!running_) {
+                return;
+            }
+            running_ = false;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    // Upload closed segments and drop aged local copies, returns segments uploaded
+    size_t sync_once() {
+        size_t uploaded = 0;
+        int64_t now_ms = chrono::duration_cast<chrono::milliseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+
+        for (const auto& commit_log : commit_logs_) {
+            for (const auto& [topic, partition] : commit_log->get_tiered_partitions()) {
+                LogConfig config = commit_log->get_topic_config(topic);
+                for (const auto& segment : commit_log->get_closed_segments(topic, partition)) {
+                    try {
+                        if (!is_uploaded(topic, partition, segment->base_offset())) {
+                            upload(topic, partition, *segment);
+                            uploaded++;
+                        }
+                        if (config.local_retention_ms >= 0 &&
+                            now_ms - segment->last_modified_ms() >= config.local_retention_ms) {
+                            commit_log->remove_segment(topic, partition, segment->base_offset());
+                        }
+                    } catch (const exception& e) {
+                        cerr << "[TieredStorage] Failed to offload " << segment->path() << ": " << e.what() << "\n";
+                        break;  // keep segments in order, retry next pass
+                    }
+                }
+            }
+        }
+        return uploaded;
+    }
+
+    // Read messages from the remote tier starting at start_offset into out
+    // end_offset and skip work as in CommitLog::read_into, returns how many were added
+    size_t read_into(const string& topic, int partition, uint64_t start_offset, size_t max_count, MessageBatch& out,
+                     uint64_t end_offset = UINT64_MAX, const BatchFilter& skip = nullptr, RecordScan* scan = nullptr) {
+        size_t added = 0;
+        for_each_remote_batch(topic, partition, start_offset, [&](const RecordBatch& batch) {
+            if (batch.header.base_offset >= end_offset) return false;
+            if (skip && skip(batch.header)) return true;
+            added += batch.decode_into(out, partition, start_offset, max_count - added, scan);
+            return added < max_count && !(scan && scan->done());
+        });
+        return added;
+    }
+
+    MessageBatch read(const string& topic, int partition, uint64_t start_offset, size_t max_count) {
+        MessageBatch messages;
+        read_into(topic, partition, start_offset, max_count, messages);
+        return messages;
+    }
+
+    // Read remote batches as stored, same budget rules as CommitLog::read_batches
+    vector<RecordBatch> read_batches(const string& topic, int partition, uint64_t start_offset, size_t max_bytes,
+                                     uint64_t end_offset = UINT64_MAX, const BatchFilter& skip = nullptr) {
+        vector<RecordBatch> batches;
+        size_t bytes = 0;
+        for_each_remote_batch(topic, partition, start_offset, [&](const RecordBatch& batch) {
+            if (batch.header.base_offset >= end_offset) return false;
+            if (skip && skip(batch.header)) return true;
+            if (!batches.empty() && bytes + batch.size_bytes() > max_bytes) return false;
+            bytes += batch.size_bytes();
+            batches.push_back(batch);
+            return bytes < max_bytes;
+        });
+        return batches;
+    }
+
+    // Offset after the last remotely stored record (0 if nothing uploaded)
+    uint64_t get_remote_end_offset(const string& topic, int partition) const {
+        lock_guard<mutex> lock(mutex_);
+        auto it = remote_.find(partition_key(topic, partition));
+        if (it == remote_.end() || it->second.empty()) return 0;
+        return prev(it->second.end())->second.next_offset;
+    }
+
+    // First remotely stored offset, false if nothing was uploaded
+    bool get_remote_start_offset(const string& topic, int partition, uint64_t& offset) const {
+        lock_guard<mutex> lock(mutex_);
+        auto it = remote_.find(partition_key(topic, partition));
+        if (it == remote_.end() || it->second.empty()) return false;
+        offset = it->second.begin()->first;
+        return true;
+    }
+
+    size_t get_remote_segment_count(const string& topic, int partition) const {
+        lock_guard<mutex> lock(mutex_);
+        auto it = remote_.find(partition_key(topic, partition));
+        return it == remote_.end() ? 0 : it->second.size();
+    }
+
+    const RemoteReadCache& get_cache() const {
+        return cache_;
+    }
+
+private:
+    struct RemoteSegment {
+        string object_key;
+        uint64_t base_offset;
+        uint64_t next_offset;
+        uint64_t size;
+    };
+
+    vector<shared_ptr<CommitLog>> commit_logs_;
+    shared_ptr<ObjectStore> store_;
+    TieredStorageConfig config_;
+    RemoteReadCache cache_;
+    // {topic-partition: {base_offset: segment}}
+    map<string, map<uint64_t, RemoteSegment>> remote_;
+    mutable mutex mutex_;
+
+    bool running_;
+    thread thread_;
+    mutex thread_mutex_;
+    condition_variable cv_;
+
+    static string partition_key(const string& topic, int partition) {
+        return topic + "-" + to_string(partition);
+    }
+
+    void run() {
+        unique_lock<mutex> lock(thread_mutex_);
+        while (running_) {
+            cv_.wait_for(lock, config_.sync_interval, [this] { return !running_; });
+            if (!running_) {
+                break;
+            }
+            lock.unlock();
+            sync_once();
+            lock.lock();
+        }
+    }
+
+    bool is_uploaded(const string& topic, int partition, uint64_t base_offset) const {
+        lock_guard<mutex> lock(mutex_);
+        auto it = remote_.find(partition_key(topic, partition));
+        return it != remote_.end() && it->second.count(base_offset);
+    }
+
+    void upload(const string& topic, int partition, const Segment& segment) {
+        RemoteSegment remote;
+        remote.base_offset = segment.base_offset();
+        remote.next_offset = segment.next_offset();
+        remote.size = segment.size();
+        remote.object_key = partition_key(topic, partition) + "/" +
+            Segment::file_name(remote.base_offset, "") + "-" +
+            Segment::file_name(remote.next_offset, ".log");
+
+        store_->put(remote.object_key, segment.path());
+
+        lock_guard<mutex> lock(mutex_);
+        remote_[partition_key(topic, partition)][remote.base_offset] = remote;
+        cout << "[TieredStorage] Uploaded " << remote.object_key << " (" << remote.size << " bytes)\n";
+    }
+
+    // Rebuild the remote index from object names after a restart
+    void load_remote_index() {
+        for (const auto& key : store_->list("")) {
+            size_t slash = key.rfind('/');
+            size_t dash = key.rfind('-');
+            if (slash == string::npos || dash == string::npos || dash < slash) {
+                continue;
+            }
+            uint64_t base_offset = 0;
+            uint64_t next_offset = 0;
+            if (!Segment::parse_file_name(key.substr(dash + 1), next_offset)) {
+                continue;
+            }
+            string base = key.substr(slash + 1, dash - slash - 1);
+            if (base.empty() || base.find_first_not_of("0123456789") != string::npos) {
+                continue;
+            }
+            base_offset = stoull(base);
+
+            RemoteSegment remote{key, base_offset, next_offset, store_->size(key)};
+            remote_[key.substr(0, slash)][base_offset] = remote;
+        }
+    }
+
+    // Walk remote batches holding offsets >= start_offset, visitor returns false to stop
+    void for_each_remote_batch(const string& topic, int partition, uint64_t start_offset,
+                               const function<bool(const RecordBatch&)>& visit) {
+        vector<RemoteSegment> segments;
+        {
+            lock_guard<mutex> lock(mutex_);
+            auto it = remote_.find(partition_key(topic, partition));
+            if (it == remote_.end()) return;
+            for (const auto& [base, remote] : it->second) {
+                if (remote.next_offset > start_offset) segments.push_back(remote);
+            }
+        }
+
+        for (const auto& remote : segments) {
+            uint64_t pos = 0;
+            while (pos + RECORD_BATCH_MIN_HEADER_SIZE <= remote.size) {
+                RecordBatch batch;
+                size_t header_size = RecordBatch::read_header(batch.header, pos, [&](char* dst, uint64_t from, size_t len) {
+                    string bytes = cache_.read(remote.object_key, remote.size, from, len);
+                    if (bytes.size() != len) {
+                        throw runtime_error("Truncated remote segment " + remote.object_key);
+                    }
+                    memcpy(dst, bytes.data(), len);
+                });
+                if (header_size == 0) {
+                    throw runtime_error("Corrupt record batch in remote segment " + remote.object_key);
+                }
+                pos += header_size;
+
+                if (batch.last_offset() >= start_offset) {
+                    batch.payload = cache_.read(remote.object_key, remote.size, pos, batch.header.payload_size);
+                    if (!visit(batch)) return;
+                }
+                pos += batch.header.payload_size;
+            }
+        }
+    }
+};
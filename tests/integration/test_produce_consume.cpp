@@ -0,0 +1,201 @@
+#include "hyperq/broker/broker.hpp"
+#include "hyperq/client/consumer.hpp"
+#include "hyperq/client/producer.hpp"
+#include <cassert>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+static Broker* make_broker(const string& dir, const string& topic, int partitions) {
+    filesystem::remove_all(dir);
+    filesystem::create_directories(dir);
+    Broker* broker = new Broker(1, dir);
+    broker->create_topic(topic, partitions, 1);
+    for (int p = 1; p < partitions; p++) {
+        broker->get_partition(topic, p)->promote_to_leader();
+    }
+    return broker;
+}
+
+// poll until count messages arrived or nothing comes for a while, per partition in arrival order
+static map<int, vector<string>> poll_messages(Consumer& consumer, size_t count) {
+    map<int, vector<string>> received;
+    size_t total = 0;
+    while (total < count) {
+        FetchResponse response = consumer.poll(chrono::milliseconds(1000));
+        assert(response.success);
+        if (response.messages.empty()) {
+            break;
+        }
+        for (const auto& msg : response.messages) {
+            received[msg.partition].push_back(string(msg.value));
+            total++;
+        }
+    }
+    return received;
+}
+
+void test_poll_prefetched() {
+    cout << "TEST: Poll Prefetched Partitions\n";
+
+    unique_ptr<Broker> broker(make_broker("/tmp/hyperq-produce-consume-test/poll", "events", 3));
+    Producer producer(*broker, "producer");
+    map<int, vector<string>> sent;
+    for (int i = 0; i < 90; i++) {
+        string key = "key-" + to_string(i % 7);
+        ProduceResponse response = producer.send("events", "value-" + to_string(i), key);
+        assert(response.success);
+        sent[response.partition].push_back("value-" + to_string(i));
+    }
+
+    // two fetchers over three partitions, every partition arrives complete and in order
+    Consumer consumer(*broker, "readers", "reader");
+    consumer.assign("events", {0, 1, 2}, 2, 2);
+    map<int, vector<string>> received = poll_messages(consumer, 90);
+    assert(received == sent);
+    assert(consumer.get_consumed_count() == 90);
+    for (const auto& [partition, values] : sent) {
+        assert(consumer.get_committed_offset("events", partition) == values.size());
+    }
+
+    // caught up: poll waits out the timeout and returns nothing
+    auto start = chrono::steady_clock::now();
+    FetchResponse idle = consumer.poll(chrono::milliseconds(50));
+    assert(idle.success && idle.messages.empty());
+    assert(chrono::steady_clock::now() - start >= chrono::milliseconds(50));
+
+    // records produced while assigned are picked up by the fetchers
+    ProduceResponse late = producer.send("events", "late", "key-0");
+    assert(late.success);
+    received = poll_messages(consumer, 1);
+    assert(received[late.partition] == vector<string>{"late"});
+    consumer.unassign();
+
+    // a new member of the group resumes from the committed offsets
+    producer.send("events", "after", "key-0");
+    Consumer next(*broker, "readers", "next");
+    next.assign("events", {0, 1, 2});
+    received = poll_messages(next, 1);
+    assert(received[late.partition] == vector<string>{"after"});
+
+    cout << "✓ PASSED\n";
+}
+
+void test_prefetch_bounded() {
+    cout << "TEST: Prefetch Queue Is Bounded\n";
+
+    unique_ptr<Broker> broker(make_broker("/tmp/hyperq-produce-consume-test/bounded", "large", 1));
+    Producer producer(*broker, "producer");
+    string payload(200 * 1024, 'x');
+    for (int i = 0; i < 20; i++) {
+        assert(producer.send("large", payload + to_string(i)).success);
+    }
+
+    // a fetch returns about 1MB, so the 4MB partition needs more fetches than fit in the buffer
+    Consumer consumer(*broker, "bounded", "bounded", IsolationLevel::ReadUncommitted, false);
+    consumer.assign("large", {0}, 2);
+    for (int i = 0; i < 200 && consumer.get_prefetched_count() < 2; i++) {
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    this_thread::sleep_for(chrono::milliseconds(50));
+    assert(consumer.get_prefetched_count() == 2);
+    assert(consumer.get_position("large", 0) == 0);
+
+    map<int, vector<string>> received = poll_messages(consumer, 20);
+    assert(received[0].size() == 20);
+    for (int i = 0; i < 20; i++) {
+        assert(received[0][i] == payload + to_string(i));
+    }
+    // without auto commit the position follows delivery and nothing is committed
+    assert(consumer.get_position("large", 0) == 20);
+    assert(consumer.get_committed_offset("large", 0) == 0);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_poll_error() {
+    cout << "TEST: Poll Delivers Fetch Errors\n";
+
+    unique_ptr<Broker> broker(make_broker("/tmp/hyperq-produce-consume-test/error", "events", 1));
+    Consumer consumer(*broker, "errors", "errors");
+    consumer.assign("events", {5});
+    FetchResponse response = consumer.poll(chrono::milliseconds(1000));
+    assert(!response.success);
+    assert(response.messages.empty());
+
+    bool threw = false;
+    try {
+        consumer.assign("events", {0}, 0);
+    } catch (const invalid_argument&) {
+        threw = true;
+    }
+    assert(threw);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_seek_to_time() {
+    cout << "TEST: Seek To Time\n";
+
+    unique_ptr<Broker> broker(make_broker("/tmp/hyperq-produce-consume-test/seek", "clicks", 1));
+    Partition* partition = broker->get_partition("clicks", 0);
+    for (int b = 0; b < 10; b++) {
+        vector<Message> records(10);
+        for (int i = 0; i < 10; i++) {
+            records[i].offset = i;
+            records[i].value = "click-" + to_string(b * 10 + i);
+            records[i].timestamp = 1000 + (b * 10 + i) * 100;
+        }
+        partition->append_batch(RecordBatch::build(0, records));
+    }
+
+    OffsetForTimeResponse lookup = broker->offsets_for_times("clicks", 0, 5950);
+    assert(lookup.success && lookup.found);
+    assert(lookup.offset == 50 && lookup.timestamp == 6000);
+    lookup = broker->offsets_for_times("clicks", 0, 20000);
+    assert(lookup.success && !lookup.found && lookup.offset == 100);
+    assert(!broker->offsets_for_times("clicks", 3, 0).success);
+    assert(!broker->offsets_for_times("missing", 0, 0).success);
+
+    // seeking an assigned partition drops what was prefetched and continues from the new position
+    Consumer consumer(*broker, "seekers", "seeker", IsolationLevel::ReadUncommitted, false);
+    consumer.assign("clicks", {0});
+    assert(poll_messages(consumer, 100)[0].size() == 100);
+    assert(consumer.seek_to_time("clicks", 0, 8000));
+    assert(consumer.get_position("clicks", 0) == 70);
+    vector<string> replayed = poll_messages(consumer, 30)[0];
+    assert(replayed.size() == 30);
+    assert(replayed.front() == "click-70" && replayed.back() == "click-99");
+    assert(!consumer.seek_to_time("clicks", 3, 0));
+    assert(consumer.get_position("clicks", 0) == 100);
+
+    // records carry their timestamps to the consumer
+    consumer.seek("clicks", 0, 42);
+    FetchResponse response = consumer.poll(chrono::milliseconds(1000));
+    assert(response.success && response.messages.front().offset == 42);
+    assert(response.messages.front().timestamp == 1000 + 42 * 100);
+
+    cout << "✓ PASSED\n";
+}
+
+int main() {
+    try {
+        filesystem::remove_all("/tmp/hyperq-produce-consume-test");
+
+        test_poll_prefetched();
+        test_prefetch_bounded();
+        test_poll_error();
+        test_seek_to_time();
+
+        cout << "\n✓ ALL TESTS PASSED\n";
+        return 0;
+    } catch (const exception& e) {
+        cerr << "✗ TEST FAILED: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,708 @@
+#include "hyperq/broker/broker.hpp"
+#include "hyperq/broker/partitioner.hpp"
+#include "hyperq/broker/shm_server.hpp"
+#include "hyperq/client/shm_producer.hpp"
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+using namespace std;
+
+void test_murmur2() {
+    cout << "TEST: murmur2 Matches Kafka\n";
+
+    // reference values from Kafka's Utils.murmur2
+    auto hash = [](const string& s) { return static_cast<int32_t>(murmur2(s.data(), s.size())); };
+    assert(hash("21") == -973932308);
+    assert(hash("foobar") == -790332482);
+    assert(hash("a-little-bit-long-string") == -985981536);
+    assert(hash("a-little-bit-longer-string") == -1486304829);
+    assert(hash("lkjh234lh9fiuh90y23oiuhsafujhadof229phr9h19h89h8") == -58897971);
+    assert(hash("abc") == 479470107);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_partitioners() {
+    cout << "TEST: Hash and Sticky Partitioners\n";
+
+    auto hash = Partitioner::create("hash");
+    auto sticky = Partitioner::create("sticky", 1000);
+
+    // keys map the same way in both, and stay put
+    for (int i = 0; i < 100; i++) {
+        string key = "customer-" + to_string(i);
+        int p = hash->partition("orders", key, 10, 8);
+        assert(p >= 0 && p < 8);
+        assert(sticky->partition("orders", key, 10, 8) == p);
+        assert(hash->partition("orders", key, 10, 8) == p);
+    }
+
+    // keyless: round-robin per topic
+    assert(hash->partition("a", "", 10, 3) == 0);
+    assert(hash->partition("a", "", 10, 3) == 1);
+    assert(hash->partition("b", "", 10, 3) == 0);
+    assert(hash->partition("a", "", 10, 3) == 2);
+    assert(hash->partition("a", "", 10, 3) == 0);
+
+    // keyless sticky: 1000 bytes on a partition before moving on
+    vector<int> counts(4, 0);
+    int previous = sticky->partition("s", "", 100, 4);
+    int switches = 0;
+    counts[previous]++;
+    for (int i = 1; i < 80; i++) {
+        int p = sticky->partition("s", "", 100, 4);
+        if (p != previous) {
+            switches++;
+        }
+        previous = p;
+        counts[p]++;
+    }
+    assert(switches == 7);
+    for (int count : counts) {
+        assert(count == 20);
+    }
+
+    bool threw = false;
+    try {
+        Partitioner::create("random");
+    } catch (const invalid_argument&) {
+        threw = true;
+    }
+    assert(threw);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_broker_sticky_produce() {
+    cout << "TEST: Broker Sticky Produce\n";
+
+    filesystem::create_directories("/tmp/hyperq-broker-test");
+    Broker broker(1, "/tmp/hyperq-broker-test");
+    broker.set_partitioner(Partitioner::create("sticky", 1024));
+    broker.create_topic("events", 4, 1);
+    for (int p = 1; p < 4; p++) {
+        broker.get_partition("events", p)->promote_to_leader();
+    }
+
+    // 100-byte records: runs of about 10 on one partition
+    string payload(100, 'x');
+    vector<int> partitions;
+    for (int i = 0; i < 40; i++) {
+        ProduceResponse response = broker.produce("events", payload);
+        assert(response.success);
+        partitions.push_back(response.partition);
+    }
+    int switches = 0;
+    for (size_t i = 1; i < partitions.size(); i++) {
+        switches += partitions[i] != partitions[i - 1];
+    }
+    assert(switches == 3);
+
+    // keyed records ignore stickiness
+    ProduceResponse first = broker.produce("events", payload, "user-1");
+    ProduceResponse second = broker.produce("events", payload, "user-1");
+    assert(first.partition == second.partition);
+    assert(first.partition == broker.partition_for("events", "user-1"));
+
+    cout << "✓ PASSED\n";
+}
+
+static size_t record_count(const FetchResponse& response) {
+    size_t count = 0;
+    for (const auto& batch : RecordBatch::parse_all(response.records)) {
+        count += batch.header.record_count;
+    }
+    return count;
+}
+
+void test_fetch_sessions() {
+    cout << "TEST: Multi-Partition Fetch Sessions\n";
+
+    filesystem::create_directories("/tmp/hyperq-broker-test");
+    Broker broker(1, "/tmp/hyperq-broker-test");
+    broker.create_topic("multi", 4, 1);
+    for (int p = 1; p < 4; p++) {
+        broker.get_partition("multi", p)->promote_to_leader();
+    }
+    for (int p = 0; p < 4; p++) {
+        for (int i = 0; i < 3; i++) {
+            broker.get_partition("multi", p)->append("p" + to_string(p) + "-" + to_string(i));
+        }
+    }
+
+    FetchRequest request;
+    for (int p = 0; p < 4; p++) {
+        request.partitions.push_back({"multi", p, 0});
+    }
+    request.partitions.push_back({"multi", 9, 0});
+
+    // one-off fetch: every partition in one response, no session kept
+    request.session_epoch = FETCH_SESSIONLESS;
+    MultiFetchResponse response = broker.fetch(request);
+    assert(response.success && response.session_id == NO_FETCH_SESSION);
+    assert(response.partitions.size() == 5);
+    for (const auto& data : response.partitions) {
+        assert(data.partition == 9 ? !data.response.success : record_count(data.response) == 3);
+    }
+    assert(broker.get_fetch_session_count() == 0);
+
+    // a session starts with a full response, then answers only what changed
+    request.session_epoch = 0;
+    response = broker.fetch(request);
+    assert(response.success && response.session_id != NO_FETCH_SESSION && response.session_epoch == 1);
+    assert(response.partitions.size() == 5);
+    assert(broker.get_fetch_session_count() == 1);
+
+    FetchRequest incremental;
+    incremental.session_id = response.session_id;
+    incremental.session_epoch = response.session_epoch;
+    response = broker.fetch(incremental);
+    assert(response.success && response.partitions.empty());      // unknown partition 9 was not kept
+
+    broker.get_partition("multi", 2)->append("p2-3");
+    incremental.session_epoch = response.session_epoch;
+    response = broker.fetch(incremental);
+    assert(response.partitions.size() == 1 && response.partitions[0].partition == 2);
+    assert(record_count(response.partitions[0].response) == 1);
+    assert(response.partitions[0].response.next_offset == 4);
+
+    // a replayed epoch is rejected and moves nothing
+    MultiFetchResponse replay = broker.fetch(incremental);
+    assert(!replay.success);
+
+    // forget partition 2, then add it back from the start
+    incremental.session_epoch = response.session_epoch;
+    incremental.forgotten = {{"multi", 2}};
+    broker.get_partition("multi", 2)->append("p2-4");
+    response = broker.fetch(incremental);
+    assert(response.success && response.partitions.empty());
+    incremental.session_epoch = response.session_epoch;
+    incremental.forgotten.clear();
+    incremental.partitions = {{"multi", 2, 0}};
+    response = broker.fetch(incremental);
+    assert(response.partitions.size() == 1 && record_count(response.partitions[0].response) == 5);
+
+    // a tiny byte budget still moves one batch per round, and the start rotates over the partitions
+    FetchRequest small;
+    small.max_bytes = 1;
+    for (int p = 0; p < 4; p++) {
+        small.partitions.push_back({"multi", p, 0});
+    }
+    response = broker.fetch(small);
+    size_t records = 0;
+    for (int round = 0; round < 20 && response.success; round++) {
+        size_t with_data = 0;
+        for (const auto& data : response.partitions) {
+            size_t count = record_count(data.response);
+            records += count;
+            with_data += count > 0;
+        }
+        assert(with_data <= 1);
+        small.session_id = response.session_id;
+        small.session_epoch = response.session_epoch;
+        small.partitions.clear();
+        response = broker.fetch(small);
+    }
+    assert(records == 14);
+
+    broker.close_fetch_session(small.session_id);
+    assert(broker.get_fetch_session_count() == 1);
+    assert(!broker.fetch(small).success);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_log_dirs() {
+    cout << "TEST: Partitions Across Log Directories\n";
+
+    vector<string> dirs = {"/tmp/hyperq-broker-test/disk-a", "/tmp/hyperq-broker-test/disk-b",
+                           "/tmp/hyperq-broker-test/disk-c"};
+    for (const auto& dir : dirs) {
+        filesystem::create_directories(dir);
+    }
+    LogConfig config;
+    config.segment_size = 4096;
+    string moved_to;
+    {
+        Broker broker(1, dirs);
+        broker.create_topic("spread", 6, 1, config);
+        for (int p = 1; p < 6; p++) {
+            broker.get_partition("spread", p)->promote_to_leader();
+        }
+        // new partitions go where the fewest are
+        map<string, int> placed;
+        for (int p = 0; p < 6; p++) {
+            placed[broker.get_log_dir("spread", p)]++;
+        }
+        assert(placed.size() == 3 && placed[dirs[0]] == 2 && placed[dirs[1]] == 2);
+
+        Partition* partition = broker.get_partition("spread", 0);
+        for (int i = 0; i < 300; i++) {
+            partition->append("before-" + to_string(i));
+        }
+
+        // move while a writer keeps appending: nothing is lost or reordered
+        string from = broker.get_log_dir("spread", 0);
+        moved_to = from == dirs[2] ? dirs[0] : dirs[2];
+        atomic<bool> stop(false);
+        int written = 0;
+        thread writer([&]() {
+            while (!stop) {
+                partition->append("during-" + to_string(written++));
+            }
+        });
+        this_thread::sleep_for(chrono::milliseconds(20));
+        broker.move_partition("spread", 0, moved_to);
+        this_thread::sleep_for(chrono::milliseconds(20));
+        stop = true;
+        writer.join();
+
+        assert(broker.get_log_dir("spread", 0) == moved_to);
+        assert(!filesystem::exists(from + "/spread-0"));
+        assert(filesystem::exists(moved_to + "/spread-0"));
+        MessageBatch messages = partition->read(0, 100000);
+        assert(messages.size() == size_t(300 + written));
+        for (size_t i = 0; i < messages.size(); i++) {
+            assert(messages[i].offset == i);
+            string expected = i < 300 ? "before-" + to_string(i) : "during-" + to_string(i - 300);
+            assert(messages[i].value == expected);
+        }
+
+        bool threw = false;
+        try {
+            broker.move_partition("spread", 0, "/tmp/hyperq-broker-test/disk-z");
+        } catch (const invalid_argument&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    // after a restart the topic is back and the partition is found where it was moved to
+    Broker restarted(1, dirs);
+    assert(!restarted.ensure_topic("spread", 6, 1, config));
+    assert(restarted.get_log_dir("spread", 0) == moved_to);
+    assert(restarted.get_partition("spread", 0)->read(299, 1)[0].value == "before-299");
+
+    // an append right after the bulk copy leaves size (preallocated) and mtime (same clock tick) as copied
+    {
+        vector<string> pair = {"/tmp/hyperq-broker-test/disk-x", "/tmp/hyperq-broker-test/disk-y"};
+        for (const auto& dir : pair) {
+            filesystem::create_directories(dir);
+        }
+        LogDirs log_dirs(pair, config);
+        shared_ptr<CommitLog> log = log_dirs.assign("held", 0);
+        log->append("held", 0, "bulk");
+        string from = log_dirs.get_dir("held", 0);
+        string segment = from + "/held-0/" + Segment::file_name(0);
+        shared_ptr<CommitLog> moved;
+        log_dirs.move("held", 0, from == pair[0] ? pair[1] : pair[0],
+                      [&](shared_ptr<CommitLog> target, const function<void()>& catch_up) {
+            struct stat copied;
+            assert(stat(segment.c_str(), &copied) == 0);
+            log->append("held", 0, "same-tick");
+            struct timespec times[2] = {copied.st_atim, copied.st_mtim};
+            assert(utimensat(AT_FDCWD, segment.c_str(), times, 0) == 0);
+            catch_up();
+            moved = target;
+        });
+        vector<Message> messages = moved->read("held", 0, 0, 10);
+        assert(messages.size() == 2 && messages[1].value == "same-tick");
+    }
+
+    bool threw = false;
+    try {
+        LogDirs duplicate({dirs[0], dirs[0]});
+    } catch (const invalid_argument&) {
+        threw = true;
+    }
+    assert(threw);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_quotas() {
+    cout << "TEST: Client and Group Quotas\n";
+
+    filesystem::create_directories("/tmp/hyperq-broker-test");
+    Broker broker(1, "/tmp/hyperq-broker-test");
+    broker.create_topic("quota", 1, 1);
+    QuotaLimits produce_limit;
+    produce_limit.produce_bytes_per_sec = 10000;
+    broker.set_quota(QuotaEntity::Client, "noisy", produce_limit);
+
+    // a second's worth of bytes goes through, the debt past it comes back as a delay
+    string payload(6000, 'x');
+    ProduceResponse response = broker.produce("quota", payload, "", "noisy");
+    assert(response.success && response.throttle_time_ms == 0);
+    response = broker.produce("quota", payload, "", "noisy");
+    assert(response.success && response.throttle_time_ms > 100 && response.throttle_time_ms <= 200);
+    uint32_t throttle = response.throttle_time_ms;
+
+    // sending inside the delay is turned away unwritten, other clients are not affected
+    response = broker.produce("quota", payload, "", "noisy");
+    assert(!response.success && response.throttle_time_ms > 0 && response.throttle_time_ms <= throttle);
+    assert(broker.get_partition("quota", 0)->get_high_watermark() == 1);
+    response = broker.produce("quota", payload, "", "quiet");
+    assert(response.success && response.throttle_time_ms == 0);
+
+    this_thread::sleep_for(chrono::milliseconds(throttle));
+    response = broker.produce("quota", "after", "", "noisy");
+    assert(response.success);
+
+    // a default request rate applies to clients without their own quota
+    QuotaLimits request_limit;
+    request_limit.requests_per_sec = 2;
+    broker.set_quota(QuotaEntity::Client, "", request_limit);
+    assert(broker.produce("quota", "a", "", "anyone").throttle_time_ms == 0);
+    assert(broker.produce("quota", "b", "", "anyone").throttle_time_ms == 0);
+    assert(broker.produce("quota", "c", "", "anyone").throttle_time_ms > 0);
+    assert(broker.get_quota(QuotaEntity::Client, "noisy").requests_per_sec == 0);
+    broker.set_quota(QuotaEntity::Client, "", QuotaLimits{});
+
+    // a group quota is shared by its members: a replaying consumer slows its whole group
+    QuotaLimits fetch_limit;
+    fetch_limit.fetch_bytes_per_sec = 1000;
+    broker.set_quota(QuotaEntity::Group, "replay", fetch_limit);
+    FetchResponse fetched = broker.fetch("quota", 0, "replay", 0, 1024 * 1024, IsolationLevel::ReadUncommitted, false, "member-1");
+    assert(fetched.success && !fetched.records.empty() && fetched.throttle_time_ms > 1000);
+    fetched = broker.fetch("quota", 0, "replay", 0, 1024 * 1024, IsolationLevel::ReadUncommitted, false, "member-2");
+    assert(fetched.success && fetched.records.empty() && fetched.next_offset == 0 && fetched.throttle_time_ms > 1000);
+
+    FetchRequest request;
+    request.session_epoch = FETCH_SESSIONLESS;
+    request.partitions.push_back({"quota", 0, 0});
+    request.client_id = "member-3";
+    request.group_id = "replay";
+    MultiFetchResponse multi = broker.fetch(request);
+    assert(multi.success && multi.throttle_time_ms > 1000);
+    assert(multi.partitions.size() == 1 && multi.partitions[0].response.records.empty());
+
+    // removing the quota lifts the throttle, debt and all
+    broker.set_quota(QuotaEntity::Group, "replay", QuotaLimits{});
+    multi = broker.fetch(request);
+    assert(multi.throttle_time_ms == 0 && record_count(multi.partitions[0].response) == 7);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_fetch_filter() {
+    cout << "TEST: Server-Side Fetch Filters\n";
+
+    // prefixes: word compare for keys of 8+ bytes, byte compare for short keys and long prefixes
+    RecordFilter filter;
+    assert(filter.empty() && filter.matches("anything", ""));
+    filter.key_prefix("cust");
+    assert(filter.matches("customer-1", "") && filter.matches("cust", "") && !filter.matches("cus", ""));
+    assert(!filter.matches("Customer-1", "") && !filter.matches("", ""));
+    filter.key_prefix("customer-1");
+    assert(filter.matches("customer-12", "") && !filter.matches("customer-2", ""));
+    filter.key_prefix("").value_prefix("B:");
+    assert(filter.matches("", "B:x") && !filter.matches("", "A:x"));
+
+    // key set, conditions combine
+    RecordFilter keys;
+    keys.keys({"user-1", "user-7", "not-a-user-key-longer-than-sixty-three-bytes-goes-in-the-top-bit"});
+    assert(keys.matches("user-1", "") && keys.matches("user-7", "") && !keys.matches("user-2", ""));
+    assert(!keys.matches("user-10", "") && !keys.matches("", ""));
+    assert(keys.matches("not-a-user-key-longer-than-sixty-three-bytes-goes-in-the-top-bit", ""));
+    RecordFilter moved = move(keys);
+    assert(moved.matches("user-7", "") && !moved.matches("user-8", ""));
+
+    // 100 records, keys user-0..9 in turn, values A:* then B:* from offset 50
+    filesystem::create_directories("/tmp/hyperq-broker-test");
+    Broker broker(1, "/tmp/hyperq-broker-test");
+    broker.create_topic("filter", 1, 1);
+    MessageBatch records;
+    for (int i = 0; i < 100; i++) {
+        records.append(i, "user-" + to_string(i % 10), (i < 50 ? "A:" : "B:") + to_string(i), 0, 0);
+    }
+    assert(broker.produce_batch("filter", 0, RecordBatch::build(0, records)).success);
+
+    RecordFilter user3;
+    user3.key_prefix("user-3");
+    FetchResponse response = broker.consume("filter", 0, "g-prefix", 0, IsolationLevel::ReadUncommitted, "", &user3);
+    assert(response.success && response.messages.size() == 10);
+    for (size_t i = 0; i < 10; i++) {
+        assert(response.messages[i].key == "user-3" && response.messages[i].offset == 3 + 10 * i);
+    }
+    assert(response.next_offset == 94);
+
+    // ten matches per consume, the next one goes on from next_offset
+    response = broker.consume("filter", 0, "g-keys", 0, IsolationLevel::ReadUncommitted, "", &moved);
+    assert(response.messages.size() == 10 && response.messages.back().offset == 47 && response.next_offset == 48);
+    response = broker.consume("filter", 0, "g-keys", response.next_offset, IsolationLevel::ReadUncommitted, "", &moved);
+    assert(response.messages.size() == 10 && response.messages.front().offset == 51 && response.next_offset == 98);
+
+    RecordFilter late;
+    late.key_prefix("user-2").value_prefix("B:");
+    response = broker.consume("filter", 0, "g-both", 0, IsolationLevel::ReadUncommitted, "", &late);
+    assert(response.messages.size() == 5 && response.messages.front().value == "B:52" && response.next_offset == 100);
+
+    // nothing matches: no messages, still past the scanned records
+    RecordFilter nobody;
+    nobody.key_prefix("nobody");
+    response = broker.consume("filter", 0, "g-none", 0, IsolationLevel::ReadUncommitted, "", &nobody);
+    assert(response.success && response.messages.empty() && response.next_offset == 100);
+    assert(broker.get_coordinator().get_offset("g-none", "filter", 0) == 100);
+
+    // exported lag runs from the committed offset to the log end: g-keys stopped at 98 of 100
+    PrometheusExporter exporter(0, "127.0.0.1");
+    broker.register_metrics(exporter);
+    string metrics = exporter.render();
+    assert(metrics.find("hyperq_consumer_group_lag{group=\"g-none\",topic=\"filter\",partition=\"0\"} 0\n") != string::npos);
+    assert(metrics.find("hyperq_consumer_group_lag{group=\"g-keys\",topic=\"filter\",partition=\"0\"} 2\n") != string::npos);
+
+    // a read gives up after the scan limit
+    RecordScan scan(nobody, 0, 30);
+    assert(broker.get_partition("filter", 0)->read(0, 10, IsolationLevel::ReadUncommitted, &scan).empty());
+    assert(scan.done() && scan.scanned == 30 && scan.next_offset == 30);
+
+    // an empty filter is no filter
+    RecordFilter none;
+    assert(broker.consume("filter", 0, "g-all", 0, IsolationLevel::ReadUncommitted, "", &none).messages.size() == 10);
+
+    cout << "✓ PASSED\n";
+}
+
+static RecordBatch shm_batch(const string& prefix, int count) {
+    MessageBatch records;
+    for (int i = 0; i < count; i++) {
+        records.append(i, "", prefix + to_string(i), 0, 0);
+    }
+    return RecordBatch::build(0, records);
+}
+
+// a client doing the handshake by hand, to get at its mapping of the ring
+// closing socket_fd hangs up
+static ShmRing shm_attach(const string& socket_path, int& fd) {
+    fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    assert(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    ShmHello hello{SHM_RING_MAGIC, SHM_RING_VERSION, "raw"};
+    assert(::send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(hello)));
+
+    ShmWelcome welcome{};
+    iovec iov{&welcome, sizeof(welcome)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    assert(::recvmsg(fd, &message, MSG_CMSG_CLOEXEC) == static_cast<ssize_t>(sizeof(welcome)));
+    int ring_fd = -1;
+    memcpy(&ring_fd, CMSG_DATA(CMSG_FIRSTHDR(&message)), sizeof(ring_fd));
+    return ShmRing::attach(ring_fd, welcome);
+}
+
+void test_shm_transport() {
+    cout << "TEST: Shared-Memory Produce\n";
+
+    filesystem::create_directories("/tmp/hyperq-broker-test");
+    Broker broker(1, "/tmp/hyperq-broker-test");
+    broker.create_topic("shm", 2, 1);
+    broker.get_partition("shm", 1)->promote_to_leader();
+    ShmServerConfig config;
+    config.slot_count = 8;
+    config.slot_size = 4096;
+    ShmServer server(broker, "/tmp/hyperq-broker-test/shm.sock", config);
+    server.start();
+
+    {
+        // more requests in flight than slots: submitting into a full ring collects the oldest
+        ShmProducer producer(server.get_socket_path(), "sidecar");
+        vector<uint64_t> tickets;
+        for (int i = 0; i < 50; i++) {
+            tickets.push_back(producer.submit("shm", 0, shm_batch("m" + to_string(i) + "-", 10)));
+        }
+        for (int i = 0; i < 50; i++) {
+            ProduceResponse response = producer.wait(tickets[i]);
+            assert(response.success && response.topic == "shm" && response.partition == 0);
+            assert(response.offset == static_cast<uint64_t>(i) * 10);
+        }
+        auto messages = broker.consume("shm", 0, "shm-group", 495).messages;
+        assert(messages.size() == 5 && string(messages[4].value) == "m49-9");
+
+        // keyed requests are partitioned by the broker, errors come back in the slot
+        ProduceResponse keyed = producer.send_batch("shm", -1, shm_batch("k", 1), "key");
+        assert(keyed.success && keyed.partition == broker.partition_for("shm", "key"));
+        ProduceResponse missing = producer.send_batch("nope", 0, shm_batch("x", 1));
+        assert(!missing.success && missing.error_message.find("does not exist") != string::npos);
+        bool threw = false;
+        try {
+            producer.submit("shm", 0, shm_batch(string(producer.max_request_bytes(), 'x'), 1));
+        } catch (const invalid_argument&) {
+            threw = true;
+        }
+        assert(threw);
+        assert(server.get_connection_count() == 1);
+    }
+
+    // a client rewriting the ring geometry in the shared header can't move the broker's slots
+    {
+        int socket_fd = -1;
+        ShmRing ring = shm_attach(server.get_socket_path(), socket_fd);
+        ring.header().slot_count = 0;
+        ring.header().slot_size = UINT32_MAX & ~uint32_t(CACHE_LINE_SIZE - 1);
+        for (uint64_t i = 0; i < 2; i++) {
+            ShmSlot& slot = ring.slot(i);
+            slot.partition = 0;
+            slot.topic_size = 0;
+            slot.key_size = 0;
+            slot.batch_size = 0;
+            slot.state.store(static_cast<uint32_t>(ShmSlotState::Request), memory_order_release);
+            ShmRing::notify(ring.header().broker);
+            auto responded = [&slot]() {
+                return slot.state.load(memory_order_acquire) == static_cast<uint32_t>(ShmSlotState::Response);
+            };
+            while (!ShmRing::wait(ring.header().client, responded)) {
+            }
+            assert(slot.success == 0 && string(slot.data(), slot.message_size).find("Malformed") == 0);
+        }
+        ::close(socket_fd);
+
+        ShmProducer producer(server.get_socket_path(), "after-corruption");
+        assert(producer.send_batch("shm", 0, shm_batch("ok", 1)).success);
+    }
+
+    // another process writes through its own mapping of the ring
+    vector<RecordBatch> batches;
+    for (int i = 0; i < 20; i++) {
+        batches.push_back(shm_batch("child-", 5));
+    }
+    uint64_t start = broker.get_partition("shm", 1)->get_high_watermark();
+    pid_t child = fork();
+    if (child == 0) {
+        int status = 0;
+        try {
+            ShmProducer producer(server.get_socket_path(), "child");
+            vector<uint64_t> tickets;
+            for (auto& batch : batches) {
+                tickets.push_back(producer.submit("shm", 1, move(batch)));
+            }
+            for (uint64_t ticket : tickets) {
+                status |= producer.wait(ticket).success ? 0 : 1;
+            }
+        } catch (...) {
+            status = 2;
+        }
+        _exit(status);
+    }
+    int status = -1;
+    waitpid(child, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(broker.get_partition("shm", 1)->get_high_watermark() == static_cast<long>(start + 100));
+
+    // hang-ups are noticed and their connections reaped
+    for (int i = 0; i < 50 && server.get_connection_count() > 0; i++) {
+        this_thread::sleep_for(chrono::milliseconds(20));
+    }
+    assert(server.get_connection_count() == 0);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_topic_registry() {
+    cout << "TEST: Topic Registry Across Restarts\n";
+
+    string dir = "/tmp/hyperq-registry-test";
+    filesystem::remove_all(dir);
+    LogConfig compacted;
+    compacted.cleanup_policy = CleanupPolicy::Compact;
+    compacted.segment_size = 8192;
+    {
+        Broker broker(1, dir);
+        assert(broker.ensure_topic("orders", 4, 1));
+        assert(!broker.ensure_topic("orders", 4, 1));
+        broker.create_topic("changelog", 2, 1, compacted);
+        MessageBatch records;
+        records.append(0, "order-1", "first", 0, 0);
+        assert(broker.produce_batch("orders", 0, RecordBatch::build(0, records)).success);
+        assert(broker.get_topic_registry().size() == 2);
+    }
+
+    // topics come back with their partition count and config, partitions open lazily
+    {
+        Broker broker(1, dir);
+        assert(broker.get_topic_count() == 2);
+        assert(broker.get_partition("orders", 3) != nullptr && broker.get_partition("orders", 4) == nullptr);
+        assert(!broker.ensure_topic("orders", 8, 1));
+        assert(broker.get_partition("orders", 4) == nullptr);
+        bool threw = false;
+        try {
+            broker.create_topic("orders", 4, 1);
+        } catch (const invalid_argument&) {
+            threw = true;
+        }
+        assert(threw);
+        assert(broker.get_partition("orders", 0)->read(0, 10)[0].value == "first");
+        assert(!broker.produce("changelog", "no key").success);    // still compacted
+        assert(filesystem::file_size(broker.get_topic_registry().get_log_path()) == 0);
+        broker.create_topic("events", 1, 1);
+    }
+
+    // a create torn by a crash is dropped, the entries before it are kept
+    {
+        ofstream log("/tmp/hyperq-registry-test/__topics.log", ios::binary | ios::app);
+        log << string("\x20\x00\x00\x00torn", 8);
+    }
+    {
+        Broker broker(1, dir);
+        assert(broker.get_topic_count() == 3 && broker.get_partition("events", 0) != nullptr);
+        broker.create_topic("audit", 1, 1);
+    }
+    {
+        TopicRegistry registry(dir);
+        assert(registry.size() == 4 && registry.contains("audit"));
+    }
+
+    // a damaged snapshot is an error, not an empty broker
+    {
+        fstream snapshot("/tmp/hyperq-registry-test/__topics.snapshot", ios::binary | ios::in | ios::out);
+        snapshot.seekp(20);
+        snapshot.put('X');
+    }
+    bool threw = false;
+    try {
+        TopicRegistry registry(dir);
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    cout << "✓ PASSED\n";
+}
+
+int main() {
+    try {
+        filesystem::remove_all("/tmp/hyperq-broker-test");
+
+        test_murmur2();
+        test_partitioners();
+        test_broker_sticky_produce();
+        test_fetch_sessions();
+        test_log_dirs();
+        test_quotas();
+        test_fetch_filter();
+        test_shm_transport();
+        test_topic_registry();
+
+        cout << "\n✓ ALL TESTS PASSED\n";
+        return 0;
+    } catch (const exception& e) {
+        cerr << "✗ TEST FAILED: " << e.what() << "\n";
+        return 1;
+    }
+}
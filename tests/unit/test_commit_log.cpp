@@ -1,6 +1,12 @@
 #include "hyperq/storage/commit_log.hpp"
 #include <cassert>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <thread>
+#include <vector>
 using namespace std;
 
 void test_append_and_read() {
@@ -64,11 +70,629 @@ void test_multiple_partitions() {
     cout << "✓ PASSED\n";
 }
 
+void test_compaction() {
+    cout << "TEST: Compaction\n";
+
+    CommitLog log("/tmp/hyperq-test");
+    LogConfig config;
+    config.segment_size = 128;
+    config.cleanup_policy = CleanupPolicy::Compact;
+    log.set_topic_config("compact", config);
+
+    // 4 keys, 10 versions each
+    map<string, string> latest;
+    for (int round = 0; round < 10; round++) {
+        for (int k = 0; k < 4; k++) {
+            string key = "key" + to_string(k);
+            string value = key + "-v" + to_string(round);
+            log.append("compact", 0, value, key);
+            latest[key] = value;
+        }
+    }
+    size_t size_before = log.get_log_size("compact", 0);
+    assert(log.get_segment_count("compact", 0) > 1);
+
+    uint64_t reclaimed = log.compact("compact", 0);
+    assert(reclaimed > 0);
+    assert(log.get_log_size("compact", 0) == size_before - reclaimed);
+    assert(log.compact("compact", 0) == 0);     // nothing rolled since
+
+    auto messages = log.read("compact", 0, 0, 100);
+    assert(messages.size() < 40);
+    map<string, string> seen;
+    uint64_t prev = 0;
+    for (size_t i = 0; i < messages.size(); i++) {
+        if (i > 0) assert(messages[i].offset > prev);
+        prev = messages[i].offset;
+        seen[messages[i].key] = messages[i].value;
+    }
+    assert(seen == latest);
+    assert(log.get_last_offset("compact", 0) == 39);
+
+    // rewritten batches keep their producer, and the last sequence the producer continues from
+    log.set_topic_config("compact-idempotent", config);
+    for (int i = 0; i < 6; i++) {
+        RecordBatch batch = RecordBatch::build(0, vector<Message>{
+            Message{0, "hot", "hot-" + to_string(i), 0, 0}, Message{1, "key" + to_string(i), "v", 0, 0}});
+        batch.set_producer(7, 3, i * 2);
+        log.append_batch("compact-idempotent", 0, move(batch));
+    }
+    assert(log.compact("compact-idempotent", 0) > 0);
+    size_t batches = 0;
+    size_t rewritten = 0;
+    log.for_each_header_from("compact-idempotent", 0, 0, [&](const RecordBatchHeader& header) {
+        int i = static_cast<int>(header.base_offset / 2);
+        assert(header.producer_id == 7 && header.producer_epoch == 3);
+        assert(header.last_sequence() == i * 2 + 1);
+        rewritten += header.record_count == 1;     // lost its old "hot" value
+        batches++;
+    });
+    assert(batches == 6 && rewritten > 0);
+
+    // keyless writes are rejected on compacted topics
+    bool threw = false;
+    try {
+        log.append("compact", 0, "no-key");
+    } catch (const invalid_argument&) {
+        threw = true;
+    }
+    assert(threw);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_compressed_batch() {
+    cout << "TEST: Compressed Batch\n";
+
+    CommitLog log("/tmp/hyperq-test");
+    CompressionCodec codec = Compression::is_available(CompressionCodec::Zlib)
+        ? CompressionCodec::Zlib : CompressionCodec::None;
+
+    vector<Message> records(20);
+    for (size_t i = 0; i < records.size(); i++) {
+        records[i].offset = i;
+        records[i].value = "{\"event\":\"page_view\",\"user\":" + to_string(i) + ",\"path\":\"/home\"}";
+    }
+    RecordBatch batch = RecordBatch::build(0, records);
+    size_t raw_size = batch.payload.size();
+    batch.compress(codec);
+    if (codec != CompressionCodec::None) {
+        assert(batch.payload.size() < raw_size);
+    }
+
+    assert(log.append_batch("compressed", 0, batch) == 0);
+    assert(log.append("compressed", 0, "plain") == 20);
+
+    // decoded reads start inside the batch
+    auto messages = log.read("compressed", 0, 5, 100);
+    assert(messages.size() == 16);
+    assert(messages[0].offset == 5);
+    assert(messages[0].value == records[5].value);
+    assert(messages.back().value == "plain");
+
+    // raw reads return the batch exactly as the producer compressed it
+    auto batches = log.read_batches("compressed", 0, 0, 1024 * 1024);
+    assert(batches.size() == 2);
+    assert(batches[0].codec() == codec);
+    assert(batches[0].payload == batch.payload);
+    assert(log.read_batches("compressed", 0, 0, 1).size() == 1);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_read_into_arena() {
+    cout << "TEST: Read Into Arena Batch\n";
+
+    CommitLog log("/tmp/hyperq-test");
+    for (int i = 0; i < 5; i++) {
+        log.append("arena", 0, "m" + to_string(i), "k" + to_string(i));
+    }
+
+    {
+        MessageBatch batch;
+        assert(log.read_into("arena", 0, 1, 3, batch) == 3);
+        assert(batch.size() == 3);
+        assert(batch[0].offset == 1);
+        assert(batch[0].key == "k1");
+        assert(batch[0].value == "m1");
+        assert(batch.back().value == "m3");
+    }
+
+    // the released buffer is handed to the next batch
+    size_t pooled = BufferPool::instance().get_free_count();
+    assert(pooled > 0);
+    MessageBatch next;
+    assert(BufferPool::instance().get_free_count() == pooled - 1);
+
+    cout << "✓ PASSED\n";
+}
+
+// same workload on the syscall backend and on io_uring (when the kernel has it)
+void test_io_backends() {
+    cout << "TEST: I/O Backends\n";
+
+    for (string type : {"syscall", "auto"}) {
+        auto io = IoBackend::create(type);
+        string dir = "/tmp/hyperq-test/io-" + io->name();
+        filesystem::remove_all(dir);
+        {
+            CommitLog log(dir, LogConfig(), io);
+            assert(&log.get_io_backend() == io.get());
+
+            // enough data for several read windows, one batch larger than a registered buffer
+            string value(100, 'v');
+            for (int b = 0; b < 50; b++) {
+                MessageBatch messages;
+                for (int i = 0; i < 100; i++) {
+                    messages.append(i, "k" + to_string(b * 100 + i), value, 0, 0);
+                }
+                assert(log.append_batch("io", 0, RecordBatch::build(0, messages)) == uint64_t(b * 100));
+            }
+            assert(log.append("io", 0, string(300 * 1024, 'x')) == 5000);
+
+            vector<RecordBatch> group;
+            MessageBatch one;
+            one.append(0, "", "grouped", 0, 0);
+            group.push_back(RecordBatch::build(0, one));
+            group.push_back(RecordBatch::build(0, one));
+            vector<exception_ptr> errors;
+            auto offsets = log.append_batches("io", 0, group, errors);
+            assert(offsets[0] == 5001 && offsets[1] == 5002);
+
+            // one partition per thread, all sharing the backend
+            vector<thread> writers;
+            for (int p = 1; p <= 4; p++) {
+                writers.emplace_back([&log, p]() {
+                    for (int i = 0; i < 50; i++) {
+                        log.append("io", p, "m" + to_string(i));
+                    }
+                });
+            }
+            for (auto& t : writers) {
+                t.join();
+            }
+        }
+
+        // reopen so reads come from disk after recovery
+        CommitLog log(dir, LogConfig(), io);
+        auto messages = log.read("io", 0, 0, 6000);
+        assert(messages.size() == 5003);
+        for (size_t i = 0; i < 5000; i++) {
+            assert(messages[i].offset == i);
+            assert(messages[i].key == "k" + to_string(i));
+        }
+        assert(messages[5000].value.size() == 300 * 1024);
+        assert(messages[5002].value == "grouped");
+
+        messages = log.read("io", 0, 4321, 3);
+        assert(messages.size() == 3);
+        assert(messages[0].offset == 4321 && messages[0].key == "k4321");
+
+        for (int p = 1; p <= 4; p++) {
+            messages = log.read("io", p, 0, 100);
+            assert(messages.size() == 50);
+            assert(messages[49].value == "m49");
+        }
+        cout << "  " << io->name() << " ok\n";
+    }
+
+    cout << "✓ PASSED\n";
+}
+
+void test_preallocated_segments() {
+    cout << "TEST: Preallocated Segments and Direct I/O\n";
+
+    for (bool direct_io : {false, true}) {
+        string dir = "/tmp/hyperq-test/prealloc-" + to_string(direct_io);
+        filesystem::remove_all(dir);
+        LogConfig config;
+        config.segment_size = 16 * 1024;
+        config.direct_io = direct_io;
+        {
+            CommitLog log(dir, config);
+            for (int i = 0; i < 300; i++) {
+                log.append("pre", 0, "message-" + to_string(i) + string(50, 'p'));
+            }
+            assert(log.get_segment_count("pre", 0) > 1);
+
+            // closed segments are cut to their batches, the active one keeps its reserved tail
+            auto closed = log.get_closed_segments("pre", 0);
+            for (const auto& segment : closed) {
+                assert(filesystem::file_size(segment->path()) == segment->size());
+            }
+            string active = dir + "/pre-0/" + Segment::file_name(closed.back()->next_offset());
+            assert(filesystem::file_size(active) == config.segment_size);
+        }
+
+        // the zero tail is not mistaken for a torn write, appends continue after the last batch
+        CommitLog log(dir, config);
+        assert(log.append("pre", 0, "after-reopen") == 300);
+        auto messages = log.read("pre", 0, 0, 400);
+        assert(messages.size() == 301);
+        for (int i = 0; i < 300; i++) {
+            assert(messages[i].offset == uint64_t(i));
+            assert(messages[i].value == "message-" + to_string(i) + string(50, 'p'));
+        }
+        assert(messages[300].value == "after-reopen");
+    }
+
+    cout << "✓ PASSED\n";
+}
+
+// syscall I/O whose fsyncs fail while failing is set, a disk going bad under the log
+class FailingSyncBackend : public IoBackend {
+public:
+    bool failing = false;
+
+    void write(int fd, const char* data, size_t len, uint64_t offset, bool sync) override {
+        inner_->write(fd, data, len, offset, false);
+        if (sync) {
+            this->sync(fd);
+        }
+    }
+    void sync(int fd) override {
+        if (failing) {
+            throw runtime_error("fdatasync failed: Input/output error");
+        }
+        inner_->sync(fd);
+    }
+    shared_ptr<PendingRead> read_async(int fd, size_t len, uint64_t offset) override {
+        return inner_->read_async(fd, len, offset);
+    }
+    string name() const override {
+        return "failing";
+    }
+
+private:
+    shared_ptr<IoBackend> inner_ = IoBackend::create("syscall");
+};
+
+void test_offline_after_io_error() {
+    cout << "TEST: Log Offline After an I/O Error\n";
+
+    string dir = "/tmp/hyperq-test/offline";
+    filesystem::remove_all(dir);
+    auto io = make_shared<FailingSyncBackend>();
+    MessageBatch one;
+    one.append(0, "", "value", 0, 0);
+    {
+        CommitLog log(dir, LogConfig(), io);
+        assert(log.append_batch("bad", 0, RecordBatch::build(0, one)) == 0);
+
+        // the group's fsync fails after both batches were written and their offsets handed out
+        io->failing = true;
+        vector<RecordBatch> group{RecordBatch::build(0, one), RecordBatch::build(0, one)};
+        vector<exception_ptr> errors;
+        bool threw = false;
+        try {
+            log.append_batches("bad", 0, group, errors);
+        } catch (const runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+
+        // the disk is back, the partition still takes nothing: a retry would land after the lost group
+        io->failing = false;
+        threw = false;
+        try {
+            log.append_batch("bad", 0, RecordBatch::build(0, one));
+        } catch (const runtime_error& e) {
+            threw = string(e.what()).find("offline") != string::npos;
+        }
+        assert(threw);
+        assert(log.append_batch("good", 0, RecordBatch::build(0, one)) == 0);
+    }
+
+    // a restart recovers what reached the log and appends after it
+    CommitLog log(dir);
+    assert(log.append_batch("bad", 0, RecordBatch::build(0, one)) == 3);
+    assert(log.read("bad", 0, 0, 10).size() == 4);
+
+    cout << "✓ PASSED\n";
+}
+
+// serialize a batch with the 24-byte magic 1 header written before producer ids existed
+static string legacy_batch(uint64_t base_offset, const vector<string>& values) {
+    MessageBatch records;
+    for (size_t i = 0; i < values.size(); i++) {
+        records.append(base_offset + i, "", values[i], 0, 0);
+    }
+    string bytes = RecordBatch::build(base_offset, records).serialize();
+    bytes[offsetof(RecordBatchHeader, magic)] = 1;
+    return bytes.substr(0, RECORD_BATCH_MIN_HEADER_SIZE) + bytes.substr(sizeof(RecordBatchHeader));
+}
+
+void test_legacy_batch_header() {
+    cout << "TEST: Legacy Batch Header\n";
+
+    filesystem::create_directories("/tmp/hyperq-test/legacy-0");
+    {
+        ofstream out("/tmp/hyperq-test/legacy-0/" + Segment::file_name(0), ios::binary);
+        out << legacy_batch(0, {"old-0", "old-1", "old-2"}) << legacy_batch(3, {"old-3"});
+    }
+
+    // old segments recover and read as before, new batches go after them in the current format
+    CommitLog log("/tmp/hyperq-test");
+    assert(log.get_last_offset("legacy", 0) == 3);
+    assert(log.append("legacy", 0, "new-4") == 4);
+    auto messages = log.read("legacy", 0, 0, 10);
+    assert(messages.size() == 5);
+    assert(messages[3].value == "old-3");
+    assert(messages[4].value == "new-4");
+
+    auto batches = RecordBatch::parse_all(legacy_batch(7, {"a", "b"}));
+    assert(batches.size() == 1);
+    assert(batches[0].header.magic == RECORD_BATCH_MAGIC);
+    assert(batches[0].header.producer_id == NO_PRODUCER_ID);
+    assert(batches[0].records(0).size() == 2);
+
+    cout << "✓ PASSED\n";
+}
+
+// batch b, record i: a clock ticking 2ms per record and 10ms per batch
+static uint64_t record_time(int b, int i) {
+    return 10000 + b * 10 + i * 2;
+}
+
+void test_time_index() {
+    cout << "TEST: Timestamp Index\n";
+
+    LogConfig config;
+    config.segment_size = 16 * 1024;
+    auto check = [](const CommitLog& log) {
+        TimestampOffset found;
+        assert(log.offset_for_time("times", 0, record_time(120, 3), found));
+        assert(found.offset == 603 && found.timestamp == record_time(120, 3));
+        assert(log.offset_for_time("times", 0, record_time(120, 3) - 1, found));
+        assert(found.offset == 603);
+        assert(log.offset_for_time("times", 0, record_time(199, 4), found) && found.offset == 999);
+        assert(!log.offset_for_time("times", 0, record_time(199, 4) + 1, found));
+
+        // batch 50 came from a skewed clock: it is older than everything, yet later in the log
+        assert(log.offset_for_time("times", 0, 0, found) && found.offset == 0);
+        assert(log.offset_for_time("times", 0, record_time(50, 0), found) && found.offset == 255);
+    };
+    {
+        CommitLog log("/tmp/hyperq-test", config);
+        string value(100, 't');
+        for (int b = 0; b < 200; b++) {
+            vector<Message> records(5);
+            for (int i = 0; i < 5; i++) {
+                records[i].offset = i;
+                records[i].value = value;
+                records[i].timestamp = b == 50 ? 100 : record_time(b, i);
+            }
+            assert(log.append_batch("times", 0, RecordBatch::build(0, records)) == uint64_t(b * 5));
+        }
+        check(log);
+
+        // timestamps are stored per record, the index only holds a few entries per segment
+        auto messages = log.read("times", 0, 603, 1);
+        assert(messages[0].timestamp == record_time(120, 3));
+        auto closed = log.get_closed_segments("times", 0);
+        assert(closed.size() > 1);
+        for (const auto& segment : closed) {
+            assert(segment->time_index().size() > 0 && segment->time_index().size() < 10);
+        }
+
+        // records without a timestamp get the time they were appended
+        uint64_t before = RecordBatch::current_time_ms();
+        log.append("times", 1, "untimed");
+        uint64_t stamped = log.read("times", 1, 0, 1)[0].timestamp;
+        assert(stamped >= before && stamped <= RecordBatch::current_time_ms());
+    }
+
+    // the index is rebuilt from the batch headers on reopen
+    CommitLog reopened("/tmp/hyperq-test", config);
+    check(reopened);
+
+    cout << "✓ PASSED\n";
+}
+
+// flip one byte of a segment file
+static void corrupt_byte(const string& path, uint64_t pos) {
+    fstream file(path, ios::in | ios::out | ios::binary);
+    file.seekg(pos);
+    char byte = static_cast<char>(file.get());
+    file.seekp(pos);
+    file.put(static_cast<char>(byte ^ 0x5a));
+}
+
+void test_checksums() {
+    cout << "TEST: Batch Checksums\n";
+
+    // CRC32C check value, and the hardware and table paths agreeing at any length and alignment
+    assert(Crc32c::compute("123456789", 9) == 0xe3069283);
+    assert(Crc32c::extend_portable(0, "123456789", 9) == 0xe3069283);
+    string data(3 * 8192 * 2 + 3 * 256 + 100, '\0');
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<char>(i * 2654435761u >> 13);
+    }
+    for (size_t len : {0, 1, 7, 8, 100, 767, 768, 1000, 24575, 24576, 30000, 50000}) {
+        for (size_t start : {0, 1, 5}) {
+            uint32_t expected = Crc32c::extend_portable(0, data.data() + start, len);
+            assert(Crc32c::compute(data.data() + start, len) == expected);
+            uint32_t split = Crc32c::extend(Crc32c::compute(data.data() + start, len / 3), data.data() + start + len / 3, len - len / 3);
+            assert(split == expected);
+        }
+    }
+
+    // the base offset is not covered, anything else is
+    MessageBatch records;
+    records.append(0, "key", "value", 0, 0);
+    RecordBatch batch = RecordBatch::build(0, records);
+    assert(!batch.has_checksum() && batch.verify_checksum());
+    batch.seal();
+    batch.header.base_offset = 42;
+    assert(batch.has_checksum() && batch.verify_checksum());
+    batch.payload[batch.payload.size() - 1] ^= 1;
+    assert(!batch.verify_checksum());
+    batch.set_producer(7, 0, 0);
+    assert(!batch.has_checksum());
+
+    // recovery cuts the active segment before a corrupt batch
+    vector<RecordBatch> stored;
+    {
+        CommitLog log("/tmp/hyperq-test");
+        for (int i = 0; i < 20; i++) {
+            log.append("crc", 0, "value-" + to_string(100 + i));
+        }
+        stored = log.read_batches("crc", 0, 0, SIZE_MAX);
+    }
+    assert(stored.size() == 20 && stored[0].has_checksum());
+    uint64_t pos = 0;
+    for (int i = 0; i < 10; i++) {
+        pos += stored[i].size_bytes();
+    }
+    corrupt_byte("/tmp/hyperq-test/crc-0/" + Segment::file_name(0), pos + sizeof(RecordBatchHeader) + 14);
+    {
+        CommitLog log("/tmp/hyperq-test");
+        assert(log.get_last_offset("crc", 0) == 9);
+        assert(log.append("crc", 0, "after-recovery") == 10);
+        auto messages = log.read("crc", 0, 0, 100);
+        assert(messages.size() == 11 && messages[10].value == "after-recovery");
+    }
+
+    // rolled segments are only checked by reads that ask for it
+    LogConfig config;
+    config.segment_size = 512;
+    {
+        CommitLog log("/tmp/hyperq-test", config);
+        for (int i = 0; i < 20; i++) {
+            log.append("crc-read", 0, "value-" + to_string(100 + i));
+        }
+        assert(log.get_segment_count("crc-read", 0) > 1);
+    }
+    corrupt_byte("/tmp/hyperq-test/crc-read-0/" + Segment::file_name(0), sizeof(RecordBatchHeader) + 14);
+    {
+        CommitLog log("/tmp/hyperq-test", config);
+        assert(log.get_last_offset("crc-read", 0) == 19);
+        assert(log.read_batches("crc-read", 0, 0, 1).size() == 1);
+    }
+    config.verify_checksums = true;
+    CommitLog verifying("/tmp/hyperq-test", config);
+    bool threw = false;
+    try {
+        verifying.read_batches("crc-read", 0, 0, 1);
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    assert(verifying.read("crc-read", 0, 1, 1)[0].value == "value-101");
+
+    cout << "✓ PASSED\n";
+}
+
+static size_t open_fd_count() {
+    return distance(filesystem::directory_iterator("/proc/self/fd"), filesystem::directory_iterator());
+}
+
+void test_file_cache() {
+    cout << "TEST: Segment File Cache\n";
+
+    // pinned descriptors outlive eviction, the cache goes over capacity instead
+    FileCache cache(FileCache::MIN_CAPACITY);
+    filesystem::create_directories("/tmp/hyperq-test/fds");
+    vector<uint64_t> ids;
+    for (size_t i = 0; i <= FileCache::MIN_CAPACITY * 2; i++) {
+        ids.push_back(cache.register_file());
+    }
+    FileCache::Handle pinned = cache.acquire(ids[0], "/tmp/hyperq-test/fds/0", true);
+    for (size_t i = 1; i < ids.size(); i++) {
+        FileCache::Handle handle = cache.acquire(ids[i], "/tmp/hyperq-test/fds/" + to_string(i), true);
+        assert(cache.open_count() <= FileCache::MIN_CAPACITY + 1);
+    }
+    assert(fcntl(pinned.fd(), F_GETFD) != -1);
+    assert(cache.open_count() == FileCache::MIN_CAPACITY);
+    int fd = pinned.fd();
+    pinned.reset();
+    assert(cache.acquire(ids[0], "/tmp/hyperq-test/fds/0").fd() == fd);    // most recently used, still open
+
+    // a log with many more segments than descriptors
+    FileCache& files = FileCache::instance();
+    size_t capacity = files.capacity();
+    files.set_capacity(FileCache::MIN_CAPACITY);
+    size_t fds_before = open_fd_count();
+    LogConfig config;
+    config.preallocate = false;
+    config.segment_size = 256;
+    {
+        CommitLog log("/tmp/hyperq-test", config);
+        const int partitions = 100;
+        for (int round = 0; round < 5; round++) {
+            for (int p = 0; p < partitions; p++) {
+                log.append("fds", p, "p" + to_string(p) + "-" + to_string(round));
+            }
+            assert(files.open_count() <= FileCache::MIN_CAPACITY);
+        }
+        for (int p = 0; p < partitions; p++) {
+            auto messages = log.read("fds", p, 0, 10);
+            assert(messages.size() == 5 && messages[4].value == "p" + to_string(p) + "-4");
+        }
+        assert(log.get_segment_count("fds", 0) > 1);
+        assert(open_fd_count() <= fds_before + FileCache::MIN_CAPACITY);
+
+        // a removed segment stays readable for whoever still holds it
+        auto closed = log.get_closed_segments("fds", 7);
+        assert(log.remove_segment("fds", 7, closed[0]->base_offset()));
+        for (int p = 0; p < partitions; p++) {
+            log.read("fds", p, 0, 10);
+        }
+        size_t records = 0;
+        closed[0]->for_each_batch(0, [&](const RecordBatch& batch) {
+            records += batch.header.record_count;
+            return true;
+        });
+        assert(records > 0);
+
+        // so does a segment compaction swapped a cleaned copy in for, however its descriptor was evicted
+        LogConfig compacted = config;
+        compacted.cleanup_policy = CleanupPolicy::Compact;
+        log.set_topic_config("fds-compact", compacted);
+        for (int i = 0; i < 20; i++) {
+            log.append("fds-compact", 0, "v" + to_string(i), i % 2 ? "k" : "u" + to_string(i));    // every other one survives
+        }
+        auto before = log.get_closed_segments("fds-compact", 0);
+        auto batch_values = [](const Segment& segment) {
+            vector<string> result;
+            segment.for_each_batch(0, [&](const RecordBatch& batch) {
+                for (const auto& msg : batch.records(0)) {
+                    result.push_back(msg.value);
+                }
+                return true;
+            });
+            return result;
+        };
+        vector<string> old_values = batch_values(*before[0]);
+        assert(log.compact("fds-compact", 0) > 0);
+        for (int p = 0; p < partitions; p++) {
+            log.read("fds", p, 0, 10);
+        }
+        assert(batch_values(*before[0]) == old_values);
+    }
+    assert(files.open_count() == 0);
+    files.set_capacity(capacity);
+
+    cout << "✓ PASSED\n";
+}
+
 int main() {
     try {
+        filesystem::remove_all("/tmp/hyperq-test");
+
         test_append_and_read();
         test_read_from_offset();
         test_multiple_partitions();
+        test_compaction();
+        test_compressed_batch();
+        test_read_into_arena();
+        test_io_backends();
+        test_preallocated_segments();
+        test_legacy_batch_header();
+        test_time_index();
+        test_checksums();
+        test_file_cache();
+        test_offline_after_io_error();
         
         cout << "\n✓ ALL TESTS PASSED\n";
         return 0;
@@ -0,0 +1,264 @@
+#include "hyperq/broker/broker.hpp"
+#include "hyperq/client/consumer.hpp"
+#include "hyperq/client/producer.hpp"
+#include <cassert>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+static vector<string> consume_all(Consumer& consumer, const string& topic, int partition) {
+    vector<string> values;
+    while (true) {
+        FetchResponse response = consumer.consume(topic, partition);
+        assert(response.success);
+        if (response.messages.empty()) {
+            return values;
+        }
+        for (const auto& msg : response.messages) {
+            values.push_back(string(msg.value));
+        }
+    }
+}
+
+static Broker* make_broker(const string& dir) {
+    filesystem::remove_all(dir);
+    filesystem::create_directories(dir);
+    Broker* broker = new Broker(1, dir);
+    broker->create_topic("input", 1, 1);
+    broker->create_topic("output", 2, 1);
+    broker->get_partition("output", 1)->promote_to_leader();
+    return broker;
+}
+
+void test_consumer_group_offsets() {
+    cout << "TEST: Consumer Group Offsets\n";
+
+    ConsumerGroupCoordinator coordinator;
+    coordinator.commit_offset("group", "orders", 0, 42);
+    assert(coordinator.get_offset("group", "orders", 0) == 42);
+    assert(coordinator.get_offset("group", "orders", 1) == 0);
+    assert(coordinator.get_consumer_lag("group", "orders", 0, 50) == 8);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_transaction_commit() {
+    cout << "TEST: Transaction Commit\n";
+
+    unique_ptr<Broker> broker(make_broker("/tmp/hyperq-coordinator-test/commit"));
+    Producer source(*broker, "source");
+    assert(source.send("input", "in-0").success);
+    assert(source.send("input", "in-1").success);
+
+    // consume-transform-produce: output and input offsets become visible together
+    Consumer reader(*broker, "processor", "reader", IsolationLevel::ReadCommitted, false);
+    Producer processor(*broker, "processor");
+    processor.init_transactions("processor-1");
+    processor.begin_transaction();
+    for (const string& value : consume_all(reader, "input", 0)) {
+        assert(processor.send("output", "out-" + value, value).success);
+    }
+    processor.send_offsets_to_transaction("processor", "input", 0, reader.get_position("input", 0));
+
+    Consumer committed(*broker, "downstream", "committed", IsolationLevel::ReadCommitted, false);
+    Consumer uncommitted(*broker, "peek", "uncommitted");
+    assert(consume_all(committed, "output", 0).size() + consume_all(committed, "output", 1).size() == 0);
+    assert(broker->get_coordinator().get_offset("processor", "input", 0) == 0);
+
+    processor.commit_transaction();
+    assert(broker->get_transaction_coordinator().get_state("processor-1") == TransactionState::Empty);
+    size_t visible = consume_all(committed, "output", 0).size() + consume_all(committed, "output", 1).size();
+    assert(visible == 2);
+    assert(broker->get_coordinator().get_offset("processor", "input", 0) == 2);
+    assert(consume_all(uncommitted, "output", 0).size() + consume_all(uncommitted, "output", 1).size() == 2);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_transaction_abort_and_fencing() {
+    cout << "TEST: Transaction Abort and Fencing\n";
+
+    unique_ptr<Broker> broker(make_broker("/tmp/hyperq-coordinator-test/abort"));
+    Producer producer(*broker, "producer");
+    producer.init_transactions("writer");
+
+    producer.begin_transaction();
+    producer.send("output", "aborted", "k");
+    producer.send_offsets_to_transaction("group", "input", 0, 10);
+    producer.abort_transaction();
+    assert(broker->get_coordinator().get_offset("group", "input", 0) == 0);
+
+    producer.begin_transaction();
+    producer.send("output", "committed", "k");
+    producer.commit_transaction();
+
+    int partition = broker->partition_for("output", "k");
+    Consumer committed(*broker, "committed", "committed", IsolationLevel::ReadCommitted, false);
+    Consumer uncommitted(*broker, "uncommitted", "uncommitted", IsolationLevel::ReadUncommitted, false);
+    assert(consume_all(committed, "output", partition) == vector<string>{"committed"});
+    assert(consume_all(uncommitted, "output", partition) == (vector<string>{"aborted", "committed"}));
+
+    // a new instance with the same transactional id aborts the old one's open transaction and fences it
+    producer.begin_transaction();
+    assert(producer.send("output", "zombie", "k").success);
+    Producer replacement(*broker, "replacement");
+    replacement.init_transactions("writer");
+    assert(broker->get_partition("output", partition)->get_open_transaction_count() == 0);
+
+    assert(!producer.send("output", "late", "k").success);
+    bool fenced = false;
+    try {
+        producer.commit_transaction();
+    } catch (const runtime_error&) {
+        fenced = true;
+    }
+    assert(fenced);
+    assert(consume_all(committed, "output", partition).empty());
+
+    replacement.begin_transaction();
+    assert(replacement.send("output", "replacement", "k").success);
+    replacement.commit_transaction();
+    assert(consume_all(committed, "output", partition) == vector<string>{"replacement"});
+
+    // a transactional batch for a partition its transaction never added is turned away
+    replacement.begin_transaction();
+    assert(replacement.send("output", "added", "k").success);
+    MessageBatch records;
+    records.append(0, "", "stray", 0, 0);
+    RecordBatch stray = RecordBatch::build(0, records);
+    stray.set_transactional();
+    stray.set_producer(replacement.get_producer_id(), 1, 0);   // the replacement's epoch, one past the fenced one
+    ProduceResponse rejected = broker->produce_batch("input", 0, stray);
+    assert(!rejected.success && rejected.error_message.find("was not added") != string::npos);
+    assert(broker->get_partition("input", 0)->get_high_watermark() == 0);
+    replacement.commit_transaction();
+
+    cout << "✓ PASSED\n";
+}
+
+void test_transaction_marker_retry() {
+    cout << "TEST: Transaction Marker Retry\n";
+
+    ConsumerGroupCoordinator groups;
+    int failures = 0;
+    vector<pair<uint16_t, bool>> markers;   // (epoch, commit) of every marker written
+    uint64_t next_id = 100;
+    TransactionCoordinator coordinator(groups,
+        [&](const string&, int, uint64_t, uint16_t epoch, bool commit) {
+            if (failures > 0) {
+                failures--;
+                throw runtime_error("marker write failed");
+            }
+            markers.push_back({epoch, commit});
+        },
+        [&]() { return next_id++; });
+
+    // the abort done by a new instance fails: the id is left half-aborted
+    ProducerIdentity first = coordinator.init_producer("txn");
+    coordinator.add_partition("txn", first, "output", 0);
+    coordinator.add_offset("txn", first, "group", "input", 0, 5);
+    failures = 1;
+    bool threw = false;
+    try {
+        coordinator.init_producer("txn");
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    assert(coordinator.get_state("txn") == TransactionState::PrepareAbort);
+
+    // the next init finishes that abort instead of refusing the id
+    ProducerIdentity second = coordinator.init_producer("txn");
+    assert(second.producer_id == first.producer_id && second.epoch == 2);
+    assert(coordinator.get_state("txn") == TransactionState::Empty);
+    assert(markers == (vector<pair<uint16_t, bool>>{{1, false}}));
+    assert(groups.get_offset("group", "input", 0) == 0);
+
+    // a commit stays a commit: its markers and offsets go out on the next init
+    coordinator.add_partition("txn", second, "output", 1);
+    coordinator.add_offset("txn", second, "group", "input", 0, 7);
+    failures = 1;
+    threw = false;
+    try {
+        coordinator.end_transaction("txn", second, true);
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    assert(coordinator.get_state("txn") == TransactionState::PrepareCommit);
+    ProducerIdentity third = coordinator.init_producer("txn");
+    assert(third.epoch == 3);
+    assert(markers.back() == make_pair(uint16_t(2), true));
+    assert(groups.get_offset("group", "input", 0) == 7);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_transaction_recovery() {
+    cout << "TEST: Transaction Recovery After a Crash\n";
+
+    string dir = "/tmp/hyperq-coordinator-test/recovery";
+    ProducerIdentity identity;
+    {
+        unique_ptr<Broker> broker(make_broker(dir));
+        string key = "k";
+        for (int i = 0; broker->partition_for("output", key) != 0; i++) {
+            key = "k" + to_string(i);
+        }
+        Producer processor(*broker, "processor");
+        processor.init_transactions("crashy");
+        processor.begin_transaction();
+        assert(processor.send("input", "in").success);
+        assert(processor.send("output", "out", key).success);
+
+        // the commit reaches output-0, then the broker dies before input-0 gets its marker
+        identity = TransactionLog(dir).get_records().at("crashy").identity;
+        broker->get_partition("output", 0)->append_marker(identity.producer_id, identity.epoch, true);
+    }
+    {
+        TransactionRecord decision;
+        decision.transactional_id = "crashy";
+        decision.identity = identity;
+        decision.state = TransactionState::PrepareCommit;
+        decision.partitions = {{"input", 0}, {"output", 0}};
+        decision.offsets["processor"][{"input", 0}] = 1;
+        TransactionLog(dir).append(decision);
+    }
+
+    // the restarted broker rolls the logged commit forward instead of aborting input-0
+    unique_ptr<Broker> broker(new Broker(1, dir));
+    assert(broker->get_transaction_coordinator().get_state("crashy") == TransactionState::Empty);
+    assert(broker->get_partition("input", 0)->get_open_transaction_count() == 0);
+    Consumer committed(*broker, "downstream", "committed", IsolationLevel::ReadCommitted, false);
+    assert(consume_all(committed, "input", 0) == vector<string>{"in"});
+    assert(consume_all(committed, "output", 0) == vector<string>{"out"});
+    assert(broker->get_coordinator().get_offset("processor", "input", 0) == 1);
+
+    // and still knows the id: a new instance is fenced past the old epoch
+    Producer replacement(*broker, "replacement");
+    replacement.init_transactions("crashy");
+    assert(TransactionLog(dir).get_records().at("crashy").identity.epoch == identity.epoch + 1);
+
+    cout << "✓ PASSED\n";
+}
+
+int main() {
+    try {
+        filesystem::remove_all("/tmp/hyperq-coordinator-test");
+
+        test_consumer_group_offsets();
+        test_transaction_commit();
+        test_transaction_abort_and_fencing();
+        test_transaction_marker_retry();
+        test_transaction_recovery();
+
+        cout << "\n✓ ALL TESTS PASSED\n";
+        return 0;
+    } catch (const exception& e) {
+        cerr << "✗ TEST FAILED: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,241 @@
+#include "hyperq/metrics/metrics.hpp"
+#include "hyperq/metrics/prometheus_exporter.hpp"
+#include "hyperq/metrics/tracing.hpp"
+#include <cassert>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+using namespace std;
+
+void test_counter_across_threads() {
+    cout << "TEST: Counter Across Threads\n";
+
+    Counter& counter = MetricsRegistry::instance().counter("test_events_total", {{"kind", "a"}});
+    vector<thread> threads;
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&counter]() {
+            for (int i = 0; i < 10000; i++) {
+                counter.add();
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    assert(counter.value() == 80000);
+
+    // same name and labels resolve to the same counter
+    assert(&MetricsRegistry::instance().counter("test_events_total", {{"kind", "a"}}) == &counter);
+    assert(&MetricsRegistry::instance().counter("test_events_total", {{"kind", "b"}}) != &counter);
+
+    Gauge& gauge = MetricsRegistry::instance().gauge("test_depth");
+    gauge.add(5);
+    gauge.sub(2);
+    assert(gauge.value() == 3);
+    gauge.set(10);
+    assert(gauge.value() == 10);
+
+    // per-partition series: one atomic, same results
+    Counter& single = MetricsRegistry::instance().counter(
+        "test_partition_events_total", {{"partition", "0"}}, "", MetricSharding::Single);
+    threads.clear();
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&single]() {
+            for (int i = 0; i < 10000; i++) {
+                single.add();
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    assert(single.value() == 40000);
+    Gauge& offset = MetricsRegistry::instance().gauge(
+        "test_partition_offset", {{"partition", "0"}}, "", MetricSharding::Single);
+    offset.add(7);
+    offset.set(3);
+    assert(offset.value() == 3);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_histogram_buckets() {
+    cout << "TEST: Histogram Buckets\n";
+
+    uint64_t values[] = {0, 1, 31, 32, 33, 63, 64, 1000, 123456, 987654321};
+    for (uint64_t v : values) {
+        size_t index = Histogram::bucket_index(v);
+        assert(index < Histogram::BUCKETS);
+        assert(Histogram::bucket_upper_bound(index) >= v);
+        // bucket width stays within ~3% of the value
+        assert(Histogram::bucket_upper_bound(index) - v <= v / Histogram::SUB_BUCKETS);
+        if (index > 0) {
+            assert(Histogram::bucket_upper_bound(index - 1) < v);
+        }
+    }
+    assert(Histogram::bucket_index(uint64_t(1) << 50) == Histogram::BUCKETS - 1);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_histogram_percentiles() {
+    cout << "TEST: Histogram Percentiles\n";
+
+    Histogram& histogram = MetricsRegistry::instance().histogram("test_latency_ns");
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&histogram, t]() {
+            for (uint64_t v = 1 + t; v <= 10000; v += 4) {
+                histogram.record(v);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    HistogramSnapshot snap = histogram.snapshot();
+    assert(snap.count == 10000);
+    assert(snap.max == 10000);
+    assert(snap.sum == 10000ull * 10001 / 2);
+
+    uint64_t p50 = snap.percentile(50);
+    uint64_t p99 = snap.percentile(99);
+    assert(p50 >= 5000 && p50 <= 5000 + 5000 / Histogram::SUB_BUCKETS);
+    assert(p99 >= 9900 && p99 <= 9900 + 9900 / Histogram::SUB_BUCKETS);
+    assert(snap.percentile(100) == 10000);
+
+    {
+        LatencyTimer timer(histogram);
+    }
+    assert(histogram.snapshot().count == 10001);
+
+    ostringstream out;
+    MetricsRegistry::instance().print(out);
+    assert(out.str().find("test_latency_ns count=10001") != string::npos);
+    assert(out.str().find("test_events_total{kind=\"a\"} 80000") != string::npos);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_request_tracing() {
+    cout << "TEST: Request Tracing\n";
+
+    // off by default: no trace, marks are no-ops
+    {
+        TraceScope trace(TraceOp::Produce, TraceStage::Enqueue);
+        TraceScope::mark(TraceStage::LogWrite);
+    }
+    assert(Tracer::instance().get_slowest_traces().empty());
+
+    Tracer::instance().set_sample_rate(1);
+    for (int i = 0; i < 3; i++) {
+        TraceScope client(TraceOp::Produce, TraceStage::Enqueue);
+        {
+            // inner scope only stamps its stage
+            TraceScope broker(TraceOp::Produce, TraceStage::BrokerReceipt);
+            TraceScope::mark(TraceStage::LockAcquired);
+            TraceScope::mark(TraceStage::LogWrite);
+            TraceScope::mark(TraceStage::FsyncDone);
+        }
+    }
+    {
+        TraceScope broker(TraceOp::Fetch, TraceStage::BrokerReceipt);
+        TraceScope::mark(TraceStage::LockAcquired);
+        TraceScope::mark(TraceStage::LogRead);
+    }
+    Tracer::instance().set_sample_rate(0);
+
+    auto& registry = MetricsRegistry::instance();
+    assert(registry.histogram("hyperq_trace_stage_ns", {{"op", "produce"}, {"stage", "fsync"}}).snapshot().count == 3);
+    assert(registry.histogram("hyperq_trace_stage_ns", {{"op", "produce"}, {"stage", "ack"}}).snapshot().count == 3);
+    assert(registry.histogram("hyperq_trace_stage_ns", {{"op", "produce"}, {"stage", "total"}}).snapshot().count == 3);
+    assert(registry.histogram("hyperq_trace_stage_ns", {{"op", "fetch"}, {"stage", "log_read"}}).snapshot().count == 1);
+    // fetch started at the broker, so there is no broker_receipt interval
+    assert(registry.histogram("hyperq_trace_stage_ns", {{"op", "fetch"}, {"stage", "broker_receipt"}}).snapshot().count == 0);
+
+    auto slowest = Tracer::instance().get_slowest_traces();
+    assert(slowest.size() == 4);
+    for (size_t i = 1; i < slowest.size(); i++) {
+        assert(slowest[i - 1].total_ns() >= slowest[i].total_ns());
+    }
+
+    ostringstream out;
+    Tracer::instance().dump(out);
+    assert(out.str().find("produce lock_acquired count=3") != string::npos);
+    assert(out.str().find("slow produce total=") != string::npos);
+
+    cout << "✓ PASSED\n";
+}
+
+string http_get(int port, const string& path) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    assert(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    send(fd, request.data(), request.size(), 0);
+    string response;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        response.append(buffer, n);
+    }
+    close(fd);
+    return response;
+}
+
+void test_prometheus_exporter() {
+    cout << "TEST: Prometheus Exporter\n";
+
+    MetricsRegistry::instance().gauge("test_log_end_offset", {{"topic", "a\"b"}}, "End offset").set(42);
+
+    PrometheusExporter exporter(0, "127.0.0.1");
+    exporter.add_collector([](MetricsSnapshot& snap) {
+        snap.gauges.push_back({"test_lag", {{"group", "g1"}}, "", 7});
+    });
+    exporter.start();
+    assert(exporter.get_port() > 0);
+
+    string response = http_get(exporter.get_port(), "/metrics");
+    assert(response.compare(0, 15, "HTTP/1.1 200 OK") == 0);
+    assert(response.find("# TYPE test_events_total counter\n") != string::npos);
+    assert(response.find("test_events_total{kind=\"a\"} 80000\n") != string::npos);
+    assert(response.find("# HELP test_log_end_offset End offset\n") != string::npos);
+    assert(response.find("test_log_end_offset{topic=\"a\\\"b\"} 42\n") != string::npos);
+    assert(response.find("test_lag{group=\"g1\"} 7\n") != string::npos);
+
+    // histogram buckets are cumulative and end with +Inf == count
+    assert(response.find("# TYPE test_latency_ns histogram\n") != string::npos);
+    // 1..8191 plus possibly the LatencyTimer sample
+    assert(response.find("test_latency_ns_bucket{le=\"8191\"} 819") != string::npos);
+    assert(response.find("test_latency_ns_bucket{le=\"+Inf\"} 10001\n") != string::npos);
+    assert(response.find("test_latency_ns_count 10001\n") != string::npos);
+
+    assert(http_get(exporter.get_port(), "/other").find("404 Not Found") != string::npos);
+
+    exporter.stop();
+    cout << "✓ PASSED\n";
+}
+
+int main() {
+    try {
+        test_counter_across_threads();
+        test_histogram_buckets();
+        test_histogram_percentiles();
+        test_prometheus_exporter();
+        test_request_tracing();
+
+        cout << "\n✓ ALL TESTS PASSED\n";
+        return 0;
+    } catch (const exception& e) {
+        cerr << "✗ TEST FAILED: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,421 @@
+#include "hyperq/broker/partition.hpp"
+#include <cassert>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+using namespace std;
+
+void test_append_and_read() {
+    cout << "TEST: Partition Append and Read\n";
+
+    auto log = make_shared<CommitLog>("/tmp/hyperq-partition-test/log");
+    Partition partition("orders", 0, 1, true, log);
+
+    assert(partition.append("order-1") == 0);
+    assert(partition.append("order-2", "customer-7") == 1);
+    assert(partition.get_high_watermark() == 1);
+
+    auto messages = partition.read(0, 10);
+    assert(messages.size() == 2);
+    assert(messages[1].key == "customer-7");
+
+    cout << "✓ PASSED\n";
+}
+
+void test_appender_thread() {
+    cout << "TEST: Partition Appender Thread\n";
+
+    auto log = make_shared<CommitLog>("/tmp/hyperq-partition-test/log");
+    Partition partition("appended", 0, 1, true, log);
+    partition.start_appender(2);    // fewer slots than producers: some sleep on a full ring
+
+    const int producers = 4;
+    const int per_producer = 50;
+    vector<thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&partition, p]() {
+            uint64_t last = 0;
+            for (int i = 0; i < per_producer; i++) {
+                uint64_t offset = i % 2 == 0
+                    ? partition.append("p" + to_string(p) + "-" + to_string(i))
+                    : partition.append_batch(RecordBatch::build(0, vector<Message>{
+                          Message{0, "", "p" + to_string(p) + "-" + to_string(i), 0, 0}}));
+                assert(i == 0 || offset > last);
+                last = offset;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    assert(partition.get_high_watermark() == producers * per_producer - 1);
+    assert(partition.get_append_group_count() > 0);
+    assert(partition.get_append_group_count() <= static_cast<uint64_t>(producers * per_producer));
+
+    // offsets are dense and each producer's messages keep their order
+    auto messages = partition.read(0, producers * per_producer);
+    assert(messages.size() == static_cast<size_t>(producers * per_producer));
+    vector<int> next(producers, 0);
+    for (size_t i = 0; i < messages.size(); i++) {
+        assert(messages[i].offset == i);
+        string value(messages[i].value);
+        int p = value[1] - '0';
+        assert(value == "p" + to_string(p) + "-" + to_string(next[p]));
+        next[p]++;
+    }
+
+    // errors reach the producer that caused them
+    bool threw = false;
+    try {
+        partition.append_batch(RecordBatch());
+    } catch (const invalid_argument&) {
+        threw = true;
+    }
+    assert(threw);
+    assert(partition.append("after-error") == static_cast<uint64_t>(producers * per_producer));
+
+    cout << "✓ PASSED\n";
+}
+
+static RecordBatch producer_batch(uint64_t producer_id, uint16_t epoch, int32_t sequence, int records) {
+    vector<Message> messages;
+    for (int i = 0; i < records; i++) {
+        messages.push_back(Message{static_cast<uint64_t>(i), "", "seq-" + to_string(sequence + i), 0, 0});
+    }
+    RecordBatch batch = RecordBatch::build(0, messages);
+    batch.set_producer(producer_id, epoch, sequence);
+    return batch;
+}
+
+template <typename E>
+static bool throws(function<void()> call) {
+    try {
+        call();
+    } catch (const E&) {
+        return true;
+    }
+    return false;
+}
+
+void test_idempotent_producer() {
+    cout << "TEST: Idempotent Producer\n";
+
+    auto log = make_shared<CommitLog>("/tmp/hyperq-partition-test/log");
+    for (bool appender : {false, true}) {
+        string topic = appender ? "idempotent-appender" : "idempotent";
+        {
+            Partition partition(topic, 0, 1, true, log);
+            if (appender) {
+                partition.start_appender(8);
+            }
+
+            assert(partition.append_batch(producer_batch(7, 0, 0, 2)) == 0);
+            assert(partition.append_batch(producer_batch(7, 0, 2, 1)) == 2);
+            // a retry is acked with the original offset and not written again
+            assert(partition.append_batch(producer_batch(7, 0, 0, 2)) == 0);
+            assert(partition.append_batch(producer_batch(7, 0, 2, 1)) == 2);
+            assert(partition.get_high_watermark() == 2);
+
+            // gaps and stale epochs are rejected
+            assert(throws<invalid_argument>([&]() { partition.append_batch(producer_batch(7, 0, 5, 1)); }));
+            assert(partition.append_batch(producer_batch(7, 1, 0, 1)) == 3);
+            assert(throws<runtime_error>([&]() { partition.append_batch(producer_batch(7, 0, 3, 1)); }));
+
+            // other producers and plain appends are independent
+            assert(partition.append_batch(producer_batch(8, 0, 0, 1)) == 4);
+            assert(partition.append("plain") == 5);
+            assert(partition.get_producer_count() == 2);
+        }
+
+        // a restarted partition still recognizes retries of batches in the log
+        Partition reopened(topic, 0, 1, true, log);
+        assert(reopened.get_producer_count() == 2);
+        assert(reopened.append_batch(producer_batch(7, 1, 0, 1)) == 3);
+        assert(reopened.append_batch(producer_batch(8, 0, 0, 1)) == 4);
+        assert(reopened.append_batch(producer_batch(7, 1, 1, 1)) == 6);
+        assert(reopened.read(0, 10).size() == 7);
+    }
+
+    cout << "✓ PASSED\n";
+}
+
+static RecordBatch transactional_batch(uint64_t producer_id, int32_t sequence, const string& value) {
+    RecordBatch batch = RecordBatch::build(0, vector<Message>{Message{0, "", value, 0, 0}});
+    batch.set_producer(producer_id, 0, sequence);
+    batch.set_transactional();
+    return batch;
+}
+
+static vector<string> values(const MessageBatch& messages) {
+    vector<string> result;
+    for (const auto& msg : messages) {
+        result.push_back(string(msg.value));
+    }
+    return result;
+}
+
+void test_transactions() {
+    cout << "TEST: Transactions and Read Committed\n";
+
+    auto log = make_shared<CommitLog>("/tmp/hyperq-partition-test/log");
+    {
+        Partition partition("txn", 0, 1, true, log);
+        partition.start_appender(8);
+
+        partition.append("plain-0");                                        // 0
+        partition.append_batch(transactional_batch(20, 0, "committed-a"));  // 1
+        partition.append_batch(transactional_batch(21, 0, "aborted-a"));    // 2
+        partition.append("plain-1");                                        // 3
+        assert(partition.get_open_transaction_count() == 2);
+        assert(partition.get_last_stable_offset() == 1);
+        assert(values(partition.read(0, 10, IsolationLevel::ReadCommitted)) == vector<string>{"plain-0"});
+        assert(partition.read(0, 10).size() == 4);
+
+        assert(partition.append_marker(21, 0, false) == 4);
+        assert(partition.get_last_stable_offset() == 1);
+        assert(partition.append_marker(20, 0, true) == 5);
+        assert(partition.get_last_stable_offset() == 6);
+
+        // markers are never returned, aborted data only to read_uncommitted
+        vector<string> committed = {"plain-0", "committed-a", "plain-1"};
+        assert(values(partition.read(0, 10, IsolationLevel::ReadCommitted)) == committed);
+        assert(values(partition.read(0, 10)) == (vector<string>{"plain-0", "committed-a", "aborted-a", "plain-1"}));
+        assert(partition.read_batches(0, 1 << 20, IsolationLevel::ReadCommitted).size() == 5);   // 3 + both markers
+
+        partition.append_batch(transactional_batch(21, 1, "left-open"));    // 6
+        assert(partition.get_last_stable_offset() == 6);
+    }
+
+    // state comes back from the log, and the transaction nobody can finish anymore is aborted
+    Partition reopened("txn", 0, 1, true, log);
+    assert(reopened.get_high_watermark() == 7);
+    assert(reopened.get_open_transaction_count() == 0);
+    assert(reopened.get_last_stable_offset() == 8);
+    assert(values(reopened.read(0, 10, IsolationLevel::ReadCommitted)) == (vector<string>{"plain-0", "committed-a", "plain-1"}));
+
+    cout << "✓ PASSED\n";
+}
+
+static vector<string> state_snapshots(const string& dir) {
+    vector<string> names;
+    for (const auto& entry : filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() == ".snapshot") {
+            names.push_back(entry.path().string());
+        }
+    }
+    return names;
+}
+
+void test_state_snapshots() {
+    cout << "TEST: Producer State Snapshots\n";
+
+    string log_dir = "/tmp/hyperq-partition-test/snapshots";
+    LogConfig config;
+    config.segment_size = 256;      // a few batches per segment
+    {
+        auto log = make_shared<CommitLog>(log_dir);
+        log->set_topic_config("snap", config);
+        Partition partition("snap", 0, 1, true, log);
+        partition.start_appender(8);
+        partition.append_batch(transactional_batch(30, 0, "aborted"));     // 0
+        partition.append_marker(30, 0, false);                              // 1
+        for (int i = 0; i < 20; i++) {
+            partition.append_batch(producer_batch(31, 0, i, 1));            // 2..21
+        }
+        assert(log->get_segment_count("snap", 0) > 3);
+    }
+    // one snapshot, newer ones replace older ones
+    auto snapshots = state_snapshots(log_dir + "/snap-0");
+    assert(snapshots.size() == 1);
+
+    // state from the snapshot plus the headers after it
+    vector<string> committed;
+    for (int i = 0; i < 20; i++) {
+        committed.push_back("seq-" + to_string(i));
+    }
+    for (bool corrupt : {false, true}) {
+        if (corrupt) {
+            // a damaged snapshot falls back to reading the whole log
+            fstream file(snapshots[0], ios::binary | ios::in | ios::out);
+            file.seekp(8);
+            file.put('X');
+        }
+        auto log = make_shared<CommitLog>(log_dir);
+        log->set_topic_config("snap", config);
+        Partition reopened("snap", 0, 1, true, log);
+        assert(reopened.get_high_watermark() == 21);
+        assert(reopened.get_producer_count() == 2);
+        assert(reopened.append_batch(producer_batch(31, 0, 19, 1)) == 21);     // a retry still in the window
+        assert(values(reopened.read(0, 100, IsolationLevel::ReadCommitted)) == committed);
+    }
+
+    cout << "✓ PASSED\n";
+}
+
+void test_state_pruning() {
+    cout << "TEST: Producer State Pruning\n";
+
+    auto log = make_shared<CommitLog>("/tmp/hyperq-partition-test/pruning");
+    LogConfig config;
+    config.segment_size = 256;
+    config.cleanup_policy = CleanupPolicy::Compact;
+    log->set_topic_config("pruned", config);
+    Partition partition("pruned", 0, 1, true, log);
+    partition.start_appender(8);
+
+    // an idempotent producer's only record is overwritten, compaction then empties its segment
+    RecordBatch batch = RecordBatch::build(0, vector<Message>{Message{0, "k", "old", 0, 0}});
+    batch.set_producer(50, 0, 0);
+    assert(partition.append_batch(batch) == 0);
+    for (int i = 0; i < 12; i++) {
+        partition.append("new-" + to_string(i), "k");
+    }
+    assert(partition.get_producer_count() == 1);
+    log->compact("pruned", 0);
+    assert(log->get_log_start_offset("pruned", 0) > 0);
+
+    // the next roll drops the producer nothing in the log refers to anymore
+    for (int i = 0; i < 4; i++) {
+        partition.append("more-" + to_string(i), "k");
+    }
+    assert(partition.get_producer_count() == 0);
+
+    cout << "✓ PASSED\n";
+}
+
+static uint64_t cache_counter(const string& name, int partition) {
+    return MetricsRegistry::instance().counter(name, {{"topic", "cached"}, {"partition", to_string(partition)}}).value();
+}
+
+void test_tail_cache() {
+    cout << "TEST: Tail Cache and Budget\n";
+
+    auto log = make_shared<CommitLog>("/tmp/hyperq-partition-test/log");
+    size_t batch_bytes = RecordBatch::build(0, vector<Message>{Message{0, "", "v-00", 0, 0}}).size_bytes();
+    auto budget = make_shared<CacheBudget>(10 * batch_bytes);
+    {
+        Partition hot("cached", 0, 1, true, log, nullptr, budget);
+        Partition cold("cached", 1, 1, true, log, nullptr, budget);
+        hot.start_appender(8);
+        for (int i = 0; i < 10; i++) {
+            hot.append("v-0" + to_string(i));
+        }
+        assert(hot.get_tail_cache()->get_batch_count() == 10);
+        assert(budget->get_used_bytes() == 10 * batch_bytes);
+
+        // a tail read is served from memory, byte for byte what the log holds
+        uint64_t hits = cache_counter("hyperq_tail_cache_hits_total", 0);
+        auto cached = hot.read_batches(5, 1 << 20);
+        assert(cache_counter("hyperq_tail_cache_hits_total", 0) == hits + 1);
+        auto stored = log->read_batches("cached", 0, 5, 1 << 20);
+        assert(cached.size() == 5 && stored.size() == 5);
+        for (size_t i = 0; i < cached.size(); i++) {
+            assert(cached[i].serialize() == stored[i].serialize());
+        }
+        assert(hot.read_batches(10, 1 << 20).empty());      // caught up
+        assert(cache_counter("hyperq_tail_cache_hits_total", 0) == hits + 2);
+
+        // the budget is broker-wide: the other partition's appends evict the oldest batches
+        for (int i = 0; i < 4; i++) {
+            cold.append("v-1" + to_string(i));
+        }
+        assert(cold.get_tail_cache()->get_batch_count() == 4);
+        assert(hot.get_tail_cache()->get_batch_count() == 6);
+        assert(budget->get_used_bytes() == 10 * batch_bytes);
+
+        // below the cached run reads go to the log
+        uint64_t misses = cache_counter("hyperq_tail_cache_misses_total", 0);
+        auto messages = hot.read(0, 100);
+        assert(messages.size() == 10 && messages[0].value == "v-00" && messages[9].value == "v-09");
+        assert(cache_counter("hyperq_tail_cache_misses_total", 0) == misses + 1);
+        assert(values(hot.read(4, 100)) == (vector<string>{"v-04", "v-05", "v-06", "v-07", "v-08", "v-09"}));
+        assert(cache_counter("hyperq_tail_cache_misses_total", 0) == misses + 1);
+
+        budget->set_capacity(2 * batch_bytes);
+        assert(hot.get_tail_cache()->get_batch_count() == 0);
+        assert(cold.get_tail_cache()->get_batch_count() == 2);
+        assert(values(hot.read(9, 100)) == vector<string>{"v-09"});
+
+        // read_committed filtering applies to cached batches too
+        budget->set_capacity(100 * batch_bytes);
+        cold.append_batch(transactional_batch(30, 0, "v-ab"));     // 4
+        cold.append_marker(30, 0, false);                           // 5
+        hits = cache_counter("hyperq_tail_cache_hits_total", 1);
+        assert(cold.read(4, 10, IsolationLevel::ReadCommitted).empty());
+        assert(values(cold.read(3, 10, IsolationLevel::ReadCommitted)) == vector<string>{"v-13"});
+        assert(values(cold.read(3, 10)) == (vector<string>{"v-13", "v-ab"}));
+        assert(cache_counter("hyperq_tail_cache_hits_total", 1) == hits + 3);
+    }
+    assert(budget->get_used_bytes() == 0);
+
+    cout << "✓ PASSED\n";
+}
+
+void test_remote_tier_read() {
+    cout << "TEST: Remote Tier Read\n";
+
+    auto log = make_shared<CommitLog>("/tmp/hyperq-partition-test/log");
+    auto store = make_shared<FileSystemObjectStore>("/tmp/hyperq-partition-test/remote");
+    auto remote = make_shared<TieredStorage>(log, store);
+
+    LogConfig config;
+    config.segment_size = 100;
+    config.remote_storage = true;
+    config.local_retention_ms = 0;
+    log->set_topic_config("tiered", config);
+
+    Partition partition("tiered", 0, 1, true, log, remote);
+    for (int i = 0; i < 30; i++) {
+        partition.append("event-" + to_string(i));
+    }
+    size_t closed = log->get_closed_segments("tiered", 0).size();
+    assert(closed > 0);
+
+    // upload everything closed, then local copies age out
+    assert(remote->sync_once() == closed);
+    assert(remote->get_remote_segment_count("tiered", 0) == closed);
+    assert(log->get_closed_segments("tiered", 0).empty());
+    assert(log->get_log_start_offset("tiered", 0) > 0);
+
+    // historical replay spans both tiers
+    auto messages = partition.read(0, 100);
+    assert(messages.size() == 30);
+    for (int i = 0; i < 30; i++) {
+        assert(messages[i].offset == static_cast<uint64_t>(i));
+        assert(messages[i].value == "event-" + to_string(i));
+    }
+    assert(!partition.read_batches(0, 1024).empty());
+
+    // remote index survives a restart
+    TieredStorage reopened(log, store);
+    assert(reopened.get_remote_segment_count("tiered", 0) == closed);
+    assert(reopened.read("tiered", 0, 3, 1)[0].value == "event-3");
+
+    cout << "✓ PASSED\n";
+}
+
+int main() {
+    try {
+        filesystem::remove_all("/tmp/hyperq-partition-test");
+        filesystem::create_directories("/tmp/hyperq-partition-test");
+
+        test_append_and_read();
+        test_appender_thread();
+        test_idempotent_producer();
+        test_transactions();
+        test_state_snapshots();
+        test_state_pruning();
+        test_tail_cache();
+        test_remote_tier_read();
+
+        cout << "\n✓ ALL TESTS PASSED\n";
+        return 0;
+    } catch (const exception& e) {
+        cerr << "✗ TEST FAILED: " << e.what() << "\n";
+        return 1;
+    }
+}